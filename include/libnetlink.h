@@ -15,6 +15,12 @@ struct rtnl_handle
 	struct sockaddr_nl	peer;
 	__u32			seq;
 	__u32			dump;
+	int			dump_intr;	/* last dump was inconsistent */
+	char			*buf;
+	int			buflen;
+	struct rtnl_batch	*batch;
+	int			(*capture)(struct nlmsghdr *n, void *arg);
+	void			*capture_arg;
 };
 
 extern int rcvbuf;
@@ -24,6 +30,7 @@ extern int rtnl_open_byproto(struct rtnl_handle *rth, unsigned subscriptions, in
 extern void rtnl_close(struct rtnl_handle *rth);
 extern int rtnl_wilddump_request(struct rtnl_handle *rth, int fam, int type);
 extern int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len);
+extern int rtnl_strict_dump(struct rtnl_handle *rth, int on);
 
 typedef int (*rtnl_filter_t)(const struct sockaddr_nl *,
 			     struct nlmsghdr *n, void *);
@@ -42,6 +49,14 @@ extern int rtnl_dump_filter(struct rtnl_handle *rth, rtnl_filter_t filter,
 			    void *arg1,
 			    rtnl_filter_t junk,
 			    void *arg2);
+/*
+ * Receive the whole dump, showing each message to prescan() as it comes,
+ * then run filter() over all of them.  Lets a printer learn everything it
+ * will need (e.g. addresses to resolve) before the first line is out.
+ */
+extern int rtnl_dump_filter_prescan(struct rtnl_handle *rth,
+				    rtnl_filter_t prescan,
+				    rtnl_filter_t filter, void *arg);
 
 extern int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		     unsigned groups, struct nlmsghdr *answer,
@@ -50,6 +65,27 @@ extern int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 extern int rtnl_send(struct rtnl_handle *rth, const char *buf, int);
 extern int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int);
 
+/*
+ * Called for each failed request of a batch with its tag and the positive
+ * errno, or 0 when no answer arrived.  The callback reports the failure and
+ * returns nonzero if it should be counted; without one the library prints it.
+ */
+typedef int (*rtnl_batch_err_t)(int tag, int error, void *arg);
+
+extern int rtnl_batch_start(struct rtnl_handle *rth, int window,
+			    rtnl_batch_err_t errfn, void *arg);
+extern void rtnl_batch_tag(struct rtnl_handle *rth, int tag);
+extern int rtnl_batch_flush(struct rtnl_handle *rth);
+extern int rtnl_batch_stop(struct rtnl_handle *rth);
+
+/*
+ * While a capture callback is set, requests which only expect an ACK are
+ * handed to it instead of the kernel, so that a command can be parsed
+ * without being executed.  A negative return fails the request.
+ */
+extern void rtnl_capture(struct rtnl_handle *rth,
+			 int (*fn)(struct nlmsghdr *n, void *arg), void *arg);
+
 extern int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
 extern int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen);
 extern int addraw_l(struct nlmsghdr *n, int maxlen, const void *data, int len);
@@ -73,12 +109,30 @@ extern int __parse_rtattr_nested_compat(struct rtattr *tb[], int max, struct rta
 
 extern int rtnl_listen(struct rtnl_handle *, rtnl_filter_t handler,
 		       void *jarg);
+/* Called after events were lost to an overrun of the receive buffer.
+ * The events still queued are read next, unless it drops them with
+ * rtnl_listen_drain() because it re-syncs from a dump.
+ */
+typedef int (*rtnl_resync_t)(struct rtnl_handle *rth, void *jarg);
+extern int rtnl_listen_resync(struct rtnl_handle *, rtnl_filter_t handler,
+			      void *jarg, rtnl_resync_t resync);
+extern void rtnl_listen_drain(struct rtnl_handle *);
 extern int rtnl_from_file(FILE *, rtnl_filter_t handler,
 		       void *jarg);
 
 #define NLMSG_TAIL(nmsg) \
 	((struct rtattr *) (((void *) (nmsg)) + NLMSG_ALIGN((nmsg)->nlmsg_len)))
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+#ifndef NLM_F_DUMP_FILTERED
+#define NLM_F_DUMP_FILTERED 0x20
+#endif
+
 #ifndef IFA_RTA
 #define IFA_RTA(r) \
 	((struct rtattr*)(((char*)(r)) + NLMSG_ALIGN(sizeof(struct ifaddrmsg))))
@@ -11,5 +11,7 @@ extern int ll_index_to_type(unsigned idx);
 extern unsigned ll_index_to_flags(unsigned idx);
 extern unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
 				 unsigned alen);
+extern int ll_walk(int (*fn)(unsigned idx, const char *name, void *arg),
+		   void *arg);
 
 #endif /* __LL_MAP_H__ */
@@ -0,0 +1,12 @@
+#ifndef __RT_MIRROR_H__
+#define __RT_MIRROR_H__ 1
+
+struct rtnl_mirror;
+
+extern struct rtnl_mirror *rtnl_mirror_new(unsigned groups);
+extern void rtnl_mirror_free(struct rtnl_mirror *m);
+extern int rtnl_mirror_update(struct rtnl_mirror *m, const struct nlmsghdr *n);
+extern int rtnl_mirror_sync(struct rtnl_mirror *m,
+			    rtnl_filter_t handler, void *arg);
+
+#endif /* __RT_MIRROR_H__ */
@@ -95,6 +95,8 @@ extern __u8* hexstring_a2n(const char *str, __u8 *buf, int blen);
 
 extern const char *format_host(int af, int len, const void *addr,
 			       char *buf, int buflen);
+extern const char *resolve_address(const void *addr, int len, int af);
+extern void resolve_prefetch(int af, int len, const void *addr);
 extern const char *rt_addr_n2a(int af, int len, const void *addr,
 			       char *buf, int buflen);
 
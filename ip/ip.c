@@ -33,6 +33,8 @@ char * _SL_ = NULL;
 char *batch_file = NULL;
 int force = 0;
 int max_flush_loops = 10;
+int stream_output = 0;
+static int pipeline;
 
 struct rtnl_handle rth = { .fd = -1 };
 
@@ -42,7 +44,7 @@ static void usage(void)
 {
 	fprintf(stderr,
 "Usage: ip [ OPTIONS ] OBJECT { COMMAND | help }\n"
-"       ip [ -force ] -batch filename\n"
+"       ip [ -force ] [ -pipeline window ] -batch filename\n"
 "where  OBJECT := { link | addr | addrlabel | route | rule | neigh | ntable |\n"
 "                   tunnel | tuntap | maddr | mroute | mrule | monitor | xfrm |\n"
 "                   netns }\n"
@@ -50,7 +52,8 @@ static void usage(void)
 "                    -f[amily] { inet | inet6 | ipx | dnet | link } |\n"
 "                    -l[oops] { maximum-addr-flush-attempts } |\n"
 "                    -o[neline] | -t[imestamp] | -b[atch] [filename] |\n"
-"                    -rc[vbuf] [size]}\n");
+"                    -str[eam] |\n"
+"                    -rc[vbuf] [size] | -pi[peline] [window] }\n");
 	exit(-1);
 }
 
@@ -99,6 +102,24 @@ static int do_cmd(const char *argv0, int argc, char **argv)
 	return -1;
 }
 
+static int batch_errors;
+
+static int batch_error(int lineno, int error, void *arg)
+{
+	if (error) {
+		errno = error;
+		perror("RTNETLINK answers");
+	}
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)arg, lineno);
+	batch_errors++;
+	return 1;
+}
+
+static void batch_exit(void)
+{
+	rtnl_batch_stop(&rth);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -118,6 +139,12 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (pipeline) {
+		if (rtnl_batch_start(&rth, pipeline, batch_error, (void *)name) < 0)
+			return -1;
+		atexit(batch_exit);
+	}
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -127,16 +154,23 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		rtnl_batch_tag(&rth, cmdlineno);
 		if (do_cmd(largv[0], largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
 			ret = 1;
 			if (!force)
 				break;
 		}
+		if (batch_errors && !force)
+			break;
 	}
 	if (line)
 		free(line);
 
+	rtnl_batch_stop(&rth);
+	if (batch_errors)
+		ret = 1;
+
 	rtnl_close(&rth);
 	return ret;
 }
@@ -208,6 +242,8 @@ int main(int argc, char **argv)
 			++oneline;
 		} else if (matches(opt, "-timestamp") == 0) {
 			++timestamp;
+		} else if (matches(opt, "-stream") == 0) {
+			++stream_output;
 #if 0
 		} else if (matches(opt, "-numeric") == 0) {
 			rtnl_names_numeric++;
@@ -223,6 +259,19 @@ int main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			batch_file = argv[1];
+		} else if (matches(opt, "-pipeline") == 0) {
+			unsigned int window;
+
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_unsigned(&window, argv[1], 0) || window == 0) {
+				fprintf(stderr, "Invalid pipeline window '%s'\n",
+					argv[1]);
+				exit(-1);
+			}
+			pipeline = window;
 		} else if (matches(opt, "-rcvbuf") == 0) {
 			unsigned int size;
 
@@ -51,6 +51,15 @@ static inline int rtm_get_table(struct rtmsg *r, struct rtattr **tb)
 
 extern struct rtnl_handle rth;
 
+extern void ipflush_start(void);
+extern void ipflush_round(void);
+extern int ipflush_add(const struct nlmsghdr *n, int type);
+extern int ipflush_queued(void);
+extern int ipflush_commit(void);
+extern void ipflush_print_round(int round, const char *what);
+extern int ipflush_finish(int rounds);
+extern int stream_output;
+
 struct link_util
 {
 	struct link_util	*next;
@@ -45,10 +45,7 @@ static struct
 	int flags, flagmask;
 	int up;
 	char *label;
-	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	int flush;
 	int group;
 } filter;
 
@@ -435,16 +432,6 @@ int print_linkinfo(const struct sockaddr_nl *who,
 	return 0;
 }
 
-static int flush_update(void)
-{
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
-		perror("Failed to send flush request");
-		return -1;
-	}
-	filter.flushp = 0;
-	return 0;
-}
-
 static int set_lifetime(unsigned int *lifetime, char *argv)
 {
 	if (strcmp(argv, "forever") == 0)
@@ -476,7 +463,7 @@ int print_addrinfo(const struct sockaddr_nl *who, struct nlmsghdr *n,
 		return -1;
 	}
 
-	if (filter.flushb && n->nlmsg_type != RTM_NEWADDR)
+	if (filter.flush && n->nlmsg_type != RTM_NEWADDR)
 		return 0;
 
 	parse_rtattr(rta_tb, IFA_MAX, IFA_RTA(ifa), n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa)));
@@ -516,19 +503,9 @@ int print_addrinfo(const struct sockaddr_nl *who, struct nlmsghdr *n,
 	if (filter.family && filter.family != ifa->ifa_family)
 		return 0;
 
-	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELADDR;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
-		filter.flushed++;
+	if (filter.flush) {
+		if (ipflush_add(n, RTM_DELADDR) < 0)
+			return -1;
 		if (show_stats < 2)
 			return 0;
 	}
@@ -536,7 +513,7 @@ int print_addrinfo(const struct sockaddr_nl *who, struct nlmsghdr *n,
 	if (n->nlmsg_type == RTM_DELADDR)
 		fprintf(fp, "Deleted ");
 
-	if (filter.oneline || filter.flushb)
+	if (filter.oneline || filter.flush)
 		fprintf(fp, "%u: %s", ifa->ifa_index, ll_index_to_name(ifa->ifa_index));
 	if (ifa->ifa_family == AF_INET)
 		fprintf(fp, "    inet ");
@@ -671,6 +648,136 @@ struct nlmsg_list
 	struct nlmsghdr	  h;
 };
 
+struct nlmsg_chain
+{
+	struct nlmsg_list *head;
+	struct nlmsg_list *tail;
+};
+
+static void nlmsg_chain_add(struct nlmsg_chain *c, struct nlmsg_list *l)
+{
+	l->next = NULL;
+	if (c->tail)
+		c->tail->next = l;
+	else
+		c->head = l;
+	c->tail = l;
+}
+
+/*
+ * Addresses are copied into an arena and hashed by interface index,
+ * so that joining them with the links is linear.  In streaming mode
+ * only the addresses of the interface being dumped are kept, and the
+ * interface is printed as soon as the dump moves on to the next one.
+ */
+#define ADDR_ARENA_CHUNK	65536
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	int		   size;
+	char		   data[0];
+};
+
+struct addr_table
+{
+	unsigned	   mask;
+	struct nlmsg_chain *hash;
+	struct nlmsg_list  **links;
+	struct arena_chunk *chunks;
+	int		   used;
+	int		   no_link;
+	int		   stream;
+	int		   ifindex;
+	struct nlmsg_chain cur;
+};
+
+static void *arena_alloc(struct addr_table *t, int len)
+{
+	struct arena_chunk *c = t->chunks;
+	void *p;
+
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (c == NULL || t->used + len > c->size) {
+		int size = len > ADDR_ARENA_CHUNK ? len : ADDR_ARENA_CHUNK;
+
+		c = malloc(sizeof(*c) + size);
+		if (c == NULL)
+			return NULL;
+		c->size = size;
+		c->next = t->chunks;
+		t->chunks = c;
+		t->used = 0;
+	}
+	p = c->data + t->used;
+	t->used += len;
+	return p;
+}
+
+/* Release everything but the current chunk */
+static void arena_reset(struct addr_table *t)
+{
+	struct arena_chunk *c = t->chunks;
+
+	if (c == NULL)
+		return;
+	while (c->next) {
+		struct arena_chunk *next = c->next->next;
+
+		free(c->next);
+		c->next = next;
+	}
+	t->used = 0;
+}
+
+static int addr_table_init(struct addr_table *t, int nlinks)
+{
+	unsigned size = 16;
+
+	memset(t, 0, sizeof(*t));
+	while (size < 2 * nlinks)
+		size <<= 1;
+	t->hash = calloc(size, sizeof(*t->hash));
+	t->links = calloc(size, sizeof(*t->links));
+	if (t->hash == NULL || t->links == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	t->mask = size - 1;
+	return 0;
+}
+
+static void addr_table_free(struct addr_table *t)
+{
+	arena_reset(t);
+	free(t->chunks);
+	free(t->hash);
+	free(t->links);
+}
+
+static void addr_table_add_link(struct addr_table *t, struct nlmsg_list *l)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
+	unsigned i;
+
+	for (i = ifi->ifi_index & t->mask; t->links[i]; i = (i + 1) & t->mask)
+		;
+	t->links[i] = l;
+}
+
+static struct nlmsg_list *addr_table_link(struct addr_table *t, int ifindex)
+{
+	unsigned i;
+
+	for (i = ifindex & t->mask; t->links[i]; i = (i + 1) & t->mask) {
+		struct ifinfomsg *ifi = NLMSG_DATA(&t->links[i]->h);
+
+		if (ifi->ifi_index == ifindex)
+			return t->links[i];
+	}
+	return NULL;
+}
+
 static int print_selected_addrinfo(int ifindex, struct nlmsg_list *ainfo, FILE *fp)
 {
 	for ( ;ainfo ;  ainfo = ainfo->next) {
@@ -680,9 +787,6 @@ static int print_selected_addrinfo(int ifindex, struct nlmsg_list *ainfo, FILE *
 		if (n->nlmsg_type != RTM_NEWADDR)
 			continue;
 
-		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(ifa)))
-			return -1;
-
 		if (ifa->ifa_index != ifindex ||
 		    (filter.family && filter.family != ifa->ifa_family))
 			continue;
@@ -692,34 +796,137 @@ static int print_selected_addrinfo(int ifindex, struct nlmsg_list *ainfo, FILE *
 	return 0;
 }
 
+static int ifa_match(struct nlmsghdr *n)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+
+	if (filter.family && filter.family != ifa->ifa_family)
+		return 0;
+	if ((filter.scope^ifa->ifa_scope)&filter.scopemask)
+		return 0;
+	if ((filter.flags^ifa->ifa_flags)&filter.flagmask)
+		return 0;
+	if (filter.pfx.family || filter.label) {
+		struct rtattr *tb[IFA_MAX+1];
+		parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+		if (!tb[IFA_LOCAL])
+			tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+
+		if (filter.pfx.family && tb[IFA_LOCAL]) {
+			inet_prefix dst;
+			memset(&dst, 0, sizeof(dst));
+			dst.family = ifa->ifa_family;
+			memcpy(&dst.data, RTA_DATA(tb[IFA_LOCAL]), RTA_PAYLOAD(tb[IFA_LOCAL]));
+			if (inet_addr_match(&dst, &filter.pfx, filter.pfx.bitlen))
+				return 0;
+		}
+		if (filter.label) {
+			SPRINT_BUF(b1);
+			const char *label;
+			if (tb[IFA_LABEL])
+				label = RTA_DATA(tb[IFA_LABEL]);
+			else
+				label = ll_idx_n2a(ifa->ifa_index, b1);
+			if (fnmatch(filter.label, label, 0) != 0)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static void print_link_addrinfo(struct nlmsg_list *l, struct nlmsg_list *ainfo,
+				int no_link)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
+
+	if (filter.family && filter.family != AF_PACKET) {
+		struct nlmsg_list *a;
+
+		for (a = ainfo; a; a = a->next) {
+			struct ifaddrmsg *ifa = NLMSG_DATA(&a->h);
+
+			if (ifa->ifa_index == ifi->ifi_index && ifa_match(&a->h))
+				break;
+		}
+		if (a == NULL)
+			return;
+	}
+
+	if (no_link || print_linkinfo(NULL, &l->h, stdout) == 0) {
+		if (filter.family != AF_PACKET)
+			print_selected_addrinfo(ifi->ifi_index, ainfo, stdout);
+	}
+	fflush(stdout);
+}
+
+static void addr_table_flush(struct addr_table *t)
+{
+	struct nlmsg_list *l;
+
+	if (t->cur.head == NULL)
+		return;
+
+	l = addr_table_link(t, t->ifindex);
+	if (l)
+		print_link_addrinfo(l, t->cur.head, t->no_link);
+
+	t->cur.head = t->cur.tail = NULL;
+	arena_reset(t);
+}
 
 static int store_nlmsg(const struct sockaddr_nl *who, struct nlmsghdr *n,
 		       void *arg)
 {
-	struct nlmsg_list **linfo = (struct nlmsg_list**)arg;
+	struct nlmsg_chain *linfo = (struct nlmsg_chain *)arg;
 	struct nlmsg_list *h;
-	struct nlmsg_list **lp;
 
 	h = malloc(n->nlmsg_len+sizeof(void*));
 	if (h == NULL)
 		return -1;
 
 	memcpy(&h->h, n, n->nlmsg_len);
-	h->next = NULL;
-
-	for (lp = linfo; *lp; lp = &(*lp)->next) /* NOTHING */;
-	*lp = h;
+	nlmsg_chain_add(linfo, h);
 
 	ll_remember_index(who, n, NULL);
 	return 0;
 }
 
+static int store_addrinfo(const struct sockaddr_nl *who, struct nlmsghdr *n,
+			  void *arg)
+{
+	struct addr_table *t = (struct addr_table *)arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct nlmsg_list *h;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	if (t->stream && ifa->ifa_index != t->ifindex) {
+		addr_table_flush(t);
+		t->ifindex = ifa->ifa_index;
+	}
+
+	h = arena_alloc(t, n->nlmsg_len+sizeof(void*));
+	if (h == NULL)
+		return -1;
+
+	memcpy(&h->h, n, n->nlmsg_len);
+	if (t->stream)
+		nlmsg_chain_add(&t->cur, h);
+	else
+		nlmsg_chain_add(&t->hash[ifa->ifa_index & t->mask], h);
+	return 0;
+}
+
 static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 {
-	struct nlmsg_list *linfo = NULL;
-	struct nlmsg_list *ainfo = NULL;
+	struct nlmsg_chain linfo = { NULL, NULL };
+	struct addr_table ainfo;
 	struct nlmsg_list *l, *n;
 	char *filter_dev = NULL;
+	int nlinks = 0;
 	int no_link = 0;
 
 	ipaddr_reset_filter(oneline);
@@ -829,11 +1036,9 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 
 	if (flush) {
 		int round = 0;
-		char flushb[4096-512];
 
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		filter.flush = 1;
+		ipflush_start();
 
 		while ((max_flush_loops == 0) || (round < max_flush_loops)) {
 			const struct rtnl_dump_filter_arg a[3] = {
@@ -856,130 +1061,86 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 					.arg2 = NULL
 				},
 			};
+			int again;
+
 			if (rtnl_wilddump_request(&rth, filter.family, RTM_GETADDR) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
 			}
-			filter.flushed = 0;
+			ipflush_round();
 			if (rtnl_dump_filter_l(&rth, a) < 0) {
 				fprintf(stderr, "Flush terminated\n");
 				exit(1);
 			}
-			if (filter.flushed == 0) {
-flush_done:
-				if (show_stats) {
-					if (round == 0)
-						printf("Nothing to flush.\n");
-					else 
-						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
-				}
+			if (ipflush_queued() == 0) {
+				if (round)
+					return ipflush_finish(round);
+				if (show_stats)
+					printf("Nothing to flush.\n");
 				fflush(stdout);
 				return 0;
 			}
 			round++;
-			if (flush_update() < 0)
+			again = ipflush_commit();
+			if (again < 0)
 				return 1;
 
-			if (show_stats) {
-				printf("\n*** Round %d, deleting %d addresses ***\n", round, filter.flushed);
-				fflush(stdout);
-			}
+			if (show_stats)
+				ipflush_print_round(round, "addresses");
 
 			/* If we are flushing, and specifying primary, then we
 			 * want to flush only a single round.  Otherwise, we'll
 			 * start flushing secondaries that were promoted to
 			 * primaries.
 			 */
-			if (!(filter.flags & IFA_F_SECONDARY) && (filter.flagmask & IFA_F_SECONDARY))
-				goto flush_done;
+			if (!again ||
+			    (!(filter.flags & IFA_F_SECONDARY) && (filter.flagmask & IFA_F_SECONDARY)))
+				return ipflush_finish(round);
 		}
 		fprintf(stderr, "*** Flush remains incomplete after %d rounds. ***\n", max_flush_loops);
 		fflush(stderr);
 		return 1;
 	}
 
+	for (l = linfo.head; l; l = l->next)
+		nlinks++;
+	if (addr_table_init(&ainfo, nlinks) < 0)
+		return 1;
+	for (l = linfo.head; l; l = l->next)
+		addr_table_add_link(&ainfo, l);
+
+	if (filter.family && filter.family != AF_PACKET && filter.oneline)
+		no_link = 1;
+	ainfo.no_link = no_link;
+	ainfo.stream = stream_output &&
+		       filter.family && filter.family != AF_PACKET;
+
 	if (filter.family != AF_PACKET) {
 		if (rtnl_wilddump_request(&rth, filter.family, RTM_GETADDR) < 0) {
 			perror("Cannot send dump request");
 			exit(1);
 		}
 
-		if (rtnl_dump_filter(&rth, store_nlmsg, &ainfo, NULL, NULL) < 0) {
+		if (rtnl_dump_filter(&rth, store_addrinfo, &ainfo, NULL, NULL) < 0) {
 			fprintf(stderr, "Dump terminated\n");
 			exit(1);
 		}
 	}
 
+	if (ainfo.stream)
+		addr_table_flush(&ainfo);
 
-	if (filter.family && filter.family != AF_PACKET) {
-		struct nlmsg_list **lp;
-		lp=&linfo;
-
-		if (filter.oneline)
-			no_link = 1;
-
-		while ((l=*lp)!=NULL) {
-			int ok = 0;
-			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
-			struct nlmsg_list *a;
-
-			for (a=ainfo; a; a=a->next) {
-				struct nlmsghdr *n = &a->h;
-				struct ifaddrmsg *ifa = NLMSG_DATA(n);
-
-				if (ifa->ifa_index != ifi->ifi_index ||
-				    (filter.family && filter.family != ifa->ifa_family))
-					continue;
-				if ((filter.scope^ifa->ifa_scope)&filter.scopemask)
-					continue;
-				if ((filter.flags^ifa->ifa_flags)&filter.flagmask)
-					continue;
-				if (filter.pfx.family || filter.label) {
-					struct rtattr *tb[IFA_MAX+1];
-					parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
-					if (!tb[IFA_LOCAL])
-						tb[IFA_LOCAL] = tb[IFA_ADDRESS];
-
-					if (filter.pfx.family && tb[IFA_LOCAL]) {
-						inet_prefix dst;
-						memset(&dst, 0, sizeof(dst));
-						dst.family = ifa->ifa_family;
-						memcpy(&dst.data, RTA_DATA(tb[IFA_LOCAL]), RTA_PAYLOAD(tb[IFA_LOCAL]));
-						if (inet_addr_match(&dst, &filter.pfx, filter.pfx.bitlen))
-							continue;
-					}
-					if (filter.label) {
-						SPRINT_BUF(b1);
-						const char *label;
-						if (tb[IFA_LABEL])
-							label = RTA_DATA(tb[IFA_LABEL]);
-						else
-							label = ll_idx_n2a(ifa->ifa_index, b1);
-						if (fnmatch(filter.label, label, 0) != 0)
-							continue;
-					}
-				}
-
-				ok = 1;
-				break;
-			}
-			if (!ok)
-				*lp = l->next;
-			else
-				lp = &l->next;
-		}
-	}
-
-	for (l=linfo; l; l = n) {
+	for (l = linfo.head; l; l = n) {
 		n = l->next;
-		if (no_link || print_linkinfo(NULL, &l->h, stdout) == 0) {
+		if (!ainfo.stream) {
 			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
-			if (filter.family != AF_PACKET)
-				print_selected_addrinfo(ifi->ifi_index, ainfo, stdout);
+
+			print_link_addrinfo(l, ainfo.hash[ifi->ifi_index & ainfo.mask].head,
+					    no_link);
 		}
-		fflush(stdout);
 		free(l);
 	}
+	addr_table_free(&ainfo);
 
 	return 0;
 }
@@ -0,0 +1,175 @@
+/*
+ * ipflush.c		Flush engine for "ip route/addr/neigh flush".
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "utils.h"
+#include "ip_common.h"
+
+/*
+ * Delete requests are collected while the table is dumped and sent only
+ * after the dump is complete, so our own deletes never disturb it.  They
+ * are then pipelined in windows with ACKs.  One dump is enough unless
+ * the kernel flagged it as inconsistent or a delete failed for a
+ * transient reason; only then is the table dumped again.
+ */
+#define IPFLUSH_WINDOW	256
+
+static struct {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+	int		queued;
+	int		retry;
+	int		failed;
+	struct timeval	start;
+	struct timeval	round;
+} fl;
+
+static double ipflush_elapsed(const struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) +
+		(now.tv_usec - since->tv_usec) / 1000000.;
+}
+
+void ipflush_start(void)
+{
+	gettimeofday(&fl.start, NULL);
+}
+
+void ipflush_round(void)
+{
+	fl.len = 0;
+	fl.queued = 0;
+	fl.retry = 0;
+	fl.failed = 0;
+	gettimeofday(&fl.round, NULL);
+}
+
+int ipflush_add(const struct nlmsghdr *n, int type)
+{
+	size_t len = NLMSG_ALIGN(n->nlmsg_len);
+	struct nlmsghdr *fn;
+
+	if (fl.len + len > fl.size) {
+		size_t size = fl.size ? fl.size : 65536;
+		char *buf;
+
+		while (fl.len + len > size)
+			size *= 2;
+		buf = realloc(fl.buf, size);
+		if (buf == NULL) {
+			fprintf(stderr, "Cannot allocate flush buffer\n");
+			return -1;
+		}
+		fl.buf = buf;
+		fl.size = size;
+	}
+
+	fn = (struct nlmsghdr *)(fl.buf + fl.len);
+	memcpy(fn, n, n->nlmsg_len);
+	memset((char *)fn + n->nlmsg_len, 0, len - n->nlmsg_len);
+	fn->nlmsg_type = type;
+	fn->nlmsg_flags = NLM_F_REQUEST;
+	fl.len += len;
+	fl.queued++;
+	return 0;
+}
+
+int ipflush_queued(void)
+{
+	return fl.queued;
+}
+
+static int ipflush_error(int tag, int error, void *arg)
+{
+	switch (error) {
+	case ENOENT:
+	case ESRCH:
+	case ENODEV:
+	case EADDRNOTAVAIL:
+		/* Already gone, e.g. with the primary address */
+		return 0;
+	case 0:
+	case EINTR:
+	case EAGAIN:
+	case EBUSY:
+	case ENOBUFS:
+		fl.retry++;
+		return 1;
+	}
+
+	if (fl.failed++ == 0) {
+		errno = error;
+		perror("RTNETLINK answers");
+	}
+	return 1;
+}
+
+/* Returns 1 if another round is needed, 0 if done, -1 on error */
+int ipflush_commit(void)
+{
+	struct rtnl_batch *outer = rth.batch;
+	char *p;
+
+	if (outer && rtnl_batch_flush(&rth) < 0)
+		return -1;
+	rth.batch = NULL;
+	if (rtnl_batch_start(&rth, IPFLUSH_WINDOW, ipflush_error, NULL) < 0)
+		return -1;
+
+	for (p = fl.buf; p < fl.buf + fl.len; ) {
+		struct nlmsghdr *n = (struct nlmsghdr *)p;
+
+		p += NLMSG_ALIGN(n->nlmsg_len);
+		/* A lost window is accounted for as retries */
+		rtnl_talk(&rth, n, 0, 0, NULL, NULL, NULL);
+	}
+
+	rtnl_batch_stop(&rth);
+	rth.batch = outer;
+	fl.len = 0;
+
+	return fl.retry || rth.dump_intr;
+}
+
+void ipflush_print_round(int round, const char *what)
+{
+	printf("\n*** Round %d, deleting %d %s, %.3f s", round, fl.queued,
+	       what, ipflush_elapsed(&fl.round));
+	if (fl.retry || rth.dump_intr)
+		printf(", %d to retry%s", fl.retry,
+		       rth.dump_intr ? ", table changed during dump" : "");
+	printf(" ***\n");
+	fflush(stdout);
+}
+
+/* Report the outcome of a flush and return its exit status */
+int ipflush_finish(int rounds)
+{
+	if (fl.failed) {
+		fprintf(stderr, "*** Flush remains incomplete, %d entr%s could not be deleted ***\n",
+			fl.failed, fl.failed > 1 ? "ies" : "y");
+		return 1;
+	}
+	if (show_stats)
+		printf("*** Flush is complete after %d round%s, %.3f s ***\n",
+		       rounds, rounds > 1 ? "s" : "",
+		       ipflush_elapsed(&fl.start));
+	fflush(stdout);
+	return 0;
+}
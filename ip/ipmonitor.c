@@ -20,16 +20,27 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "utils.h"
+#include "rt_mirror.h"
+#include "rtjournal.h"
 #include "ip_common.h"
 
 static void usage(void) __attribute__((noreturn));
 int prefix_banner;
+static struct rtnl_mirror *mirror;
+static unsigned file_groups;
+static struct {
+	struct nlmsghdr	n;
+	__u32		tv[2];
+} file_stamp;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ip monitor [ all | LISTofOBJECTS ]\n");
+	fprintf(stderr, "Usage: ip monitor [ all | LISTofOBJECTS ] [ resync ]\n");
+	fprintf(stderr, "       ip monitor file FILE [ since TIME ] [ until TIME ] [ all | LISTofOBJECTS ]\n");
+	fprintf(stderr, "TIME := { SECONDS | @SECONDS | YYYY-MM-DD[ HH:MM[:SS]] }\n");
 	exit(-1);
 }
 
@@ -94,6 +105,13 @@ int accept_msg(const struct sockaddr_nl *who,
 		fprintf(fp, "Timestamp: %s %lu us\n", tstr, usecs);
 		return 0;
 	}
+	if (n->nlmsg_type == NLMSG_OVERRUN) {
+		if (prefix_banner)
+			fprintf(fp, "[RESYNC]");
+		fprintf(fp, "Resync: events were lost\n");
+		fflush(fp);
+		return 0;
+	}
 	if (n->nlmsg_type == RTM_NEWQDISC ||
 	    n->nlmsg_type == RTM_DELQDISC ||
 	    n->nlmsg_type == RTM_NEWTCLASS ||
@@ -109,15 +127,159 @@ int accept_msg(const struct sockaddr_nl *who,
 	return 0;
 }
 
+static int monitor_msg(const struct sockaddr_nl *who,
+		       struct nlmsghdr *n, void *arg)
+{
+	if (mirror && rtnl_mirror_update(mirror, n) < 0)
+		return -1;
+	return accept_msg(who, n, arg);
+}
+
+/* Mark the gap and, with "resync", report what changed meanwhile */
+static int monitor_resync(struct rtnl_handle *rth, void *arg)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct nlmsghdr marker = {
+		.nlmsg_len = NLMSG_LENGTH(0),
+		.nlmsg_type = NLMSG_OVERRUN,
+	};
+
+	accept_msg(&nladdr, &marker, arg);
+	if (mirror == NULL)
+		return 0;
+	rtnl_listen_drain(rth);
+	return rtnl_mirror_sync(mirror, accept_msg, arg);
+}
+
+/* Group an event was delivered to, ~0U for what is always shown */
+static unsigned msg_group(const struct nlmsghdr *n)
+{
+	int family = ((struct rtgenmsg *)NLMSG_DATA(n))->rtgen_family;
+
+	switch (n->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		return nl_mgrp(RTNLGRP_LINK);
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		if (family == AF_INET)
+			return nl_mgrp(RTNLGRP_IPV4_IFADDR);
+		if (family == AF_INET6)
+			return nl_mgrp(RTNLGRP_IPV6_IFADDR);
+		break;
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		if (family == AF_INET)
+			return nl_mgrp(RTNLGRP_IPV4_ROUTE);
+		if (family == AF_INET6)
+			return nl_mgrp(RTNLGRP_IPV6_ROUTE);
+		break;
+	case RTM_NEWRULE:
+	case RTM_DELRULE:
+		if (family == AF_INET)
+			return nl_mgrp(RTNLGRP_IPV4_RULE);
+		if (family == AF_INET6)
+			return nl_mgrp(RTNLGRP_IPV6_RULE);
+		break;
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		return nl_mgrp(RTNLGRP_NEIGH);
+	case RTM_NEWPREFIX:
+		return nl_mgrp(RTNLGRP_IPV6_PREFIX);
+	case NLMSG_OVERRUN:
+		return ~0U;
+	}
+	return ~RTMGRP_TC;
+}
+
+/* Replayed events: a timestamp is shown only before an event shown */
+static int file_msg(const struct sockaddr_nl *who,
+		    struct nlmsghdr *n, void *arg)
+{
+	if (n->nlmsg_type == RTJ_TSTAMP) {
+		if (n->nlmsg_len >= NLMSG_LENGTH(sizeof(file_stamp.tv)))
+			memcpy(&file_stamp, n, sizeof(file_stamp));
+		return 0;
+	}
+	if (!(msg_group(n) & file_groups)) {
+		if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK)
+			ll_remember_index(who, n, NULL);
+		return 0;
+	}
+	if (file_stamp.n.nlmsg_len) {
+		accept_msg(who, &file_stamp.n, arg);
+		file_stamp.n.nlmsg_len = 0;
+	}
+	return accept_msg(who, n, arg);
+}
+
+/* Events skipped over still name the links of later ones */
+static int file_snap(const struct sockaddr_nl *who,
+		     struct nlmsghdr *n, void *arg)
+{
+	if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK)
+		ll_remember_index(who, n, NULL);
+	return 0;
+}
+
+static int get_time_us(__u64 *us, const char *arg)
+{
+	static const char *fmts[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M", "%Y-%m-%d",
+	};
+	unsigned long secs;
+	struct tm tm;
+	char *end;
+	int i;
+
+	secs = strtoul(arg + (*arg == '@'), &end, 10);
+	if (end != arg && *end == 0) {
+		*us = secs * 1000000ULL;
+		return 0;
+	}
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(arg, fmts[i], &tm);
+		if (end && *end == 0) {
+			tm.tm_isdst = -1;
+			*us = mktime(&tm) * 1000000ULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int monitor_file(const char *file, unsigned groups,
+			__u64 since, __u64 until)
+{
+	struct stat st;
+	FILE *fp;
+
+	file_groups = groups;
+	if (stat(file, &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+		return rtj_replay(file, since, until, file_msg, file_snap,
+				  stdout) < 0 ? -1 : 0;
+
+	fp = fopen(file, "r");
+	if (fp == NULL) {
+		perror("Cannot fopen");
+		exit(-1);
+	}
+	return rtnl_from_file(fp, file_msg, stdout);
+}
+
 int do_ipmonitor(int argc, char **argv)
 {
 	char *file = NULL;
+	__u64 since = 0, until = 0;
 	unsigned groups = ~RTMGRP_TC;
 	int llink=0;
 	int laddr=0;
 	int lroute=0;
 	int lprefix=0;
 	int lneigh=0;
+	int resync=0;
 
 	rtnl_close(&rth);
 	ipaddr_reset_filter(1);
@@ -128,6 +290,14 @@ int do_ipmonitor(int argc, char **argv)
 		if (matches(*argv, "file") == 0) {
 			NEXT_ARG();
 			file = *argv;
+		} else if (matches(*argv, "since") == 0) {
+			NEXT_ARG();
+			if (get_time_us(&since, *argv))
+				invarg("invalid \"since\" time\n", *argv);
+		} else if (matches(*argv, "until") == 0) {
+			NEXT_ARG();
+			if (get_time_us(&until, *argv))
+				invarg("invalid \"until\" time\n", *argv);
 		} else if (matches(*argv, "link") == 0) {
 			llink=1;
 			groups = 0;
@@ -146,6 +316,8 @@ int do_ipmonitor(int argc, char **argv)
 		} else if (strcmp(*argv, "all") == 0) {
 			groups = ~RTMGRP_TC;
 			prefix_banner=1;
+		} else if (matches(*argv, "resync") == 0) {
+			resync = 1;
 		} else if (matches(*argv, "help") == 0) {
 			usage();
 		} else {
@@ -176,21 +348,24 @@ int do_ipmonitor(int argc, char **argv)
 	if (lneigh) {
 		groups |= nl_mgrp(RTNLGRP_NEIGH);
 	}
-	if (file) {
-		FILE *fp;
-		fp = fopen(file, "r");
-		if (fp == NULL) {
-			perror("Cannot fopen");
-			exit(-1);
-		}
-		return rtnl_from_file(fp, accept_msg, stdout);
+	if (file)
+		return monitor_file(file, groups, since, until);
+	if (since || until) {
+		fprintf(stderr, "\"since\" and \"until\" only apply to \"file\".\n");
+		exit(-1);
 	}
 
 	if (rtnl_open(&rth, groups) < 0)
 		exit(1);
 	ll_init_map(&rth);
 
-	if (rtnl_listen(&rth, accept_msg, stdout) < 0)
+	if (resync) {
+		mirror = rtnl_mirror_new(groups);
+		if (mirror == NULL || rtnl_mirror_sync(mirror, NULL, NULL) < 0)
+			exit(1);
+	}
+
+	if (rtnl_listen_resync(&rth, monitor_msg, stdout, monitor_resync) < 0)
 		exit(2);
 
 	return 0;
@@ -35,10 +35,7 @@ static struct
 	int state;
 	int unused_only;
 	inet_prefix pfx;
-	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	int flush;
 } filter;
 
 static void usage(void) __attribute__((noreturn));
@@ -81,16 +78,6 @@ int nud_state_a2n(unsigned *state, char *arg)
 	return 0;
 }
 
-static int flush_update(void)
-{
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
-		perror("Failed to send flush request");
-		return -1;
-	}
-	filter.flushp = 0;
-	return 0;
-}
-
 
 static int ipneigh_modify(int cmd, int flags, int argc, char **argv)
 {
@@ -201,7 +188,7 @@ int print_neigh(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		return -1;
 	}
 
-	if (filter.flushb && n->nlmsg_type != RTM_NEWNEIGH)
+	if (filter.flush && n->nlmsg_type != RTM_NEWNEIGH)
 		return 0;
 
 	if (filter.family && filter.family != r->ndm_family)
@@ -231,19 +218,9 @@ int print_neigh(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 			return 0;
 	}
 
-	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELNEIGH;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
-		filter.flushed++;
+	if (filter.flush) {
+		if (ipflush_add(n, RTM_DELNEIGH) < 0)
+			return -1;
 		if (show_stats < 2)
 			return 0;
 	}
@@ -304,6 +281,28 @@ int print_neigh(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 	return 0;
 }
 
+/* Queues the names print_neigh() is going to ask format_host() for */
+static int prescan_neigh(const struct sockaddr_nl *who, struct nlmsghdr *n,
+			 void *arg)
+{
+	struct ndmsg *r = NLMSG_DATA(n);
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
+	struct rtattr *tb[NDA_MAX+1];
+
+	if (n->nlmsg_type != RTM_NEWNEIGH || len < 0)
+		return 0;
+	if (filter.family && filter.family != r->ndm_family)
+		return 0;
+	if (filter.index && filter.index != r->ndm_ifindex)
+		return 0;
+
+	parse_rtattr(tb, NDA_MAX, NDA_RTA(r), len);
+	if (tb[NDA_DST])
+		resolve_prefetch(r->ndm_family, RTA_PAYLOAD(tb[NDA_DST]),
+				 RTA_DATA(tb[NDA_DST]));
+	return 0;
+}
+
 void ipneigh_reset_filter()
 {
 	memset(&filter, 0, sizeof(filter));
@@ -314,6 +313,7 @@ int do_show_or_flush(int argc, char **argv, int flush)
 {
 	char *filter_dev = NULL;
 	int state_given = 0;
+	int ret;
 
 	ipneigh_reset_filter();
 
@@ -378,40 +378,39 @@ int do_show_or_flush(int argc, char **argv, int flush)
 
 	if (flush) {
 		int round = 0;
-		char flushb[4096-512];
 
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		filter.flush = 1;
 		filter.state &= ~NUD_FAILED;
+		ipflush_start();
 
 		while (round < MAX_ROUNDS) {
+			int again;
+
 			if (rtnl_wilddump_request(&rth, filter.family, RTM_GETNEIGH) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
 			}
-			filter.flushed = 0;
+			ipflush_round();
 			if (rtnl_dump_filter(&rth, print_neigh, stdout, NULL, NULL) < 0) {
 				fprintf(stderr, "Flush terminated\n");
 				exit(1);
 			}
-			if (filter.flushed == 0) {
-				if (show_stats) {
-					if (round == 0)
-						printf("Nothing to flush.\n");
-					else
-						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
-				}
+			if (ipflush_queued() == 0) {
+				if (round)
+					return ipflush_finish(round);
+				if (show_stats)
+					printf("Nothing to flush.\n");
 				fflush(stdout);
 				return 0;
 			}
 			round++;
-			if (flush_update() < 0)
+			again = ipflush_commit();
+			if (again < 0)
 				exit(1);
-			if (show_stats) {
-				printf("\n*** Round %d, deleting %d entries ***\n", round, filter.flushed);
-				fflush(stdout);
-			}
+			if (show_stats)
+				ipflush_print_round(round, "entries");
+			if (!again)
+				return ipflush_finish(round);
 		}
 		printf("*** Flush not complete bailing out after %d rounds\n",
 			MAX_ROUNDS);
@@ -423,7 +422,12 @@ int do_show_or_flush(int argc, char **argv, int flush)
 		exit(1);
 	}
 
-	if (rtnl_dump_filter(&rth, print_neigh, stdout, NULL, NULL) < 0) {
+	if (resolve_hosts)
+		ret = rtnl_dump_filter_prescan(&rth, prescan_neigh, print_neigh,
+					       stdout);
+	else
+		ret = rtnl_dump_filter(&rth, print_neigh, stdout, NULL, NULL);
+	if (ret < 0) {
 		fprintf(stderr, "Dump terminated\n");
 		exit(1);
 	}
@@ -12,6 +12,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <fcntl.h>
@@ -19,14 +20,18 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <linux/in_route.h>
+#include <linux/if.h>
 #include <errno.h>
 
 #include "rt_names.h"
 #include "utils.h"
+#include "ll_map.h"
 #include "ip_common.h"
 
 #ifndef RTAX_RTTVAR
@@ -94,10 +99,10 @@ static struct
 {
 	int tb;
 	int cloned;
-	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	int dumped;
+	int dropped;
+	int kernel_filtered;
+	int flush;
 	int protocol, protocolmask;
 	int scope, scopemask;
 	int type, typemask;
@@ -114,16 +119,6 @@ static struct
 	inet_prefix msrc;
 } filter;
 
-static int flush_update(void)
-{
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
-		perror("Failed to send flush request");
-		return -1;
-	}
-	filter.flushp = 0;
-	return 0;
-}
-
 int filter_nlmsg(struct nlmsghdr *n, struct rtattr **tb, int host_len)
 {
 	struct rtmsg *r = NLMSG_DATA(n);
@@ -252,7 +247,7 @@ int filter_nlmsg(struct nlmsghdr *n, struct rtattr **tb, int host_len)
 		if ((mark ^ filter.mark) & filter.markmask)
 			return 0;
 	}
-	if (filter.flushb &&
+	if (filter.flush &&
 	    r->rtm_family == AF_INET6 &&
 	    r->rtm_dst_len == 0 &&
 	    r->rtm_type == RTN_UNREACHABLE &&
@@ -263,6 +258,20 @@ int filter_nlmsg(struct nlmsghdr *n, struct rtattr **tb, int host_len)
 	return 1;
 }
 
+/* filter_nlmsg() accounting which routes the kernel already filtered */
+static int iproute_filter(struct nlmsghdr *n, struct rtattr **tb, int host_len)
+{
+	filter.dumped++;
+	if (n->nlmsg_flags & NLM_F_DUMP_FILTERED)
+		filter.kernel_filtered = 1;
+
+	if (!filter_nlmsg(n, tb, host_len)) {
+		filter.dropped++;
+		return 0;
+	}
+	return 1;
+}
+
 int calc_host_len(struct rtmsg *r)
 {
 	if (r->rtm_family == AF_INET6)
@@ -294,7 +303,7 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 			n->nlmsg_len, n->nlmsg_type, n->nlmsg_flags);
 		return 0;
 	}
-	if (filter.flushb && n->nlmsg_type != RTM_NEWROUTE)
+	if (filter.flush && n->nlmsg_type != RTM_NEWROUTE)
 		return 0;
 	len -= NLMSG_LENGTH(sizeof(*r));
 	if (len < 0) {
@@ -307,22 +316,12 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
 	table = rtm_get_table(r, tb);
 
-	if (!filter_nlmsg(n, tb, host_len))
+	if (!iproute_filter(n, tb, host_len))
 		return 0;
 
-	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELROUTE;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
-		filter.flushed++;
+	if (filter.flush) {
+		if (ipflush_add(n, RTM_DELROUTE) < 0)
+			return -1;
 		if (show_stats < 2)
 			return 0;
 	}
@@ -1025,6 +1024,9 @@ static int rtnl_rtcache_request(struct rtnl_handle *rth, int family)
 	} req;
 	struct sockaddr_nl nladdr;
 
+	if (rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	memset(&req, 0, sizeof(req));
 	nladdr.nl_family = AF_NETLINK;
@@ -1040,6 +1042,45 @@ static int rtnl_rtcache_request(struct rtnl_handle *rth, int family)
 	return sendto(rth->fd, (void*)&req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
 }
 
+/*
+ * Dump request carrying the table, protocol, type and output device
+ * filters, so that kernels with strict dump checking only send matching
+ * routes.  filter_nlmsg() still applies all filters in userspace, which
+ * is all older kernels get.  The kernel cannot filter on prefixes.
+ */
+static int iproute_dump_request(struct rtnl_handle *rth, int family)
+{
+	struct {
+		struct nlmsghdr 	n;
+		struct rtmsg 		r;
+		char   			buf[64];
+	} req;
+
+	if (rtnl_strict_dump(rth, 1) < 0)
+		return rtnl_wilddump_request(rth, family, RTM_GETROUTE);
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.r.rtm_family = family;
+	/* strict kernels leave cached routes out unless asked for them */
+	if (filter.cloned)
+		req.r.rtm_flags = RTM_F_CLONED;
+
+	if (filter.tb > 0) {
+		req.r.rtm_table = filter.tb < 256 ? filter.tb : RT_TABLE_UNSPEC;
+		addattr32(&req.n, sizeof(req), RTA_TABLE, filter.tb);
+	}
+	if (filter.protocolmask)
+		req.r.rtm_protocol = filter.protocol;
+	if (filter.typemask)
+		req.r.rtm_type = filter.type;
+	if (filter.oifmask)
+		addattr32(&req.n, sizeof(req), RTA_OIF, filter.oif);
+
+	return rtnl_dump_request(rth, RTM_GETROUTE, &req.r,
+				 req.n.nlmsg_len - NLMSG_LENGTH(0));
+}
+
 static int iproute_flush_cache(void)
 {
 #define ROUTE_FLUSH_PATH "/proc/sys/net/ipv4/route/flush"
@@ -1064,33 +1105,203 @@ static int iproute_flush_cache(void)
 	return 0;
 }
 
-int save_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+/*
+ * "ip route save" writes a snapshot: a header, the ifindex to name map
+ * of the saving host and then the RTM_NEWROUTE messages back to back.
+ * Older versions wrote the bare messages; such a stream starts with
+ * nlmsg_len, which never matches the magic.  Snapshots may be appended
+ * to one another, restore takes a header anywhere as the start of the
+ * next one.
+ */
+#define RTSNAP_MAGIC	0x52544e53
+#define RTSNAP_VERSION	1
+#define RTSNAP_WINDOW	128
+
+struct rtsnap_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	hdrlen;
+	__u32	ifcount;
+	__u32	msgcount;	/* 0 if unknown, from older versions */
+};
+
+struct rtsnap_if {
+	__u32	ifindex;
+	char	name[IFNAMSIZ];
+};
+
+static struct rtsnap_hdr snap_hdr;
+static off_t snap_off = -1;
+static FILE *snap_fp;		/* where the messages go */
+
+static int save_count_link(unsigned idx, const char *name, void *arg)
 {
-	int ret;
-	int len = n->nlmsg_len;
-	struct rtmsg *r = NLMSG_DATA(n);
-	struct rtattr *tb[RTA_MAX+1];
-	int host_len = -1;
+	snap_hdr.ifcount++;
+	return 0;
+}
+
+static int save_link(unsigned idx, const char *name, void *arg)
+{
+	struct rtsnap_if ent;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.ifindex = idx;
+	strncpy(ent.name, name, IFNAMSIZ - 1);
+	return fwrite(&ent, sizeof(ent), 1, stdout) == 1 ? 0 : -1;
+}
+
+static int save_route_hdr(void)
+{
+	if (fwrite(&snap_hdr, sizeof(snap_hdr), 1, stdout) != 1 ||
+	    ll_walk(save_link, NULL) < 0) {
+		perror("Cannot write route snapshot");
+		return -1;
+	}
+	return 0;
+}
+
+static int save_route_start(void)
+{
+	struct stat st;
 
 	if (isatty(STDOUT_FILENO)) {
 		fprintf(stderr, "Not sending binary stream to stdout\n");
 		return -1;
 	}
 
+	snap_hdr.magic = RTSNAP_MAGIC;
+	snap_hdr.version = RTSNAP_VERSION;
+	snap_hdr.hdrlen = sizeof(snap_hdr);
+	ll_walk(save_count_link, NULL);
+
+	/* The message count of a file is filled in afterwards in place */
+	if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (fflush(stdout) != 0)
+			return -1;
+		if (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND)
+			snap_off = lseek(STDOUT_FILENO, 0, SEEK_END);
+		else
+			snap_off = ftello(stdout);
+		snap_fp = stdout;
+		return save_route_hdr();
+	}
+
+	/* A pipe gets the header once the dump is done, spool it meanwhile */
+	snap_fp = tmpfile();
+	if (snap_fp == NULL) {
+		perror("Cannot create route snapshot spool");
+		return -1;
+	}
+	return 0;
+}
+
+static int save_route_end(void)
+{
+	int flags, err;
+
+	if (snap_fp != stdout) {
+		char buf[65536];
+		size_t len;
+
+		if (fflush(snap_fp) != 0 || fseek(snap_fp, 0, SEEK_SET) != 0 ||
+		    save_route_hdr() < 0)
+			goto werr;
+		while ((len = fread(buf, 1, sizeof(buf), snap_fp)) > 0)
+			if (fwrite(buf, 1, len, stdout) != len)
+				goto werr;
+		if (ferror(snap_fp))
+			goto werr;
+		fclose(snap_fp);
+	}
+	if (fflush(stdout) != 0)
+		goto werr;
+	if (snap_off < 0)
+		return 0;
+
+	/* pwrite() ignores the offset of files opened for appending */
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (flags > 0 && (flags & O_APPEND))
+		fcntl(STDOUT_FILENO, F_SETFL, flags & ~O_APPEND);
+	err = pwrite(STDOUT_FILENO, &snap_hdr.msgcount, sizeof(snap_hdr.msgcount),
+		     snap_off + offsetof(struct rtsnap_hdr, msgcount)) < 0;
+	if (flags > 0 && (flags & O_APPEND))
+		fcntl(STDOUT_FILENO, F_SETFL, flags);
+	if (err) {
+		perror("Cannot update route snapshot header");
+		return -1;
+	}
+	return 0;
+
+werr:
+	perror("Cannot write route snapshot");
+	return -1;
+}
+
+int save_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	int len = n->nlmsg_len;
+	struct rtmsg *r = NLMSG_DATA(n);
+	struct rtattr *tb[RTA_MAX+1];
+	int host_len = -1;
+
 	host_len = calc_host_len(r);
 	len -= NLMSG_LENGTH(sizeof(*r));
 	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
 
-	if (!filter_nlmsg(n, tb, host_len))
+	if (!iproute_filter(n, tb, host_len))
 		return 0;
 
-	ret = write(STDOUT_FILENO, n, n->nlmsg_len);
-	if ((ret > 0) && (ret != n->nlmsg_len)) {
-		fprintf(stderr, "Short write while saving nlmsg\n");
-		ret = -EIO;
+	if (fwrite(n, NLMSG_ALIGN(n->nlmsg_len), 1, snap_fp) != 1) {
+		perror("Cannot write route snapshot");
+		return -1;
 	}
+	snap_hdr.msgcount++;
+	return 0;
+}
 
-	return ret == n->nlmsg_len ? 0 : ret;
+static void prefetch_rta(int family, struct rtattr *rta)
+{
+	if (rta)
+		resolve_prefetch(family, RTA_PAYLOAD(rta), RTA_DATA(rta));
+}
+
+/* Queues the names print_route() is going to ask format_host() for */
+static int prescan_route(const struct sockaddr_nl *who, struct nlmsghdr *n,
+			 void *arg)
+{
+	struct rtmsg *r = NLMSG_DATA(n);
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
+	struct rtattr *tb[RTA_MAX+1];
+	int host_len = calc_host_len(r);
+
+	if (n->nlmsg_type != RTM_NEWROUTE || len < 0)
+		return 0;
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
+	if (!filter_nlmsg(n, tb, host_len))
+		return 0;
+
+	if (r->rtm_dst_len == host_len)
+		prefetch_rta(r->rtm_family, tb[RTA_DST]);
+	if (r->rtm_src_len == host_len)
+		prefetch_rta(r->rtm_family, tb[RTA_SRC]);
+	if (filter.rvia.bitlen != host_len)
+		prefetch_rta(r->rtm_family, tb[RTA_GATEWAY]);
+	if (tb[RTA_MULTIPATH]) {
+		struct rtnexthop *nh = RTA_DATA(tb[RTA_MULTIPATH]);
+
+		len = RTA_PAYLOAD(tb[RTA_MULTIPATH]);
+		while (len >= (int)sizeof(*nh) && nh->rtnh_len <= len &&
+		       nh->rtnh_len >= sizeof(*nh)) {
+			if (nh->rtnh_len > sizeof(*nh)) {
+				parse_rtattr(tb, RTA_MAX, RTNH_DATA(nh),
+					     nh->rtnh_len - sizeof(*nh));
+				prefetch_rta(r->rtm_family, tb[RTA_GATEWAY]);
+			}
+			len -= NLMSG_ALIGN(nh->rtnh_len);
+			nh = RTNH_NEXT(nh);
+		}
+	}
+	return 0;
 }
 
 static int iproute_list_flush_or_save(int argc, char **argv, int action)
@@ -1099,6 +1310,7 @@ static int iproute_list_flush_or_save(int argc, char **argv, int action)
 	char *id = NULL;
 	char *od = NULL;
 	unsigned int mark = 0;
+	int ret;
 	rtnl_filter_t filter_fn;
 
 	if (action == IPROUTE_SAVE)
@@ -1266,7 +1478,6 @@ static int iproute_list_flush_or_save(int argc, char **argv, int action)
 
 	if (action == IPROUTE_FLUSH) {
 		int round = 0;
-		char flushb[4096-512];
 		time_t start = time(0);
 
 		if (filter.cloned) {
@@ -1279,49 +1490,54 @@ static int iproute_list_flush_or_save(int argc, char **argv, int action)
 				return 0;
 		}
 
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		filter.flush = 1;
+		ipflush_start();
 
 		for (;;) {
-			if (rtnl_wilddump_request(&rth, do_ipv6, RTM_GETROUTE) < 0) {
+			int again;
+
+			if (iproute_dump_request(&rth, do_ipv6) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
 			}
-			filter.flushed = 0;
+			ipflush_round();
 			if (rtnl_dump_filter(&rth, filter_fn, stdout, NULL, NULL) < 0) {
 				fprintf(stderr, "Flush terminated\n");
 				exit(1);
 			}
-			if (filter.flushed == 0) {
-				if (show_stats) {
-					if (round == 0 && (!filter.cloned || do_ipv6 == AF_INET6))
+			rtnl_strict_dump(&rth, 0);
+			if (ipflush_queued() == 0) {
+				if (round == 0 && (!filter.cloned || do_ipv6 == AF_INET6)) {
+					if (show_stats)
 						printf("Nothing to flush.\n");
-					else
-						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
+					fflush(stdout);
+					return 0;
 				}
-				fflush(stdout);
-				return 0;
+				return ipflush_finish(round);
 			}
 			round++;
-			if (flush_update() < 0)
+			again = ipflush_commit();
+			if (again < 0)
 				exit(1);
 
+			if (show_stats)
+				ipflush_print_round(round, "entries");
+			if (!again)
+				return ipflush_finish(round);
+
 			if (time(0) - start > 30) {
 				printf("\n*** Flush not completed after %ld seconds, %d entries remain ***\n",
-				       time(0) - start, filter.flushed);
+				       time(0) - start, ipflush_queued());
 				exit(1);
 			}
-
-			if (show_stats) {
-				printf("\n*** Round %d, deleting %d entries ***\n", round, filter.flushed);
-				fflush(stdout);
-			}
 		}
 	}
 
+	if (action == IPROUTE_SAVE && save_route_start() < 0)
+		exit(1);
+
 	if (!filter.cloned) {
-		if (rtnl_wilddump_request(&rth, do_ipv6, RTM_GETROUTE) < 0) {
+		if (iproute_dump_request(&rth, do_ipv6) < 0) {
 			perror("Cannot send dump request");
 			exit(1);
 		}
@@ -1332,10 +1548,24 @@ static int iproute_list_flush_or_save(int argc, char **argv, int action)
 		}
 	}
 
-	if (rtnl_dump_filter(&rth, filter_fn, stdout, NULL, NULL) < 0) {
+	if (resolve_hosts && action == IPROUTE_LIST)
+		ret = rtnl_dump_filter_prescan(&rth, prescan_route, filter_fn,
+					       stdout);
+	else
+		ret = rtnl_dump_filter(&rth, filter_fn, stdout, NULL, NULL);
+	if (ret < 0) {
 		fprintf(stderr, "Dump terminated\n");
 		exit(1);
 	}
+	rtnl_strict_dump(&rth, 0);
+
+	if (action == IPROUTE_SAVE && save_route_end() < 0)
+		exit(1);
+
+	if (show_stats > 1)
+		fprintf(stderr, "*** Dumped %d routes (%sfiltered by kernel), "
+			"%d filtered in userspace ***\n", filter.dumped,
+			filter.kernel_filtered ? "" : "not ", filter.dropped);
 
 	exit(0);
 }
@@ -1506,24 +1736,272 @@ int iproute_get(int argc, char **argv)
 	exit(0);
 }
 
-int restore_handler(const struct sockaddr_nl *nl, struct nlmsghdr *n, void *arg)
+struct rtsnap_remap {
+	__u32	from;
+	__u32	to;
+	char	name[IFNAMSIZ];
+};
+
+struct rtsnap_restore {
+	struct rtsnap_remap	*map;
+	int			maplen;
+	unsigned		total;
+	int			total_unknown;
+	unsigned		done;
+	unsigned		failed;
+};
+
+static int remap_cmp(const void *a, const void *b)
 {
-	int ret;
+	const struct rtsnap_remap *x = a, *y = b;
 
-	n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
+	return x->from < y->from ? -1 : x->from > y->from;
+}
 
-	ll_init_map(&rth);
+static void restore_map_build(struct rtsnap_restore *rs,
+			      const struct rtsnap_if *ifs, int count)
+{
+	int i;
+
+	free(rs->map);
+	rs->map = calloc(count, sizeof(*rs->map));
+	if (rs->map == NULL && count) {
+		fprintf(stderr, "Cannot allocate interface map\n");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		struct rtsnap_remap *m = &rs->map[i];
+
+		m->from = ifs[i].ifindex;
+		memcpy(m->name, ifs[i].name, IFNAMSIZ);
+		m->name[IFNAMSIZ - 1] = 0;
+		m->to = ll_name_to_index(m->name);
+	}
+	qsort(rs->map, count, sizeof(*rs->map), remap_cmp);
+	rs->maplen = count;
+}
+
+/* Returns the name of the saved device if it is missing here */
+static const char *restore_remap_one(const struct rtsnap_restore *rs,
+				     void *data)
+{
+	struct rtsnap_remap key, *m;
+
+	memcpy(&key.from, data, sizeof(key.from));
+	if (key.from == 0)
+		return NULL;
+	m = bsearch(&key, rs->map, rs->maplen, sizeof(*m), remap_cmp);
+	if (m == NULL)
+		return NULL;
+	if (m->to == 0)
+		return m->name;
+	memcpy(data, &m->to, sizeof(m->to));
+	return NULL;
+}
+
+static const char *restore_remap(const struct rtsnap_restore *rs,
+				 struct nlmsghdr *n)
+{
+	struct rtmsg *r = NLMSG_DATA(n);
+	struct rtattr *tb[RTA_MAX+1];
+	const char *missing = NULL;
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
 
-	ret = rtnl_talk(&rth, n, 0, 0, n, NULL, NULL);
-	if ((ret < 0) && (errno == EEXIST))
-		ret = 0;
+	if (rs->maplen == 0 || len < 0)
+		return NULL;
 
-	return ret;
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
+	if (tb[RTA_OIF] && RTA_PAYLOAD(tb[RTA_OIF]) >= sizeof(__u32))
+		missing = restore_remap_one(rs, RTA_DATA(tb[RTA_OIF]));
+	if (!missing && tb[RTA_IIF] && RTA_PAYLOAD(tb[RTA_IIF]) >= sizeof(__u32))
+		missing = restore_remap_one(rs, RTA_DATA(tb[RTA_IIF]));
+	if (!missing && tb[RTA_MULTIPATH]) {
+		struct rtnexthop *nh = RTA_DATA(tb[RTA_MULTIPATH]);
+		int mlen = RTA_PAYLOAD(tb[RTA_MULTIPATH]);
+
+		while (!missing && mlen >= (int)sizeof(*nh) &&
+		       nh->rtnh_len >= sizeof(*nh) && nh->rtnh_len <= mlen) {
+			missing = restore_remap_one(rs, &nh->rtnh_ifindex);
+			mlen -= RTNH_ALIGN(nh->rtnh_len);
+			nh = RTNH_NEXT(nh);
+		}
+	}
+	return missing;
+}
+
+static int restore_error(int msgno, int error, void *arg)
+{
+	struct rtsnap_restore *rs = arg;
+
+	if (error == EEXIST)
+		return 0;
+
+	fprintf(stderr, "Route %d: %s\n", msgno,
+		error ? strerror(error) : "no answer from kernel");
+	rs->failed++;
+	return 1;
+}
+
+/* Map the snapshot when stdin is a file, otherwise read it whole */
+static char *restore_load(size_t *lenp)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0 && lseek(STDIN_FILENO, 0, SEEK_CUR) == 0) {
+		buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE, STDIN_FILENO, 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, st.st_size, MADV_SEQUENTIAL);
+			*lenp = st.st_size;
+			return buf;
+		}
+		buf = NULL;
+	}
+
+	for (;;) {
+		size_t cnt;
+
+		if (len == size) {
+			size = size ? size * 2 : 1 << 16;
+			buf = realloc(buf, size);
+			if (buf == NULL) {
+				fprintf(stderr, "Cannot allocate restore buffer\n");
+				exit(1);
+			}
+		}
+		cnt = fread(buf + len, 1, size - len, stdin);
+		if (cnt == 0)
+			break;
+		len += cnt;
+	}
+	if (ferror(stdin)) {
+		perror("Cannot read route snapshot");
+		exit(1);
+	}
+	*lenp = len;
+	return buf;
+}
+
+/* Start over with the interface map of the snapshot at *pp */
+static void restore_header(struct rtsnap_restore *rs, char **pp, char *end)
+{
+	const struct rtsnap_hdr *hdr = (const struct rtsnap_hdr *)*pp;
+	char *p = *pp;
+
+	if (hdr->version != RTSNAP_VERSION) {
+		fprintf(stderr, "Unsupported route snapshot version %u\n",
+			hdr->version);
+		exit(1);
+	}
+	if (hdr->hdrlen < sizeof(*hdr) || end - p < hdr->hdrlen ||
+	    (end - p - hdr->hdrlen) / sizeof(struct rtsnap_if) < hdr->ifcount) {
+		fprintf(stderr, "Truncated route snapshot header\n");
+		exit(1);
+	}
+	p += hdr->hdrlen;
+	restore_map_build(rs, (const struct rtsnap_if *)p, hdr->ifcount);
+	p += hdr->ifcount * sizeof(struct rtsnap_if);
+
+	if (hdr->msgcount == 0)
+		rs->total_unknown = 1;
+	rs->total = rs->total_unknown ? 0 : rs->total + hdr->msgcount;
+	*pp = p;
+}
+
+static int restore_is_header(const char *p, const char *end)
+{
+	const struct rtsnap_hdr *hdr = (const struct rtsnap_hdr *)p;
+
+	return end - p >= (int)sizeof(*hdr) && hdr->magic == RTSNAP_MAGIC;
+}
+
+static void restore_progress(const struct rtsnap_restore *rs, int last)
+{
+	if (!last && rs->done % 1024)
+		return;
+	if (rs->total)
+		fprintf(stderr, "\rRestoring routes: %u/%u", rs->done, rs->total);
+	else
+		fprintf(stderr, "\rRestoring routes: %u", rs->done);
+	if (last)
+		fputc('\n', stderr);
 }
 
 int iproute_restore(void)
 {
-	exit(rtnl_from_file(stdin, &restore_handler, NULL));
+	struct rtsnap_restore rs;
+	struct rtnl_batch *outer = rth.batch;
+	int progress = isatty(STDERR_FILENO);
+	char *buf, *p, *end;
+	size_t len;
+
+	memset(&rs, 0, sizeof(rs));
+	ll_init_map(&rth);
+
+	buf = restore_load(&len);
+	p = buf;
+	end = buf + len;
+
+	/* Replay in a batch of our own, so that per route errors are ours */
+	if (outer && rtnl_batch_flush(&rth) < 0)
+		exit(2);
+	rth.batch = NULL;
+	if (rtnl_batch_start(&rth, RTSNAP_WINDOW, restore_error, &rs) < 0)
+		exit(1);
+
+	while (p < end) {
+		struct nlmsghdr *n;
+		const char *missing;
+		int msgno;
+
+		if (restore_is_header(p, end)) {
+			restore_header(&rs, &p, end);
+			continue;
+		}
+		n = (struct nlmsghdr *)p;
+		msgno = ++rs.done;
+
+		if (end - p < (int)sizeof(*n) ||
+		    n->nlmsg_len < sizeof(*n) || n->nlmsg_len > end - p) {
+			fprintf(stderr, "Route %d: truncated message\n", msgno);
+			rs.failed++;
+			break;
+		}
+		p += NLMSG_ALIGN(n->nlmsg_len);
+
+		if (n->nlmsg_type != RTM_NEWROUTE) {
+			fprintf(stderr, "Route %d: not a route message\n", msgno);
+			rs.failed++;
+			continue;
+		}
+		missing = restore_remap(&rs, n);
+		if (missing) {
+			fprintf(stderr, "Route %d: device \"%s\" does not exist\n",
+				msgno, missing);
+			rs.failed++;
+			continue;
+		}
+
+		n->nlmsg_flags |= NLM_F_REQUEST | NLM_F_CREATE | NLM_F_ACK;
+		rtnl_batch_tag(&rth, msgno);
+		if (rtnl_talk(&rth, n, 0, 0, NULL, NULL, NULL) < 0)
+			break;
+		if (progress)
+			restore_progress(&rs, 0);
+	}
+	rtnl_batch_stop(&rth);
+	rth.batch = outer;
+
+	if (progress)
+		restore_progress(&rs, 1);
+	if (rs.failed || show_stats)
+		fprintf(stderr, "Restored %u routes, %u failed\n",
+			rs.done - rs.failed, rs.failed);
+
+	exit(rs.failed ? 2 : 0);
 }
 
 void iproute_reset_filter()
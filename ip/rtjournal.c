@@ -0,0 +1,467 @@
+/*
+ * rtjournal.c		Segmented event journal of rtmon.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "rtjournal.h"
+
+#define RTJ_SEG_MIN	(64 * 1024)
+#define RTJ_STAMP_LEN	NLMSG_ALIGN(NLMSG_LENGTH(2 * sizeof(__u32)))
+
+struct rtj_writer
+{
+	char		*dir;
+	unsigned	segsize;
+	unsigned	rotate;
+	unsigned	retain;
+	unsigned	seq;
+	int		fd;
+	char		*base;
+	struct rtj_hdr	*hdr;
+	struct rtj_idx	*idx;
+	time_t		opened;
+};
+
+static int rtj_seg_filter(const struct dirent *d)
+{
+	unsigned seq;
+	char c;
+
+	return sscanf(d->d_name, "%u.rt%c", &seq, &c) == 2 && c == 'j' &&
+		strlen(d->d_name) == 12;
+}
+
+static int rtj_segments(const char *dir, struct dirent ***list)
+{
+	return scandir(dir, list, rtj_seg_filter, alphasort);
+}
+
+static void rtj_free_list(struct dirent **list, int cnt)
+{
+	while (cnt > 0)
+		free(list[--cnt]);
+	free(list);
+}
+
+static int rtj_open_seg(struct rtj_writer *w)
+{
+	char path[strlen(w->dir) + 16];
+	unsigned idx_max = w->segsize / RTJ_IDX_STEP;
+	struct rtj_hdr *hdr;
+
+	snprintf(path, sizeof(path), "%s/%08u.rtj", w->dir, w->seq);
+	w->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (w->fd < 0) {
+		fprintf(stderr, "Cannot create \"%s\": %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	/* Take the space now: a full disk must not turn into SIGBUS later */
+	if ((errno = posix_fallocate(w->fd, 0, w->segsize)) != 0) {
+		perror("Cannot allocate journal segment");
+		goto err;
+	}
+	w->base = mmap(NULL, w->segsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       w->fd, 0);
+	if (w->base == MAP_FAILED) {
+		perror("Cannot map journal segment");
+		goto err;
+	}
+
+	hdr = w->hdr = (struct rtj_hdr *)w->base;
+	w->idx = (struct rtj_idx *)(w->base + sizeof(*hdr));
+	hdr->magic = RTJ_MAGIC;
+	hdr->version = RTJ_VERSION;
+	hdr->hdrlen = sizeof(*hdr);
+	hdr->size = w->segsize;
+	hdr->idx_max = idx_max;
+	hdr->data_off = (sizeof(*hdr) + idx_max * sizeof(struct rtj_idx) + 63) & ~63;
+	w->opened = time(NULL);
+	return 0;
+
+err:
+	close(w->fd);
+	unlink(path);
+	return -1;
+}
+
+static void rtj_close_seg(struct rtj_writer *w)
+{
+	w->hdr->closed = 1;
+	munmap(w->base, w->segsize);
+	close(w->fd);
+	w->seq++;
+}
+
+/* Remove segments whose last event is older than the retention time */
+static void rtj_expire(struct rtj_writer *w)
+{
+	struct dirent **list;
+	time_t limit = time(NULL) - w->retain;
+	int i, cnt;
+
+	cnt = rtj_segments(w->dir, &list);
+	if (cnt < 0)
+		return;
+	for (i = 0; i < cnt; i++) {
+		char path[strlen(w->dir) + 16];
+		struct rtj_hdr hdr;
+		int fd;
+
+		if (strtoul(list[i]->d_name, NULL, 10) >= w->seq)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", w->dir, list[i]->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+		    hdr.magic == RTJ_MAGIC && hdr.last_us &&
+		    hdr.last_us / 1000000 < limit)
+			unlink(path);
+		close(fd);
+	}
+	rtj_free_list(list, cnt);
+}
+
+struct rtj_writer *rtj_create(const char *dir, unsigned segsize,
+			      unsigned rotate, unsigned retain)
+{
+	struct rtj_writer *w;
+	struct dirent **list;
+	int cnt;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create \"%s\": %s\n", dir,
+			strerror(errno));
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return NULL;
+	w->dir = strdup(dir);
+	w->segsize = segsize < RTJ_SEG_MIN ? RTJ_SEG_MIN : segsize;
+	w->rotate = rotate;
+	w->retain = retain;
+
+	cnt = rtj_segments(dir, &list);
+	if (cnt > 0) {
+		w->seq = strtoul(list[cnt - 1]->d_name, NULL, 10) + 1;
+		rtj_free_list(list, cnt);
+	}
+
+	if (retain)
+		rtj_expire(w);
+	if (rtj_open_seg(w) < 0) {
+		free(w->dir);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+/* Whether the record of n calls for a new segment */
+int rtj_full(struct rtj_writer *w, const struct nlmsghdr *n)
+{
+	const struct rtj_hdr *hdr = w->hdr;
+	unsigned need = RTJ_STAMP_LEN + NLMSG_ALIGN(n->nlmsg_len);
+
+	if (hdr->data_off + hdr->data_len + need > hdr->size)
+		return 1;
+	return w->rotate && hdr->first_us &&
+		time(NULL) - w->opened >= w->rotate;
+}
+
+int rtj_rotate(struct rtj_writer *w)
+{
+	rtj_close_seg(w);
+	if (w->retain)
+		rtj_expire(w);
+	return rtj_open_seg(w);
+}
+
+/* Records without a timestamp belong to the snapshot of the segment */
+int rtj_append(struct rtj_writer *w, const struct nlmsghdr *n,
+	       const struct timeval *tv)
+{
+	struct rtj_hdr *hdr = w->hdr;
+	char *data = w->base + hdr->data_off;
+	__u32 off = hdr->data_len;
+	unsigned len = NLMSG_ALIGN(n->nlmsg_len);
+	__u64 ts = 0;
+
+	if (hdr->data_off + off + len + (tv ? RTJ_STAMP_LEN : 0) > hdr->size) {
+		fprintf(stderr, "Message of %u bytes does not fit a journal segment\n",
+			n->nlmsg_len);
+		return -1;
+	}
+
+	if (tv) {
+		struct nlmsghdr *s = (struct nlmsghdr *)(data + off);
+
+		ts = tv->tv_sec * 1000000ULL + tv->tv_usec;
+		memset(s, 0, RTJ_STAMP_LEN);
+		s->nlmsg_len = NLMSG_LENGTH(2 * sizeof(__u32));
+		s->nlmsg_type = RTJ_TSTAMP;
+		((__u32 *)NLMSG_DATA(s))[0] = tv->tv_sec;
+		((__u32 *)NLMSG_DATA(s))[1] = tv->tv_usec;
+
+		if (hdr->first_us == 0) {
+			hdr->first_us = ts;
+			hdr->snap_len = off;
+		}
+		if (hdr->idx_cnt < hdr->idx_max &&
+		    (hdr->idx_cnt == 0 ||
+		     off - w->idx[hdr->idx_cnt - 1].off >= RTJ_IDX_STEP)) {
+			w->idx[hdr->idx_cnt].ts_us = ts;
+			w->idx[hdr->idx_cnt].off = off;
+			__sync_synchronize();
+			hdr->idx_cnt++;
+		}
+		off += RTJ_STAMP_LEN;
+	}
+
+	memcpy(data + off, n, n->nlmsg_len);
+	memset(data + off + n->nlmsg_len, 0, len - n->nlmsg_len);
+
+	/* Readers of the live segment only look up to data_len */
+	__sync_synchronize();
+	if (tv)
+		hdr->last_us = ts;
+	hdr->data_len = off + len;
+	return 0;
+}
+
+void rtj_close(struct rtj_writer *w)
+{
+	rtj_close_seg(w);
+	free(w->dir);
+	free(w);
+}
+
+struct rtj_replay
+{
+	__u64		since;
+	__u64		until;
+	__u64		now;
+	rtnl_filter_t	handler;
+	rtnl_filter_t	snap;
+	void		*arg;
+	struct sockaddr_nl nladdr;
+};
+
+/*
+ * Feed records from off on; those before "since" only go to the snapshot
+ * handler.  Returns 1 once past "until".
+ */
+static int rtj_scan(struct rtj_replay *r, char *data, __u32 len, __u32 off,
+		    int snapshot)
+{
+	while (len - off >= sizeof(struct nlmsghdr)) {
+		struct nlmsghdr *n = (struct nlmsghdr *)(data + off);
+		rtnl_filter_t fn = r->handler;
+		int err;
+
+		if (n->nlmsg_len == 0)
+			break;
+		if (n->nlmsg_len < sizeof(*n) || n->nlmsg_len > len - off) {
+			fprintf(stderr, "!!!malformed message: len=%u @%u\n",
+				n->nlmsg_len, off);
+			return -1;
+		}
+		off += NLMSG_ALIGN(n->nlmsg_len);
+
+		if (n->nlmsg_type == RTJ_TSTAMP &&
+		    n->nlmsg_len >= NLMSG_LENGTH(2 * sizeof(__u32))) {
+			__u32 *t = NLMSG_DATA(n);
+
+			r->now = t[0] * 1000000ULL + t[1];
+			if (r->until && r->now > r->until)
+				return 1;
+		}
+		if (snapshot || r->now < r->since)
+			fn = r->snap;
+		if (fn) {
+			err = fn(&r->nladdr, n, r->arg);
+			if (err < 0)
+				return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * What a jump through the index skips still names the links of later
+ * events: pass its link records to the snapshot handler, only looking at
+ * the headers of the others.
+ */
+static int rtj_scan_links(struct rtj_replay *r, char *data, __u32 len,
+			  __u32 off)
+{
+	while (len - off >= sizeof(struct nlmsghdr)) {
+		struct nlmsghdr *n = (struct nlmsghdr *)(data + off);
+		int err;
+
+		if (n->nlmsg_len < sizeof(*n) || n->nlmsg_len > len - off) {
+			fprintf(stderr, "!!!malformed message: len=%u @%u\n",
+				n->nlmsg_len, off);
+			return -1;
+		}
+		off += NLMSG_ALIGN(n->nlmsg_len);
+
+		if (r->snap &&
+		    (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK)) {
+			err = r->snap(&r->nladdr, n, r->arg);
+			if (err < 0)
+				return err;
+		}
+	}
+	return 0;
+}
+
+static int rtj_replay_seg(struct rtj_replay *r, char *base, size_t size,
+			  int first)
+{
+	const struct rtj_hdr *hdr = (const struct rtj_hdr *)base;
+	const struct rtj_idx *idx = (const struct rtj_idx *)(base + hdr->hdrlen);
+	__u32 len = hdr->data_len, off;
+	char *data;
+	int err;
+
+	if (size < sizeof(*hdr) || hdr->version != RTJ_VERSION ||
+	    hdr->hdrlen < sizeof(*hdr) || hdr->data_off > size ||
+	    len > size - hdr->data_off || hdr->snap_len > len ||
+	    hdr->hdrlen + (size_t)hdr->idx_cnt * sizeof(*idx) > hdr->data_off) {
+		fprintf(stderr, "Corrupted journal segment\n");
+		return -1;
+	}
+	if (r->until && hdr->first_us > r->until)
+		return 1;
+	if (r->since && hdr->last_us < r->since && hdr->closed)
+		return 0;
+
+	/* Only the first snapshot is shown, the others just name links */
+	data = base + hdr->data_off;
+	err = rtj_scan(r, data, hdr->snap_len, 0, !first || r->since);
+	if (err)
+		return err;
+
+	off = hdr->snap_len;
+	if (r->since && hdr->idx_cnt && idx[0].ts_us <= r->since) {
+		unsigned lo = 0, hi = hdr->idx_cnt;
+
+		while (hi - lo > 1) {
+			unsigned mid = (lo + hi) / 2;
+
+			if (idx[mid].ts_us <= r->since)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		if (idx[lo].off < len && idx[lo].off > off) {
+			err = rtj_scan_links(r, data, idx[lo].off, off);
+			if (err)
+				return err;
+			off = idx[lo].off;
+		}
+	}
+	return rtj_scan(r, data, len, off, 0);
+}
+
+static int rtj_replay_file(struct rtj_replay *r, const char *path, int first)
+{
+	struct stat st;
+	char *base;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Cannot open \"%s\": %s\n", path,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("Cannot map journal");
+		return -1;
+	}
+	madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	/* Files written by plain "rtmon file" are a bare stream */
+	if (st.st_size >= sizeof(struct rtj_hdr) &&
+	    ((struct rtj_hdr *)base)->magic == RTJ_MAGIC)
+		err = rtj_replay_seg(r, base, st.st_size, first);
+	else
+		err = rtj_scan(r, base, st.st_size, 0, 0);
+
+	munmap(base, st.st_size);
+	return err;
+}
+
+/*
+ * Replay a journal directory, a single segment or a plain rtmon file.
+ * Events between since_us and until_us (0 for no limit) go to handler,
+ * everything else read on the way to snap.
+ */
+int rtj_replay(const char *path, __u64 since_us, __u64 until_us,
+	       rtnl_filter_t handler, rtnl_filter_t snap, void *arg)
+{
+	struct rtj_replay r;
+	struct dirent **list;
+	struct stat st;
+	int i, cnt, err = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.since = since_us;
+	r.until = until_us;
+	r.handler = handler;
+	r.snap = snap;
+	r.arg = arg;
+	r.nladdr.nl_family = AF_NETLINK;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "Cannot open \"%s\": %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return rtj_replay_file(&r, path, 1) < 0 ? -1 : 0;
+
+	cnt = rtj_segments(path, &list);
+	if (cnt < 0) {
+		perror("Cannot read journal");
+		return -1;
+	}
+	for (i = 0; i < cnt && err == 0; i++) {
+		char name[strlen(path) + 16];
+
+		snprintf(name, sizeof(name), "%s/%s", path, list[i]->d_name);
+		err = rtj_replay_file(&r, name, i == 0);
+	}
+	rtj_free_list(list, cnt);
+	return err < 0 ? -1 : 0;
+}
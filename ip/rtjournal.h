@@ -0,0 +1,57 @@
+#ifndef __RTJOURNAL_H__
+#define __RTJOURNAL_H__ 1
+
+#include <sys/time.h>
+#include "libnetlink.h"
+
+/*
+ * rtmon journal: a directory of fixed size segment files.  A segment
+ * starts with a header and a sparse index of timestamps, followed by
+ * records in the rtmon stream format, i.e. a timestamp message before
+ * every event.  The records at the start of a segment, before the first
+ * timestamp, are a snapshot of the links.  Segments are written and read
+ * through mmap.
+ */
+#define RTJ_MAGIC	0x4c4e4a52	/* "RJNL" */
+#define RTJ_VERSION	1
+#define RTJ_TSTAMP	15		/* nlmsg_type of timestamp records */
+#define RTJ_IDX_STEP	4096		/* bytes of records per index entry */
+
+struct rtj_hdr
+{
+	__u32	magic;
+	__u16	version;
+	__u16	hdrlen;
+	__u32	size;		/* of the whole segment */
+	__u32	data_off;
+	__u32	data_len;	/* bytes of records written so far */
+	__u32	snap_len;	/* leading link snapshot */
+	__u32	idx_max;
+	__u32	idx_cnt;
+	__u64	first_us;
+	__u64	last_us;
+	__u32	closed;
+	__u32	pad;
+};
+
+struct rtj_idx
+{
+	__u64	ts_us;
+	__u32	off;		/* of a timestamp record, from data_off */
+	__u32	pad;
+};
+
+struct rtj_writer;
+
+extern struct rtj_writer *rtj_create(const char *dir, unsigned segsize,
+				     unsigned rotate, unsigned retain);
+extern int rtj_full(struct rtj_writer *w, const struct nlmsghdr *n);
+extern int rtj_rotate(struct rtj_writer *w);
+extern int rtj_append(struct rtj_writer *w, const struct nlmsghdr *n,
+		      const struct timeval *tv);
+extern void rtj_close(struct rtj_writer *w);
+
+extern int rtj_replay(const char *path, __u64 since_us, __u64 until_us,
+		      rtnl_filter_t handler, rtnl_filter_t snap, void *arg);
+
+#endif /* __RTJOURNAL_H__ */
@@ -19,14 +19,19 @@
 #include <sys/time.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <limits.h>
 
 #include "SNAPSHOT.h"
 
 #include "utils.h"
 #include "libnetlink.h"
+#include "rt_mirror.h"
+#include "rtjournal.h"
 
 int resolve_hosts = 0;
 static int init_phase = 1;
+static struct rtnl_mirror *mirror;
+static struct rtj_writer *journal;
 
 static void write_stamp(FILE *fp)
 {
@@ -45,10 +50,54 @@ static void write_stamp(FILE *fp)
 	fwrite((void*)n1, 1, NLMSG_ALIGN(n1->nlmsg_len), fp);
 }
 
+static int snap_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
+		    void *arg)
+{
+	return rtj_append(journal, n, NULL);
+}
+
+/* Every segment starts with the links, so that it can be read alone */
+static void journal_rotate(void)
+{
+	struct rtnl_handle rth;
+
+	if (rtj_rotate(journal) < 0)
+		exit(1);
+	if (rtnl_open(&rth, 0) < 0 ||
+	    rtnl_wilddump_request(&rth, AF_UNSPEC, RTM_GETLINK) < 0 ||
+	    rtnl_dump_filter(&rth, snap_msg, NULL, NULL, NULL) < 0) {
+		fprintf(stderr, "Cannot dump links into the journal\n");
+		exit(1);
+	}
+	rtnl_close(&rth);
+}
+
+static int journal_msg(struct nlmsghdr *n)
+{
+	struct timeval tv;
+
+	/* A journal with holes is worse than none, give up loudly */
+	if (init_phase) {
+		if (snap_msg(NULL, n, NULL) < 0)
+			exit(1);
+		return 0;
+	}
+
+	gettimeofday(&tv, NULL);
+	if (rtj_full(journal, n))
+		journal_rotate();
+	if (rtj_append(journal, n, &tv) < 0)
+		exit(1);
+	return 0;
+}
+
 static int dump_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
 		    void *arg)
 {
 	FILE *fp = (FILE*)arg;
+
+	if (journal)
+		return journal_msg(n);
 	if (!init_phase)
 		write_stamp(fp);
 	fwrite((void*)n, 1, NLMSG_ALIGN(n->nlmsg_len), fp);
@@ -56,9 +105,33 @@ static int dump_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
 	return 0;
 }
 
+static int listen_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
+		      void *arg)
+{
+	if (rtnl_mirror_update(mirror, n) < 0)
+		return -1;
+	return dump_msg(who, n, arg);
+}
+
+/* Record the gap followed by what changed while events were lost */
+static int resync_msg(struct rtnl_handle *rth, void *arg)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct nlmsghdr marker = {
+		.nlmsg_len = NLMSG_LENGTH(0),
+		.nlmsg_type = NLMSG_OVERRUN,
+	};
+
+	dump_msg(&nladdr, &marker, arg);
+	rtnl_listen_drain(rth);
+	return rtnl_mirror_sync(mirror, dump_msg, arg);
+}
+
 void usage(void)
 {
 	fprintf(stderr, "Usage: rtmon file FILE [ all | LISTofOBJECTS]\n");
+	fprintf(stderr, "       rtmon journal DIR [ segment SIZE ] [ rotate SECS ] [ retain SECS ]\n");
+	fprintf(stderr, "                         [ all | LISTofOBJECTS]\n");
 	fprintf(stderr, "LISTofOBJECTS := [ link ] [ address ] [ route ]\n");
 	exit(-1);
 }
@@ -74,6 +147,10 @@ main(int argc, char **argv)
 	int laddr = 0;
 	int lroute = 0;
 	char *file = NULL;
+	char *dir = NULL;
+	unsigned segsize = 16 << 20;
+	unsigned rotate = 0;
+	unsigned retain = 0;
 
 	while (argc > 1) {
 		if (matches(argv[1], "-family") == 0) {
@@ -108,6 +185,31 @@ main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			file = argv[1];
+		} else if (matches(argv[1], "journal") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			dir = argv[1];
+		} else if (matches(argv[1], "segment") == 0) {
+			unsigned long size;
+			int shift = 0;
+			char *end;
+
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			size = strtoul(argv[1], &end, 0);
+			if (*end == 'k' || *end == 'K')
+				shift = 10, end++;
+			else if (*end == 'm' || *end == 'M')
+				shift = 20, end++;
+			segsize = size << shift;
+			if (*end || size == 0 || size > (UINT_MAX >> shift)) {
+				fprintf(stderr, "Segment size \"%s\" is invalid\n", argv[1]);
+				exit(-1);
+			}
 		} else if (matches(argv[1], "link") == 0) {
 			llink=1;
 			groups = 0;
@@ -117,6 +219,24 @@ main(int argc, char **argv)
 		} else if (matches(argv[1], "route") == 0) {
 			lroute=1;
 			groups = 0;
+		} else if (matches(argv[1], "rotate") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_unsigned(&rotate, argv[1], 0)) {
+				fprintf(stderr, "Rotate time \"%s\" is invalid\n", argv[1]);
+				exit(-1);
+			}
+		} else if (matches(argv[1], "retain") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_unsigned(&retain, argv[1], 0)) {
+				fprintf(stderr, "Retain time \"%s\" is invalid\n", argv[1]);
+				exit(-1);
+			}
 		} else if (strcmp(argv[1], "all") == 0) {
 			groups = ~0U;
 		} else if (matches(argv[1], "help") == 0) {
@@ -128,8 +248,8 @@ main(int argc, char **argv)
 		argc--;	argv++;
 	}
 
-	if (file == NULL) {
-		fprintf(stderr, "Not enough information: argument \"file\" is required\n");
+	if ((file == NULL) == (dir == NULL)) {
+		fprintf(stderr, "Not enough information: argument \"file\" or \"journal\" is required\n");
 		exit(-1);
 	}
 	if (llink)
@@ -147,10 +267,17 @@ main(int argc, char **argv)
 			groups |= nl_mgrp(RTNLGRP_IPV6_ROUTE);
 	}
 
-	fp = fopen(file, "w");
-	if (fp == NULL) {
-		perror("Cannot fopen");
-		exit(-1);
+	if (dir) {
+		fp = NULL;
+		journal = rtj_create(dir, segsize, rotate, retain);
+		if (journal == NULL)
+			exit(-1);
+	} else {
+		fp = fopen(file, "w");
+		if (fp == NULL) {
+			perror("Cannot fopen");
+			exit(-1);
+		}
 	}
 
 	if (rtnl_open(&rth, groups) < 0)
@@ -161,16 +288,21 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	write_stamp(fp);
+	if (fp)
+		write_stamp(fp);
 
 	if (rtnl_dump_filter(&rth, dump_msg, fp, NULL, NULL) < 0) {
 		fprintf(stderr, "Dump terminated\n");
 		return 1;
 	}
 
+	mirror = rtnl_mirror_new(groups);
+	if (mirror == NULL || rtnl_mirror_sync(mirror, NULL, NULL) < 0)
+		exit(1);
+
 	init_phase = 0;
 
-	if (rtnl_listen(&rth, dump_msg, (void*)fp) < 0)
+	if (rtnl_listen_resync(&rth, listen_msg, (void*)fp, resync_msg) < 0)
 		exit(2);
 
 	exit(0);
@@ -27,12 +27,39 @@
 
 int rcvbuf = 1024 * 1024;
 
+/* Kernel never builds dump skbs larger than this, unless a single
+ * message does not fit.
+ */
+#define RTNL_RXBUF_MIN	32768
+
+/* Must stay below the SO_SNDBUF set in rtnl_open_byproto() */
+#define RTNL_BATCH_BUFSIZE	32768
+
+struct rtnl_batch
+{
+	int			window;
+	int			count;
+	int			len;
+	int			last;
+	char			*buf;
+	int			*tags;
+	int			tag;
+	__u32			first_seq;
+	rtnl_batch_err_t	errfn;
+	void			*arg;
+};
+
 void rtnl_close(struct rtnl_handle *rth)
 {
+	if (rth->batch)
+		rtnl_batch_stop(rth);
 	if (rth->fd >= 0) {
 		close(rth->fd);
 		rth->fd = -1;
 	}
+	free(rth->buf);
+	rth->buf = NULL;
+	rth->buflen = 0;
 }
 
 int rtnl_open_byproto(struct rtnl_handle *rth, unsigned subscriptions,
@@ -96,6 +123,9 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 		struct rtgenmsg g;
 	} req;
 
+	if (rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	memset(&req, 0, sizeof(req));
 	req.nlh.nlmsg_len = sizeof(req);
 	req.nlh.nlmsg_type = type;
@@ -109,6 +139,9 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 
 int rtnl_send(struct rtnl_handle *rth, const char *buf, int len)
 {
+	if (rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	return send(rth->fd, buf, len, 0);
 }
 
@@ -118,6 +151,9 @@ int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int len)
 	int status;
 	char resp[1024];
 
+	if (rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	status = send(rth->fd, buf, len, 0);
 	if (status < 0)
 		return status;
@@ -160,6 +196,9 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 		.msg_iovlen = 2,
 	};
 
+	if (rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 
@@ -172,6 +211,231 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	return sendmsg(rth->fd, &msg, 0);
 }
 
+/*
+ * Receive the next datagram into the receive buffer of the handle.
+ * The size of the datagram is probed first with MSG_PEEK|MSG_TRUNC,
+ * so the buffer is grown instead of truncating large messages.
+ * Messages stay valid until the next call on the same handle.
+ */
+static int rtnl_recvmsg(struct rtnl_handle *rth, struct msghdr *msg)
+{
+	struct iovec *iov = msg->msg_iov;
+	socklen_t namelen = msg->msg_namelen;
+	int len;
+
+	iov->iov_base = NULL;
+	iov->iov_len = 0;
+	len = recvmsg(rth->fd, msg, MSG_PEEK|MSG_TRUNC);
+	if (len <= 0)
+		return len;
+
+	if (len > rth->buflen) {
+		int size = rth->buflen ? : RTNL_RXBUF_MIN;
+		char *buf;
+
+		while (size < len)
+			size <<= 1;
+		buf = realloc(rth->buf, size);
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		rth->buf = buf;
+		rth->buflen = size;
+	}
+
+	iov->iov_base = rth->buf;
+	iov->iov_len = rth->buflen;
+	msg->msg_namelen = namelen;
+	return recvmsg(rth->fd, msg, 0);
+}
+
+/*
+ * Batch mode: requests which only expect an ACK are queued by rtnl_talk()
+ * and sent up to "window" at a time in a single datagram.  ACKs are
+ * matched back to the requests by sequence number, and errors are
+ * reported through errfn with the tag that was current when the
+ * request was queued (e.g. the line number of a batch file).
+ */
+int rtnl_batch_start(struct rtnl_handle *rth, int window,
+		     rtnl_batch_err_t errfn, void *arg)
+{
+	struct rtnl_batch *b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		goto oom;
+	b->buf = malloc(RTNL_BATCH_BUFSIZE);
+	b->tags = calloc(window, sizeof(int));
+	if (b->buf == NULL || b->tags == NULL)
+		goto oom;
+
+	b->window = window;
+	b->errfn = errfn;
+	b->arg = arg;
+	rth->batch = b;
+	return 0;
+
+oom:
+	if (b) {
+		free(b->buf);
+		free(b->tags);
+		free(b);
+	}
+	fprintf(stderr, "Cannot allocate netlink batch\n");
+	return -1;
+}
+
+void rtnl_batch_tag(struct rtnl_handle *rth, int tag)
+{
+	if (rth->batch)
+		rth->batch->tag = tag;
+}
+
+static int rtnl_batch_add(struct rtnl_handle *rth, struct nlmsghdr *n)
+{
+	struct rtnl_batch *b = rth->batch;
+	int len = NLMSG_ALIGN(n->nlmsg_len);
+
+	if (b->count == b->window || b->len + len > RTNL_BATCH_BUFSIZE) {
+		if (rtnl_batch_flush(rth) < 0)
+			return -1;
+	}
+
+	n->nlmsg_seq = ++rth->seq;
+	if (b->count == 0)
+		b->first_seq = n->nlmsg_seq;
+
+	/* Only the last request of a window is acked, see rtnl_batch_flush() */
+	memcpy(b->buf + b->len, n, n->nlmsg_len);
+	memset(b->buf + b->len + n->nlmsg_len, 0, len - n->nlmsg_len);
+	((struct nlmsghdr *)(b->buf + b->len))->nlmsg_flags &= ~NLM_F_ACK;
+	b->last = b->len;
+	b->len += len;
+	b->tags[b->count++] = b->tag;
+	return 0;
+}
+
+static int rtnl_batch_fail(struct rtnl_batch *b, int i, int error)
+{
+	if (b->errfn)
+		return b->errfn(b->tags[i], error, b->arg) != 0;
+
+	if (error) {
+		errno = error;
+		perror("RTNETLINK answers");
+	} else
+		fprintf(stderr, "ERROR truncated\n");
+	return 1;
+}
+
+/*
+ * The kernel handles the requests of a window in order and reports errors
+ * even without NLM_F_ACK, so acking the last one is enough to know the
+ * outcome of all of them.
+ * Returns number of failed requests, or -1 if the window was lost.
+ */
+int rtnl_batch_flush(struct rtnl_handle *rth)
+{
+	struct rtnl_batch *b = rth->batch;
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int acked = 0, failed = 0;
+
+	if (b == NULL || b->count == 0)
+		return 0;
+
+	((struct nlmsghdr *)(b->buf + b->last))->nlmsg_flags |= NLM_F_ACK;
+	if (send(rth->fd, b->buf, b->len, 0) < 0) {
+		perror("Cannot talk to rtnetlink");
+		goto lost;
+	}
+
+	while (acked < b->count) {
+		struct nlmsghdr *h;
+		int status;
+
+		status = rtnl_recvmsg(rth, &msg);
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(errno), errno);
+			goto lost;
+		}
+		if (status == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			goto lost;
+		}
+
+		for (h = (struct nlmsghdr *)rth->buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(h);
+			__u32 i = h->nlmsg_seq - b->first_seq;
+
+			if (nladdr.nl_pid != 0 ||
+			    h->nlmsg_pid != rth->local.nl_pid ||
+			    h->nlmsg_type != NLMSG_ERROR || i >= b->count)
+				continue;
+
+			acked = i + 1;
+			if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*err)))
+				failed += rtnl_batch_fail(b, i, 0);
+			else if (err->error)
+				failed += rtnl_batch_fail(b, i, -err->error);
+		}
+	}
+
+	b->count = b->len = 0;
+	return failed;
+
+lost:
+	for (; acked < b->count; acked++)
+		rtnl_batch_fail(b, acked, 0);
+	b->count = b->len = 0;
+	return -1;
+}
+
+int rtnl_batch_stop(struct rtnl_handle *rth)
+{
+	struct rtnl_batch *b = rth->batch;
+	int ret;
+
+	if (b == NULL)
+		return 0;
+
+	ret = rtnl_batch_flush(rth);
+	free(b->buf);
+	free(b->tags);
+	free(b);
+	rth->batch = NULL;
+	return ret;
+}
+
+void rtnl_capture(struct rtnl_handle *rth,
+		  int (*fn)(struct nlmsghdr *n, void *arg), void *arg)
+{
+	rth->capture = fn;
+	rth->capture_arg = arg;
+}
+
+/*
+ * Ask the kernel to validate dump requests strictly, so that filters
+ * in the request header and attributes are honoured.  Fails on kernels
+ * which do not support it; they silently ignore such filters.
+ */
+int rtnl_strict_dump(struct rtnl_handle *rth, int on)
+{
+	return setsockopt(rth->fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+			  &on, sizeof(on));
+}
+
 int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		       const struct rtnl_dump_filter_arg *arg)
 {
@@ -183,17 +447,15 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
-	char buf[16384];
 
-	iov.iov_base = buf;
+	rth->dump_intr = 0;
 	while (1) {
 		int status;
 		const struct rtnl_dump_filter_arg *a;
 		int found_done = 0;
 		int msglen = 0;
 
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rth->fd, &msg, 0);
+		status = rtnl_recvmsg(rth, &msg);
 
 		if (status < 0) {
 			if (errno == EINTR || errno == EAGAIN)
@@ -209,7 +471,7 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		}
 
 		for (a = arg; a->filter; a++) {
-			struct nlmsghdr *h = (struct nlmsghdr*)buf;
+			struct nlmsghdr *h = (struct nlmsghdr*)rth->buf;
 			msglen = status;
 
 			while (NLMSG_OK(h, msglen)) {
@@ -227,6 +489,8 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 					goto skip_it;
 				}
 
+				if (h->nlmsg_flags & NLM_F_DUMP_INTR)
+					rth->dump_intr = 1;
 				if (h->nlmsg_type == NLMSG_DONE) {
 					found_done = 1;
 					break; /* process next filter */
@@ -279,6 +543,59 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 	return rtnl_dump_filter_l(rth, a);
 }
 
+struct rtnl_prescan
+{
+	rtnl_filter_t	prescan;
+	void		*arg;
+	char		*buf;
+	size_t		len;
+	size_t		size;
+};
+
+static int rtnl_prescan_store(const struct sockaddr_nl *who,
+			      struct nlmsghdr *n, void *arg)
+{
+	struct rtnl_prescan *p = arg;
+	size_t len = NLMSG_ALIGN(n->nlmsg_len);
+
+	if (p->len + len > p->size) {
+		size_t size = p->size ? 2 * p->size : 65536;
+		char *buf;
+
+		while (size < p->len + len)
+			size *= 2;
+		if ((buf = realloc(p->buf, size)) == NULL) {
+			perror("Cannot store dump");
+			return -1;
+		}
+		p->buf = buf;
+		p->size = size;
+	}
+	memcpy(p->buf + p->len, n, n->nlmsg_len);
+	p->len += len;
+	return p->prescan(who, n, p->arg);
+}
+
+int rtnl_dump_filter_prescan(struct rtnl_handle *rth,
+			     rtnl_filter_t prescan,
+			     rtnl_filter_t filter, void *arg)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct rtnl_prescan p = { .prescan = prescan, .arg = arg };
+	size_t off;
+	int err;
+
+	err = rtnl_dump_filter(rth, rtnl_prescan_store, &p, NULL, NULL);
+	for (off = 0; err >= 0 && off < p.len; ) {
+		struct nlmsghdr *n = (struct nlmsghdr *)(p.buf + off);
+
+		off += NLMSG_ALIGN(n->nlmsg_len);
+		err = filter(&nladdr, n, arg);
+	}
+	free(p.buf);
+	return err < 0 ? err : 0;
+}
+
 int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	      unsigned groups, struct nlmsghdr *answer,
 	      rtnl_filter_t junk,
@@ -298,7 +615,17 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
-	char   buf[16384];
+
+	if (rtnl->capture && answer == NULL && peer == 0 && groups == 0)
+		return rtnl->capture(n, rtnl->capture_arg) < 0 ? -1 : 0;
+
+	if (rtnl->batch) {
+		if (answer == NULL && peer == 0 && groups == 0 &&
+		    NLMSG_ALIGN(n->nlmsg_len) <= RTNL_BATCH_BUFSIZE)
+			return rtnl_batch_add(rtnl, n);
+		if (rtnl_batch_flush(rtnl) < 0)
+			return -1;
+	}
 
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
@@ -317,13 +644,8 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		return -1;
 	}
 
-	memset(buf,0,sizeof(buf));
-
-	iov.iov_base = buf;
-
 	while (1) {
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rtnl->fd, &msg, 0);
+		status = rtnl_recvmsg(rtnl, &msg);
 
 		if (status < 0) {
 			if (errno == EINTR || errno == EAGAIN)
@@ -340,7 +662,7 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 			fprintf(stderr, "sender address length == %d\n", msg.msg_namelen);
 			exit(1);
 		}
-		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
+		for (h = (struct nlmsghdr*)rtnl->buf; status >= sizeof(*h); ) {
 			int err;
 			int len = h->nlmsg_len;
 			int l = len - sizeof(*h);
@@ -404,79 +726,155 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	}
 }
 
-int rtnl_listen(struct rtnl_handle *rtnl,
-		rtnl_filter_t handler,
-		void *jarg)
+/*
+ * Events are drained with recvmmsg() into RTNL_LISTEN_VLEN buffers.  On an
+ * overrun the receive buffer is doubled, up to RTNL_LISTEN_RCVBUF_MAX, so a
+ * listener adapts to bursts without starting with a huge buffer.
+ */
+#define RTNL_LISTEN_VLEN	16
+#define RTNL_LISTEN_BUFSIZE	32768
+#define RTNL_LISTEN_RCVBUF_MAX	(64 * 1024 * 1024)
+
+static void rtnl_listen_grow(struct rtnl_handle *rtnl)
 {
-	int status;
+	int size;
+	socklen_t len = sizeof(size);
+
+	/* The kernel reports twice the size set, so this doubles it */
+	if (getsockopt(rtnl->fd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0 ||
+	    size >= RTNL_LISTEN_RCVBUF_MAX)
+		return;
+
+	if (setsockopt(rtnl->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &size, sizeof(size)) < 0)
+		setsockopt(rtnl->fd, SOL_SOCKET, SO_RCVBUF,
+			   &size, sizeof(size));
+}
+
+static int rtnl_listen_one(struct msghdr *msg, int status,
+			   rtnl_filter_t handler, void *jarg)
+{
+	struct sockaddr_nl *nladdr = msg->msg_name;
 	struct nlmsghdr *h;
-	struct sockaddr_nl nladdr;
-	struct iovec iov;
-	struct msghdr msg = {
-		.msg_name = &nladdr,
-		.msg_namelen = sizeof(nladdr),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
-	char   buf[8192];
 
-	memset(&nladdr, 0, sizeof(nladdr));
-	nladdr.nl_family = AF_NETLINK;
-	nladdr.nl_pid = 0;
-	nladdr.nl_groups = 0;
+	if (msg->msg_namelen != sizeof(*nladdr)) {
+		fprintf(stderr, "Sender address length == %d\n", msg->msg_namelen);
+		exit(1);
+	}
+	for (h = (struct nlmsghdr*)msg->msg_iov->iov_base; status >= sizeof(*h); ) {
+		int err;
+		int len = h->nlmsg_len;
+		int l = len - sizeof(*h);
+
+		if (l<0 || len>status) {
+			if (msg->msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "Truncated message\n");
+				return -1;
+			}
+			fprintf(stderr, "!!!malformed message: len=%d\n", len);
+			exit(1);
+		}
 
-	iov.iov_base = buf;
-	while (1) {
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rtnl->fd, &msg, 0);
+		err = handler(nladdr, h, jarg);
+		if (err < 0)
+			return err;
 
-		if (status < 0) {
+		status -= NLMSG_ALIGN(len);
+		h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
+	}
+	if (msg->msg_flags & MSG_TRUNC) {
+		fprintf(stderr, "Message truncated\n");
+		return 0;
+	}
+	if (status) {
+		fprintf(stderr, "!!!Remnant of size %d\n", status);
+		exit(1);
+	}
+	return 0;
+}
+
+int rtnl_listen_resync(struct rtnl_handle *rtnl,
+		       rtnl_filter_t handler, void *jarg,
+		       rtnl_resync_t resync)
+{
+	struct mmsghdr msgs[RTNL_LISTEN_VLEN];
+	struct sockaddr_nl nladdr[RTNL_LISTEN_VLEN];
+	struct iovec iov[RTNL_LISTEN_VLEN];
+	char *buf;
+	int i, cnt, err = 0;
+
+	if (rtnl_batch_flush(rtnl) < 0)
+		return -1;
+
+	buf = malloc(RTNL_LISTEN_VLEN * RTNL_LISTEN_BUFSIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Cannot allocate netlink receive buffers\n");
+		return -1;
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RTNL_LISTEN_VLEN; i++) {
+		iov[i].iov_base = buf + i * RTNL_LISTEN_BUFSIZE;
+		iov[i].iov_len = RTNL_LISTEN_BUFSIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &nladdr[i];
+	}
+
+	while (err >= 0) {
+		for (i = 0; i < RTNL_LISTEN_VLEN; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(nladdr[i]);
+			msgs[i].msg_hdr.msg_flags = 0;
+		}
+		cnt = recvmmsg(rtnl->fd, msgs, RTNL_LISTEN_VLEN,
+			       MSG_WAITFORONE, NULL);
+
+		if (cnt < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
+			if (errno == ENOBUFS) {
+				rtnl_listen_grow(rtnl);
+				if (resync) {
+					err = resync(rtnl, jarg);
+					continue;
+				}
+			}
 			fprintf(stderr, "netlink receive error %s (%d)\n",
 				strerror(errno), errno);
 			if (errno == ENOBUFS)
 				continue;
-			return -1;
+			err = -1;
+			break;
 		}
-		if (status == 0) {
+		if (cnt == 0 || msgs[0].msg_len == 0) {
 			fprintf(stderr, "EOF on netlink\n");
-			return -1;
-		}
-		if (msg.msg_namelen != sizeof(nladdr)) {
-			fprintf(stderr, "Sender address length == %d\n", msg.msg_namelen);
-			exit(1);
+			err = -1;
+			break;
 		}
-		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
-			int err;
-			int len = h->nlmsg_len;
-			int l = len - sizeof(*h);
+		for (i = 0; i < cnt && err >= 0; i++)
+			err = rtnl_listen_one(&msgs[i].msg_hdr, msgs[i].msg_len,
+					      handler, jarg);
+	}
 
-			if (l<0 || len>status) {
-				if (msg.msg_flags & MSG_TRUNC) {
-					fprintf(stderr, "Truncated message\n");
-					return -1;
-				}
-				fprintf(stderr, "!!!malformed message: len=%d\n", len);
-				exit(1);
-			}
+	free(buf);
+	return err;
+}
 
-			err = handler(&nladdr, h, jarg);
-			if (err < 0)
-				return err;
+/* Drop what is still queued, it predates the lost events */
+void rtnl_listen_drain(struct rtnl_handle *rtnl)
+{
+	char c;
 
-			status -= NLMSG_ALIGN(len);
-			h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
-		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
-		if (status) {
-			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
-		}
-	}
+	while (recv(rtnl->fd, &c, 1, MSG_DONTWAIT | MSG_TRUNC) >= 0 ||
+	       errno == ENOBUFS || errno == EINTR)
+		;
+}
+
+int rtnl_listen(struct rtnl_handle *rtnl,
+		rtnl_filter_t handler,
+		void *jarg)
+{
+	return rtnl_listen_resync(rtnl, handler, jarg, NULL);
 }
 
 int rtnl_from_file(FILE *rtnl, rtnl_filter_t handler,
@@ -28,6 +28,7 @@ extern unsigned int if_nametoindex (const char *);
 struct ll_cache
 {
 	struct ll_cache   *idx_next;
+	struct ll_cache   *name_next;
 	unsigned	flags;
 	int		index;
 	unsigned short	type;
@@ -36,45 +37,210 @@ struct ll_cache
 	unsigned char	addr[20];
 };
 
-#define IDXMAP_SIZE	1024
-static struct ll_cache *idx_head[IDXMAP_SIZE];
+/*
+ * Entries are hashed both by index and by name.  Both tables have
+ * the same size and are doubled when the number of entries exceeds it.
+ * Entries are carved from slabs and recycled through a free list.
+ */
+#define LL_HASH_MIN	1024
+#define LL_SLAB_SIZE	256
+
+static struct ll_cache **idx_head;
+static struct ll_cache **name_head;
+static unsigned ll_hash_size;
+static unsigned ll_count;
+static struct ll_cache *ll_free;
+
+static inline unsigned namehash(const char *str)
+{
+	unsigned hash = 5381;
+
+	while (*str)
+		hash = hash * 33 + *str++;
+	return hash;
+}
+
+static inline struct ll_cache **idxhead(unsigned idx)
+{
+	return &idx_head[idx & (ll_hash_size - 1)];
+}
+
+static inline struct ll_cache **namehead(const char *name)
+{
+	return &name_head[namehash(name) & (ll_hash_size - 1)];
+}
+
+static struct ll_cache *ll_get_by_index(unsigned idx)
+{
+	struct ll_cache *im;
+
+	if (ll_hash_size == 0)
+		return NULL;
+
+	for (im = *idxhead(idx); im; im = im->idx_next)
+		if (im->index == idx)
+			return im;
+	return NULL;
+}
+
+static struct ll_cache *ll_get_by_name(const char *name)
+{
+	struct ll_cache *im;
+
+	if (ll_hash_size == 0)
+		return NULL;
+
+	for (im = *namehead(name); im; im = im->name_next)
+		if (strcmp(im->name, name) == 0)
+			return im;
+	return NULL;
+}
+
+static void ll_name_link(struct ll_cache *im)
+{
+	struct ll_cache **imp = namehead(im->name);
+
+	im->name_next = *imp;
+	*imp = im;
+}
+
+static void ll_name_unlink(struct ll_cache *im)
+{
+	struct ll_cache **imp;
+
+	for (imp = namehead(im->name); *imp; imp = &(*imp)->name_next) {
+		if (*imp == im) {
+			*imp = im->name_next;
+			break;
+		}
+	}
+}
+
+static int ll_hash_grow(void)
+{
+	unsigned size = ll_hash_size ? ll_hash_size << 1 : LL_HASH_MIN;
+	struct ll_cache **old = idx_head;
+	unsigned old_size = ll_hash_size;
+	struct ll_cache **nidx, **nname;
+	unsigned i;
+
+	nidx = calloc(size, sizeof(*nidx));
+	nname = calloc(size, sizeof(*nname));
+	if (nidx == NULL || nname == NULL) {
+		free(nidx);
+		free(nname);
+		return -1;
+	}
+
+	free(name_head);
+	idx_head = nidx;
+	name_head = nname;
+	ll_hash_size = size;
+
+	for (i = 0; i < old_size; i++) {
+		struct ll_cache *im, *next;
+
+		for (im = old[i]; im; im = next) {
+			struct ll_cache **imp = idxhead(im->index);
+
+			next = im->idx_next;
+			im->idx_next = *imp;
+			*imp = im;
+			ll_name_link(im);
+		}
+	}
+	free(old);
+	return 0;
+}
 
-static inline struct ll_cache *idxhead(int idx)
+static struct ll_cache *ll_alloc(void)
 {
-	return idx_head[idx & (IDXMAP_SIZE - 1)];
+	struct ll_cache *im;
+
+	if (ll_free == NULL) {
+		struct ll_cache *slab;
+		int i;
+
+		slab = calloc(LL_SLAB_SIZE, sizeof(*slab));
+		if (slab == NULL)
+			return NULL;
+		for (i = 0; i < LL_SLAB_SIZE; i++) {
+			slab[i].idx_next = ll_free;
+			ll_free = &slab[i];
+		}
+	}
+
+	im = ll_free;
+	ll_free = im->idx_next;
+	memset(im, 0, sizeof(*im));
+	return im;
+}
+
+static void ll_forget_index(int index)
+{
+	struct ll_cache *im, **imp;
+
+	if (ll_hash_size == 0)
+		return;
+
+	for (imp = idxhead(index); (im = *imp) != NULL; imp = &im->idx_next) {
+		if (im->index == index) {
+			*imp = im->idx_next;
+			ll_name_unlink(im);
+			im->idx_next = ll_free;
+			ll_free = im;
+			ll_count--;
+			return;
+		}
+	}
 }
 
 int ll_remember_index(const struct sockaddr_nl *who,
 		      struct nlmsghdr *n, void *arg)
 {
-	int h;
 	struct ifinfomsg *ifi = NLMSG_DATA(n);
-	struct ll_cache *im, **imp;
+	struct ll_cache *im;
 	struct rtattr *tb[IFLA_MAX+1];
+	const char *name;
 
-	if (n->nlmsg_type != RTM_NEWLINK)
+	if (n->nlmsg_type != RTM_NEWLINK && n->nlmsg_type != RTM_DELLINK)
 		return 0;
 
-	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(ifi)))
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
 		return -1;
 
+	if (n->nlmsg_type == RTM_DELLINK) {
+		/* Bridge port removal, the device itself stays */
+		if (ifi->ifi_family != AF_BRIDGE)
+			ll_forget_index(ifi->ifi_index);
+		return 0;
+	}
+
 	memset(tb, 0, sizeof(tb));
 	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
 	if (tb[IFLA_IFNAME] == NULL)
 		return 0;
+	name = RTA_DATA(tb[IFLA_IFNAME]);
 
-	h = ifi->ifi_index & (IDXMAP_SIZE - 1);
-	for (imp = &idx_head[h]; (im=*imp)!=NULL; imp = &im->idx_next)
-		if (im->index == ifi->ifi_index)
-			break;
-
+	im = ll_get_by_index(ifi->ifi_index);
 	if (im == NULL) {
-		im = malloc(sizeof(*im));
+		if (ll_count >= ll_hash_size && ll_hash_grow() < 0 &&
+		    ll_hash_size == 0)
+			return 0;
+
+		im = ll_alloc();
 		if (im == NULL)
 			return 0;
-		im->idx_next = *imp;
 		im->index = ifi->ifi_index;
-		*imp = im;
+		im->idx_next = *idxhead(im->index);
+		*idxhead(im->index) = im;
+		strncpy(im->name, name, IFNAMSIZ - 1);
+		ll_name_link(im);
+		ll_count++;
+	} else if (strcmp(im->name, name) != 0) {
+		ll_name_unlink(im);
+		strncpy(im->name, name, IFNAMSIZ - 1);
+		ll_name_link(im);
 	}
 
 	im->type = ifi->ifi_type;
@@ -89,7 +255,6 @@ int ll_remember_index(const struct sockaddr_nl *who,
 		im->alen = 0;
 		memset(im->addr, 0, sizeof(im->addr));
 	}
-	strcpy(im->name, RTA_DATA(tb[IFLA_IFNAME]));
 	return 0;
 }
 
@@ -100,9 +265,9 @@ const char *ll_idx_n2a(unsigned idx, char *buf)
 	if (idx == 0)
 		return "*";
 
-	for (im = idxhead(idx); im; im = im->idx_next)
-		if (im->index == idx)
-			return im->name;
+	im = ll_get_by_index(idx);
+	if (im)
+		return im->name;
 
 	snprintf(buf, IFNAMSIZ, "if%d", idx);
 	return buf;
@@ -122,10 +287,8 @@ int ll_index_to_type(unsigned idx)
 
 	if (idx == 0)
 		return -1;
-	for (im = idxhead(idx); im; im = im->idx_next)
-		if (im->index == idx)
-			return im->type;
-	return -1;
+	im = ll_get_by_index(idx);
+	return im ? im->type : -1;
 }
 
 unsigned ll_index_to_flags(unsigned idx)
@@ -135,10 +298,8 @@ unsigned ll_index_to_flags(unsigned idx)
 	if (idx == 0)
 		return 0;
 
-	for (im = idxhead(idx); im; im = im->idx_next)
-		if (im->index == idx)
-			return im->flags;
-	return 0;
+	im = ll_get_by_index(idx);
+	return im ? im->flags : 0;
 }
 
 unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
@@ -149,42 +310,29 @@ unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
 	if (idx == 0)
 		return 0;
 
-	for (im = idxhead(idx); im; im = im->idx_next) {
-		if (im->index == idx) {
-			if (alen > sizeof(im->addr))
-				alen = sizeof(im->addr);
-			if (alen > im->alen)
-				alen = im->alen;
-			memcpy(addr, im->addr, alen);
-			return alen;
-		}
-	}
-	return 0;
+	im = ll_get_by_index(idx);
+	if (im == NULL)
+		return 0;
+
+	if (alen > sizeof(im->addr))
+		alen = sizeof(im->addr);
+	if (alen > im->alen)
+		alen = im->alen;
+	memcpy(addr, im->addr, alen);
+	return alen;
 }
 
 unsigned ll_name_to_index(const char *name)
 {
-	static char ncache[IFNAMSIZ];
-	static int icache;
-	struct ll_cache *im;
-	int i;
+	const struct ll_cache *im;
 	unsigned idx;
 
 	if (name == NULL)
 		return 0;
 
-	if (icache && strcmp(name, ncache) == 0)
-		return icache;
-
-	for (i=0; i<IDXMAP_SIZE; i++) {
-		for (im = idx_head[i]; im; im = im->idx_next) {
-			if (strcmp(im->name, name) == 0) {
-				icache = im->index;
-				strcpy(ncache, name);
-				return im->index;
-			}
-		}
-	}
+	im = ll_get_by_name(name);
+	if (im)
+		return im->index;
 
 	idx = if_nametoindex(name);
 	if (idx == 0)
@@ -192,6 +340,23 @@ unsigned ll_name_to_index(const char *name)
 	return idx;
 }
 
+/* Call fn for every cached link until it returns nonzero */
+int ll_walk(int (*fn)(unsigned idx, const char *name, void *arg), void *arg)
+{
+	const struct ll_cache *im;
+	unsigned h;
+	int err;
+
+	for (h = 0; h < ll_hash_size; h++) {
+		for (im = idx_head[h]; im; im = im->idx_next) {
+			err = fn(im->index, im->name, arg);
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
 int ll_init_map(struct rtnl_handle *rth)
 {
 	static int initialized;
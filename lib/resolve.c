@@ -0,0 +1,384 @@
+/*
+ * resolve.c		Reverse lookups for format_host().
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Lookups are done by a bounded pool of threads.  A dump can queue all
+ * its addresses with resolve_prefetch() before printing anything, so they
+ * are resolved in parallel, and resolve_address() then waits only for the
+ * one it is asked about, never past a deadline common to the whole run.
+ * Answers, failures included, are kept with a TTL in a per-user cache
+ * file which later runs start from.
+ *
+ * Environment: IP_RESOLVE_WINDOW (lookups in flight), IP_RESOLVE_TIMEOUT
+ * (seconds), IP_RESOLVE_TTL (seconds) and IP_RESOLVE_CACHE (file, empty
+ * to disable).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+
+#ifdef RESOLVE_HOSTNAMES
+
+#define NHASH		65536
+#define R_WINDOW	32
+#define R_TIMEOUT	10
+#define R_TTL		3600
+#define R_NEG_TTL	300
+
+enum {
+	R_QUEUED,
+	R_BUSY,
+	R_DONE,
+};
+
+struct namerec
+{
+	struct namerec *next;
+	struct namerec *qnext;
+	const char *name;
+	int state;
+	time_t expires;
+	inet_prefix addr;
+};
+
+static struct namerec **nht;
+static struct namerec *r_queue, **r_tail = &r_queue;
+static pthread_mutex_t r_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t r_cond = PTHREAD_COND_INITIALIZER;
+static int r_workers, r_window = R_WINDOW, r_timeout = R_TIMEOUT;
+static int r_ttl = R_TTL, r_dirty;
+static struct timespec r_deadline;
+static char r_cache[PATH_MAX];
+
+static int r_env(const char *name, int dflt)
+{
+	const char *s = getenv(name);
+	int v;
+
+	if (s == NULL || (v = atoi(s)) <= 0)
+		return dflt;
+	return v;
+}
+
+static unsigned r_hash(int af, const void *addr, int len)
+{
+	const unsigned char *p = addr;
+	unsigned h = 2166136261U ^ af;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h & (NHASH - 1);
+}
+
+static struct namerec *r_find(int af, const void *addr, int len, int *created)
+{
+	unsigned hash = r_hash(af, addr, len);
+	struct namerec *n;
+
+	for (n = nht[hash]; n; n = n->next) {
+		if (n->addr.family == af &&
+		    n->addr.bytelen == len &&
+		    memcmp(n->addr.data, addr, len) == 0)
+			return n;
+	}
+	if (created == NULL || (n = calloc(1, sizeof(*n))) == NULL)
+		return NULL;
+	n->addr.family = af;
+	n->addr.bytelen = len;
+	memcpy(n->addr.data, addr, len);
+	n->next = nht[hash];
+	nht[hash] = n;
+	*created = 1;
+	return n;
+}
+
+static void r_load(void)
+{
+	char line[1200], abuf[64], name[1024];
+	time_t now = time(NULL);
+	struct stat st;
+	FILE *fp;
+	int fd;
+
+	fd = open(r_cache, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+	    (fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		struct namerec *n;
+		__u32 data[4];
+		long expires;
+		int af, len, created = 0;
+
+		if (sscanf(line, "%ld %d %63s %1023s", &expires, &af,
+			   abuf, name) != 4 || expires <= now)
+			continue;
+		if ((af != AF_INET && af != AF_INET6) ||
+		    inet_pton(af, abuf, data) != 1)
+			continue;
+		len = af == AF_INET ? 4 : 16;
+		n = r_find(af, data, len, &created);
+		if (n == NULL || !created)
+			continue;
+		n->state = R_DONE;
+		n->expires = expires;
+		if (strcmp(name, "-"))
+			n->name = strdup(name);
+	}
+	fclose(fp);
+}
+
+static void r_save(void)
+{
+	char tmp[PATH_MAX + 16], abuf[64];
+	time_t now = time(NULL);
+	FILE *fp;
+	int fd, i;
+
+	pthread_mutex_lock(&r_lock);
+	if (!r_dirty || !r_cache[0])
+		goto out;
+	snprintf(tmp, sizeof(tmp), "%s.%d", r_cache, getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+	if (fd < 0)
+		goto out;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	for (i = 0; i < NHASH; i++) {
+		struct namerec *n;
+
+		for (n = nht[i]; n; n = n->next) {
+			if (n->state != R_DONE || n->expires <= now ||
+			    (n->addr.family != AF_INET &&
+			     n->addr.family != AF_INET6))
+				continue;
+			inet_ntop(n->addr.family, n->addr.data, abuf, sizeof(abuf));
+			fprintf(fp, "%ld %d %s %s\n", (long)n->expires,
+				n->addr.family, abuf, n->name ? : "-");
+		}
+	}
+	if (fclose(fp) || rename(tmp, r_cache))
+		unlink(tmp);
+out:
+	pthread_mutex_unlock(&r_lock);
+}
+
+static int r_init(void)
+{
+	const char *s, *tmp;
+
+	if (nht)
+		return 0;
+	nht = calloc(NHASH, sizeof(*nht));
+	if (nht == NULL)
+		return -1;
+
+	r_window = r_env("IP_RESOLVE_WINDOW", R_WINDOW);
+	r_timeout = r_env("IP_RESOLVE_TIMEOUT", R_TIMEOUT);
+	r_ttl = r_env("IP_RESOLVE_TTL", R_TTL);
+	if ((s = getenv("IP_RESOLVE_CACHE")) != NULL)
+		snprintf(r_cache, sizeof(r_cache), "%s", s);
+	else {
+		if ((tmp = getenv("TMPDIR")) == NULL || tmp[0] == 0)
+			tmp = P_tmpdir;
+		snprintf(r_cache, sizeof(r_cache), "%s/.resolve.u%d",
+			 tmp, getuid());
+	}
+	if (r_cache[0]) {
+		r_load();
+		atexit(r_save);
+	}
+	return 0;
+}
+
+static char *r_lookup(const inet_prefix *a)
+{
+	struct hostent he, *res = NULL;
+	size_t len = 1024;
+	char *buf = NULL, *name = NULL;
+	int err, herr;
+
+	for (;;) {
+		char *p = realloc(buf, len);
+
+		if (p == NULL)
+			break;
+		buf = p;
+		err = gethostbyaddr_r(a->data, a->bytelen, a->family, &he,
+				      buf, len, &res, &herr);
+		if (err != ERANGE || len >= 65536)
+			break;
+		len *= 2;
+	}
+	if (res && res->h_name)
+		name = strdup(res->h_name);
+	free(buf);
+	return name;
+}
+
+/*
+ * Runs with r_lock held, drops it around every lookup.  Past the deadline,
+ * if one is given, the rest of the queue is given up on; such entries are
+ * done but expired, so they are not saved.
+ */
+static void r_drain(const struct timespec *deadline)
+{
+	struct namerec *n;
+
+	while ((n = r_queue) != NULL) {
+		struct timespec now;
+		char *name;
+
+		if ((r_queue = n->qnext) == NULL)
+			r_tail = &r_queue;
+		if (deadline) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			if (now.tv_sec > deadline->tv_sec ||
+			    (now.tv_sec == deadline->tv_sec &&
+			     now.tv_nsec >= deadline->tv_nsec)) {
+				n->state = R_DONE;
+				n->expires = 0;
+				continue;
+			}
+		}
+		n->state = R_BUSY;
+		pthread_mutex_unlock(&r_lock);
+
+		name = r_lookup(&n->addr);
+
+		pthread_mutex_lock(&r_lock);
+		n->name = name;
+		n->state = R_DONE;
+		n->expires = time(NULL) + (name ? r_ttl : R_NEG_TTL);
+		r_dirty = 1;
+		pthread_cond_broadcast(&r_cond);
+	}
+}
+
+static void *r_worker(void *arg)
+{
+	pthread_mutex_lock(&r_lock);
+	r_drain(NULL);
+	r_workers--;
+	pthread_mutex_unlock(&r_lock);
+	return NULL;
+}
+
+static void r_enqueue(struct namerec *n)
+{
+	pthread_attr_t attr;
+	pthread_t t;
+
+	n->state = R_QUEUED;
+	n->qnext = NULL;
+	*r_tail = n;
+	r_tail = &n->qnext;
+
+	if (r_workers >= r_window)
+		return;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&t, &attr, r_worker, NULL) == 0)
+		r_workers++;
+	pthread_attr_destroy(&attr);
+}
+
+/* Look at v4 mapped addresses as the IPv4 ones they are */
+static void r_unmap(int *af, const void **addr, int *len)
+{
+	const __u32 *a = *addr;
+
+	if (*af == AF_INET6 && *len == 16 && a[0] == 0 && a[1] == 0 &&
+	    a[2] == htonl(0xffff)) {
+		*af = AF_INET;
+		*addr = a + 3;
+		*len = 4;
+	}
+}
+
+void resolve_prefetch(int af, int len, const void *addr)
+{
+	struct namerec *n;
+	int created = 0;
+
+	if (len <= 0 || len > sizeof(n->addr.data))
+		return;
+	r_unmap(&af, &addr, &len);
+
+	pthread_mutex_lock(&r_lock);
+	if (r_init() == 0 && (n = r_find(af, addr, len, &created)) && created)
+		r_enqueue(n);
+	pthread_mutex_unlock(&r_lock);
+}
+
+const char *resolve_address(const void *addr, int len, int af)
+{
+	struct namerec *n;
+	const char *name = NULL;
+	int created = 0;
+
+	if (len <= 0 || len > sizeof(n->addr.data))
+		return NULL;
+	r_unmap(&af, &addr, &len);
+
+	pthread_mutex_lock(&r_lock);
+	if (r_init() < 0 || (n = r_find(af, addr, len, &created)) == NULL)
+		goto out;
+	if (created)
+		r_enqueue(n);
+
+	if (n->state != R_DONE) {
+		if (r_deadline.tv_sec == 0) {
+			clock_gettime(CLOCK_REALTIME, &r_deadline);
+			r_deadline.tv_sec += r_timeout;
+		}
+		fflush(stdout);
+	}
+	while (n->state != R_DONE) {
+		/* No thread could be started, do the work here */
+		if (r_workers == 0) {
+			r_drain(&r_deadline);
+			continue;
+		}
+		if (pthread_cond_timedwait(&r_cond, &r_lock, &r_deadline) == ETIMEDOUT)
+			break;
+	}
+	if (n->state == R_DONE)
+		name = n->name;
+out:
+	pthread_mutex_unlock(&r_lock);
+	return name;
+}
+
+#else
+
+void resolve_prefetch(int af, int len, const void *addr)
+{
+}
+
+#endif
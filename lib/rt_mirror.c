@@ -0,0 +1,476 @@
+/*
+ * rt_mirror.c		Userspace copy of the rtnetlink objects a listener
+ *			is subscribed to, used to resynchronise it after
+ *			events were lost.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/if_link.h>
+#include <linux/neighbour.h>
+
+#include "libnetlink.h"
+#include "rt_mirror.h"
+
+/*
+ * Objects are hashed by their identity: the fields the kernel uses to
+ * look them up.  rtnl_mirror_sync() dumps the subscribed tables into a
+ * fresh copy and reports what differs from the old one, ignoring
+ * attributes which change without an event, like statistics.
+ */
+#define MIRROR_HASH_MIN	1024
+#define MIRROR_KEY_MAX	512
+
+struct mirror_key
+{
+	int		len;
+	unsigned char	buf[MIRROR_KEY_MAX];
+};
+
+struct mirror_ent
+{
+	struct mirror_ent	*next;
+	unsigned		hash;
+	int			klen;
+	struct nlmsghdr		*n;
+	unsigned char		key[0];
+};
+
+struct rtnl_mirror
+{
+	unsigned		groups;
+	struct mirror_ent	**hash;
+	unsigned		size;
+	unsigned		count;
+};
+
+static const struct {
+	int	group;
+	int	family;
+	int	type;
+} mirror_dumps[] = {
+	{ RTNLGRP_LINK,		AF_UNSPEC,	RTM_GETLINK },
+	{ RTNLGRP_IPV4_IFADDR,	AF_INET,	RTM_GETADDR },
+	{ RTNLGRP_IPV6_IFADDR,	AF_INET6,	RTM_GETADDR },
+	{ RTNLGRP_IPV4_ROUTE,	AF_INET,	RTM_GETROUTE },
+	{ RTNLGRP_IPV6_ROUTE,	AF_INET6,	RTM_GETROUTE },
+	{ RTNLGRP_NEIGH,	AF_UNSPEC,	RTM_GETNEIGH },
+	{ RTNLGRP_IPV4_RULE,	AF_INET,	RTM_GETRULE },
+	{ RTNLGRP_IPV6_RULE,	AF_INET6,	RTM_GETRULE },
+};
+
+static void key_add(struct mirror_key *k, const void *data, int len)
+{
+	if (len > 255)
+		len = 255;
+	if (k->len + 1 + len > MIRROR_KEY_MAX)
+		len = MIRROR_KEY_MAX - k->len - 1;
+	if (len < 0)
+		return;
+	k->buf[k->len++] = len;
+	if (len)
+		memcpy(k->buf + k->len, data, len);
+	k->len += len;
+}
+
+static void key_add_rta(struct mirror_key *k, const struct rtattr *rta)
+{
+	if (rta)
+		key_add(k, RTA_DATA(rta), RTA_PAYLOAD(rta));
+	else
+		key_add(k, NULL, 0);
+}
+
+/* Returns the type of the object as a RTM_NEW message, or 0 if untracked */
+static int mirror_key(const struct nlmsghdr *n, struct mirror_key *k)
+{
+	int len = n->nlmsg_len;
+	int type = n->nlmsg_type & ~1;
+
+	k->len = 0;
+	switch (type) {
+	case RTM_NEWLINK: {
+		const struct ifinfomsg *ifi = NLMSG_DATA(n);
+
+		/* Only AF_UNSPEC links are dumped */
+		if (len < NLMSG_LENGTH(sizeof(*ifi)) ||
+		    ifi->ifi_family != AF_UNSPEC)
+			return 0;
+		key_add(k, &type, sizeof(type));
+		key_add(k, &ifi->ifi_family, sizeof(ifi->ifi_family));
+		key_add(k, &ifi->ifi_index, sizeof(ifi->ifi_index));
+		break;
+	}
+	case RTM_NEWADDR: {
+		const struct ifaddrmsg *ifa = NLMSG_DATA(n);
+		struct rtattr *tb[IFA_MAX+1];
+
+		len -= NLMSG_LENGTH(sizeof(*ifa));
+		if (len < 0)
+			return 0;
+		parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), len);
+		key_add(k, &type, sizeof(type));
+		key_add(k, &ifa->ifa_family, sizeof(ifa->ifa_family));
+		key_add(k, &ifa->ifa_index, sizeof(ifa->ifa_index));
+		key_add(k, &ifa->ifa_prefixlen, sizeof(ifa->ifa_prefixlen));
+		key_add_rta(k, tb[IFA_LOCAL]);
+		key_add_rta(k, tb[IFA_ADDRESS]);
+		break;
+	}
+	case RTM_NEWROUTE: {
+		const struct rtmsg *r = NLMSG_DATA(n);
+		struct rtattr *tb[RTA_MAX+1];
+		__u32 table;
+
+		len -= NLMSG_LENGTH(sizeof(*r));
+		if (len < 0 || (r->rtm_flags & RTM_F_CLONED))
+			return 0;
+		parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
+		table = tb[RTA_TABLE] ? *(__u32 *)RTA_DATA(tb[RTA_TABLE]) :
+			r->rtm_table;
+		key_add(k, &type, sizeof(type));
+		key_add(k, &r->rtm_family, sizeof(r->rtm_family));
+		key_add(k, &table, sizeof(table));
+		key_add(k, &r->rtm_dst_len, sizeof(r->rtm_dst_len));
+		key_add(k, &r->rtm_src_len, sizeof(r->rtm_src_len));
+		key_add(k, &r->rtm_tos, sizeof(r->rtm_tos));
+		key_add_rta(k, tb[RTA_DST]);
+		key_add_rta(k, tb[RTA_SRC]);
+		key_add_rta(k, tb[RTA_PRIORITY]);
+		if (r->rtm_family == AF_INET6) {
+			key_add_rta(k, tb[RTA_OIF]);
+			key_add_rta(k, tb[RTA_GATEWAY]);
+		}
+		break;
+	}
+	case RTM_NEWNEIGH: {
+		const struct ndmsg *ndm = NLMSG_DATA(n);
+		struct rtattr *tb[NDA_MAX+1];
+
+		len -= NLMSG_LENGTH(sizeof(*ndm));
+		if (len < 0)
+			return 0;
+		parse_rtattr(tb, NDA_MAX, NDA_RTA(ndm), len);
+		key_add(k, &type, sizeof(type));
+		key_add(k, &ndm->ndm_family, sizeof(ndm->ndm_family));
+		key_add(k, &ndm->ndm_ifindex, sizeof(ndm->ndm_ifindex));
+		key_add_rta(k, tb[NDA_DST]);
+		if (ndm->ndm_family == AF_BRIDGE)
+			key_add_rta(k, tb[NDA_LLADDR]);
+		break;
+	}
+	case RTM_NEWRULE:
+		/* Rules have no identity apart from their contents */
+		if (len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+			return 0;
+		key_add(k, &type, sizeof(type));
+		key_add(k, NLMSG_DATA(n), len - NLMSG_LENGTH(0));
+		break;
+	default:
+		return 0;
+	}
+	return type;
+}
+
+static unsigned mirror_hash(const struct mirror_key *k)
+{
+	unsigned h = 2166136261u;
+	int i;
+
+	for (i = 0; i < k->len; i++)
+		h = (h ^ k->buf[i]) * 16777619u;
+	return h;
+}
+
+static struct mirror_ent **mirror_find(struct rtnl_mirror *m,
+				       const unsigned char *key, int klen,
+				       unsigned h)
+{
+	struct mirror_ent **ep;
+
+	for (ep = &m->hash[h & (m->size - 1)]; *ep; ep = &(*ep)->next) {
+		struct mirror_ent *e = *ep;
+
+		if (e->hash == h && e->klen == klen &&
+		    memcmp(e->key, key, klen) == 0)
+			break;
+	}
+	return ep;
+}
+
+static int mirror_grow(struct rtnl_mirror *m)
+{
+	unsigned size = m->size ? m->size * 2 : MIRROR_HASH_MIN;
+	struct mirror_ent **hash;
+	unsigned i;
+
+	hash = calloc(size, sizeof(*hash));
+	if (hash == NULL)
+		return -1;
+	for (i = 0; i < m->size; i++) {
+		struct mirror_ent *e, *next;
+
+		for (e = m->hash[i]; e; e = next) {
+			next = e->next;
+			e->next = hash[e->hash & (size - 1)];
+			hash[e->hash & (size - 1)] = e;
+		}
+	}
+	free(m->hash);
+	m->hash = hash;
+	m->size = size;
+	return 0;
+}
+
+static int mirror_set(struct rtnl_mirror *m, const struct mirror_key *k,
+		      const struct nlmsghdr *n)
+{
+	struct mirror_ent **ep, *e, *old;
+	unsigned h = mirror_hash(k);
+
+	if (m->count >= m->size && mirror_grow(m) < 0)
+		goto oom;
+
+	e = malloc(sizeof(*e) + NLMSG_ALIGN(k->len) + n->nlmsg_len);
+	if (e == NULL)
+		goto oom;
+	e->hash = h;
+	e->klen = k->len;
+	memcpy(e->key, k->buf, k->len);
+	e->n = (struct nlmsghdr *)(e->key + NLMSG_ALIGN(k->len));
+	memcpy(e->n, n, n->nlmsg_len);
+
+	ep = mirror_find(m, k->buf, k->len, h);
+	old = *ep;
+	if (old) {
+		e->next = old->next;
+		free(old);
+	} else {
+		e->next = NULL;
+		m->count++;
+	}
+	*ep = e;
+	return 0;
+
+oom:
+	fprintf(stderr, "Cannot allocate mirror entry\n");
+	return -1;
+}
+
+struct rtnl_mirror *rtnl_mirror_new(unsigned groups)
+{
+	struct rtnl_mirror *m = calloc(1, sizeof(*m));
+
+	if (m == NULL || mirror_grow(m) < 0) {
+		free(m);
+		return NULL;
+	}
+	m->groups = groups;
+	return m;
+}
+
+static void mirror_clear(struct rtnl_mirror *m)
+{
+	unsigned i;
+
+	for (i = 0; i < m->size; i++) {
+		struct mirror_ent *e, *next;
+
+		for (e = m->hash[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(m->hash);
+	m->hash = NULL;
+	m->size = m->count = 0;
+}
+
+void rtnl_mirror_free(struct rtnl_mirror *m)
+{
+	if (m) {
+		mirror_clear(m);
+		free(m);
+	}
+}
+
+/* Apply an event; messages of other types are ignored */
+int rtnl_mirror_update(struct rtnl_mirror *m, const struct nlmsghdr *n)
+{
+	struct mirror_key k;
+	struct mirror_ent **ep, *e;
+	int type = mirror_key(n, &k);
+
+	if (type == 0)
+		return 0;
+	if (n->nlmsg_type == type)
+		return mirror_set(m, &k, n);
+
+	ep = mirror_find(m, k.buf, k.len, mirror_hash(&k));
+	e = *ep;
+	if (e) {
+		*ep = e->next;
+		free(e);
+		m->count--;
+	}
+	return 0;
+}
+
+static int mirror_volatile(int type, int attr)
+{
+	switch (type) {
+	case RTM_NEWLINK:
+		return attr == IFLA_STATS || attr == IFLA_STATS64 ||
+			attr == IFLA_AF_SPEC;
+	case RTM_NEWADDR:
+		return attr == IFA_CACHEINFO;
+	case RTM_NEWROUTE:
+		return attr == RTA_CACHEINFO;
+	case RTM_NEWNEIGH:
+		return attr == NDA_CACHEINFO || attr == NDA_PROBES;
+	}
+	return 0;
+}
+
+static struct rtattr *mirror_next_rta(int type, struct rtattr *rta, int *len)
+{
+	while (RTA_OK(rta, *len) && mirror_volatile(type, rta->rta_type))
+		rta = RTA_NEXT(rta, *len);
+	return RTA_OK(rta, *len) ? rta : NULL;
+}
+
+static int mirror_same(int type, const struct nlmsghdr *a,
+		       const struct nlmsghdr *b)
+{
+	struct rtattr *ra, *rb;
+	int hlen, la, lb;
+
+	switch (type) {
+	case RTM_NEWLINK:
+		hlen = sizeof(struct ifinfomsg);
+		/* Only ifi_change differs between dumps and events */
+		if (memcmp(NLMSG_DATA(a), NLMSG_DATA(b),
+			   offsetof(struct ifinfomsg, ifi_change)))
+			return 0;
+		break;
+	case RTM_NEWADDR:
+		hlen = sizeof(struct ifaddrmsg);
+		break;
+	case RTM_NEWNEIGH:
+		hlen = sizeof(struct ndmsg);
+		break;
+	default:
+		hlen = sizeof(struct rtmsg);
+		break;
+	}
+	if (type != RTM_NEWLINK &&
+	    memcmp(NLMSG_DATA(a), NLMSG_DATA(b), hlen))
+		return 0;
+
+	la = a->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(hlen));
+	lb = b->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(hlen));
+	ra = (struct rtattr *)((char *)NLMSG_DATA(a) + NLMSG_ALIGN(hlen));
+	rb = (struct rtattr *)((char *)NLMSG_DATA(b) + NLMSG_ALIGN(hlen));
+	for (;;) {
+		ra = mirror_next_rta(type, ra, &la);
+		rb = mirror_next_rta(type, rb, &lb);
+		if (ra == NULL || rb == NULL)
+			return ra == rb;
+		if (ra->rta_len != rb->rta_len ||
+		    memcmp(ra, rb, ra->rta_len))
+			return 0;
+		ra = RTA_NEXT(ra, la);
+		rb = RTA_NEXT(rb, lb);
+	}
+}
+
+static int mirror_collect(const struct sockaddr_nl *who,
+			  struct nlmsghdr *n, void *arg)
+{
+	struct rtnl_mirror *m = arg;
+	struct mirror_key k;
+
+	if (mirror_key(n, &k) != n->nlmsg_type)
+		return 0;
+	return mirror_set(m, &k, n);
+}
+
+/*
+ * Replace the copy with a fresh dump of the subscribed tables.  If handler
+ * is given, it is called with every object that is new or changed and with
+ * a RTM_DEL message for every object that disappeared.
+ */
+int rtnl_mirror_sync(struct rtnl_mirror *m, rtnl_filter_t handler, void *arg)
+{
+	struct rtnl_mirror cur;
+	struct rtnl_handle rth;
+	struct sockaddr_nl nladdr;
+	unsigned i;
+	int err = 0;
+
+	memset(&cur, 0, sizeof(cur));
+	if (mirror_grow(&cur) < 0)
+		return -1;
+	if (rtnl_open(&rth, 0) < 0) {
+		mirror_clear(&cur);
+		return -1;
+	}
+	for (i = 0; i < sizeof(mirror_dumps) / sizeof(mirror_dumps[0]); i++) {
+		if (!(m->groups & (1 << (mirror_dumps[i].group - 1))))
+			continue;
+		if (rtnl_wilddump_request(&rth, mirror_dumps[i].family,
+					  mirror_dumps[i].type) < 0 ||
+		    rtnl_dump_filter(&rth, mirror_collect, &cur,
+				     NULL, NULL) < 0) {
+			fprintf(stderr, "Cannot dump for resync\n");
+			err = -1;
+			break;
+		}
+	}
+	rtnl_close(&rth);
+	if (err < 0) {
+		mirror_clear(&cur);
+		return err;
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	for (i = 0; handler && err >= 0 && i < cur.size; i++) {
+		struct mirror_ent *e;
+
+		for (e = cur.hash[i]; e && err >= 0; e = e->next) {
+			struct mirror_ent *old;
+
+			old = *mirror_find(m, e->key, e->klen, e->hash);
+			if (old == NULL ||
+			    !mirror_same(e->n->nlmsg_type, old->n, e->n))
+				err = handler(&nladdr, e->n, arg);
+		}
+	}
+	for (i = 0; handler && err >= 0 && i < m->size; i++) {
+		struct mirror_ent *e;
+
+		for (e = m->hash[i]; e && err >= 0; e = e->next) {
+			if (*mirror_find(&cur, e->key, e->klen, e->hash) == NULL) {
+				e->n->nlmsg_type |= 1;
+				err = handler(&nladdr, e->n, arg);
+			}
+		}
+	}
+
+	mirror_clear(m);
+	m->hash = cur.hash;
+	m->size = cur.size;
+	m->count = cur.count;
+	return err;
+}
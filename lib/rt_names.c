@@ -7,6 +7,12 @@
  *		2 of the License, or (at your option) any later version.
  *
  * Authors:	Alexey Kuznetsov, <kuznet@ms2.inr.ac.ru>
+ *
+ * Each /etc/iproute2 database is compiled, on first use, into an image
+ * holding an id hash and a name hash over one string table.  The image is
+ * saved as a per-user cache keyed by the identity and mtime of its source
+ * and is simply mapped by later runs, so a large rt_tables costs neither
+ * parsing nor scanning.
  */
 
 #include <stdio.h>
@@ -15,165 +21,387 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <asm/types.h>
 #include <linux/rtnetlink.h>
 
 #include "rt_names.h"
 
-struct rtnl_hash_entry {
-	struct rtnl_hash_entry *next;
-	char *			name;
-	unsigned int		id;
+#define RTNL_DB_MAGIC	0x52544e44
+#define RTNL_DB_VERSION	1
+
+struct rtnl_db_hdr {
+	__u32	magic;
+	__u32	version;
+	__u64	dev;		/* of the source file */
+	__u64	ino;
+	__u64	size;
+	__s64	mtime_sec;
+	__s64	mtime_nsec;
+	__u32	nent;
+	__u32	nbuckets;	/* power of two */
+	__u32	strsize;
+	__u32	pad;
+	/* __u32 id_bucket[nbuckets], name_bucket[nbuckets],
+	 * struct rtnl_db_ent ent[nent], char str[strsize] follow */
+};
+
+/* Chains hold entry index + 1, the latest line of the file comes first */
+struct rtnl_db_ent {
+	__u32	id;
+	__u32	name;		/* offset in str */
+	__u32	id_next;
+	__u32	name_next;
+};
+
+struct rtnl_db_dflt {
+	unsigned int	id;
+	char		*name;
 };
 
-static void
-rtnl_hash_initialize(char *file, struct rtnl_hash_entry **hash, int size)
+struct rtnl_db {
+	const char			*file;
+	unsigned int			max;	/* larger ids are ignored */
+	const struct rtnl_db_dflt	*dflt;
+	int				init;
+	const struct rtnl_db_hdr	*img;
+	size_t				len;
+};
+
+static unsigned int rtnl_db_strhash(const char *s)
 {
-	struct rtnl_hash_entry *entry;
-	char buf[512];
-	FILE *fp;
+	unsigned int h = 2166136261U;
 
-	fp = fopen(file, "r");
-	if (!fp)
-		return;
-	while (fgets(buf, sizeof(buf), fp)) {
-		char *p = buf;
-		int id;
-		char namebuf[512];
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619U;
+	return h;
+}
 
-		while (*p == ' ' || *p == '\t')
-			p++;
-		if (*p == '#' || *p == '\n' || *p == 0)
-			continue;
-		if (sscanf(p, "0x%x %s\n", &id, namebuf) != 2 &&
-		    sscanf(p, "0x%x %s #", &id, namebuf) != 2 &&
-		    sscanf(p, "%d %s\n", &id, namebuf) != 2 &&
-		    sscanf(p, "%d %s #", &id, namebuf) != 2) {
-			fprintf(stderr, "Database %s is corrupted at %s\n",
-				file, p);
-			fclose(fp);
-			return;
-		}
+static unsigned int rtnl_db_idhash(unsigned int id)
+{
+	return id * 2654435761U;
+}
 
-		if (id<0)
-			continue;
-		entry = malloc(sizeof(*entry));
-		entry->id   = id;
-		entry->name = strdup(namebuf);
-		entry->next = hash[id & (size - 1)];
-		hash[id & (size - 1)] = entry;
+static const __u32 *rtnl_db_buckets(const struct rtnl_db_hdr *h)
+{
+	return (const __u32 *)(h + 1);
+}
+
+static const struct rtnl_db_ent *rtnl_db_ents(const struct rtnl_db_hdr *h)
+{
+	return (const void *)(rtnl_db_buckets(h) + 2 * h->nbuckets);
+}
+
+static const char *rtnl_db_strs(const struct rtnl_db_hdr *h)
+{
+	return (const char *)(rtnl_db_ents(h) + h->nent);
+}
+
+static size_t rtnl_db_size(__u32 nent, __u32 nbuckets, __u32 strsize)
+{
+	return sizeof(struct rtnl_db_hdr) + 2 * nbuckets * sizeof(__u32) +
+	       nent * sizeof(struct rtnl_db_ent) + strsize;
+}
+
+static char *rtnl_db_cache_name(const char *file, char *buf, int len)
+{
+	const char *base = strrchr(file, '/');
+
+	snprintf(buf, len, "%s/.rt_names.u%d.%s", P_tmpdir, getuid(),
+		 base ? base + 1 : file);
+	return buf;
+}
+
+/* Map the cache if it was compiled from this very version of the file */
+static int rtnl_db_map(struct rtnl_db *db, const struct stat *src)
+{
+	const struct rtnl_db_hdr *h;
+	char name[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	fd = open(rtnl_db_cache_name(db->file, name, sizeof(name)),
+		  O_RDONLY|O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+	    st.st_nlink != 1 || st.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
 	}
-	fclose(fp);
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+		return -1;
+
+	if (h->magic != RTNL_DB_MAGIC || h->version != RTNL_DB_VERSION ||
+	    h->dev != src->st_dev || h->ino != src->st_ino ||
+	    h->size != src->st_size ||
+	    h->mtime_sec != src->st_mtim.tv_sec ||
+	    h->mtime_nsec != src->st_mtim.tv_nsec ||
+	    h->nbuckets == 0 || (h->nbuckets & (h->nbuckets - 1)) ||
+	    h->nbuckets > st.st_size || h->nent > st.st_size ||
+	    h->strsize == 0 || h->strsize > st.st_size ||
+	    rtnl_db_size(h->nent, h->nbuckets, h->strsize) != st.st_size ||
+	    rtnl_db_strs(h)[h->strsize - 1] != 0) {
+		munmap((void *)h, st.st_size);
+		return -1;
+	}
+	db->img = h;
+	db->len = st.st_size;
+	return 0;
 }
 
-static void rtnl_tab_initialize(char *file, char **tab, int size)
+static void rtnl_db_save(struct rtnl_db *db)
 {
-	char buf[512];
-	FILE *fp;
+	char name[PATH_MAX], tmp[PATH_MAX + 16];
+	int fd, ok;
 
-	fp = fopen(file, "r");
-	if (!fp)
+	rtnl_db_cache_name(db->file, name, sizeof(name));
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0600);
+	if (fd < 0)
 		return;
+	ok = write(fd, db->img, db->len) == db->len;
+	close(fd);
+	if (!ok || rename(tmp, name))
+		unlink(tmp);
+}
+
+/*
+ * Parse "id name" lines, the id in decimal or 0x hex.  Anything after
+ * the name is ignored.  Returns -1 when the file is corrupted, what was
+ * read up to there is kept.
+ */
+static int rtnl_db_parse(struct rtnl_db *db, FILE *fp,
+			 struct rtnl_db_ent **ents, __u32 *nent,
+			 char **strs, __u32 *strsize)
+{
+	__u32 nalloc = 0, salloc = 0;
+	char buf[512];
+
 	while (fgets(buf, sizeof(buf), fp)) {
-		char *p = buf;
-		int id;
-		char namebuf[512];
+		char *p = buf, *end, *name;
+		long id;
+		int len;
 
 		while (*p == ' ' || *p == '\t')
 			p++;
 		if (*p == '#' || *p == '\n' || *p == 0)
 			continue;
-		if (sscanf(p, "0x%x %s\n", &id, namebuf) != 2 &&
-		    sscanf(p, "0x%x %s #", &id, namebuf) != 2 &&
-		    sscanf(p, "%d %s\n", &id, namebuf) != 2 &&
-		    sscanf(p, "%d %s #", &id, namebuf) != 2) {
+		if (p[0] == '0' && p[1] == 'x')
+			id = strtoul(p + 2, &end, 16);
+		else
+			id = strtol(p, &end, 10);
+		name = end;
+		while (*name == ' ' || *name == '\t')
+			name++;
+		len = strcspn(name, " \t\n");
+		if (end == p || len == 0) {
 			fprintf(stderr, "Database %s is corrupted at %s\n",
-				file, p);
-			fclose(fp);
-			return;
+				db->file, p);
+			return -1;
 		}
 
-		if (id<0 || id>size)
+		if (id < 0 || id > db->max)
 			continue;
-
-		tab[id] = strdup(namebuf);
+		if (*nent == nalloc) {
+			nalloc = nalloc ? 2 * nalloc : 64;
+			*ents = realloc(*ents, nalloc * sizeof(**ents));
+			if (*ents == NULL)
+				abort();
+		}
+		while (*strsize + len + 1 > salloc) {
+			salloc = salloc ? 2 * salloc : 1024;
+			*strs = realloc(*strs, salloc);
+			if (*strs == NULL)
+				abort();
+		}
+		(*ents)[*nent].id = id;
+		(*ents)[*nent].name = *strsize;
+		(*nent)++;
+		memcpy(*strs + *strsize, name, len);
+		(*strs)[*strsize + len] = 0;
+		*strsize += len + 1;
 	}
-	fclose(fp);
+	return 0;
 }
 
-static char * rtnl_rtprot_tab[256] = {
-	[RTPROT_UNSPEC] = "none",
-	[RTPROT_REDIRECT] ="redirect",
-	[RTPROT_KERNEL] = "kernel",
-	[RTPROT_BOOT] = "boot",
-	[RTPROT_STATIC] = "static",
-
-	[RTPROT_GATED] = "gated",
-	[RTPROT_RA] = "ra",
-	[RTPROT_MRT] =	"mrt",
-	[RTPROT_ZEBRA] ="zebra",
-	[RTPROT_BIRD] = "bird",
-	[RTPROT_DNROUTED] = "dnrouted",
-	[RTPROT_XORP] = "xorp",
-	[RTPROT_NTK] = "ntk",
-	[RTPROT_DHCP] = "dhcp",
-};
+/* Build the image from the file, and cache it unless the file was bad */
+static void rtnl_db_compile(struct rtnl_db *db, FILE *fp, const struct stat *src)
+{
+	struct rtnl_db_ent *ents = NULL, *e;
+	struct rtnl_db_hdr *h;
+	__u32 nent = 0, strsize = 1, nb = 256, *idb, *nameb, i;
+	char *strs = NULL;
+	int bad;
+
+	strs = malloc(1);
+	if (strs == NULL)
+		abort();
+	strs[0] = 0;
+	bad = rtnl_db_parse(db, fp, &ents, &nent, &strs, &strsize);
+
+	while (nb < nent)
+		nb <<= 1;
+	db->len = rtnl_db_size(nent, nb, strsize);
+	h = calloc(1, db->len);
+	if (h == NULL)
+		abort();
+	h->magic = RTNL_DB_MAGIC;
+	h->version = RTNL_DB_VERSION;
+	h->dev = src->st_dev;
+	h->ino = src->st_ino;
+	h->size = src->st_size;
+	h->mtime_sec = src->st_mtim.tv_sec;
+	h->mtime_nsec = src->st_mtim.tv_nsec;
+	h->nent = nent;
+	h->nbuckets = nb;
+	h->strsize = strsize;
+
+	idb = (__u32 *)rtnl_db_buckets(h);
+	nameb = idb + nb;
+	e = (struct rtnl_db_ent *)rtnl_db_ents(h);
+	memcpy((char *)rtnl_db_strs(h), strs, strsize);
+	for (i = 0; i < nent; i++) {
+		unsigned int ih = rtnl_db_idhash(ents[i].id) & (nb - 1);
+		unsigned int nh = rtnl_db_strhash(strs + ents[i].name) & (nb - 1);
+
+		e[i].id = ents[i].id;
+		e[i].name = ents[i].name;
+		e[i].id_next = idb[ih];
+		idb[ih] = i + 1;
+		e[i].name_next = nameb[nh];
+		nameb[nh] = i + 1;
+	}
+	free(ents);
+	free(strs);
 
+	db->img = h;
+	if (!bad)
+		rtnl_db_save(db);
+}
 
+static void rtnl_db_initialize(struct rtnl_db *db)
+{
+	struct stat st;
+	FILE *fp;
+
+	db->init = 1;
+	fp = fopen(db->file, "r");
+	if (!fp)
+		return;
+	if (fstat(fileno(fp), &st) == 0 && rtnl_db_map(db, &st) < 0)
+		rtnl_db_compile(db, fp, &st);
+	fclose(fp);
+}
 
-static int rtnl_rtprot_init;
+static char *rtnl_db_n2a(struct rtnl_db *db, unsigned int id)
+{
+	const struct rtnl_db_hdr *h;
+	const struct rtnl_db_dflt *d;
+
+	if (!db->init)
+		rtnl_db_initialize(db);
+	h = db->img;
+	if (h) {
+		const struct rtnl_db_ent *e = rtnl_db_ents(h);
+		__u32 i = rtnl_db_buckets(h)[rtnl_db_idhash(id) & (h->nbuckets - 1)];
+
+		for (; i && i <= h->nent; i = e[i-1].id_next)
+			if (e[i-1].id == id && e[i-1].name < h->strsize)
+				return (char *)rtnl_db_strs(h) + e[i-1].name;
+	}
+	for (d = db->dflt; d && d->name; d++)
+		if (d->id == id)
+			return d->name;
+	return NULL;
+}
 
-static void rtnl_rtprot_initialize(void)
+static int rtnl_db_a2n(struct rtnl_db *db, const char *name, unsigned int *id)
 {
-	rtnl_rtprot_init = 1;
-	rtnl_tab_initialize("/etc/iproute2/rt_protos",
-			    rtnl_rtprot_tab, 256);
+	const struct rtnl_db_hdr *h;
+	const struct rtnl_db_dflt *d;
+
+	if (!db->init)
+		rtnl_db_initialize(db);
+	h = db->img;
+	if (h) {
+		const struct rtnl_db_ent *e = rtnl_db_ents(h);
+		const __u32 *nameb = rtnl_db_buckets(h) + h->nbuckets;
+		__u32 i = nameb[rtnl_db_strhash(name) & (h->nbuckets - 1)];
+
+		for (; i && i <= h->nent; i = e[i-1].name_next)
+			if (e[i-1].name < h->strsize &&
+			    strcmp(rtnl_db_strs(h) + e[i-1].name, name) == 0) {
+				*id = e[i-1].id;
+				return 0;
+			}
+	}
+	for (d = db->dflt; d && d->name; d++)
+		if (strcmp(d->name, name) == 0) {
+			*id = d->id;
+			return 0;
+		}
+	return -1;
 }
 
+static const struct rtnl_db_dflt rtnl_rtprot_dflt[] = {
+	{ RTPROT_UNSPEC, "none" },
+	{ RTPROT_REDIRECT, "redirect" },
+	{ RTPROT_KERNEL, "kernel" },
+	{ RTPROT_BOOT, "boot" },
+	{ RTPROT_STATIC, "static" },
+
+	{ RTPROT_GATED, "gated" },
+	{ RTPROT_RA, "ra" },
+	{ RTPROT_MRT, "mrt" },
+	{ RTPROT_ZEBRA, "zebra" },
+	{ RTPROT_BIRD, "bird" },
+	{ RTPROT_DNROUTED, "dnrouted" },
+	{ RTPROT_XORP, "xorp" },
+	{ RTPROT_NTK, "ntk" },
+	{ RTPROT_DHCP, "dhcp" },
+	{ 0, NULL }
+};
+
+static struct rtnl_db rtnl_rtprot_db = {
+	.file = "/etc/iproute2/rt_protos",
+	.max = 255,
+	.dflt = rtnl_rtprot_dflt,
+};
+
 char * rtnl_rtprot_n2a(int id, char *buf, int len)
 {
+	char *name;
+
 	if (id<0 || id>=256) {
 		snprintf(buf, len, "%d", id);
 		return buf;
 	}
-	if (!rtnl_rtprot_tab[id]) {
-		if (!rtnl_rtprot_init)
-			rtnl_rtprot_initialize();
-	}
-	if (rtnl_rtprot_tab[id])
-		return rtnl_rtprot_tab[id];
+	name = rtnl_db_n2a(&rtnl_rtprot_db, id);
+	if (name)
+		return name;
 	snprintf(buf, len, "%d", id);
 	return buf;
 }
 
 int rtnl_rtprot_a2n(__u32 *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
+	unsigned long res;
+	unsigned int i;
 	char *end;
-	int i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_rtprot_db, arg, &i) == 0) {
+		*id = i;
 		return 0;
 	}
 
-	if (!rtnl_rtprot_init)
-		rtnl_rtprot_initialize();
-
-	for (i=0; i<256; i++) {
-		if (rtnl_rtprot_tab[i] &&
-		    strcmp(rtnl_rtprot_tab[i], arg) == 0) {
-			cache = rtnl_rtprot_tab[i];
-			res = i;
-			*id = res;
-			return 0;
-		}
-	}
-
 	res = strtoul(arg, &end, 0);
 	if (!end || end == arg || *end || res > 255)
 		return -1;
@@ -183,64 +411,47 @@ int rtnl_rtprot_a2n(__u32 *id, char *arg)
 
 
 
-static char * rtnl_rtscope_tab[256] = {
-	"global",
+static const struct rtnl_db_dflt rtnl_rtscope_dflt[] = {
+	{ 0, "global" },
+	{ 255, "nowhere" },
+	{ 254, "host" },
+	{ 253, "link" },
+	{ 200, "site" },
+	{ 0, NULL }
 };
 
-static int rtnl_rtscope_init;
-
-static void rtnl_rtscope_initialize(void)
-{
-	rtnl_rtscope_init = 1;
-	rtnl_rtscope_tab[255] = "nowhere";
-	rtnl_rtscope_tab[254] = "host";
-	rtnl_rtscope_tab[253] = "link";
-	rtnl_rtscope_tab[200] = "site";
-	rtnl_tab_initialize("/etc/iproute2/rt_scopes",
-			    rtnl_rtscope_tab, 256);
-}
+static struct rtnl_db rtnl_rtscope_db = {
+	.file = "/etc/iproute2/rt_scopes",
+	.max = 255,
+	.dflt = rtnl_rtscope_dflt,
+};
 
 char * rtnl_rtscope_n2a(int id, char *buf, int len)
 {
+	char *name;
+
 	if (id<0 || id>=256) {
 		snprintf(buf, len, "%d", id);
 		return buf;
 	}
-	if (!rtnl_rtscope_tab[id]) {
-		if (!rtnl_rtscope_init)
-			rtnl_rtscope_initialize();
-	}
-	if (rtnl_rtscope_tab[id])
-		return rtnl_rtscope_tab[id];
+	name = rtnl_db_n2a(&rtnl_rtscope_db, id);
+	if (name)
+		return name;
 	snprintf(buf, len, "%d", id);
 	return buf;
 }
 
 int rtnl_rtscope_a2n(__u32 *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
+	unsigned long res;
+	unsigned int i;
 	char *end;
-	int i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_rtscope_db, arg, &i) == 0) {
+		*id = i;
 		return 0;
 	}
 
-	if (!rtnl_rtscope_init)
-		rtnl_rtscope_initialize();
-
-	for (i=0; i<256; i++) {
-		if (rtnl_rtscope_tab[i] &&
-		    strcmp(rtnl_rtscope_tab[i], arg) == 0) {
-			cache = rtnl_rtscope_tab[i];
-			res = i;
-			*id = res;
-			return 0;
-		}
-	}
-
 	res = strtoul(arg, &end, 0);
 	if (!end || end == arg || *end || res > 255)
 		return -1;
@@ -250,31 +461,28 @@ int rtnl_rtscope_a2n(__u32 *id, char *arg)
 
 
 
-static char * rtnl_rtrealm_tab[256] = {
-	"unknown",
+static const struct rtnl_db_dflt rtnl_rtrealm_dflt[] = {
+	{ 0, "unknown" },
+	{ 0, NULL }
 };
 
-static int rtnl_rtrealm_init;
-
-static void rtnl_rtrealm_initialize(void)
-{
-	rtnl_rtrealm_init = 1;
-	rtnl_tab_initialize("/etc/iproute2/rt_realms",
-			    rtnl_rtrealm_tab, 256);
-}
+static struct rtnl_db rtnl_rtrealm_db = {
+	.file = "/etc/iproute2/rt_realms",
+	.max = 255,
+	.dflt = rtnl_rtrealm_dflt,
+};
 
 char * rtnl_rtrealm_n2a(int id, char *buf, int len)
 {
+	char *name;
+
 	if (id<0 || id>=256) {
 		snprintf(buf, len, "%d", id);
 		return buf;
 	}
-	if (!rtnl_rtrealm_tab[id]) {
-		if (!rtnl_rtrealm_init)
-			rtnl_rtrealm_initialize();
-	}
-	if (rtnl_rtrealm_tab[id])
-		return rtnl_rtrealm_tab[id];
+	name = rtnl_db_n2a(&rtnl_rtrealm_db, id);
+	if (name)
+		return name;
 	snprintf(buf, len, "%d", id);
 	return buf;
 }
@@ -282,29 +490,15 @@ char * rtnl_rtrealm_n2a(int id, char *buf, int len)
 
 int rtnl_rtrealm_a2n(__u32 *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
+	unsigned long res;
+	unsigned int i;
 	char *end;
-	int i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_rtrealm_db, arg, &i) == 0) {
+		*id = i;
 		return 0;
 	}
 
-	if (!rtnl_rtrealm_init)
-		rtnl_rtrealm_initialize();
-
-	for (i=0; i<256; i++) {
-		if (rtnl_rtrealm_tab[i] &&
-		    strcmp(rtnl_rtrealm_tab[i], arg) == 0) {
-			cache = rtnl_rtrealm_tab[i];
-			res = i;
-			*id = res;
-			return 0;
-		}
-	}
-
 	res = strtoul(arg, &end, 0);
 	if (!end || end == arg || *end || res > 255)
 		return -1;
@@ -313,72 +507,44 @@ int rtnl_rtrealm_a2n(__u32 *id, char *arg)
 }
 
 
-static struct rtnl_hash_entry dflt_table_entry  = { .id = 253, .name = "default" };
-static struct rtnl_hash_entry main_table_entry  = { .id = 254, .name = "main" };
-static struct rtnl_hash_entry local_table_entry = { .id = 255, .name = "local" };
-
-static struct rtnl_hash_entry * rtnl_rttable_hash[256] = {
-	[253] = &dflt_table_entry,
-	[254] = &main_table_entry,
-	[255] = &local_table_entry,
+static const struct rtnl_db_dflt rtnl_rttable_dflt[] = {
+	{ 253, "default" },
+	{ 254, "main" },
+	{ 255, "local" },
+	{ 0, NULL }
 };
 
-static int rtnl_rttable_init;
-
-static void rtnl_rttable_initialize(void)
-{
-	rtnl_rttable_init = 1;
-	rtnl_hash_initialize("/etc/iproute2/rt_tables",
-			     rtnl_rttable_hash, 256);
-}
+static struct rtnl_db rtnl_rttable_db = {
+	.file = "/etc/iproute2/rt_tables",
+	.max = RT_TABLE_MAX,
+	.dflt = rtnl_rttable_dflt,
+};
 
 char * rtnl_rttable_n2a(__u32 id, char *buf, int len)
 {
-	struct rtnl_hash_entry *entry;
+	char *name;
 
 	if (id > RT_TABLE_MAX) {
 		snprintf(buf, len, "%u", id);
 		return buf;
 	}
-	if (!rtnl_rttable_init)
-		rtnl_rttable_initialize();
-	entry = rtnl_rttable_hash[id & 255];
-	while (entry && entry->id != id)
-		entry = entry->next;
-	if (entry)
-		return entry->name;
+	name = rtnl_db_n2a(&rtnl_rttable_db, id);
+	if (name)
+		return name;
 	snprintf(buf, len, "%u", id);
 	return buf;
 }
 
 int rtnl_rttable_a2n(__u32 *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
-	struct rtnl_hash_entry *entry;
+	unsigned int i;
 	char *end;
-	__u32 i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_rttable_db, arg, &i) == 0) {
+		*id = i;
 		return 0;
 	}
 
-	if (!rtnl_rttable_init)
-		rtnl_rttable_initialize();
-
-	for (i=0; i<256; i++) {
-		entry = rtnl_rttable_hash[i];
-		while (entry && strcmp(entry->name, arg))
-			entry = entry->next;
-		if (entry) {
-			cache = entry->name;
-			res = entry->id;
-			*id = res;
-			return 0;
-		}
-	}
-
 	i = strtoul(arg, &end, 0);
 	if (!end || end == arg || *end || i > RT_TABLE_MAX)
 		return -1;
@@ -387,31 +553,28 @@ int rtnl_rttable_a2n(__u32 *id, char *arg)
 }
 
 
-static char * rtnl_rtdsfield_tab[256] = {
-	"0",
+static const struct rtnl_db_dflt rtnl_rtdsfield_dflt[] = {
+	{ 0, "0" },
+	{ 0, NULL }
 };
 
-static int rtnl_rtdsfield_init;
-
-static void rtnl_rtdsfield_initialize(void)
-{
-	rtnl_rtdsfield_init = 1;
-	rtnl_tab_initialize("/etc/iproute2/rt_dsfield",
-			    rtnl_rtdsfield_tab, 256);
-}
+static struct rtnl_db rtnl_rtdsfield_db = {
+	.file = "/etc/iproute2/rt_dsfield",
+	.max = 255,
+	.dflt = rtnl_rtdsfield_dflt,
+};
 
 char * rtnl_dsfield_n2a(int id, char *buf, int len)
 {
+	char *name;
+
 	if (id<0 || id>=256) {
 		snprintf(buf, len, "%d", id);
 		return buf;
 	}
-	if (!rtnl_rtdsfield_tab[id]) {
-		if (!rtnl_rtdsfield_init)
-			rtnl_rtdsfield_initialize();
-	}
-	if (rtnl_rtdsfield_tab[id])
-		return rtnl_rtdsfield_tab[id];
+	name = rtnl_db_n2a(&rtnl_rtdsfield_db, id);
+	if (name)
+		return name;
 	snprintf(buf, len, "0x%02x", id);
 	return buf;
 }
@@ -419,29 +582,15 @@ char * rtnl_dsfield_n2a(int id, char *buf, int len)
 
 int rtnl_dsfield_a2n(__u32 *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
+	unsigned long res;
+	unsigned int i;
 	char *end;
-	int i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_rtdsfield_db, arg, &i) == 0) {
+		*id = i;
 		return 0;
 	}
 
-	if (!rtnl_rtdsfield_init)
-		rtnl_rtdsfield_initialize();
-
-	for (i=0; i<256; i++) {
-		if (rtnl_rtdsfield_tab[i] &&
-		    strcmp(rtnl_rtdsfield_tab[i], arg) == 0) {
-			cache = rtnl_rtdsfield_tab[i];
-			res = i;
-			*id = res;
-			return 0;
-		}
-	}
-
 	res = strtoul(arg, &end, 16);
 	if (!end || end == arg || *end || res > 255)
 		return -1;
@@ -450,49 +599,28 @@ int rtnl_dsfield_a2n(__u32 *id, char *arg)
 }
 
 
-static struct rtnl_hash_entry dflt_group_entry  = { .id = 0, .name = "default" };
-
-static struct rtnl_hash_entry * rtnl_group_hash[256] = {
-	[0] = &dflt_group_entry,
+static const struct rtnl_db_dflt rtnl_group_dflt[] = {
+	{ 0, "default" },
+	{ 0, NULL }
 };
 
-static int rtnl_group_init;
-
-static void rtnl_group_initialize(void)
-{
-	rtnl_group_init = 1;
-	rtnl_hash_initialize("/etc/iproute2/group",
-			     rtnl_group_hash, 256);
-}
+static struct rtnl_db rtnl_group_db = {
+	.file = "/etc/iproute2/group",
+	.max = INT_MAX,
+	.dflt = rtnl_group_dflt,
+};
 
 int rtnl_group_a2n(int *id, char *arg)
 {
-	static char *cache = NULL;
-	static unsigned long res;
-	struct rtnl_hash_entry *entry;
+	unsigned int u;
 	char *end;
 	int i;
 
-	if (cache && strcmp(cache, arg) == 0) {
-		*id = res;
+	if (rtnl_db_a2n(&rtnl_group_db, arg, &u) == 0) {
+		*id = u;
 		return 0;
 	}
 
-	if (!rtnl_group_init)
-		rtnl_group_initialize();
-
-	for (i=0; i<256; i++) {
-		entry = rtnl_group_hash[i];
-		while (entry && strcmp(entry->name, arg))
-			entry = entry->next;
-		if (entry) {
-			cache = entry->name;
-			res = entry->id;
-			*id = res;
-			return 0;
-		}
-	}
-
 	i = strtol(arg, &end, 0);
 	if (!end || end == arg || *end || i < 0)
 		return -1;
@@ -16,8 +16,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <netdb.h>
-#include <db_185.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/poll.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -39,28 +40,77 @@
 
 int resolve_hosts;
 
-DB	*dbase;
 char	*dbname = "/var/lib/arpd/arpd.db";
 
 int	ifnum;
 int	*ifvec;
 char	**ifnames;
 
-struct dbkey
+/*
+ * The database is a file of fixed size records, hashed by (ifindex, addr)
+ * with linear probing, and used in place through a shared mapping: a
+ * lookup is a few memory reads, an update a few stores.  Pages written
+ * since the last pass are pushed to disk a few at a time from the main
+ * loop, which polls with a short timeout while any are left, and in full
+ * on SIGHUP and at exit.  The table is rebuilt into a fresh file when it
+ * gets three quarters full of live entries and tombstones, twice as large
+ * if the live entries alone fill half of it.
+ */
+
+#define ARPDB_MAGIC	"ARPDTBL1"
+#define ARPDB_HDRSZ	4096
+#define ARPDB_MINSLOTS	4096
+#define ARPDB_LLMAX	16
+#define ARPDB_FLUSH	64	/* pages written back per loop iteration */
+
+enum {
+	ARPDB_EMPTY,
+	ARPDB_VALID,
+	ARPDB_NEG,
+	ARPDB_DEAD,		/* deleted, keeps probe chains intact */
+};
+
+struct arpdb_hdr
+{
+	char	magic[8];
+	__u32	rec_size;
+	__u32	nslots;
+	__u32	count;		/* valid and negative entries */
+	__u32	used;		/* count plus tombstones */
+	__u32	clean;		/* closed properly, counters can be trusted */
+};
+
+struct arpdb_rec
 {
 	__u32	iface;
 	__u32	addr;
+	__u8	state;
+	__u8	neg_cnt;	/* probes sent since the entry went negative */
+	__u8	hlen;
+	__u8	pad;
+	__u32	stamp;		/* when the host was last found dead */
+	__u8	lladdr[ARPDB_LLMAX];
 };
 
-#define IS_NEG(x)	(((__u8*)(x))[0] == 0xFF)
-#define NEG_TIME(x)	(((x)[2]<<24)|((x)[3]<<16)|((x)[4]<<8)|(x)[5])
-#define NEG_AGE(x)	((__u32)time(NULL) - NEG_TIME((__u8*)x))
-#define NEG_VALID(x)	(NEG_AGE(x) < negative_timeout)
-#define NEG_CNT(x)	(((__u8*)(x))[1])
+struct arpdb_hdr *db_hdr;
+struct arpdb_rec *db_tab;
+size_t	db_size;
+int	db_fd = -1;
+int	db_rdonly;
+__u8	*db_dirty;
+unsigned db_ndirty;
+unsigned db_cursor;
+time_t	db_retry;	/* no rebuild attempts before this */
+long	db_pgsz;
+
+#define IS_NEG(r)	((r)->state == ARPDB_NEG)
+#define NEG_AGE(r)	((__u32)time(NULL) - (r)->stamp)
+#define NEG_VALID(r)	(NEG_AGE(r) < negative_timeout)
 
 struct rtnl_handle rth;
 
-struct pollfd pset[2];
+struct pollfd pset[3];
+int npset = 2;
 int udp_sock = -1;
 
 volatile int do_exit;
@@ -176,52 +226,225 @@ void undo_sysctl_adjustments(void)
 }
 
 
+/*
+ * Probes are built from a cache of link types, hardware addresses and
+ * IPv4 addresses, loaded with one dump of each and then kept current
+ * from RTMGRP_LINK and RTMGRP_IPV4_IFADDR events, rather than asked for
+ * with several system calls per probe.
+ */
+
+#define IFINFO_HASH	256
+
+struct ifinfo
+{
+	struct ifinfo	*next;
+	int		ifindex;
+	int		type;
+	int		hlen;
+	__u8		hwaddr[ARPDB_LLMAX];
+	int		naddr;
+	struct ifinfo_addr {
+		__u32	addr;
+		__u32	mask;
+		int	secondary;
+	}		*addr;
+};
+
+struct ifinfo *ifinfo_hash[IFINFO_HASH];
+struct rtnl_handle lrth = { .fd = -1 };
+time_t	ifinfo_retry;	/* no reload attempts before this */
+
+struct ifinfo *ifinfo_get(int ifindex, int create)
+{
+	struct ifinfo **ip = &ifinfo_hash[ifindex & (IFINFO_HASH - 1)];
+	struct ifinfo *i;
+
+	for (i = *ip; i; i = i->next)
+		if (i->ifindex == ifindex)
+			return i;
+	if (!create || (i = calloc(1, sizeof(*i))) == NULL)
+		return NULL;
+	i->ifindex = ifindex;
+	i->next = *ip;
+	*ip = i;
+	return i;
+}
+
+void ifinfo_del(int ifindex)
+{
+	struct ifinfo **ip = &ifinfo_hash[ifindex & (IFINFO_HASH - 1)];
+	struct ifinfo *i;
+
+	for (; (i = *ip) != NULL; ip = &i->next) {
+		if (i->ifindex == ifindex) {
+			*ip = i->next;
+			free(i->addr);
+			free(i);
+			return;
+		}
+	}
+}
+
+int ifinfo_update(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
+{
+	if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK) {
+		struct ifinfomsg *ifi = NLMSG_DATA(n);
+		struct rtattr *tb[IFLA_MAX+1];
+		int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+		struct ifinfo *i;
+
+		if (len < 0)
+			return 0;
+		if (n->nlmsg_type == RTM_DELLINK) {
+			ifinfo_del(ifi->ifi_index);
+			return 0;
+		}
+		if ((i = ifinfo_get(ifi->ifi_index, 1)) == NULL)
+			return 0;
+		parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
+		i->type = ifi->ifi_type;
+		i->hlen = 0;
+		if (tb[IFLA_ADDRESS] && RTA_PAYLOAD(tb[IFLA_ADDRESS]) <= ARPDB_LLMAX) {
+			i->hlen = RTA_PAYLOAD(tb[IFLA_ADDRESS]);
+			memcpy(i->hwaddr, RTA_DATA(tb[IFLA_ADDRESS]), i->hlen);
+		}
+	} else if (n->nlmsg_type == RTM_NEWADDR || n->nlmsg_type == RTM_DELADDR) {
+		struct ifaddrmsg *ifa = NLMSG_DATA(n);
+		struct rtattr *tb[IFA_MAX+1];
+		int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+		struct ifinfo *i;
+		__u32 addr;
+		int k;
+
+		if (len < 0 || ifa->ifa_family != AF_INET)
+			return 0;
+		parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), len);
+		if (!tb[IFA_LOCAL])
+			tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+		if (!tb[IFA_LOCAL] || RTA_PAYLOAD(tb[IFA_LOCAL]) != 4)
+			return 0;
+		memcpy(&addr, RTA_DATA(tb[IFA_LOCAL]), 4);
+
+		if ((i = ifinfo_get(ifa->ifa_index, n->nlmsg_type == RTM_NEWADDR)) == NULL)
+			return 0;
+		for (k = 0; k < i->naddr; k++)
+			if (i->addr[k].addr == addr)
+				break;
+		if (n->nlmsg_type == RTM_DELADDR) {
+			if (k < i->naddr)
+				i->addr[k] = i->addr[--i->naddr];
+			return 0;
+		}
+		if (k == i->naddr) {
+			struct ifinfo_addr *a;
+
+			a = realloc(i->addr, (i->naddr + 1) * sizeof(*a));
+			if (a == NULL)
+				return 0;
+			i->addr = a;
+			i->naddr++;
+		}
+		i->addr[k].addr = addr;
+		i->addr[k].mask = ifa->ifa_prefixlen ?
+			htonl(~0U << (32 - ifa->ifa_prefixlen)) : 0;
+		i->addr[k].secondary = !!(ifa->ifa_flags & IFA_F_SECONDARY);
+	}
+	return 0;
+}
+
+int ifinfo_load(void)
+{
+	int i;
+
+	for (i = 0; i < IFINFO_HASH; i++)
+		while (ifinfo_hash[i])
+			ifinfo_del(ifinfo_hash[i]->ifindex);
+	if (lrth.fd >= 0)
+		rtnl_close(&lrth);
+	if (rtnl_open(&lrth, RTMGRP_LINK|RTMGRP_IPV4_IFADDR) < 0 ||
+	    rtnl_wilddump_request(&lrth, AF_UNSPEC, RTM_GETLINK) < 0 ||
+	    rtnl_dump_filter(&lrth, ifinfo_update, NULL, NULL, NULL) < 0 ||
+	    rtnl_wilddump_request(&lrth, AF_INET, RTM_GETADDR) < 0 ||
+	    rtnl_dump_filter(&lrth, ifinfo_update, NULL, NULL, NULL) < 0) {
+		if (lrth.fd >= 0)
+			rtnl_close(&lrth);
+		lrth.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* On failure the socket is left out of the poll set and the main loop
+ * tries again a second later; probes go without a source meanwhile.
+ */
+void ifinfo_reload(void)
+{
+	if (ifinfo_load() < 0) {
+		syslog(LOG_ERR, "cannot reload interface addresses: %m");
+		ifinfo_retry = time(NULL) + 1;
+	}
+	pset[2].fd = lrth.fd;
+}
+
+/* Same choice as the kernel makes for a link scope destination:
+ * a primary address on the subnet of dst, else the first primary one.
+ */
+int ifinfo_source(struct ifinfo *i, __u32 dst, __u32 *src)
+{
+	int k, best = -1, score = -1;
+
+	for (k = 0; k < i->naddr; k++) {
+		struct ifinfo_addr *a = &i->addr[k];
+		int sc;
+
+		if (a->secondary)
+			sc = 0;
+		else
+			sc = ((a->addr ^ dst) & a->mask) == 0 ? 2 : 1;
+		if (sc > score) {
+			score = sc;
+			best = k;
+		}
+	}
+	if (best < 0)
+		return -1;
+	*src = i->addr[best].addr;
+	return 0;
+}
+
 int send_probe(int ifindex, __u32 addr)
 {
-	struct ifreq ifr;
-	struct sockaddr_in dst;
-	socklen_t len;
 	unsigned char buf[256];
 	struct arphdr *ah = (struct arphdr*)buf;
 	unsigned char *p = (unsigned char *)(ah+1);
 	struct sockaddr_ll sll;
+	struct ifinfo *i;
+	__u32 src;
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = ifindex;
-	if (ioctl(udp_sock, SIOCGIFNAME, &ifr))
+	if ((i = ifinfo_get(ifindex, 0)) == NULL)
 		return -1;
-	if (ioctl(udp_sock, SIOCGIFHWADDR, &ifr))
+	if (i->type != ARPHRD_ETHER || i->hlen != 6)
 		return -1;
-	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
-		return -1;
-	if (setsockopt(udp_sock, SOL_SOCKET, SO_BINDTODEVICE, ifr.ifr_name, strlen(ifr.ifr_name)+1) < 0)
-		return -1;
-
-	dst.sin_family = AF_INET;
-	dst.sin_port = htons(1025);
-	dst.sin_addr.s_addr = addr;
-	if (connect(udp_sock, (struct sockaddr*)&dst, sizeof(dst)) < 0)
-		return -1;
-	len = sizeof(dst);
-	if (getsockname(udp_sock, (struct sockaddr*)&dst, &len) < 0)
+	if (ifinfo_source(i, addr, &src))
 		return -1;
 
-	ah->ar_hrd = htons(ifr.ifr_hwaddr.sa_family);
+	ah->ar_hrd = htons(i->type);
 	ah->ar_pro = htons(ETH_P_IP);
 	ah->ar_hln = 6;
 	ah->ar_pln = 4;
 	ah->ar_op  = htons(ARPOP_REQUEST);
 
-	memcpy(p, ifr.ifr_hwaddr.sa_data, ah->ar_hln);
+	memcpy(p, i->hwaddr, ah->ar_hln);
 	p += ah->ar_hln;
 
-	memcpy(p, &dst.sin_addr, 4);
+	memcpy(p, &src, 4);
 	p+=4;
 
 	sll.sll_family = AF_PACKET;
 	memset(sll.sll_addr, 0xFF, sizeof(sll.sll_addr));
 	sll.sll_ifindex = ifindex;
 	sll.sll_protocol = htons(ETH_P_ARP);
+	sll.sll_halen = ah->ar_hln;
 	memcpy(p, &sll.sll_addr, ah->ar_hln);
 	p+=ah->ar_hln;
 
@@ -260,6 +483,20 @@ int queue_active_probe(int ifindex, __u32 addr)
 	return -1;
 }
 
+/* Answers to the kernel are queued and sent a datagram at a time,
+ * once per pass over the sockets or when the buffer fills up.
+ */
+char	nlq[65536];
+int	nlq_len;
+
+void flush_kernel_responses(void)
+{
+	if (nlq_len) {
+		rtnl_send(&rth, nlq, nlq_len);
+		nlq_len = 0;
+	}
+}
+
 int respond_to_kernel(int ifindex, __u32 addr, char *lla, int llalen)
 {
 	struct {
@@ -281,31 +518,346 @@ int respond_to_kernel(int ifindex, __u32 addr, char *lla, int llalen)
 
 	addattr_l(&req.n, sizeof(req), NDA_DST, &addr, 4);
 	addattr_l(&req.n, sizeof(req), NDA_LLADDR, lla, llalen);
-	return rtnl_send(&rth, (char*)&req, req.n.nlmsg_len) <= 0;
+
+	if (nlq_len + NLMSG_ALIGN(req.n.nlmsg_len) > sizeof(nlq))
+		flush_kernel_responses();
+	memcpy(nlq + nlq_len, &req, req.n.nlmsg_len);
+	nlq_len += NLMSG_ALIGN(req.n.nlmsg_len);
+	return 0;
+}
+
+static size_t arpdb_bytes(__u32 nslots)
+{
+	return ARPDB_HDRSZ + (size_t)nslots * sizeof(struct arpdb_rec);
+}
+
+/* The file need not end on a page boundary, count the last partial one */
+static size_t arpdb_npages(size_t size)
+{
+	return (size + db_pgsz - 1) / db_pgsz;
+}
+
+static unsigned arpdb_hash(__u32 iface, __u32 addr)
+{
+	__u32 h = iface * 0x9E3779B1U ^ addr;
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6BU;
+	h ^= h >> 13;
+	return h;
+}
+
+static void arpdb_touch(const void *p)
+{
+	size_t pg = ((const char *)p - (const char *)db_hdr) / db_pgsz;
+
+	if (!db_dirty[pg]) {
+		db_dirty[pg] = 1;
+		db_ndirty++;
+	}
+}
+
+/* Start writeback of up to max dirty pages, all of them if max is 0 */
+void arpdb_flush(unsigned max)
+{
+	unsigned npages = arpdb_npages(db_size);
+	unsigned n = 0;
+
+	while (db_ndirty && (max == 0 || n < max)) {
+		unsigned pg = db_cursor, run = 0;
+
+		while (pg + run < npages && db_dirty[pg + run]) {
+			db_dirty[pg + run] = 0;
+			run++;
+		}
+		if (run) {
+			sync_file_range(db_fd, (off_t)pg * db_pgsz,
+					(off_t)run * db_pgsz,
+					SYNC_FILE_RANGE_WRITE);
+			db_ndirty -= run;
+			n += run;
+		}
+		db_cursor = pg + run + 1;
+		if (db_cursor >= npages)
+			db_cursor = 0;
+	}
+}
+
+void arpdb_sync(void)
+{
+	if (db_ndirty) {
+		memset(db_dirty, 0, arpdb_npages(db_size));
+		db_ndirty = 0;
+		msync(db_hdr, db_size, MS_SYNC);
+	}
+}
+
+static int arpdb_map(int fd, size_t size)
+{
+	int prot = db_rdonly ? PROT_READ : PROT_READ|PROT_WRITE;
+	void *p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	__u8 *dirty;
+
+	if (p == MAP_FAILED)
+		return -1;
+	if ((dirty = calloc(arpdb_npages(size), 1)) == NULL) {
+		munmap(p, size);
+		return -1;
+	}
+	if (db_hdr) {
+		munmap(db_hdr, db_size);
+		close(db_fd);
+		free(db_dirty);
+	}
+	db_hdr = p;
+	db_tab = (struct arpdb_rec *)((char *)p + ARPDB_HDRSZ);
+	db_size = size;
+	db_fd = fd;
+	db_dirty = dirty;
+	db_ndirty = 0;
+	db_cursor = 0;
+	return 0;
+}
+
+static struct arpdb_rec *arpdb_slot(struct arpdb_rec *tab, __u32 nslots,
+				    __u32 iface, __u32 addr, int create)
+{
+	unsigned mask = nslots - 1;
+	unsigned i = arpdb_hash(iface, addr) & mask;
+	struct arpdb_rec *tomb = NULL;
+
+	for (;; i = (i + 1) & mask) {
+		struct arpdb_rec *r = &tab[i];
+
+		if (r->state == ARPDB_EMPTY)
+			return create ? (tomb ? : r) : NULL;
+		if (r->state == ARPDB_DEAD) {
+			if (!tomb)
+				tomb = r;
+		} else if (r->iface == iface && r->addr == addr) {
+			return r;
+		}
+	}
+}
+
+/* Rebuild the table into name.new with nslots slots and rename it over */
+static int arpdb_rehash(__u32 nslots)
+{
+	char tmp[PATH_MAX];
+	struct arpdb_hdr *h;
+	struct arpdb_rec *tab;
+	size_t size = arpdb_bytes(nslots);
+	__u32 i;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.new", dbname);
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) ||
+	    (h = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	tab = (struct arpdb_rec *)((char *)h + ARPDB_HDRSZ);
+	memcpy(h->magic, ARPDB_MAGIC, sizeof(h->magic));
+	h->rec_size = sizeof(struct arpdb_rec);
+	h->nslots = nslots;
+	for (i = 0; db_hdr && i < db_hdr->nslots; i++) {
+		struct arpdb_rec *r = &db_tab[i];
+
+		if (r->state != ARPDB_VALID && r->state != ARPDB_NEG)
+			continue;
+		*arpdb_slot(tab, nslots, r->iface, r->addr, 1) = *r;
+		h->count++;
+	}
+	h->used = h->count;
+	if (msync(h, size, MS_SYNC) || rename(tmp, dbname)) {
+		munmap(h, size);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	munmap(h, size);
+	if (arpdb_map(fd, size)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read only opens leave a missing or empty database alone, db_hdr stays NULL */
+int arpdb_open(int rdonly)
+{
+	struct arpdb_hdr *h;
+	struct stat st;
+	__u32 i;
+	int fd;
+
+	db_pgsz = sysconf(_SC_PAGESIZE);
+	db_rdonly = rdonly;
+
+	fd = open(dbname, rdonly ? O_RDONLY : O_RDWR|O_CREAT, 0644);
+	if (fd < 0 && rdonly && errno == ENOENT)
+		return 0;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(dbname);
+		return -1;
+	}
+	/* The table is replaced by name when it grows, after daemon()
+	 * has moved us to the root directory.
+	 */
+	if (!rdonly && dbname[0] != '/') {
+		char *path = realpath(dbname, NULL);
+
+		if (path)
+			dbname = path;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		if (rdonly)
+			return 0;
+		if (arpdb_rehash(ARPDB_MINSLOTS)) {
+			perror(dbname);
+			return -1;
+		}
+		h = db_hdr;
+	} else {
+		if (st.st_size < ARPDB_HDRSZ || arpdb_map(fd, st.st_size)) {
+			fprintf(stderr, "%s: not an arpd database\n", dbname);
+			close(fd);
+			return -1;
+		}
+		h = db_hdr;
+		if (memcmp(h->magic, ARPDB_MAGIC, sizeof(h->magic)) ||
+		    h->rec_size != sizeof(struct arpdb_rec) ||
+		    h->nslots == 0 || (h->nslots & (h->nslots - 1)) ||
+		    arpdb_bytes(h->nslots) != db_size) {
+			fprintf(stderr, "%s: not an arpd database\n", dbname);
+			return -1;
+		}
+		if (rdonly)
+			return 0;
+	}
+
+	/* Counters may be behind after a crash, recount them once */
+	if (!h->clean) {
+		h->count = h->used = 0;
+		for (i = 0; i < h->nslots; i++) {
+			if (db_tab[i].state == ARPDB_EMPTY)
+				continue;
+			h->used++;
+			if (db_tab[i].state != ARPDB_DEAD)
+				h->count++;
+		}
+	}
+	h->clean = 0;
+	msync(h, ARPDB_HDRSZ, MS_SYNC);
+	return 0;
+}
+
+void arpdb_close(void)
+{
+	if (!db_hdr)
+		return;
+	if (!db_rdonly) {
+		arpdb_sync();
+		db_hdr->clean = 1;
+		msync(db_hdr, ARPDB_HDRSZ, MS_SYNC);
+	}
+	munmap(db_hdr, db_size);
+	close(db_fd);
+	db_hdr = NULL;
+}
+
+struct arpdb_rec *arpdb_lookup(__u32 iface, __u32 addr)
+{
+	return arpdb_slot(db_tab, db_hdr->nslots, iface, addr, 0);
+}
+
+/* Find or add the entry.  May rebuild the table, which moves every entry. */
+struct arpdb_rec *arpdb_insert(__u32 iface, __u32 addr)
+{
+	struct arpdb_rec *r;
+
+	if ((db_hdr->used + 1) * 4 > db_hdr->nslots * 3 &&
+	    time(NULL) >= db_retry) {
+		__u32 nslots = db_hdr->nslots;
+
+		/* Grow only if it is the live entries that fill it */
+		if ((db_hdr->count + 1) * 2 > nslots)
+			nslots *= 2;
+		if (arpdb_rehash(nslots)) {
+			syslog(LOG_ERR, "cannot rebuild %s: %m", dbname);
+			db_retry = time(NULL) + 1;
+		}
+	}
+	/* Keep an empty slot, probing stops at one */
+	if (db_hdr->used + 1 >= db_hdr->nslots)
+		return NULL;
+	r = arpdb_slot(db_tab, db_hdr->nslots, iface, addr, 1);
+	if (r->state == ARPDB_EMPTY || r->state == ARPDB_DEAD) {
+		if (r->state == ARPDB_EMPTY)
+			db_hdr->used++;
+		db_hdr->count++;
+		arpdb_touch(db_hdr);
+		r->iface = iface;
+		r->addr = addr;
+		r->state = ARPDB_VALID;
+		r->hlen = 0;
+	}
+	return r;
+}
+
+void arpdb_delete(struct arpdb_rec *r)
+{
+	r->state = ARPDB_DEAD;
+	db_hdr->count--;
+	arpdb_touch(r);
+	arpdb_touch(db_hdr);
+}
+
+int arpdb_store(__u32 iface, __u32 addr, const void *lla, int llalen)
+{
+	struct arpdb_rec *r;
+
+	if (llalen > ARPDB_LLMAX || (r = arpdb_insert(iface, addr)) == NULL)
+		return -1;
+	r->state = ARPDB_VALID;
+	r->neg_cnt = 0;
+	r->hlen = llalen;
+	memcpy(r->lladdr, lla, llalen);
+	arpdb_touch(r);
+	return 0;
 }
 
-void prepare_neg_entry(__u8 *ndata, __u32 stamp)
+int arpdb_store_neg(__u32 iface, __u32 addr, __u32 stamp)
 {
-	ndata[0] = 0xFF;
-	ndata[1] = 0;
-	ndata[2] = stamp>>24;
-	ndata[3] = stamp>>16;
-	ndata[4] = stamp>>8;
-	ndata[5] = stamp;
+	struct arpdb_rec *r;
+
+	if ((r = arpdb_insert(iface, addr)) == NULL)
+		return -1;
+	r->state = ARPDB_NEG;
+	r->neg_cnt = 0;
+	r->hlen = 0;
+	r->stamp = stamp;
+	arpdb_touch(r);
+	return 0;
 }
 
 
-int do_one_request(struct nlmsghdr *n)
+int do_one_request(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 {
 	struct ndmsg *ndm = NLMSG_DATA(n);
 	int len = n->nlmsg_len;
 	struct rtattr * tb[NDA_MAX+1];
-	struct dbkey key;
-	DBT dbkey, dbdat;
+	struct arpdb_rec *r;
+	__u32 iface, addr;
 	int do_acct = 0;
 
 	if (n->nlmsg_type == NLMSG_DONE) {
-		dbase->sync(dbase, 0);
+		arpdb_sync();
 
 		/* Now we have at least mirror of kernel db, so that
 		 * may start real resolution.
@@ -333,15 +885,9 @@ int do_one_request(struct nlmsghdr *n)
 	if (!tb[NDA_DST])
 		return 0;
 
-	key.iface = ndm->ndm_ifindex;
-	memcpy(&key.addr, RTA_DATA(tb[NDA_DST]), 4);
-	dbkey.data = &key;
-	dbkey.size = sizeof(key);
-
-	if (dbase->get(dbase, &dbkey, &dbdat, 0) != 0) {
-		dbdat.data = 0;
-		dbdat.size = 0;
-	}
+	iface = ndm->ndm_ifindex;
+	memcpy(&addr, RTA_DATA(tb[NDA_DST]), 4);
+	r = arpdb_lookup(iface, addr);
 
 	if (n->nlmsg_type == RTM_GETNEIGH) {
 		if (!(n->nlmsg_flags&NLM_F_REQUEST))
@@ -359,24 +905,25 @@ int do_one_request(struct nlmsghdr *n)
 			 * Kernel is going to initiate broadcast resolution.
 			 * OK, we invalidate our information as well.
 			 */
-			if (dbdat.data && !IS_NEG(dbdat.data))
-				stats.app_neg++;
-
-			dbase->del(dbase, &dbkey, 0);
+			if (r) {
+				if (!IS_NEG(r))
+					stats.app_neg++;
+				arpdb_delete(r);
+			}
 		} else {
 			/* If we get this kernel does not have any information.
 			 * If we have something tell this to kernel. */
 			stats.app_recv++;
-			if (dbdat.data && !IS_NEG(dbdat.data)) {
+			if (r && !IS_NEG(r)) {
 				stats.app_success++;
-				respond_to_kernel(key.iface, key.addr, dbdat.data, dbdat.size);
+				respond_to_kernel(iface, addr, (char*)r->lladdr, r->hlen);
 				return 0;
 			}
 
 			/* Sheeit! We have nothing to tell. */
 			/* If we have recent negative entry, be silent. */
-			if (dbdat.data && NEG_VALID(dbdat.data)) {
-				if (NEG_CNT(dbdat.data) >= active_probing) {
+			if (r && NEG_VALID(r)) {
+				if (r->neg_cnt >= active_probing) {
 					stats.app_suppressed++;
 					return 0;
 				}
@@ -385,10 +932,10 @@ int do_one_request(struct nlmsghdr *n)
 		}
 
 		if (active_probing &&
-		    queue_active_probe(ndm->ndm_ifindex, key.addr) == 0 &&
+		    queue_active_probe(ndm->ndm_ifindex, addr) == 0 &&
 		    do_acct) {
-			NEG_CNT(dbdat.data)++;
-			dbase->put(dbase, &dbkey, &dbdat, 0);
+			r->neg_cnt++;
+			arpdb_touch(r);
 		}
 	} else if (n->nlmsg_type == RTM_NEWNEIGH) {
 		if (n->nlmsg_flags&NLM_F_REQUEST)
@@ -398,27 +945,21 @@ int do_one_request(struct nlmsghdr *n)
 			/* Kernel was not able to resolve. Host is dead.
 			 * Create negative entry if it is not present
 			 * or renew it if it is too old. */
-			if (!dbdat.data ||
-			    !IS_NEG(dbdat.data) ||
-			    !NEG_VALID(dbdat.data)) {
-				__u8 ndata[6];
+			if (!r || !IS_NEG(r) || !NEG_VALID(r)) {
 				stats.kern_neg++;
-				prepare_neg_entry(ndata, time(NULL));
-				dbdat.data = ndata;
-				dbdat.size = sizeof(ndata);
-				dbase->put(dbase, &dbkey, &dbdat, 0);
+				arpdb_store_neg(iface, addr, time(NULL));
 			}
 		} else if (tb[NDA_LLADDR]) {
-			if (dbdat.data && !IS_NEG(dbdat.data)) {
-				if (memcmp(RTA_DATA(tb[NDA_LLADDR]), dbdat.data, dbdat.size) == 0)
+			if (r && !IS_NEG(r)) {
+				if (r->hlen == RTA_PAYLOAD(tb[NDA_LLADDR]) &&
+				    memcmp(RTA_DATA(tb[NDA_LLADDR]), r->lladdr, r->hlen) == 0)
 					return 0;
 				stats.kern_change++;
 			} else {
 				stats.kern_new++;
 			}
-			dbdat.data = RTA_DATA(tb[NDA_LLADDR]);
-			dbdat.size = RTA_PAYLOAD(tb[NDA_LLADDR]);
-			dbase->put(dbase, &dbkey, &dbdat, 0);
+			arpdb_store(iface, addr, RTA_DATA(tb[NDA_LLADDR]),
+				    RTA_PAYLOAD(tb[NDA_LLADDR]));
 		}
 	}
 	return 0;
@@ -429,13 +970,18 @@ void load_initial_table(void)
 	rtnl_wilddump_request(&rth, AF_INET, RTM_GETNEIGH);
 }
 
-void get_kern_msg(void)
+#define KERN_BATCH	64	/* netlink datagrams read per wakeup */
+#define ARP_BATCH	64	/* packets per recvmmsg() */
+#define ARP_ROUNDS	16	/* recvmmsg() calls per wakeup */
+
+/* Read what is queued on a netlink socket, up to KERN_BATCH datagrams */
+void get_kern_msg(struct rtnl_handle *rh, rtnl_filter_t handler)
 {
-	int status;
+	static char buf[32768];
+	int status, round;
 	struct nlmsghdr *h;
 	struct sockaddr_nl nladdr;
 	struct iovec iov;
-	char   buf[8192];
 	struct msghdr msg = {
 		(void*)&nladdr, sizeof(nladdr),
 		&iov,	1,
@@ -443,57 +989,101 @@ void get_kern_msg(void)
 		0
 	};
 
-	memset(&nladdr, 0, sizeof(nladdr));
+	for (round = 0; round < KERN_BATCH; round++) {
+		memset(&nladdr, 0, sizeof(nladdr));
+		msg.msg_namelen = sizeof(nladdr);
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
 
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
+		status = recvmsg(rh->fd, &msg, MSG_DONTWAIT);
 
-	status = recvmsg(rth.fd, &msg, MSG_DONTWAIT);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Link and address events were lost, start over */
+			if (errno == ENOBUFS && rh == &lrth) {
+				ifinfo_reload();
+				return;
+			}
+			if (errno == ENOBUFS)
+				continue;
+			return;
+		}
+		if (status == 0)
+			return;
 
-	if (status <= 0)
-		return;
+		if (msg.msg_namelen != sizeof(nladdr))
+			continue;
 
-	if (msg.msg_namelen != sizeof(nladdr))
-		return;
+		if (nladdr.nl_pid)
+			continue;
 
-	if (nladdr.nl_pid)
-		return;
+		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
+			int len = h->nlmsg_len;
+			int l = len - sizeof(*h);
 
-	for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
-		int len = h->nlmsg_len;
-		int l = len - sizeof(*h);
+			if (l < 0 || len > status)
+				break;
 
-		if (l < 0 || len > status)
-			return;
+			if (handler(&nladdr, h, NULL) < 0)
+				break;
 
-		if (do_one_request(h) < 0)
-			return;
+			status -= NLMSG_ALIGN(len);
+			h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
+		}
+	}
+}
 
-		status -= NLMSG_ALIGN(len);
-		h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
+/* Only pass IPv4 requests and replies with a sender address, from one of
+ * the interfaces watched.  get_arp_pkt() still checks everything itself.
+ */
+int attach_arp_filter(int fd)
+{
+	struct sock_filter f[48];
+	struct sock_fprog prog;
+	int nif = (ifnum > 1 && ifnum <= 32) ? ifnum : 0;
+	int len = 11 + (nif ? nif + 1 : 0) + 2;
+	int accept = len - 2, drop = len - 1;
+	int i, pc;
+
+#define J(from, to)	((to) - (from) - 1)
+	f[0] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 2);	/* ar_pro */
+	f[1] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, J(1, drop));
+	f[2] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 5);	/* ar_pln */
+	f[3] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 4, 0, J(3, drop));
+	f[4] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6);	/* ar_op */
+	f[5] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REQUEST, 1, 0);
+	f[6] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REPLY, 0, J(6, drop));
+	f[7] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 4);	/* ar_hln */
+	f[8] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+	f[9] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_IND, 8);	/* sender IP */
+	f[10] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0, J(10, drop), 0);
+	pc = 11;
+	if (nif) {
+		f[pc++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+						       SKF_AD_OFF + SKF_AD_IFINDEX);
+		for (i = 0; i < nif; i++, pc++)
+			f[pc] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+					ifvec[i], J(pc, accept),
+					i == nif - 1 ? J(pc, drop) : 0);
 	}
+	f[accept] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xFFFF);
+	f[drop] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+#undef J
+
+	prog.len = len;
+	prog.filter = f;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
 }
 
 /* Receive gratuitous ARP messages and store them, that's all. */
-void get_arp_pkt(void)
+void do_arp_pkt(unsigned char *buf, int n, struct sockaddr_ll *sll)
 {
-	unsigned char buf[1024];
-	struct sockaddr_ll sll;
-	socklen_t sll_len = sizeof(sll);
 	struct arphdr *a = (struct arphdr*)buf;
-	struct dbkey key;
-	DBT dbkey, dbdat;
-	int n;
-
-	n = recvfrom(pset[0].fd, buf, sizeof(buf), MSG_DONTWAIT,
-		     (struct sockaddr*)&sll, &sll_len);
-	if (n < 0) {
-		if (errno != EINTR && errno != EAGAIN)
-			syslog(LOG_ERR, "recvfrom: %m");
-		return;
-	}
+	struct arpdb_rec *r;
+	__u32 addr;
 
-	if (ifnum && !handle_if(sll.sll_ifindex))
+	if (ifnum && !handle_if(sll->sll_ifindex))
 		return;
 
 	/* Sanity checks */
@@ -503,31 +1093,59 @@ void get_arp_pkt(void)
 	     a->ar_op != htons(ARPOP_REPLY)) ||
 	    a->ar_pln != 4 ||
 	    a->ar_pro != htons(ETH_P_IP) ||
-	    a->ar_hln != sll.sll_halen ||
+	    a->ar_hln != sll->sll_halen ||
 	    sizeof(*a) + 2*4 + 2*a->ar_hln > n)
 		return;
 
-	key.iface = sll.sll_ifindex;
-	memcpy(&key.addr, (char*)(a+1) + a->ar_hln, 4);
+	memcpy(&addr, (char*)(a+1) + a->ar_hln, 4);
 
 	/* DAD message, ignore. */
-	if (key.addr == 0)
+	if (addr == 0)
 		return;
 
-	dbkey.data = &key;
-	dbkey.size = sizeof(key);
-
-	if (dbase->get(dbase, &dbkey, &dbdat, 0) == 0 && !IS_NEG(dbdat.data)) {
-		if (memcmp(dbdat.data, a+1, dbdat.size) == 0)
+	r = arpdb_lookup(sll->sll_ifindex, addr);
+	if (r && !IS_NEG(r)) {
+		if (r->hlen == a->ar_hln && memcmp(r->lladdr, a+1, r->hlen) == 0)
 			return;
 		stats.arp_change++;
 	} else {
 		stats.arp_new++;
 	}
 
-	dbdat.data = a+1;
-	dbdat.size = a->ar_hln;
-	dbase->put(dbase, &dbkey, &dbdat, 0);
+	arpdb_store(sll->sll_ifindex, addr, a+1, a->ar_hln);
+}
+
+void get_arp_pkt(void)
+{
+	static unsigned char buf[ARP_BATCH][128];
+	static struct sockaddr_ll sll[ARP_BATCH];
+	static struct iovec iov[ARP_BATCH];
+	static struct mmsghdr msg[ARP_BATCH];
+	int i, n, round;
+
+	for (round = 0; round < ARP_ROUNDS; round++) {
+		for (i = 0; i < ARP_BATCH; i++) {
+			iov[i].iov_base = buf[i];
+			iov[i].iov_len = sizeof(buf[i]);
+			memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+			msg[i].msg_hdr.msg_name = &sll[i];
+			msg[i].msg_hdr.msg_namelen = sizeof(sll[i]);
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(pset[0].fd, msg, ARP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				syslog(LOG_ERR, "recvmmsg: %m");
+			return;
+		}
+
+		for (i = 0; i < n; i++)
+			do_arp_pkt(buf[i], msg[i].msg_len, &sll[i]);
+		if (n < ARP_BATCH)
+			return;
+	}
 }
 
 void catch_signal(int sig, void (*handler)(int))
@@ -588,6 +1206,7 @@ void send_stats(void)
 int main(int argc, char **argv)
 {
 	int opt;
+	int timeout;
 	int do_list = 0;
 	char *do_load = NULL;
 
@@ -667,20 +1286,13 @@ int main(int argc, char **argv)
 		}
 	}
 
-	dbase = dbopen(dbname, O_CREAT|O_RDWR, 0644, DB_HASH, NULL);
-	if (dbase == NULL) {
-		perror("db_open");
+	if (arpdb_open(do_list && !do_load))
 		exit(-1);
-	}
 
 	if (do_load) {
 		char buf[128];
 		FILE *fp;
-		struct dbkey k;
-		DBT dbkey, dbdat;
-
-		dbkey.data = &k;
-		dbkey.size = sizeof(k);
+		__u32 iface, addr;
 
 		if (strcmp(do_load, "-") == 0 || strcmp(do_load, "--") == 0) {
 			fp = stdin;
@@ -698,49 +1310,51 @@ int main(int argc, char **argv)
 			if (buf[0] == '#')
 				continue;
 
-			if (sscanf(buf, "%u%s%s", &k.iface, ipbuf, macbuf) != 3) {
+			if (sscanf(buf, "%u%s%s", &iface, ipbuf, macbuf) != 3) {
 				fprintf(stderr, "Wrong format of input file \"%s\"\n", do_load);
 				goto do_abort;
 			}
 			if (strncmp(macbuf, "FAILED:", 7) == 0)
 				continue;
-			if (!inet_aton(ipbuf, (struct in_addr*)&k.addr)) {
+			if (!inet_aton(ipbuf, (struct in_addr*)&addr)) {
 				fprintf(stderr, "Invalid IP address: \"%s\"\n", ipbuf);
 				goto do_abort;
 			}
 
-			dbdat.data = hexstring_a2n(macbuf, b1, 6);
-			if (dbdat.data == NULL)
+			if (hexstring_a2n(macbuf, b1, 6) == NULL)
 				goto do_abort;
-			dbdat.size = 6;
 
-			if (dbase->put(dbase, &dbkey, &dbdat, 0)) {
-				perror("hash->put");
+			if (arpdb_store(iface, addr, b1, 6)) {
+				perror("arpdb_store");
 				goto do_abort;
 			}
 		}
-		dbase->sync(dbase, 0);
+		arpdb_sync();
 		if (fp != stdin)
 			fclose(fp);
 	}
 
 	if (do_list) {
-		DBT dbkey, dbdat;
+		__u32 i;
+
 		printf("%-8s %-15s %s\n", "#Ifindex", "IP", "MAC");
-		while (dbase->seq(dbase, &dbkey, &dbdat, R_NEXT) == 0) {
-			struct dbkey *key = dbkey.data;
-			if (handle_if(key->iface)) {
-				if (!IS_NEG(dbdat.data)) {
-					char b1[18];
+		for (i = 0; db_hdr && i < db_hdr->nslots; i++) {
+			struct arpdb_rec *r = &db_tab[i];
+
+			if (r->state != ARPDB_VALID && r->state != ARPDB_NEG)
+				continue;
+			if (handle_if(r->iface)) {
+				if (!IS_NEG(r)) {
+					char b1[3*ARPDB_LLMAX];
 					printf("%-8d %-15s %s\n",
-					       key->iface,
-					       inet_ntoa(*(struct in_addr*)&key->addr),
-					       hexstring_n2a(dbdat.data, 6, b1, 18));
+					       r->iface,
+					       inet_ntoa(*(struct in_addr*)&r->addr),
+					       hexstring_n2a(r->lladdr, r->hlen, b1, sizeof(b1)));
 				} else {
 					printf("%-8d %-15s FAILED: %dsec ago\n",
-					       key->iface,
-					       inet_ntoa(*(struct in_addr*)&key->addr),
-					       NEG_AGE(dbdat.data));
+					       r->iface,
+					       inet_ntoa(*(struct in_addr*)&r->addr),
+					       NEG_AGE(r));
 				}
 			}
 		}
@@ -766,6 +1380,17 @@ int main(int argc, char **argv)
 			goto do_abort;
 		}
 	}
+	if (attach_arp_filter(pset[0].fd) < 0)
+		perror("SO_ATTACH_FILTER");
+	if (1) {
+		int bufsize = 4*1024*1024;
+
+		/* Room for a storm to wait in while a batch is handled */
+		if (setsockopt(pset[0].fd, SOL_SOCKET, SO_RCVBUFFORCE,
+			       &bufsize, sizeof(bufsize)) < 0)
+			setsockopt(pset[0].fd, SOL_SOCKET, SO_RCVBUF,
+				   &bufsize, sizeof(bufsize));
+	}
 
 	if (rtnl_open(&rth, RTMGRP_NEIGH) < 0) {
 		perror("rtnl_open");
@@ -773,6 +1398,15 @@ int main(int argc, char **argv)
 	}
 	pset[1].fd = rth.fd;
 
+	if (active_probing) {
+		if (ifinfo_load() < 0) {
+			perror("cannot load interface addresses");
+			goto do_abort;
+		}
+		pset[2].fd = lrth.fd;
+		npset = 3;
+	}
+
 	load_initial_table();
 
 	if (daemon(0, 0)) {
@@ -791,6 +1425,8 @@ int main(int argc, char **argv)
 	pset[0].revents = 0;
 	pset[1].events = EVENTS;
 	pset[1].revents = 0;
+	pset[2].events = EVENTS;
+	pset[2].revents = 0;
 
 	sigsetjmp(env, 1);
 
@@ -801,29 +1437,44 @@ int main(int argc, char **argv)
 			break;
 		if (do_sync) {
 			in_poll = 0;
-			dbase->sync(dbase, 0);
+			arpdb_sync();
 			do_sync = 0;
 			in_poll = 1;
 		}
 		if (do_stats)
 			send_stats();
-		if (poll(pset, 2, 30000) > 0) {
+		if (npset > 2 && lrth.fd < 0 && time(NULL) >= ifinfo_retry) {
 			in_poll = 0;
+			ifinfo_reload();
+			in_poll = 1;
+		}
+		timeout = 30000;
+		if (db_ndirty)
+			timeout = 100;
+		else if (npset > 2 && lrth.fd < 0)
+			timeout = 1000;
+		if (poll(pset, npset, timeout) > 0) {
+			in_poll = 0;
+			if (npset > 2 && pset[2].revents&EVENTS)
+				get_kern_msg(&lrth, ifinfo_update);
 			if (pset[0].revents&EVENTS)
 				get_arp_pkt();
 			if (pset[1].revents&EVENTS)
-				get_kern_msg();
+				get_kern_msg(&rth, do_one_request);
+			flush_kernel_responses();
+			arpdb_flush(ARPDB_FLUSH);
 		} else {
-			do_sync = 1;
+			in_poll = 0;
+			arpdb_flush(ARPDB_FLUSH);
 		}
 	}
 
 	undo_sysctl_adjustments();
 out:
-	dbase->close(dbase);
+	arpdb_close();
 	exit(0);
 
 do_abort:
-	dbase->close(dbase);
+	arpdb_close();
 	exit(-1);
 }
@@ -34,6 +34,8 @@
 
 #include <SNAPSHOT.h>
 
+#include "statshm.h"
+
 int dump_zeros = 0;
 int reset_history = 0;
 int ignore_history = 0;
@@ -42,27 +44,70 @@ int no_update = 0;
 int scan_interval = 0;
 int time_constant = 0;
 int show_errors = 0;
-double W;
 char **patterns;
 int npatterns;
 
 char info_source[128];
 int source_mismatch;
+static struct statshm *shm;
 
-#define MAXS (sizeof(struct rtnl_link_stats)/sizeof(__u32))
+#define MAXS (sizeof(struct rtnl_link_stats64)/sizeof(__u64))
+#define IFSTAT_HASH	4096
 
 struct ifstat_ent
 {
 	struct ifstat_ent	*next;
+	struct ifstat_ent	*hnext;
 	char			*name;
 	int			ifindex;
+	int			stats32;	/* kernel counters wrap at 2^32 */
 	unsigned long long	val[MAXS];
 	double			rate[MAXS];
-	__u32			ival[MAXS];
+	__u64			ival[MAXS];
 };
 
 struct ifstat_ent *kern_db;
 struct ifstat_ent *hist_db;
+static struct ifstat_ent **hist_hash;
+
+/* Index a list by ifindex; interfaces come and go, the order may change */
+static struct ifstat_ent **hash_db(struct ifstat_ent *db)
+{
+	struct ifstat_ent **tbl = calloc(IFSTAT_HASH, sizeof(*tbl));
+
+	if (!tbl)
+		abort();
+	for (; db; db = db->next) {
+		unsigned h = db->ifindex & (IFSTAT_HASH - 1);
+
+		db->hnext = tbl[h];
+		tbl[h] = db;
+	}
+	return tbl;
+}
+
+static struct ifstat_ent *lookup_db(struct ifstat_ent **tbl, int ifindex)
+{
+	struct ifstat_ent *n;
+
+	if (!tbl)
+		return NULL;
+	for (n = tbl[ifindex & (IFSTAT_HASH - 1)]; n; n = n->hnext)
+		if (n->ifindex == ifindex)
+			return n;
+	return NULL;
+}
+
+static void free_db(struct ifstat_ent *db)
+{
+	while (db) {
+		struct ifstat_ent *n = db;
+
+		db = db->next;
+		free(n->name);
+		free(n);
+	}
+}
 
 static int match(const char *id)
 {
@@ -98,7 +143,8 @@ static int get_nlmsg(const struct sockaddr_nl *who,
 		return 0;
 
 	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
-	if (tb[IFLA_IFNAME] == NULL || tb[IFLA_STATS] == NULL)
+	if (tb[IFLA_IFNAME] == NULL ||
+	    (tb[IFLA_STATS64] == NULL && tb[IFLA_STATS] == NULL))
 		return 0;
 
 	n = malloc(sizeof(*n));
@@ -106,7 +152,17 @@ static int get_nlmsg(const struct sockaddr_nl *who,
 		abort();
 	n->ifindex = ifi->ifi_index;
 	n->name = strdup(RTA_DATA(tb[IFLA_IFNAME]));
-	memcpy(&n->ival, RTA_DATA(tb[IFLA_STATS]), sizeof(n->ival));
+	if (tb[IFLA_STATS64] &&
+	    RTA_PAYLOAD(tb[IFLA_STATS64]) >= sizeof(n->ival)) {
+		n->stats32 = 0;
+		memcpy(&n->ival, RTA_DATA(tb[IFLA_STATS64]), sizeof(n->ival));
+	} else {
+		__u32 *s = RTA_DATA(tb[IFLA_STATS]);
+
+		n->stats32 = 1;
+		for (i=0; i<MAXS; i++)
+			n->ival[i] = s[i];
+	}
 	memset(&n->rate, 0, sizeof(n->rate));
 	for (i=0; i<MAXS; i++)
 		n->val[i] = n->ival[i];
@@ -180,19 +236,20 @@ void load_raw_table(FILE *fp)
 		n->name = strdup(p);
 		p = next;
 
+		n->stats32 = 0;
 		for (i=0; i<MAXS; i++) {
-			unsigned rate;
+			unsigned long long rate;
 			if (!(next = strchr(p, ' ')))
 				abort();
 			*next++ = 0;
 			if (sscanf(p, "%llu", n->val+i) != 1)
 				abort();
-			n->ival[i] = (__u32)n->val[i];
+			n->ival[i] = n->val[i];
 			p = next;
 			if (!(next = strchr(p, ' ')))
 				abort();
 			*next++ = 0;
-			if (sscanf(p, "%u", &rate) != 1)
+			if (sscanf(p, "%llu", &rate) != 1)
 				abort();
 			n->rate[i] = rate;
 			p = next;
@@ -211,8 +268,7 @@ void load_raw_table(FILE *fp)
 
 void dump_raw_db(FILE *fp, int to_hist)
 {
-	struct ifstat_ent *n, *h;
-	h = hist_db;
+	struct ifstat_ent *n;
 	fprintf(fp, "#%s\n", info_source);
 
 	for (n=kern_db; n; n=n->next) {
@@ -223,18 +279,16 @@ void dump_raw_db(FILE *fp, int to_hist)
 			struct ifstat_ent *h1;
 			if (!to_hist)
 				continue;
-			for (h1 = h; h1; h1 = h1->next) {
-				if (h1->ifindex == n->ifindex) {
-					vals = h1->val;
-					rates = h1->rate;
-					h = h1->next;
-					break;
-				}
+			h1 = lookup_db(hist_hash, n->ifindex);
+			if (h1) {
+				vals = h1->val;
+				rates = h1->rate;
 			}
 		}
 		fprintf(fp, "%d %s ", n->ifindex, n->name);
 		for (i=0; i<MAXS; i++)
-			fprintf(fp, "%llu %u ", vals[i], (unsigned)rates[i]);
+			fprintf(fp, "%llu %llu ", vals[i],
+				(unsigned long long)rates[i]);
 		fprintf(fp, "\n");
 	}
 }
@@ -390,8 +444,7 @@ void dump_kern_db(FILE *fp)
 
 void dump_incr_db(FILE *fp)
 {
-	struct ifstat_ent *n, *h;
-	h = hist_db;
+	struct ifstat_ent *n;
 
 	print_head(fp);
 
@@ -402,13 +455,10 @@ void dump_incr_db(FILE *fp)
 
 		memcpy(vals, n->val, sizeof(vals));
 
-		for (h1 = h; h1; h1 = h1->next) {
-			if (h1->ifindex == n->ifindex) {
-				for (i = 0; i < MAXS; i++)
-					vals[i] -= h1->val[i];
-				h = h1->next;
-				break;
-			}
+		h1 = lookup_db(hist_hash, n->ifindex);
+		if (h1) {
+			for (i = 0; i < MAXS; i++)
+				vals[i] -= h1->val[i];
 		}
 		if (!match(n->name))
 			continue;
@@ -417,69 +467,178 @@ void dump_incr_db(FILE *fp)
 }
 
 
+/* Interface record of the shared memory table */
+struct ifstat_rec
+{
+	__s32	ifindex;
+	char	name[IFNAMSIZ];
+	__u64	val[MAXS];
+	double	rate[MAXS];
+};
+
+/* Clients read the table from shared memory, see load_shm_db() */
+static void publish_db(void)
+{
+	static struct statshm_table *t;
+	static size_t size;
+	struct ifstat_rec *r;
+	struct ifstat_ent *n;
+	size_t len;
+	int cnt = 0;
+
+	if (shm == NULL)
+		return;
+	for (n = kern_db; n; n = n->next)
+		cnt += match(n->name);
+	len = sizeof(*t) + cnt * sizeof(*r);
+	if (len > size) {
+		void *p = realloc(t, len);
+
+		if (p == NULL)
+			return;
+		t = p;
+		size = len;
+	}
+
+	memset(t, 0, len);
+	strncpy(t->source, info_source, sizeof(t->source) - 1);
+	t->count = cnt;
+	t->size = sizeof(*r);
+	r = (struct ifstat_rec *)(t + 1);
+	for (n = kern_db; n; n = n->next) {
+		if (!match(n->name))
+			continue;
+		r->ifindex = n->ifindex;
+		strncpy(r->name, n->name, sizeof(r->name) - 1);
+		memcpy(r->val, n->val, sizeof(r->val));
+		memcpy(r->rate, n->rate, sizeof(r->rate));
+		r++;
+	}
+	statshm_publish(shm, t, len);
+}
+
+static int load_shm_db(void)
+{
+	struct ifstat_ent *n, **tail = &kern_db;
+	struct statshm_table *t;
+	struct ifstat_rec *r;
+	char name[32];
+	char *buf;
+	size_t len;
+	int i;
+
+	sprintf(name, "/ifstat%d", getuid());
+	if (statshm_read(name, &buf, &len) &&
+	    statshm_read("/ifstat0", &buf, &len))
+		return -1;
+	t = (struct statshm_table *)buf;
+	if (len < sizeof(*t) || t->size != sizeof(*r) ||
+	    len != sizeof(*t) + (size_t)t->count * sizeof(*r)) {
+		free(buf);
+		return -1;
+	}
+
+	t->source[sizeof(t->source) - 1] = 0;
+	if (info_source[0] && strcmp(info_source, t->source))
+		source_mismatch = 1;
+	strncpy(info_source, t->source, sizeof(info_source) - 1);
+
+	while (*tail)
+		tail = &(*tail)->next;
+	r = (struct ifstat_rec *)(t + 1);
+	for (i = 0; i < t->count; i++, r++) {
+		if ((n = malloc(sizeof(*n))) == NULL)
+			abort();
+		n->ifindex = r->ifindex;
+		n->name = strndup(r->name, sizeof(r->name));
+		n->stats32 = 0;
+		memcpy(n->val, r->val, sizeof(n->val));
+		memcpy(n->ival, r->val, sizeof(n->ival));
+		memcpy(n->rate, r->rate, sizeof(n->rate));
+		n->next = NULL;
+		*tail = n;
+		tail = &n->next;
+	}
+	free(buf);
+	return 0;
+}
+
+static int load_sock_db(int fd)
+{
+	FILE *sfp = fdopen(fd, "r");
+
+	if (sfp == NULL)
+		return -1;
+	load_raw_table(sfp);
+	fclose(sfp);
+	return 0;
+}
+
 static int children;
 
 void sigchild(int signo)
 {
 }
 
-void update_db(int interval)
+/*
+ * Take a new sample, interval is in microseconds.  The list is replaced
+ * with the new dump, so that interfaces which appeared are picked up and
+ * those gone are forgotten; old entries are found through the hash.
+ */
+void update_db(long long interval)
 {
-	struct ifstat_ent *n, *h;
+	struct ifstat_ent *n, *h, **tbl;
+	double w = 0;
 
-	n = kern_db;
+	h = kern_db;
 	kern_db = NULL;
 
 	load_info();
 
-	h = kern_db;
-	kern_db = n;
+	/* Exact decay over the interval, whatever its length */
+	if (interval > 0)
+		w = 1 - exp(-log(10) * interval / (time_constant * 1000.0));
 
+	tbl = hash_db(h);
 	for (n = kern_db; n; n = n->next) {
-		struct ifstat_ent *h1;
-		for (h1 = h; h1; h1 = h1->next) {
-			if (h1->ifindex == n->ifindex) {
-				int i;
-				for (i = 0; i < MAXS; i++) {
-					if ((long)(h1->ival[i] - n->ival[i]) < 0) {
-						memset(n->ival, 0, sizeof(n->ival));
-						break;
-					}
-				}
-				for (i = 0; i < MAXS; i++) {
-					double sample;
-					unsigned long incr = h1->ival[i] - n->ival[i];
-					n->val[i] += incr;
-					n->ival[i] = h1->ival[i];
-					sample = (double)(incr*1000)/interval;
-					if (interval >= scan_interval) {
-						n->rate[i] += W*(sample-n->rate[i]);
-					} else if (interval >= 1000) {
-						if (interval >= time_constant) {
-							n->rate[i] = sample;
-						} else {
-							double w = W*(double)interval/scan_interval;
-							n->rate[i] += w*(sample-n->rate[i]);
-						}
-					}
+		struct ifstat_ent *h1 = lookup_db(tbl, n->ifindex);
+		__u64 ival[MAXS];
+		int i;
+
+		if (h1 == NULL)
+			continue;
+
+		memcpy(ival, n->ival, sizeof(ival));
+		memcpy(n->val, h1->val, sizeof(n->val));
+		memcpy(n->rate, h1->rate, sizeof(n->rate));
+
+		/* A counter going back means the device was reset or replaced */
+		if (!n->stats32 && !h1->stats32) {
+			for (i = 0; i < MAXS; i++) {
+				if (ival[i] < h1->ival[i]) {
+					memset(h1->ival, 0, sizeof(h1->ival));
+					break;
 				}
+			}
+		}
+		for (i = 0; i < MAXS; i++) {
+			__u64 incr = ival[i] - h1->ival[i];
 
-				while (h != h1) {
-					struct ifstat_ent *tmp = h;
-					h = h->next;
-					free(tmp->name);
-					free(tmp);
-				};
-				h = h1->next;
-				free(h1->name);
-				free(h1);
-				break;
+			if (n->stats32)
+				incr = (__u32)incr;
+			n->val[i] += incr;
+			if (interval > 0) {
+				double sample = incr * 1000000.0 / interval;
+
+				n->rate[i] += w * (sample - n->rate[i]);
 			}
 		}
 	}
+	free(tbl);
+	free_db(h);
 }
 
-#define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
+#define T_DIFF(a,b) (((long long)(a).tv_sec-(b).tv_sec)*1000000 + ((a).tv_usec-(b).tv_usec))
 
 
 void server_loop(int fd)
@@ -489,25 +648,28 @@ void server_loop(int fd)
 	p.fd = fd;
 	p.events = p.revents = POLLIN;
 
-	sprintf(info_source, "%d.%lu sampling_interval=%d time_const=%d",
-		getpid(), (unsigned long)random(), scan_interval/1000, time_constant/1000);
+	sprintf(info_source, "%d.%lu sampling_interval=%g time_const=%d",
+		getpid(), (unsigned long)random(), scan_interval/1000.0, time_constant/1000);
 
 	load_info();
+	publish_db();
+	gettimeofday(&snaptime, NULL);
 
 	for (;;) {
 		int status;
-		int tdiff;
+		long long tdiff;
 		struct timeval now;
 
 		gettimeofday(&now, NULL);
 		tdiff = T_DIFF(now, snaptime);
-		if (tdiff >= scan_interval) {
+		if (tdiff >= scan_interval * 1000LL) {
 			update_db(tdiff);
+			publish_db();
 			snaptime = now;
 			tdiff = 0;
 		}
 
-		if (poll(&p, 1, tdiff + scan_interval) > 0
+		if (poll(&p, 1, scan_interval - tdiff/1000) > 0
 		    && (p.revents&POLLIN)) {
 			int clnt = accept(fd, NULL, NULL);
 			if (clnt >= 0) {
@@ -611,7 +773,7 @@ int main(int argc, char *argv[])
 			show_errors = 1;
 			break;
 		case 'd':
-			scan_interval = atoi(optarg) * 1000;
+			scan_interval = atof(optarg) * 1000;
 			if (scan_interval <= 0) {
 				fprintf(stderr, "ifstat: invalid scan interval\n");
 				exit(-1);
@@ -643,10 +805,11 @@ int main(int argc, char *argv[])
 	sprintf(sun.sun_path+1, "ifstat%d", getuid());
 
 	if (scan_interval > 0) {
+		char shm_name[32];
+
 		if (time_constant == 0)
 			time_constant = 60;
 		time_constant *= 1000;
-		W = 1 - 1/exp(log(10)*(double)scan_interval/time_constant);
 		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
 			perror("ifstat: socket");
 			exit(-1);
@@ -663,6 +826,8 @@ int main(int argc, char *argv[])
 			perror("ifstat: daemon");
 			exit(-1);
 		}
+		sprintf(shm_name, "/ifstat%d", getuid());
+		shm = statshm_create(shm_name);
 		signal(SIGPIPE, SIG_IGN);
 		signal(SIGCHLD, sigchild);
 		server_loop(fd);
@@ -723,27 +888,28 @@ int main(int argc, char *argv[])
 		load_raw_table(hist_fp);
 
 		hist_db = kern_db;
+		hist_hash = hash_db(hist_db);
 		kern_db = NULL;
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "ifstat0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		FILE *sfp = fdopen(fd, "r");
-		load_raw_table(sfp);
+	if (load_shm_db() == 0 ||
+	    ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+	     (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
+	      || (strcpy(sun.sun_path+1, "ifstat0"),
+		  connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
+	     && verify_forging(fd) == 0 && load_sock_db(fd) == 0)) {
 		if (hist_db && source_mismatch) {
 			fprintf(stderr, "ifstat: history is stale, ignoring it.\n");
 			hist_db = NULL;
+			hist_hash = NULL;
 		}
-		fclose(sfp);
 	} else {
 		if (fd >= 0)
 			close(fd);
 		if (hist_db && info_source[0] && strcmp(info_source, "kernel")) {
 			fprintf(stderr, "ifstat: history is stale, ignoring it.\n");
 			hist_db = NULL;
+			hist_hash = NULL;
 			info_source[0] = 0;
 		}
 		load_info();
@@ -34,12 +34,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <linux/types.h>
 
 #include "lnstat.h"
 
+/* Binary output: a header with the keys, then fixed size records */
+#define LNSTAT_BIN_MAGIC	0x54534e4c	/* "LNST" */
+#define LNSTAT_BIN_VERSION	1
+
+struct lnstat_bin_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	num;		/* followed by num "file:key" strings */
+};
+
 static struct option opts[] = {
 	{ "version", 0, NULL, 'V' },
+	{ "binary", 1, NULL, 'b' },
 	{ "count", 1, NULL, 'c' },
 	{ "dump", 1, NULL, 'd' },
 	{ "file", 1, NULL, 'f' },
@@ -59,6 +74,8 @@ static int usage(char *name, int exit_code)
 			"\nwith ABSOLUTELY NO WARRANTY.\n\n");
 	fprintf(stderr, "Parameters:\n");
 	fprintf(stderr, "\t-V --version\t\tPrint Version of Program\n");
+	fprintf(stderr, "\t-b --binary <file>\t"
+			"Also write raw counters to <file> in binary\n");
 	fprintf(stderr, "\t-c --count <count>\t"
 			"Print <count> number of intervals\n");
 	fprintf(stderr, "\t-d --dump\t\t"
@@ -66,7 +83,7 @@ static int usage(char *name, int exit_code)
 	fprintf(stderr, "\t-f --file <file>\tStatistics file to use\n");
 	fprintf(stderr, "\t-h --help\t\tThis help message\n");
 	fprintf(stderr, "\t-i --interval <intv>\t"
-			"Set interval to 'intv' seconds\n");
+			"Set interval to 'intv' seconds, may be fractional\n");
 	fprintf(stderr, "\t-k --keys k,k,k,...\tDisplay only keys specified\n");
 	fprintf(stderr, "\t-s --subject [0-2]\t?\n");
 	fprintf(stderr, "\t-w --width n,n,n,...\tWidth for each field\n");
@@ -104,9 +121,50 @@ static void print_line(FILE *of, const struct lnstat_file *lnstat_files,
 	fputc('\n', of);
 }
 
+/*
+ * One record per sample: the time in microseconds and the raw counter
+ * of every key, both as 64 bit values in host byte order.
+ */
+static int write_bin_line(int fd, const struct field_params *fp)
+{
+	static __u64 rec[MAX_FIELDS + 1];
+	struct timeval tv;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	rec[0] = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	for (i = 0; i < fp->num; i++)
+		rec[i + 1] = fp->params[i].lf->values[1];
+
+	return write(fd, rec, (fp->num + 1) * sizeof(rec[0]));
+}
+
+static int write_bin_hdr(int fd, const struct field_params *fp)
+{
+	struct lnstat_bin_hdr hdr = {
+		.magic = LNSTAT_BIN_MAGIC,
+		.version = LNSTAT_BIN_VERSION,
+		.num = fp->num,
+	};
+	FILE *f;
+	int i;
+
+	f = fdopen(dup(fd), "w");
+	if (!f)
+		return -1;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	for (i = 0; i < fp->num; i++) {
+		const struct lnstat_field *lf = fp->params[i].lf;
+
+		fprintf(f, "%s:%s%c", lf->file->basename, lf->name, 0);
+	}
+	return fclose(f);
+}
+
 /* find lnstat_field according to user specification */
 static int map_field_params(struct lnstat_file *lnstat_files,
-			    struct field_params *fps, int interval)
+			    struct field_params *fps,
+			    const struct timeval *interval)
 {
 	int i, j = 0;
 	struct lnstat_file *lf;
@@ -116,8 +174,7 @@ static int map_field_params(struct lnstat_file *lnstat_files,
 		for (lf = lnstat_files; lf; lf = lf->next) {
 			for (i = 0; i < lf->num_fields; i++) {
 				fps->params[j].lf = &lf->fields[i];
-				fps->params[j].lf->file->interval.tv_sec =
-								interval;
+				fps->params[j].lf->file->interval = *interval;
 				if (!fps->params[j].print.width)
 					fps->params[j].print.width =
 							FIELD_WIDTH_DEFAULT;
@@ -144,7 +201,7 @@ static int map_field_params(struct lnstat_file *lnstat_files,
 				fps->params[i].name);
 			return 0;
 		}
-		fps->params[i].lf->file->interval.tv_sec = interval;
+		fps->params[i].lf->file->interval = *interval;
 		if (!fps->params[i].print.width)
 			fps->params[i].print.width = FIELD_WIDTH_DEFAULT;
 	}
@@ -219,7 +276,11 @@ int main(int argc, char **argv)
 	struct lnstat_file *lnstat_files;
 	const char *basename;
 	int c;
-	int interval = DEFAULT_INTERVAL;
+	double interval = DEFAULT_INTERVAL;
+	struct itimerspec its;
+	struct timeval itv;
+	const char *binary = NULL;
+	int bin_fd = -1, tfd;
 	int hdr = 2;
 	enum {
 		MODE_DUMP,
@@ -248,12 +309,15 @@ int main(int argc, char **argv)
 		num_req_files = 1;
 	}
 
-	while ((c = getopt_long(argc, argv,"Vc:df:h?i:k:s:w:",
+	while ((c = getopt_long(argc, argv,"Vb:c:df:h?i:k:s:w:",
 				opts, NULL)) != -1) {
 		int i, len = 0;
 		char *tmp, *tok;
 
 		switch (c) {
+			case 'b':
+				binary = optarg;
+				break;
 			case 'c':
 				count = strtoul(optarg, NULL, 0);
 				break;
@@ -268,7 +332,7 @@ int main(int argc, char **argv)
 				usage(argv[0], 0);
 				break;
 			case 'i':
-				sscanf(optarg, "%u", &interval);
+				sscanf(optarg, "%lf", &interval);
 				break;
 			case 'k':
 				tmp = strdup(optarg);
@@ -326,23 +390,66 @@ int main(int argc, char **argv)
 		break;
 	case MODE_NORMAL:
 
-		if (!map_field_params(lnstat_files, &fp, interval))
+		/* millisecond resolution */
+		if (interval < 0.001)
+			interval = 0.001;
+		itv.tv_sec = interval;
+		itv.tv_usec = (interval - itv.tv_sec) * 1000 * 1000;
+		itv.tv_usec -= itv.tv_usec % 1000;
+
+		if (!map_field_params(lnstat_files, &fp, &itv))
 			exit(1);
 
 		header = build_hdr_string(lnstat_files, &fp, 80);
 		if (!header)
 			exit(1);
 
-		if (interval < 1 )
-			interval=1;
+		/* "-" replaces the text output with the binary one */
+		if (binary) {
+			if (strcmp(binary, "-") == 0)
+				bin_fd = STDOUT_FILENO;
+			else
+				bin_fd = open(binary, O_WRONLY|O_CREAT|O_TRUNC,
+					      0644);
+			if (bin_fd < 0 || write_bin_hdr(bin_fd, &fp) < 0) {
+				perror(binary);
+				exit(1);
+			}
+		}
+
+		/* ticks do not drift with the time spent sampling */
+		tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		its.it_value.tv_sec = its.it_interval.tv_sec = itv.tv_sec;
+		its.it_value.tv_nsec = its.it_interval.tv_nsec =
+							itv.tv_usec * 1000;
+		if (tfd >= 0 && timerfd_settime(tfd, 0, &its, NULL) < 0) {
+			close(tfd);
+			tfd = -1;
+		}
 
 		for (i = 0; i < count; i++) {
+			__u64 ticks;
+
+			if (i) {
+				if (tfd < 0)
+					usleep(itv.tv_sec * 1000000 + itv.tv_usec);
+				else if (read(tfd, &ticks, sizeof(ticks)) < 0)
+					break;
+			}
+			if (lnstat_update(lnstat_files) < 0) {
+				perror("lnstat: read");
+				exit(1);
+			}
+			if (bin_fd >= 0 && write_bin_line(bin_fd, &fp) < 0) {
+				perror(binary);
+				exit(1);
+			}
+			if (bin_fd == STDOUT_FILENO)
+				continue;
 			if  ((hdr > 1 && (! (i % 20))) || (hdr == 1 && i == 0))
 				print_hdr(stdout, header);
-			lnstat_update(lnstat_files);
 			print_line(stdout, lnstat_files, &fp);
 			fflush(stdout);
-			sleep(interval);
 		}
 	}
 
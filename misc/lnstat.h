@@ -28,7 +28,9 @@ struct lnstat_file {
 	struct timeval last_read;		/* last time of read */
 	struct timeval interval;		/* interval */
 	int compat;				/* 1 == backwards compat mode */
-	FILE *fp;
+	int fd;
+	char *buf;				/* whole file, as last read */
+	size_t buf_size;
 	unsigned int num_fields;		/* number of fields */
 	struct lnstat_field fields[LNSTAT_MAX_FIELDS_PER_LINE];
 };
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <time.h>
 
@@ -29,87 +30,129 @@
 
 #include "lnstat.h"
 
-/* size of temp buffer used to read lines from procfiles */
-#define FGETS_BUF_SIZE 1024
+/* initial size of the buffer procfiles are read into */
+#define READ_BUF_SIZE 4096
 
 
 #define RTSTAT_COMPAT_LINE "entries  in_hit in_slow_tot in_no_route in_brd in_martian_dst in_martian_src  out_hit out_slow_tot out_slow_mc  gc_total gc_ignored gc_goal_miss gc_dst_overflow in_hlist_search out_hlist_search\n"
 
-/* Read (and summarize for SMP) the different stats vars. */
+/* Read the whole file from the start, keeping the fd and the buffer. */
+static int lnstat_read(struct lnstat_file *lf)
+{
+	size_t len = 0;
+
+	for (;;) {
+		ssize_t n;
+
+		if (len + 1 >= lf->buf_size) {
+			char *buf = realloc(lf->buf, lf->buf_size * 2);
+
+			if (!buf)
+				return -1;
+			lf->buf = buf;
+			lf->buf_size *= 2;
+		}
+		n = pread(lf->fd, lf->buf + len, lf->buf_size - len - 1, len);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	lf->buf[len] = '\0';
+	return 0;
+}
+
+static unsigned long scan_hex(const char **ptr)
+{
+	const char *p = *ptr;
+	unsigned long val = 0;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	for (;; p++) {
+		unsigned int c = *p;
+
+		if (c - '0' < 10)
+			c -= '0';
+		else if ((c | 0x20) - 'a' < 6)
+			c = (c | 0x20) - 'a' + 10;
+		else
+			break;
+		val = (val << 4) | c;
+	}
+	*ptr = p;
+	return val;
+}
+
+/* Parse (and summarize for SMP) the different stats vars. */
 static int scan_lines(struct lnstat_file *lf, int i)
 {
+	const char *ptr = lf->buf;
 	int j, num_lines = 0;
 
 	for (j = 0; j < lf->num_fields; j++)
 		lf->fields[j].values[i] = 0;
 
-	while(!feof(lf->fp)) {
-		char buf[FGETS_BUF_SIZE];
-		char *ptr = buf;
+	/* skip the template line */
+	if (!lf->compat)
+		ptr = strchr(ptr, '\n') ? : "";
 
+	while (*ptr) {
+		if (*ptr == '\n' && !*++ptr)
+			break;
 		num_lines++;
 
-		fgets(buf, sizeof(buf)-1, lf->fp);
-		gettimeofday(&lf->last_read, NULL);
-
 		for (j = 0; j < lf->num_fields; j++) {
-			unsigned long f = strtoul(ptr, &ptr, 16);
+			unsigned long f = scan_hex(&ptr);
 			if (j == 0)
 				lf->fields[j].values[i] = f;
 			else
 				lf->fields[j].values[i] += f;
 		}
+		while (*ptr && *ptr != '\n')
+			ptr++;
 	}
 	return num_lines;
 }
 
-static int time_after(struct timeval *last,
-		      struct timeval *tout,
-		      struct timeval *now)
-{
-	if (now->tv_sec > last->tv_sec + tout->tv_sec)
-		return 1;
-
-	if (now->tv_sec == last->tv_sec + tout->tv_sec) {
-		if (now->tv_usec > last->tv_usec + tout->tv_usec)
-			return 1;
-	}
-
-	return 0;
-}
-
+/*
+ * Rates are per second over the time actually elapsed since the previous
+ * read, so that callers may sample at any pace.
+ */
 int lnstat_update(struct lnstat_file *lnstat_files)
 {
 	struct lnstat_file *lf;
-	char buf[FGETS_BUF_SIZE];
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
 
 	for (lf = lnstat_files; lf; lf = lf->next) {
-		if (time_after(&lf->last_read, &lf->interval, &tv)) {
-			int i;
-			struct lnstat_field *lfi;
-
-			rewind(lf->fp);
-			if (!lf->compat) {
-				/* skip first line */
-				fgets(buf, sizeof(buf)-1, lf->fp);
-			}
-			scan_lines(lf, 1);
-
-			for (i = 0, lfi = &lf->fields[i];
-			     i < lf->num_fields; i++, lfi = &lf->fields[i]) {
-				if (i == 0)
-					lfi->result = lfi->values[1];
-				else
-					lfi->result = (lfi->values[1]-lfi->values[0])
-				    			/ lf->interval.tv_sec;
-			}
+		struct lnstat_field *lfi;
+		struct timeval tv;
+		double elapsed;
+		int i;
 
-			rewind(lf->fp);
-			fgets(buf, sizeof(buf)-1, lf->fp);
-			scan_lines(lf, 0);
+		if (lnstat_read(lf) < 0)
+			return -1;
+		gettimeofday(&tv, NULL);
+		scan_lines(lf, 1);
+
+		if (lf->last_read.tv_sec)
+			elapsed = (tv.tv_sec - lf->last_read.tv_sec) +
+				  (tv.tv_usec - lf->last_read.tv_usec) / 1e6;
+		else
+			elapsed = lf->interval.tv_sec +
+				  lf->interval.tv_usec / 1e6;
+		lf->last_read = tv;
+
+		for (i = 0, lfi = &lf->fields[i];
+		     i < lf->num_fields; i++, lfi = &lf->fields[i]) {
+			if (i == 0)
+				lfi->result = lfi->values[1];
+			else if (elapsed > 0)
+				lfi->result = (lfi->values[1]-lfi->values[0])
+							/ elapsed;
+			else
+				lfi->result = 0;
+			lfi->values[0] = lfi->values[1];
 		}
 	}
 
@@ -139,20 +182,23 @@ static int __lnstat_scan_fields(struct lnstat_file *lf, char *buf)
 
 static int lnstat_scan_fields(struct lnstat_file *lf)
 {
-	char buf[FGETS_BUF_SIZE];
+	char *eol;
 
-	rewind(lf->fp);
-	fgets(buf, sizeof(buf)-1, lf->fp);
+	if (lnstat_read(lf) < 0)
+		return -1;
+	eol = strchr(lf->buf, '\n');
+	if (eol)
+		*eol = '\0';
 
-	return __lnstat_scan_fields(lf, buf);
+	return __lnstat_scan_fields(lf, lf->buf);
 }
 
 /* fake function emulating lnstat_scan_fields() for old kernels */
 static int lnstat_scan_compat_rtstat_fields(struct lnstat_file *lf)
 {
-	char buf[FGETS_BUF_SIZE];
+	char buf[sizeof(RTSTAT_COMPAT_LINE)];
 
-	strncpy(buf, RTSTAT_COMPAT_LINE, sizeof(buf)-1);
+	strcpy(buf, RTSTAT_COMPAT_LINE);
 
 	return __lnstat_scan_fields(lf, buf);
 }
@@ -190,9 +236,16 @@ static struct lnstat_file *alloc_and_open(const char *path, const char *file)
 	/* initialize to default */
 	lf->interval.tv_sec = 1;
 
-	/* open */
-	lf->fp = fopen(lf->path, "r");
-	if (!lf->fp) {
+	/* open, the fd and the buffer are kept for all later reads */
+	lf->fd = open(lf->path, O_RDONLY);
+	if (lf->fd < 0) {
+		free(lf);
+		return NULL;
+	}
+	lf->buf_size = READ_BUF_SIZE;
+	lf->buf = malloc(lf->buf_size);
+	if (!lf->buf) {
+		close(lf->fd);
 		free(lf);
 		return NULL;
 	}
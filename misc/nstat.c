@@ -29,6 +29,8 @@
 
 #include <SNAPSHOT.h>
 
+#include "statshm.h"
+
 int dump_zeros = 0;
 int reset_history = 0;
 int ignore_history = 0;
@@ -42,6 +44,7 @@ int npatterns;
 
 char info_source[128];
 int source_mismatch;
+static struct statshm *shm;
 
 static int generic_proc_open(const char *env, char *name)
 {
@@ -309,6 +312,116 @@ void dump_incr_db(FILE *fp)
 	}
 }
 
+/* Counter record of the shared memory table */
+struct nstat_rec
+{
+	char	id[64];
+	__u64	val;
+	double	rate;
+};
+
+/* What dump_kern_db() would print for clients */
+static int publish_ent(struct nstat_ent *n)
+{
+	return (dump_zeros || n->val || n->rate) && match(n->id) &&
+	       strlen(n->id) < sizeof(((struct nstat_rec *)0)->id);
+}
+
+/* Clients read the table from shared memory, see load_shm_db() */
+static void publish_db(void)
+{
+	static struct statshm_table *t;
+	static size_t size;
+	struct nstat_rec *r;
+	struct nstat_ent *n;
+	size_t len;
+	int cnt = 0;
+
+	if (shm == NULL)
+		return;
+	for (n = kern_db; n; n = n->next)
+		cnt += publish_ent(n);
+	len = sizeof(*t) + cnt * sizeof(*r);
+	if (len > size) {
+		void *p = realloc(t, len);
+
+		if (p == NULL)
+			return;
+		t = p;
+		size = len;
+	}
+
+	memset(t, 0, len);
+	strncpy(t->source, info_source, sizeof(t->source) - 1);
+	t->count = cnt;
+	t->size = sizeof(*r);
+	r = (struct nstat_rec *)(t + 1);
+	for (n = kern_db; n; n = n->next) {
+		if (!publish_ent(n))
+			continue;
+		strcpy(r->id, n->id);
+		r->val = n->val;
+		r->rate = n->rate;
+		r++;
+	}
+	statshm_publish(shm, t, len);
+}
+
+static int load_shm_db(void)
+{
+	struct nstat_ent *n, **tail = &kern_db;
+	struct statshm_table *t;
+	struct nstat_rec *r;
+	char name[32];
+	char *buf;
+	size_t len;
+	int i;
+
+	sprintf(name, "/nstat%d", getuid());
+	if (statshm_read(name, &buf, &len) &&
+	    statshm_read("/nstat0", &buf, &len))
+		return -1;
+	t = (struct statshm_table *)buf;
+	if (len < sizeof(*t) || t->size != sizeof(*r) ||
+	    len != sizeof(*t) + (size_t)t->count * sizeof(*r)) {
+		free(buf);
+		return -1;
+	}
+
+	t->source[sizeof(t->source) - 1] = 0;
+	if (info_source[0] && strcmp(info_source, t->source))
+		source_mismatch = 1;
+	strncpy(info_source, t->source, sizeof(info_source) - 1);
+
+	while (*tail)
+		tail = &(*tail)->next;
+	r = (struct nstat_rec *)(t + 1);
+	for (i = 0; i < t->count; i++, r++) {
+		if ((n = malloc(sizeof(*n))) == NULL)
+			abort();
+		n->id = strndup(r->id, sizeof(r->id));
+		n->val = r->val;
+		n->ival = (unsigned long)r->val;
+		n->rate = r->rate;
+		n->next = NULL;
+		*tail = n;
+		tail = &n->next;
+	}
+	free(buf);
+	return 0;
+}
+
+static int load_sock_db(int fd)
+{
+	FILE *sfp = fdopen(fd, "r");
+
+	if (sfp == NULL)
+		return -1;
+	load_good_table(sfp);
+	fclose(sfp);
+	return 0;
+}
+
 static int children;
 
 void sigchild(int signo)
@@ -380,6 +493,7 @@ void server_loop(int fd)
 	load_netstat();
 	load_snmp6();
 	load_snmp();
+	publish_db();
 
 	for (;;) {
 		int status;
@@ -389,6 +503,7 @@ void server_loop(int fd)
 		tdiff = T_DIFF(now, snaptime);
 		if (tdiff >= scan_interval) {
 			update_db(tdiff);
+			publish_db();
 			snaptime = now;
 			tdiff = 0;
 		}
@@ -497,6 +612,8 @@ int main(int argc, char *argv[])
 	sprintf(sun.sun_path+1, "nstat%d", getuid());
 
 	if (scan_interval > 0) {
+		char shm_name[32];
+
 		if (time_constant == 0)
 			time_constant = 60;
 		time_constant *= 1000;
@@ -517,6 +634,8 @@ int main(int argc, char *argv[])
 			perror("nstat: daemon");
 			exit(-1);
 		}
+		sprintf(shm_name, "/nstat%d", getuid());
+		shm = statshm_create(shm_name);
 		signal(SIGPIPE, SIG_IGN);
 		signal(SIGCHLD, sigchild);
 		server_loop(fd);
@@ -578,18 +697,16 @@ int main(int argc, char *argv[])
 		kern_db = NULL;
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "nstat0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		FILE *sfp = fdopen(fd, "r");
-		load_good_table(sfp);
+	if (load_shm_db() == 0 ||
+	    ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+	     (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
+	      || (strcpy(sun.sun_path+1, "nstat0"),
+		  connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
+	     && verify_forging(fd) == 0 && load_sock_db(fd) == 0)) {
 		if (hist_db && source_mismatch) {
 			fprintf(stderr, "nstat: history is stale, ignoring it.\n");
 			hist_db = NULL;
 		}
-		fclose(sfp);
 	} else {
 		if (fd >= 0)
 			close(fd);
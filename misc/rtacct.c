@@ -30,6 +30,7 @@
 #include <math.h>
 
 #include "rt_names.h"
+#include "statshm.h"
 
 #include <SNAPSHOT.h>
 
@@ -75,6 +76,7 @@ struct rtacct_data kern_db_static;
 
 struct rtacct_data *kern_db = &kern_db_static;
 struct rtacct_data *hist_db;
+static struct statshm *shm;
 
 void nread(int fd, char *buf, int tot)
 {
@@ -361,6 +363,39 @@ void pad_kern_table(struct rtacct_data *dat, __u32 *ival)
 		dat->val[i] = ival[i];
 }
 
+/* Clients copy the table from shared memory, see load_shm_db() */
+static void publish_db(void)
+{
+	if (shm)
+		statshm_publish(shm, kern_db, sizeof(*kern_db));
+}
+
+static int load_shm_db(void)
+{
+	char name[32];
+	char *buf;
+	size_t len;
+
+	sprintf(name, "/rtacct%d", getuid());
+	if (statshm_read(name, &buf, &len) &&
+	    statshm_read("/rtacct0", &buf, &len))
+		return -1;
+	if (len != sizeof(*kern_db)) {
+		free(buf);
+		return -1;
+	}
+	memcpy(kern_db, buf, len);
+	free(buf);
+	return 0;
+}
+
+static int load_sock_db(int fd)
+{
+	nread(fd, (char*)kern_db, sizeof(*kern_db));
+	close(fd);
+	return 0;
+}
+
 void server_loop(int fd)
 {
 	struct timeval snaptime = { 0 };
@@ -374,6 +409,7 @@ void server_loop(int fd)
 		scan_interval/1000, time_constant/1000);
 
 	pad_kern_table(kern_db, read_kern_table(kern_db->ival));
+	publish_db();
 
 	for (;;) {
 		int status;
@@ -383,6 +419,7 @@ void server_loop(int fd)
 		tdiff = T_DIFF(now, snaptime);
 		if (tdiff >= scan_interval) {
 			update_db(tdiff);
+			publish_db();
 			snaptime = now;
 			tdiff = 0;
 		}
@@ -508,6 +545,8 @@ int main(int argc, char *argv[])
 	sprintf(sun.sun_path+1, "rtacct%d", getuid());
 
 	if (scan_interval > 0) {
+		char shm_name[32];
+
 		if (time_constant == 0)
 			time_constant = 60;
 		time_constant *= 1000;
@@ -528,6 +567,8 @@ int main(int argc, char *argv[])
 			perror("rtacct: daemon");
 			exit(-1);
 		}
+		sprintf(shm_name, "/rtacct%d", getuid());
+		shm = statshm_create(shm_name);
 		signal(SIGPIPE, SIG_IGN);
 		signal(SIGCHLD, sigchild);
 		server_loop(fd);
@@ -596,18 +637,17 @@ int main(int argc, char *argv[])
 		close(fd);
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "rtacct0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		nread(fd, (char*)kern_db, sizeof(*kern_db));
+	if (load_shm_db() == 0 ||
+	    ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+	     (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
+	      || (strcpy(sun.sun_path+1, "rtacct0"),
+		  connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
+	     && verify_forging(fd) == 0 && load_sock_db(fd) == 0)) {
 		if (hist_db && hist_db->signature[0] &&
 		    strcmp(kern_db->signature, hist_db->signature)) {
 			fprintf(stderr, "rtacct: history is stale, ignoring it.\n");
 			hist_db = NULL;
 		}
-		close(fd);
 	} else {
 		if (fd >= 0)
 			close(fd);
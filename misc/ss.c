@@ -17,6 +17,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
 #include <string.h>
 #include <errno.h>
@@ -26,6 +27,7 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "utils.h"
 #include "rt_names.h"
@@ -34,7 +36,11 @@
 #include "SNAPSHOT.h"
 
 #include <netinet/tcp.h>
+#include <linux/sock_diag.h>
 #include <linux/inet_diag.h>
+#include <linux/unix_diag.h>
+#include <linux/packet_diag.h>
+#include <linux/netlink_diag.h>
 
 int resolve_hosts = 0;
 int resolve_services = 1;
@@ -42,6 +48,7 @@ int preferred_family = AF_UNSPEC;
 int show_options = 0;
 int show_details = 0;
 int show_users = 0;
+int lazy_users = 0;
 int show_mem = 0;
 int show_tcpinfo = 0;
 
@@ -95,12 +102,15 @@ enum {
 
 #include "ssfilter.h"
 
+struct ssf_prog;
+
 struct filter
 {
 	int dbs;
 	int states;
 	int families;
 	struct ssfilter *f;
+	struct ssf_prog *prog;
 };
 
 struct filter default_filter = {
@@ -203,14 +213,40 @@ struct user_ent {
 	char		process[0];
 };
 
-#define USER_ENT_HASH_SIZE	256
-struct user_ent *user_ent_hash[USER_ENT_HASH_SIZE];
+#define USER_ENT_HASH_MIN	256
+static struct user_ent **user_ent_hash;
+static unsigned int user_ent_hash_size;
+static unsigned int user_ent_count;
 
 static int user_ent_hashfn(unsigned int ino)
 {
 	int val = (ino >> 24) ^ (ino >> 16) ^ (ino >> 8) ^ ino;
 
-	return val & (USER_ENT_HASH_SIZE - 1);
+	return val & (user_ent_hash_size - 1);
+}
+
+static void user_ent_hash_grow(void)
+{
+	struct user_ent **old = user_ent_hash;
+	unsigned int i, old_size = user_ent_hash_size;
+
+	user_ent_hash_size = old_size ? old_size * 2 : USER_ENT_HASH_MIN;
+	user_ent_hash = calloc(user_ent_hash_size, sizeof(*user_ent_hash));
+	if (!user_ent_hash)
+		abort();
+
+	for (i = 0; i < old_size; i++) {
+		struct user_ent *p, *next;
+
+		for (p = old[i]; p; p = next) {
+			struct user_ent **pp = &user_ent_hash[user_ent_hashfn(p->ino)];
+
+			next = p->next;
+			p->next = *pp;
+			*pp = p;
+		}
+	}
+	free(old);
 }
 
 static void user_ent_add(unsigned int ino, const char *process, int pid, int fd)
@@ -218,6 +254,9 @@ static void user_ent_add(unsigned int ino, const char *process, int pid, int fd)
 	struct user_ent *p, **pp;
 	int str_len;
 
+	if (user_ent_count >= user_ent_hash_size)
+		user_ent_hash_grow();
+
 	str_len = strlen(process) + 1;
 	p = malloc(sizeof(struct user_ent) + str_len);
 	if (!p)
@@ -231,75 +270,176 @@ static void user_ent_add(unsigned int ino, const char *process, int pid, int fd)
 	pp = &user_ent_hash[user_ent_hashfn(ino)];
 	p->next = *pp;
 	*pp = p;
+	user_ent_count++;
 }
 
-static void user_ent_hash_build(void)
+static int user_ent_known(unsigned int ino)
 {
-	const char *root = getenv("PROC_ROOT") ? : "/proc/";
-	struct dirent *d;
-	char name[1024];
-	int nameoff;
-	DIR *dir;
+	struct user_ent *p;
+
+	if (!user_ent_hash)
+		return 0;
+	for (p = user_ent_hash[user_ent_hashfn(ino)]; p; p = p->next)
+		if (p->ino == ino)
+			return 1;
+	return 0;
+}
 
-	strcpy(name, root);
-	if (strlen(name) == 0 || name[strlen(name)-1] != '/')
-		strcat(name, "/");
+/* The /proc walk is resumable, one process per step, so that lazy
+ * lookups can stop as soon as the inodes asked for have been seen.
+ * Directories are read with getdents64 into buffers reused for the
+ * whole walk and every path is resolved relative to an open fd.
+ */
+struct linux_dirent64 {
+	__u64		d_ino;
+	__s64		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[0];
+};
 
-	nameoff = strlen(name);
+static struct {
+	int	proc_fd;
+	int	started;
+	int	done;
+	int	pos;
+	int	len;
+	char	buf[32768];
+	char	fdbuf[32768];
+} user_walk = { .proc_fd = -1 };
+
+static int user_dents_num(const char *name)
+{
+	int n = 0;
 
-	dir = opendir(name);
-	if (!dir)
-		return;
+	if (*name == 0)
+		return -1;
+	for (; *name; name++) {
+		if (*name < '0' || *name > '9')
+			return -1;
+		n = n*10 + (*name - '0');
+	}
+	return n;
+}
 
-	while ((d = readdir(dir)) != NULL) {
-		struct dirent *d1;
-		char process[16];
-		int pid, pos;
-		DIR *dir1;
-		char crap;
+static void user_ent_scan_pid(int pid)
+{
+	char name[64], process[16];
+	int fd_fd, len;
 
-		if (sscanf(d->d_name, "%d%c", &pid, &crap) != 1)
-			continue;
+	snprintf(name, sizeof(name), "%d/fd", pid);
+	fd_fd = openat(user_walk.proc_fd, name, O_RDONLY|O_DIRECTORY);
+	if (fd_fd < 0)
+		return;
 
-		sprintf(name + nameoff, "%d/fd/", pid);
-		pos = strlen(name);
-		if ((dir1 = opendir(name)) == NULL)
-			continue;
+	process[0] = '\0';
 
-		process[0] = '\0';
+	while ((len = syscall(SYS_getdents64, fd_fd, user_walk.fdbuf,
+			      sizeof(user_walk.fdbuf))) > 0) {
+		int pos;
 
-		while ((d1 = readdir(dir1)) != NULL) {
+		for (pos = 0; pos < len; ) {
+			struct linux_dirent64 *d1 = (void *)(user_walk.fdbuf + pos);
 			const char *pattern = "socket:[";
 			unsigned int ino;
 			char lnk[64];
-			int fd;
+			int fd, n;
+
+			pos += d1->d_reclen;
 
-			if (sscanf(d1->d_name, "%d%c", &fd, &crap) != 1)
+			if ((fd = user_dents_num(d1->d_name)) < 0)
 				continue;
 
-			sprintf(name+pos, "%d", fd);
-			if (readlink(name, lnk, sizeof(lnk)-1) < 0 ||
-			    strncmp(lnk, pattern, strlen(pattern)))
+			n = readlinkat(fd_fd, d1->d_name, lnk, sizeof(lnk)-1);
+			if (n < 0)
+				continue;
+			lnk[n] = 0;
+			if (strncmp(lnk, pattern, strlen(pattern)))
 				continue;
 
 			sscanf(lnk, "socket:[%u]", &ino);
 
 			if (process[0] == '\0') {
-				char tmp[1024];
-				FILE *fp;
-
-				snprintf(tmp, sizeof(tmp), "%s/%d/stat", root, pid);
-				if ((fp = fopen(tmp, "r")) != NULL) {
-					fscanf(fp, "%*d (%[^)])", process);
-					fclose(fp);
+				char stat[128];
+				int sfd;
+
+				snprintf(name, sizeof(name), "%d/stat", pid);
+				if ((sfd = openat(user_walk.proc_fd, name, O_RDONLY)) >= 0) {
+					n = read(sfd, stat, sizeof(stat)-1);
+					if (n > 0) {
+						stat[n] = 0;
+						sscanf(stat, "%*d (%15[^)])", process);
+					}
+					close(sfd);
 				}
 			}
 
 			user_ent_add(ino, process, pid, fd);
 		}
-		closedir(dir1);
 	}
-	closedir(dir);
+	close(fd_fd);
+}
+
+/* Scan the next process.  Returns 0 once the walk is complete. */
+static int user_ent_walk_step(void)
+{
+	if (user_walk.done)
+		return 0;
+
+	if (!user_walk.started) {
+		const char *root = getenv("PROC_ROOT") ? : "/proc/";
+
+		user_walk.started = 1;
+		if (!user_ent_hash)
+			user_ent_hash_grow();
+		user_walk.proc_fd = open(root, O_RDONLY|O_DIRECTORY);
+		if (user_walk.proc_fd < 0)
+			goto done;
+	}
+
+	while (1) {
+		struct linux_dirent64 *d;
+		int pid;
+
+		if (user_walk.pos >= user_walk.len) {
+			user_walk.len = syscall(SYS_getdents64, user_walk.proc_fd,
+						user_walk.buf, sizeof(user_walk.buf));
+			user_walk.pos = 0;
+			if (user_walk.len <= 0)
+				goto done;
+		}
+
+		d = (void *)(user_walk.buf + user_walk.pos);
+		user_walk.pos += d->d_reclen;
+
+		if ((pid = user_dents_num(d->d_name)) < 0)
+			continue;
+
+		user_ent_scan_pid(pid);
+		return 1;
+	}
+
+done:
+	if (user_walk.proc_fd >= 0)
+		close(user_walk.proc_fd);
+	user_walk.proc_fd = -1;
+	user_walk.done = 1;
+	return 0;
+}
+
+/* Called on the first lookup: nothing is read from /proc unless
+ * some socket is actually going to be printed.  In lazy mode the walk
+ * only goes as far as needed to find each inode asked for.
+ */
+static void user_ent_resolve(unsigned int ino)
+{
+	if (lazy_users) {
+		while (!user_ent_known(ino) && user_ent_walk_step())
+			;
+	} else {
+		while (user_ent_walk_step())
+			;
+	}
 }
 
 int find_users(unsigned ino, char *buf, int buflen)
@@ -311,6 +451,10 @@ int find_users(unsigned ino, char *buf, int buflen)
 	if (!ino)
 		return 0;
 
+	user_ent_resolve(ino);
+	if (!user_ent_hash)
+		return 0;
+
 	p = user_ent_hash[user_ent_hashfn(ino)];
 	ptr = buf;
 	while (p) {
@@ -691,13 +835,14 @@ int unix_match(const inet_prefix *a, const inet_prefix *p)
 	return !fnmatch(pattern, addr, 0);
 }
 
-int run_ssfilter(struct ssfilter *f, struct tcpstat *s)
+static int ephemeral_low, ephemeral_high = 65535;
+
+/* Evaluate a single condition of the filter tree. */
+static int ssfilter_leaf(struct ssfilter *f, struct tcpstat *s)
 {
 	switch (f->type) {
 		case SSF_S_AUTO:
 	{
-                static int low, high=65535;
-
 		if (s->local.family == AF_UNIX) {
 			char *p;
 			memcpy(&p, s->local.data, sizeof(p));
@@ -709,14 +854,7 @@ int run_ssfilter(struct ssfilter *f, struct tcpstat *s)
 		if (s->local.family == AF_NETLINK)
 			return s->lport < 0;
 
-                if (!low) {
-			FILE *fp = ephemeral_ports_open();
-			if (fp) {
-				fscanf(fp, "%d%d", &low, &high);
-				fclose(fp);
-			}
-		}
-		return s->lport >= low && s->lport <= high;
+		return s->lport >= ephemeral_low && s->lport <= ephemeral_high;
 	}
 		case SSF_DCOND:
 	{
@@ -770,19 +908,364 @@ int run_ssfilter(struct ssfilter *f, struct tcpstat *s)
 		struct aafilter *a = (void*)f->pred;
 		return s->lport <= a->port;
 	}
-
-		/* Yup. It is recursion. Sorry. */
-		case SSF_AND:
-		return run_ssfilter(f->pred, s) && run_ssfilter(f->post, s);
-		case SSF_OR:
-		return run_ssfilter(f->pred, s) || run_ssfilter(f->post, s);
-		case SSF_NOT:
-		return !run_ssfilter(f->pred, s);
 		default:
 		abort();
 	}
 }
 
+/* The filter tree is compiled once into a flat program.  Every
+ * instruction tests one condition and jumps forward to "yes" or "no";
+ * jumping to len accepts the socket, to len+1 rejects it.  Runs of
+ * ORed host conditions sharing a port are merged into one sorted
+ * address set per prefix length, runs of ORed port conditions into a
+ * port bitmap.
+ */
+enum {
+	SSF_OP_LEAF,		/* evaluate the tree node */
+	SSF_OP_PORTS,		/* port is in bitmap */
+	SSF_OP_ADDRS,		/* port matches and address is in set */
+};
+
+struct ssf_addrgrp
+{
+	int		bitlen;
+	int		v4;
+	int		cnt;
+	__u32		(*keys)[4];
+};
+
+struct ssf_op
+{
+	int			code;
+	int			yes;
+	int			no;
+	int			remote;
+	int			port;
+	struct ssfilter		*leaf;
+	unsigned char		*ports;
+	int			ngrp;
+	struct ssf_addrgrp	*grp;
+};
+
+struct ssf_prog
+{
+	int		len;
+	struct ssf_op	ops[0];
+};
+
+/* Conditions that can share one instruction when ORed together */
+static int ssf_class(struct ssfilter *f, int *remote, int *port)
+{
+	struct aafilter *a;
+
+	if (f->type != SSF_SCOND && f->type != SSF_DCOND)
+		return SSF_OP_LEAF;
+	a = (void*)f->pred;
+	if (a->addr.family == AF_UNIX)
+		return SSF_OP_LEAF;
+
+	*remote = f->type == SSF_DCOND;
+	*port = a->port;
+	if (a->addr.bitlen)
+		return SSF_OP_ADDRS;
+	if (a->port >= 0 && a->port <= 65535)
+		return SSF_OP_PORTS;
+	return SSF_OP_LEAF;
+}
+
+static int ssf_or_flatten(struct ssfilter *f, struct ssfilter **v, int n)
+{
+	if (f->type != SSF_OR) {
+		if (v)
+			v[n] = f;
+		return n + 1;
+	}
+	n = ssf_or_flatten(f->pred, v, n);
+	return ssf_or_flatten(f->post, v, n);
+}
+
+/* Split the operands of an OR chain into runs executed as one
+ * instruction each.  grp[i] is the run of operand i; returns the
+ * number of runs.
+ */
+static int ssf_or_group(struct ssfilter **v, int n, int *grp)
+{
+	int i, j, runs = 0;
+
+	for (i = 0; i < n; i++) {
+		int ci, ri = 0, pi = 0;
+
+		grp[i] = -1;
+		ci = ssf_class(v[i], &ri, &pi);
+		if (ci != SSF_OP_LEAF) {
+			for (j = 0; j < i; j++) {
+				int rj = 0, pj = 0;
+
+				if (ssf_class(v[j], &rj, &pj) == ci && rj == ri &&
+				    (ci == SSF_OP_PORTS || pj == pi)) {
+					grp[i] = grp[j];
+					break;
+				}
+			}
+		}
+		if (grp[i] < 0)
+			grp[i] = runs++;
+	}
+	return runs;
+}
+
+static int ssf_size(struct ssfilter *f);
+
+static int ssf_or_size(struct ssfilter *f)
+{
+	int n = ssf_or_flatten(f, NULL, 0);
+	struct ssfilter *v[n];
+	int grp[n];
+	int i, g, runs, size = 0;
+	int remote, port;
+
+	ssf_or_flatten(f, v, 0);
+	runs = ssf_or_group(v, n, grp);
+	for (g = 0; g < runs; g++) {
+		for (i = 0; grp[i] != g; i++)
+			;
+		if (ssf_class(v[i], &remote, &port) == SSF_OP_LEAF)
+			size += ssf_size(v[i]);
+		else
+			size++;
+	}
+	return size;
+}
+
+static int ssf_size(struct ssfilter *f)
+{
+	switch (f->type) {
+	case SSF_AND:
+		return ssf_size(f->pred) + ssf_size(f->post);
+	case SSF_OR:
+		return ssf_or_size(f);
+	case SSF_NOT:
+		return ssf_size(f->pred);
+	default:
+		return 1;
+	}
+}
+
+static void ssf_mask(__u32 *key, const __u32 *data, int bitlen)
+{
+	int i;
+
+	for (i = 0; i < 4; i++, bitlen -= 32) {
+		if (bitlen >= 32)
+			key[i] = data[i];
+		else if (bitlen > 0)
+			key[i] = data[i] & htonl(0xffffffff << (32 - bitlen));
+		else
+			key[i] = 0;
+	}
+}
+
+static int ssf_key_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 4*sizeof(__u32));
+}
+
+static void ssf_addrs_add(struct ssf_op *op, struct aafilter *a)
+{
+	for (; a; a = a->next) {
+		struct ssf_addrgrp *g;
+		int bitlen = a->addr.bitlen, v4 = a->addr.family == AF_INET;
+		int i;
+
+		if (bitlen > 128)
+			bitlen = 128;
+		for (i = 0; i < op->ngrp; i++)
+			if (op->grp[i].bitlen == bitlen && op->grp[i].v4 == v4)
+				break;
+		if (i == op->ngrp) {
+			op->grp = realloc(op->grp, (op->ngrp + 1) * sizeof(*op->grp));
+			if (!op->grp)
+				abort();
+			memset(&op->grp[i], 0, sizeof(op->grp[i]));
+			op->grp[i].bitlen = bitlen;
+			op->grp[i].v4 = v4;
+			op->ngrp++;
+		}
+		g = &op->grp[i];
+		g->keys = realloc(g->keys, (g->cnt + 1) * sizeof(*g->keys));
+		if (!g->keys)
+			abort();
+		ssf_mask(g->keys[g->cnt++], a->addr.data, bitlen);
+	}
+}
+
+static int ssf_emit(struct ssf_prog *p, int pc, struct ssfilter *f,
+		    int yes, int no);
+
+static int ssf_emit_or(struct ssf_prog *p, int pc, struct ssfilter *f,
+		       int yes, int no)
+{
+	int n = ssf_or_flatten(f, NULL, 0);
+	struct ssfilter *v[n];
+	int grp[n];
+	int i, g, runs, end = pc + ssf_or_size(f);
+
+	ssf_or_flatten(f, v, 0);
+	runs = ssf_or_group(v, n, grp);
+	for (g = 0; g < runs; g++) {
+		struct ssf_op *op;
+		int remote = 0, port = 0, code;
+		int next;
+
+		for (i = 0; grp[i] != g; i++)
+			;
+		code = ssf_class(v[i], &remote, &port);
+
+		if (code == SSF_OP_LEAF) {
+			next = pc + ssf_size(v[i]);
+			ssf_emit(p, pc, v[i], yes, g == runs - 1 ? no : next);
+			pc = next;
+			continue;
+		}
+
+		next = pc + 1;
+		op = &p->ops[pc];
+		memset(op, 0, sizeof(*op));
+		op->code = code;
+		op->yes = yes;
+		op->no = g == runs - 1 ? no : next;
+		op->remote = remote;
+		op->port = code == SSF_OP_ADDRS ? port : -1;
+
+		if (code == SSF_OP_PORTS) {
+			op->ports = calloc(65536/8, 1);
+			if (!op->ports)
+				abort();
+		}
+		for (; i < n; i++) {
+			struct aafilter *a = (void*)v[i]->pred;
+
+			if (grp[i] != g)
+				continue;
+			if (code == SSF_OP_PORTS)
+				op->ports[a->port >> 3] |= 1 << (a->port & 7);
+			else
+				ssf_addrs_add(op, a);
+		}
+		for (i = 0; i < op->ngrp; i++)
+			qsort(op->grp[i].keys, op->grp[i].cnt,
+			      sizeof(*op->grp[i].keys), ssf_key_cmp);
+		pc = next;
+	}
+	return end;
+}
+
+/* Emit f at pc; returns the first pc after it. */
+static int ssf_emit(struct ssf_prog *p, int pc, struct ssfilter *f,
+		    int yes, int no)
+{
+	struct ssf_op *op;
+
+	switch (f->type) {
+	case SSF_AND:
+	{
+		int next = pc + ssf_size(f->pred);
+
+		ssf_emit(p, pc, f->pred, next, no);
+		return ssf_emit(p, next, f->post, yes, no);
+	}
+	case SSF_OR:
+		return ssf_emit_or(p, pc, f, yes, no);
+	case SSF_NOT:
+		return ssf_emit(p, pc, f->pred, no, yes);
+	case SSF_S_AUTO:
+		if (!ephemeral_low) {
+			FILE *fp = ephemeral_ports_open();
+			if (fp) {
+				fscanf(fp, "%d%d", &ephemeral_low, &ephemeral_high);
+				fclose(fp);
+			}
+		}
+		/* fall through */
+	default:
+		op = &p->ops[pc];
+		memset(op, 0, sizeof(*op));
+		op->code = SSF_OP_LEAF;
+		op->leaf = f;
+		op->yes = yes;
+		op->no = no;
+		return pc + 1;
+	}
+}
+
+static struct ssf_prog *ssfilter_compile(struct ssfilter *f)
+{
+	int len = ssf_size(f);
+	struct ssf_prog *p;
+
+	p = malloc(sizeof(*p) + len * sizeof(struct ssf_op));
+	if (!p)
+		abort();
+	p->len = len;
+	ssf_emit(p, 0, f, len, len + 1);
+	return p;
+}
+
+static int ssf_addrs_match(const struct ssf_op *op, const inet_prefix *a)
+{
+	int mapped = a->family == AF_INET6 &&
+		     a->data[0] == 0 && a->data[1] == 0 &&
+		     a->data[2] == htonl(0xffff);
+	int i;
+
+	for (i = 0; i < op->ngrp; i++) {
+		const struct ssf_addrgrp *g = &op->grp[i];
+		__u32 key[4];
+
+		ssf_mask(key, a->data, g->bitlen);
+		if (bsearch(key, g->keys, g->cnt, sizeof(*g->keys), ssf_key_cmp))
+			return 1;
+
+		/* Cursed "v4 mapped" addresses, see inet2_addr_match() */
+		if (g->v4 && mapped) {
+			__u32 tmp[4] = { a->data[3], a->data[1], a->data[2], a->data[3] };
+
+			ssf_mask(key, tmp, g->bitlen);
+			if (bsearch(key, g->keys, g->cnt, sizeof(*g->keys), ssf_key_cmp))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+int run_ssfilter(const struct filter *f, struct tcpstat *s)
+{
+	const struct ssf_prog *p = f->prog;
+	int pc = 0;
+
+	while (pc < p->len) {
+		const struct ssf_op *op = &p->ops[pc];
+		int port = op->remote ? s->rport : s->lport;
+		int match;
+
+		switch (op->code) {
+		case SSF_OP_PORTS:
+			match = port >= 0 && port <= 65535 &&
+				(op->ports[port >> 3] & (1 << (port & 7)));
+			break;
+		case SSF_OP_ADDRS:
+			match = (op->port == -1 || op->port == port) &&
+				ssf_addrs_match(op, op->remote ? &s->remote : &s->local);
+			break;
+		default:
+			match = ssfilter_leaf(op->leaf, s);
+			break;
+		}
+		pc = match ? op->yes : op->no;
+	}
+	return pc == p->len;
+}
+
 /* Relocate external jumps by reloc. */
 static void ssfilter_patch(char *a, int len, int reloc)
 {
@@ -1208,7 +1691,7 @@ static int tcp_show_line(char *line, const struct filter *f, int family)
 		s.local.bytelen = s.remote.bytelen = 16;
 	}
 
-	if (f->f && run_ssfilter(f->f, &s) == 0)
+	if (f->f && run_ssfilter(f, &s) == 0)
 		return 0;
 
 	opt[0] = 0;
@@ -1419,7 +1902,7 @@ static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f)
 	memcpy(s.local.data, r->id.idiag_src, s.local.bytelen);
 	memcpy(s.remote.data, r->id.idiag_dst, s.local.bytelen);
 
-	if (f && f->f && run_ssfilter(f->f, &s) == 0)
+	if (f && f->f && run_ssfilter(f, &s) == 0)
 		return 0;
 
 	if (netid_width)
@@ -1466,78 +1949,541 @@ static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f)
 	return 0;
 }
 
-static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype)
+/* SOCK_DIAG_BY_FAMILY dumps.
+ *
+ * When more than one table is requested, diag_prefetch() opens a
+ * socket per dump and starts a thread receiving its replies, so the
+ * kernel walks all socket tables at once.  The replies are queued per
+ * dump and consumed by sockdiag_dump() in the usual output order, so
+ * the output is the same as with serial dumps.
+ */
+
+#define SOCKDIAG_SEQ	123456
+#define DIAG_JOB_MAXQ	(32*1024*1024)
+
+struct diag_chunk
 {
-	int fd;
-	struct sockaddr_nl nladdr;
-	struct {
-		struct nlmsghdr nlh;
-		struct inet_diag_req r;
-	} req;
-	char    *bc = NULL;
-	int	bclen;
-	struct msghdr msg;
-	struct rtattr rta;
-	char	buf[8192];
-	struct iovec iov[3];
+	struct diag_chunk	*next;
+	int			len;
+	char			data[0];
+};
 
-	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_INET_DIAG)) < 0)
-		return -1;
+struct diag_job
+{
+	struct diag_job		*next;
+	char			req[64];
+	int			reqlen;
+	char			*bc;
+	int			bclen;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct diag_chunk	*head;
+	struct diag_chunk	**tail;
+	int			queued;
+	int			done;
+	int			abandoned;
+	int			err;
+};
 
-	memset(&nladdr, 0, sizeof(nladdr));
-	nladdr.nl_family = AF_NETLINK;
+static struct diag_job *diag_jobs;
 
-	req.nlh.nlmsg_len = sizeof(req);
-	req.nlh.nlmsg_type = socktype;
-	req.nlh.nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
-	req.nlh.nlmsg_pid = 0;
-	req.nlh.nlmsg_seq = 123456;
-	memset(&req.r, 0, sizeof(req.r));
-	req.r.idiag_family = AF_INET;
-	req.r.idiag_states = f->states;
-	if (show_mem)
-		req.r.idiag_ext |= (1<<(INET_DIAG_MEMINFO-1));
+static int sockdiag_family(const void *req)
+{
+	return ((const struct sock_diag_req *)req)->sdiag_family;
+}
 
-	if (show_tcpinfo) {
-		req.r.idiag_ext |= (1<<(INET_DIAG_INFO-1));
-		req.r.idiag_ext |= (1<<(INET_DIAG_VEGASINFO-1));
-		req.r.idiag_ext |= (1<<(INET_DIAG_CONG-1));
-	}
+/* Only inet dumps understand the filter bytecode */
+static int sockdiag_bytecode(struct filter *f, const void *req, char **bc)
+{
+	*bc = NULL;
+	if (!f->f ||
+	    (sockdiag_family(req) != AF_INET && sockdiag_family(req) != AF_INET6))
+		return 0;
+	return ssfilter_bytecompile(f->f, bc);
+}
 
-	iov[0] = (struct iovec){
-		.iov_base = &req,
-		.iov_len = sizeof(req)
+static int sockdiag_send(int fd, void *req, int reqlen, char *bc, int bclen)
+{
+	struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+	struct nlmsghdr nlh = {
+		.nlmsg_len = NLMSG_LENGTH(reqlen),
+		.nlmsg_type = SOCK_DIAG_BY_FAMILY,
+		.nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST,
+		.nlmsg_seq = SOCKDIAG_SEQ,
 	};
-	if (f->f) {
-		bclen = ssfilter_bytecompile(f->f, &bc);
+	struct rtattr rta;
+	struct iovec iov[4];
+	struct msghdr msg;
+
+	iov[0] = (struct iovec){ &nlh, sizeof(nlh) };
+	iov[1] = (struct iovec){ req, reqlen };
+	if (bc) {
 		rta.rta_type = INET_DIAG_REQ_BYTECODE;
 		rta.rta_len = RTA_LENGTH(bclen);
-		iov[1] = (struct iovec){ &rta, sizeof(rta) };
-		iov[2] = (struct iovec){ bc, bclen };
-		req.nlh.nlmsg_len += RTA_LENGTH(bclen);
+		iov[2] = (struct iovec){ &rta, sizeof(rta) };
+		iov[3] = (struct iovec){ bc, bclen };
+		nlh.nlmsg_len += RTA_LENGTH(bclen);
 	}
 
 	msg = (struct msghdr) {
 		.msg_name = (void*)&nladdr,
 		.msg_namelen = sizeof(nladdr),
 		.msg_iov = iov,
-		.msg_iovlen = f->f ? 3 : 1,
+		.msg_iovlen = bc ? 4 : 2,
 	};
 
-	if (sendmsg(fd, &msg, 0) < 0)
-		return -1;
+	return sendmsg(fd, &msg, 0);
+}
 
-	iov[0] = (struct iovec){
-		.iov_base = buf,
-		.iov_len = sizeof(buf)
-	};
+/* Walk one datagram of replies.  Returns 1 once the dump is complete,
+ * 0 if more is to come and -1 with errno set on failure.  With a NULL
+ * show() it only looks for the end of the dump.
+ */
+static int sockdiag_parse(char *buf, int status, struct filter *f,
+			  int (*show)(struct nlmsghdr *, struct filter *, void *),
+			  void *arg)
+{
+	struct nlmsghdr *h = (struct nlmsghdr*)buf;
 
-	while (1) {
-		int status;
-		struct nlmsghdr *h;
+	while (NLMSG_OK(h, status)) {
+		if (h->nlmsg_seq != SOCKDIAG_SEQ)
+			goto skip_it;
 
-		msg = (struct msghdr) {
-			(void*)&nladdr, sizeof(nladdr),
+		if (h->nlmsg_type == NLMSG_DONE) {
+			int *ret = NLMSG_DATA(h);
+
+			/* A missing protocol handler is reported here */
+			if (h->nlmsg_len >= NLMSG_LENGTH(sizeof(*ret)) &&
+			    *ret < 0) {
+				errno = -*ret;
+				return -1;
+			}
+			return 1;
+		}
+		if (h->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *e = (struct nlmsgerr*)NLMSG_DATA(h);
+			if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr)))
+				errno = EINVAL;
+			else
+				errno = -e->error;
+			return -1;
+		}
+		if (show && show(h, f, arg) < 0)
+			return -1;
+skip_it:
+		h = NLMSG_NEXT(h, status);
+	}
+	return 0;
+}
+
+/* With -r the inet replies are held back until the dump is complete,
+ * and their addresses handed to the resolver first, so the names are
+ * looked up in parallel rather than one at a time as lines are printed.
+ */
+static int sockdiag_hold(const void *req)
+{
+	return resolve_hosts && (sockdiag_family(req) == AF_INET ||
+				 sockdiag_family(req) == AF_INET6);
+}
+
+static int prefetch_show(struct nlmsghdr *h, struct filter *f, void *arg)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+
+	if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*r)))
+		return 0;
+	if (r->idiag_family == AF_INET) {
+		/* formatted_print() shows these as '*' */
+		if (r->id.idiag_src[0])
+			resolve_prefetch(AF_INET, 4, r->id.idiag_src);
+		if (r->id.idiag_dst[0])
+			resolve_prefetch(AF_INET, 4, r->id.idiag_dst);
+	} else if (r->idiag_family == AF_INET6) {
+		resolve_prefetch(AF_INET6, 16, r->id.idiag_src);
+		resolve_prefetch(AF_INET6, 16, r->id.idiag_dst);
+	}
+	return 0;
+}
+
+/* Feed the held replies to show() and free them */
+static int sockdiag_replay(struct diag_chunk *held, struct filter *f,
+			   int (*show)(struct nlmsghdr *, struct filter *, void *),
+			   void *arg)
+{
+	struct diag_chunk *c;
+	int ret = 0;
+
+	while ((c = held) != NULL) {
+		held = c->next;
+		if (ret == 0)
+			ret = sockdiag_parse(c->data, c->len, f, show, arg);
+		free(c);
+	}
+	return ret;
+}
+
+static void *diag_job_run(void *arg)
+{
+	struct diag_job *job = arg;
+	char buf[32768];
+	int fd, err = 0, last = 0;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG)) < 0) {
+		err = errno;
+		goto out;
+	}
+	if (sockdiag_send(fd, job->req, job->reqlen, job->bc, job->bclen) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	while (!last) {
+		struct diag_chunk *c;
+		int status;
+
+		status = recv(fd, buf, sizeof(buf), 0);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		if (status == 0) {
+			err = EPIPE;
+			break;
+		}
+		last = sockdiag_parse(buf, status, NULL, NULL, NULL) != 0;
+
+		if ((c = malloc(sizeof(*c) + status)) == NULL) {
+			err = ENOMEM;
+			break;
+		}
+		c->next = NULL;
+		c->len = status;
+		memcpy(c->data, buf, status);
+
+		pthread_mutex_lock(&job->lock);
+		while (job->queued > DIAG_JOB_MAXQ && !job->abandoned)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->abandoned) {
+			pthread_mutex_unlock(&job->lock);
+			free(c);
+			break;
+		}
+		*job->tail = c;
+		job->tail = &c->next;
+		job->queued += status;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	job->err = err;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+static void diag_job_start(struct filter *f, void *req, int reqlen)
+{
+	struct diag_job *job;
+
+	if ((job = malloc(sizeof(*job))) == NULL)
+		return;
+	memset(job, 0, sizeof(*job));
+	memcpy(job->req, req, reqlen);
+	job->reqlen = reqlen;
+	job->bclen = sockdiag_bytecode(f, req, &job->bc);
+	job->tail = &job->head;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+
+	if (pthread_create(&job->thread, NULL, diag_job_run, job)) {
+		free(job->bc);
+		free(job);
+		return;
+	}
+	job->next = diag_jobs;
+	diag_jobs = job;
+}
+
+static struct diag_job *diag_job_find(void *req, int reqlen)
+{
+	struct diag_job **jp, *job;
+
+	for (jp = &diag_jobs; (job = *jp) != NULL; jp = &job->next) {
+		if (job->reqlen == reqlen && memcmp(job->req, req, reqlen) == 0) {
+			*jp = job->next;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static int diag_job_consume(struct diag_job *job, struct filter *f,
+			    int (*show)(struct nlmsghdr *, struct filter *, void *),
+			    void *arg)
+{
+	struct diag_chunk *c, *held = NULL, **htail = &held;
+	int hold = sockdiag_hold(job->req);
+	int ret = 0, saved_errno;
+
+	while (ret == 0) {
+		pthread_mutex_lock(&job->lock);
+		while (!job->head && !job->done)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if ((c = job->head) != NULL) {
+			if ((job->head = c->next) == NULL)
+				job->tail = &job->head;
+			job->queued -= c->len;
+			pthread_cond_broadcast(&job->cond);
+		}
+		pthread_mutex_unlock(&job->lock);
+
+		if (!c) {
+			errno = job->err ? : EPIPE;
+			ret = -1;
+			break;
+		}
+		if (hold) {
+			ret = sockdiag_parse(c->data, c->len, f,
+					     prefetch_show, NULL);
+			c->next = NULL;
+			*htail = c;
+			htail = &c->next;
+			continue;
+		}
+		ret = sockdiag_parse(c->data, c->len, f, show, arg);
+		free(c);
+	}
+	saved_errno = errno;
+	if (held) {
+		int err = sockdiag_replay(held, f, show, arg);
+
+		if (ret >= 0) {
+			ret = err;
+			saved_errno = errno;
+		}
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->abandoned = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	pthread_join(job->thread, NULL);
+
+	while ((c = job->head) != NULL) {
+		job->head = c->next;
+		free(c);
+	}
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	free(job->bc);
+	free(job);
+
+	errno = saved_errno;
+	return ret < 0 ? -1 : 0;
+}
+
+/* Run one SOCK_DIAG_BY_FAMILY dump and feed every reply to show().
+ * Returns -1 with errno set if the kernel has no handler for the
+ * requested family/protocol, so that callers can fall back to /proc.
+ */
+static int sockdiag_dump(void *req, int reqlen, struct filter *f,
+			 int (*show)(struct nlmsghdr *, struct filter *, void *),
+			 void *arg)
+{
+	struct diag_job *job;
+	struct diag_chunk *c, *held = NULL, **htail = &held;
+	int fd, ret = -1, saved_errno;
+	char	*bc;
+	int	bclen;
+	char	buf[32768];
+
+	if ((job = diag_job_find(req, reqlen)) != NULL)
+		return diag_job_consume(job, f, show, arg);
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_SOCK_DIAG)) < 0)
+		return -1;
+
+	bclen = sockdiag_bytecode(f, req, &bc);
+	if (sockdiag_send(fd, req, reqlen, bc, bclen) < 0)
+		goto out;
+
+	do {
+		int status = recv(fd, buf, sizeof(buf), 0);
+
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		if (status == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			errno = EPIPE;
+			goto out;
+		}
+		if (!sockdiag_hold(req)) {
+			ret = sockdiag_parse(buf, status, f, show, arg);
+			continue;
+		}
+		if ((c = malloc(sizeof(*c) + status)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		c->next = NULL;
+		c->len = status;
+		memcpy(c->data, buf, status);
+		*htail = c;
+		htail = &c->next;
+		ret = sockdiag_parse(buf, status, f, prefetch_show, NULL);
+	} while (ret == 0);
+
+out:
+	saved_errno = errno;
+	if (held) {
+		int err = sockdiag_replay(held, f, show, arg);
+
+		if (ret >= 0) {
+			ret = err;
+			saved_errno = errno;
+		}
+	}
+	free(bc);
+	close(fd);
+	errno = saved_errno;
+	return ret < 0 ? -1 : 0;
+}
+
+static void inet_diag_req_fill(struct inet_diag_req_v2 *req, struct filter *f,
+			       int family, int protocol)
+{
+	memset(req, 0, sizeof(*req));
+	req->sdiag_family = family;
+	req->sdiag_protocol = protocol;
+	req->idiag_states = f->states;
+
+	if (protocol != IPPROTO_TCP && protocol != IPPROTO_DCCP)
+		return;
+	if (show_mem)
+		req->idiag_ext |= (1<<(INET_DIAG_MEMINFO-1));
+	if (show_tcpinfo) {
+		req->idiag_ext |= (1<<(INET_DIAG_INFO-1));
+		req->idiag_ext |= (1<<(INET_DIAG_VEGASINFO-1));
+		req->idiag_ext |= (1<<(INET_DIAG_CONG-1));
+	}
+}
+
+/* inet sockets through sock_diag, one dump per address family.
+ * Socket states and the ssfilter are both applied by the kernel.
+ */
+static int inet_show_netlink(struct filter *f, int protocol,
+			     int (*show)(struct nlmsghdr *, struct filter *, void *))
+{
+	struct inet_diag_req_v2 req;
+	int fam, done = 0;
+
+	for (fam = 0; fam < 2; fam++) {
+		int family = fam ? AF_INET6 : AF_INET;
+
+		if (!(f->families & (1<<family)))
+			continue;
+
+		inet_diag_req_fill(&req, f, family, protocol);
+		if (sockdiag_dump(&req, sizeof(req), f, show, NULL) < 0) {
+			/* Nothing printed yet: let the caller fall back */
+			if (!done)
+				return -1;
+			perror("SOCK_DIAG answers");
+		}
+		done = 1;
+	}
+	return 0;
+}
+
+static int tcp_diag_show(struct nlmsghdr *nlh, struct filter *f, void *arg)
+{
+	/* The kernel has already applied the filter */
+	return tcp_show_sock(nlh, NULL);
+}
+
+static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype)
+{
+	int fd;
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req r;
+	} req;
+	char    *bc = NULL;
+	int	bclen;
+	struct msghdr msg;
+	struct rtattr rta;
+	char	buf[8192];
+	struct iovec iov[3];
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_INET_DIAG)) < 0)
+		return -1;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = socktype;
+	req.nlh.nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
+	req.nlh.nlmsg_pid = 0;
+	req.nlh.nlmsg_seq = 123456;
+	memset(&req.r, 0, sizeof(req.r));
+	req.r.idiag_family = AF_INET;
+	req.r.idiag_states = f->states;
+	if (show_mem)
+		req.r.idiag_ext |= (1<<(INET_DIAG_MEMINFO-1));
+
+	if (show_tcpinfo) {
+		req.r.idiag_ext |= (1<<(INET_DIAG_INFO-1));
+		req.r.idiag_ext |= (1<<(INET_DIAG_VEGASINFO-1));
+		req.r.idiag_ext |= (1<<(INET_DIAG_CONG-1));
+	}
+
+	iov[0] = (struct iovec){
+		.iov_base = &req,
+		.iov_len = sizeof(req)
+	};
+	if (f->f) {
+		bclen = ssfilter_bytecompile(f->f, &bc);
+		rta.rta_type = INET_DIAG_REQ_BYTECODE;
+		rta.rta_len = RTA_LENGTH(bclen);
+		iov[1] = (struct iovec){ &rta, sizeof(rta) };
+		iov[2] = (struct iovec){ bc, bclen };
+		req.nlh.nlmsg_len += RTA_LENGTH(bclen);
+	}
+
+	msg = (struct msghdr) {
+		.msg_name = (void*)&nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = iov,
+		.msg_iovlen = f->f ? 3 : 1,
+	};
+
+	if (sendmsg(fd, &msg, 0) < 0)
+		return -1;
+
+	iov[0] = (struct iovec){
+		.iov_base = buf,
+		.iov_len = sizeof(buf)
+	};
+
+	while (1) {
+		int status;
+		struct nlmsghdr *h;
+
+		msg = (struct msghdr) {
+			(void*)&nladdr, sizeof(nladdr),
 			iov,	1,
 			NULL,	0,
 			0
@@ -1672,9 +2618,14 @@ static int tcp_show(struct filter *f, int socktype)
 	if (getenv("TCPDIAG_FILE"))
 		return tcp_show_netlink_file(f);
 
-	if (!getenv("PROC_NET_TCP") && !getenv("PROC_ROOT")
-	    && tcp_show_netlink(f, NULL, socktype) == 0)
-		return 0;
+	if (!getenv("PROC_NET_TCP") && !getenv("PROC_ROOT")) {
+		int protocol = socktype == DCCPDIAG_GETSOCK ? IPPROTO_DCCP
+							    : IPPROTO_TCP;
+
+		if (inet_show_netlink(f, protocol, tcp_diag_show) == 0 ||
+		    tcp_show_netlink(f, NULL, socktype) == 0)
+			return 0;
+	}
 
 	/* Sigh... We have to parse /proc/net/tcp... */
 
@@ -1739,6 +2690,51 @@ outerr:
 }
 
 
+static int dgram_show_sock(struct nlmsghdr *nlh, struct filter *f, void *arg)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(nlh);
+	struct tcpstat s;
+
+	s.local.family = s.remote.family = r->idiag_family;
+	s.lport = ntohs(r->id.idiag_sport);
+	s.rport = ntohs(r->id.idiag_dport);
+	if (s.local.family == AF_INET)
+		s.local.bytelen = s.remote.bytelen = 4;
+	else
+		s.local.bytelen = s.remote.bytelen = 16;
+	memcpy(s.local.data, r->id.idiag_src, s.local.bytelen);
+	memcpy(s.remote.data, r->id.idiag_dst, s.local.bytelen);
+
+	if (netid_width)
+		printf("%-*s ", netid_width, dg_proto);
+	if (state_width)
+		printf("%-*s ", state_width, sstate_name[r->idiag_state]);
+
+	printf("%-6d %-6d ", r->idiag_rqueue, r->idiag_wqueue);
+
+	formatted_print(&s.local, s.lport);
+	formatted_print(&s.remote, s.rport);
+
+	if (show_users) {
+		char ubuf[4096];
+		if (find_users(r->idiag_inode, ubuf, sizeof(ubuf)) > 0)
+			printf(" users:(%s)", ubuf);
+	}
+
+	if (show_details) {
+		if (r->idiag_uid)
+			printf(" uid=%u", (unsigned)r->idiag_uid);
+		printf(" ino=%u", r->idiag_inode);
+		printf(" sk=");
+		if (r->id.idiag_cookie[1] != 0)
+			printf("%08x", r->id.idiag_cookie[1]);
+		printf("%08x", r->id.idiag_cookie[0]);
+	}
+	printf("\n");
+
+	return 0;
+}
+
 int dgram_show_line(char *line, const struct filter *f, int family)
 {
 	struct tcpstat s;
@@ -1789,7 +2785,7 @@ int dgram_show_line(char *line, const struct filter *f, int family)
 		s.local.bytelen = s.remote.bytelen = 16;
 	}
 
-	if (f->f && run_ssfilter(f->f, &s) == 0)
+	if (f->f && run_ssfilter(f, &s) == 0)
 		return 0;
 
 	opt[0] = 0;
@@ -1837,6 +2833,10 @@ int udp_show(struct filter *f)
 
 	dg_proto = UDP_PROTO;
 
+	if (!getenv("PROC_NET_UDP") && !getenv("PROC_ROOT")
+	    && inet_show_netlink(f, IPPROTO_UDP, dgram_show_sock) == 0)
+		return 0;
+
 	if (f->families&(1<<AF_INET)) {
 		if ((fp = net_udp_open()) == NULL)
 			goto outerr;
@@ -1869,6 +2869,10 @@ int raw_show(struct filter *f)
 
 	dg_proto = RAW_PROTO;
 
+	if (!getenv("PROC_NET_RAW") && !getenv("PROC_ROOT")
+	    && inet_show_netlink(f, IPPROTO_RAW, dgram_show_sock) == 0)
+		return 0;
+
 	if (f->families&(1<<AF_INET)) {
 		if ((fp = net_raw_open()) == NULL)
 			goto outerr;
@@ -1899,6 +2903,7 @@ outerr:
 struct unixstat
 {
 	struct unixstat *next;
+	struct unixstat *hnext;
 	int ino;
 	int peer;
 	int rq;
@@ -1927,11 +2932,42 @@ void unix_list_free(struct unixstat *list)
 	}
 }
 
+/* Index the list by inode, for finding the peers of a large one */
+static struct unixstat **unix_list_hash(struct unixstat *list,
+					unsigned int *hmask)
+{
+	struct unixstat *s, **htab;
+	unsigned int size = 1, cnt = 0;
+
+	for (s = list; s; s = s->next)
+		cnt++;
+	while (size < cnt)
+		size <<= 1;
+	htab = calloc(size, sizeof(*htab));
+	if (htab == NULL)
+		return NULL;
+
+	for (s = list; s; s = s->next) {
+		struct unixstat **hp = &htab[s->ino & (size - 1)];
+
+		/* Keep list order, so the first of equal inodes is found */
+		while (*hp)
+			hp = &(*hp)->hnext;
+		s->hnext = NULL;
+		*hp = s;
+	}
+	*hmask = size - 1;
+	return htab;
+}
+
 void unix_list_print(struct unixstat *list, struct filter *f)
 {
-	struct unixstat *s;
+	struct unixstat *s, **htab;
+	unsigned int hmask = 0;
 	char *peer;
 
+	htab = unix_list_hash(list, &hmask);
+
 	for (s = list; s; s = s->next) {
 		if (!(f->states & (1<<s->state)))
 			continue;
@@ -1943,9 +2979,15 @@ void unix_list_print(struct unixstat *list, struct filter *f)
 		peer = "*";
 		if (s->peer) {
 			struct unixstat *p;
-			for (p = list; p; p = p->next) {
-				if (s->peer == p->ino)
-					break;
+
+			if (htab) {
+				for (p = htab[s->peer & hmask]; p; p = p->hnext)
+					if (s->peer == p->ino)
+						break;
+			} else {
+				for (p = list; p; p = p->next)
+					if (s->peer == p->ino)
+						break;
 			}
 			if (!p) {
 				peer = "?";
@@ -1963,7 +3005,7 @@ void unix_list_print(struct unixstat *list, struct filter *f)
 				memset(tst.remote.data, 0, sizeof(peer));
 			else
 				memcpy(tst.remote.data, &peer, sizeof(peer));
-			if (run_ssfilter(f->f, &tst) == 0)
+			if (run_ssfilter(f, &tst) == 0)
 				continue;
 		}
 
@@ -1983,6 +3025,118 @@ void unix_list_print(struct unixstat *list, struct filter *f)
 		}
 		printf("\n");
 	}
+	free(htab);
+}
+
+static int unix_show_sock(struct nlmsghdr *nlh, struct filter *f, void *arg)
+{
+	struct unixstat **list = arg;
+	struct unix_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[UNIX_DIAG_MAX+1];
+	struct unixstat *u;
+
+	parse_rtattr(tb, UNIX_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+
+	if (!(u = malloc(sizeof(*u))))
+		return -1;
+	memset(u, 0, sizeof(*u));
+
+	u->type = r->udiag_type;
+	u->state = r->udiag_state;
+	u->ino = r->udiag_ino;
+	if (tb[UNIX_DIAG_PEER])
+		u->peer = *(__u32*)RTA_DATA(tb[UNIX_DIAG_PEER]);
+	if (tb[UNIX_DIAG_RQLEN]) {
+		struct unix_diag_rqlen *rql = RTA_DATA(tb[UNIX_DIAG_RQLEN]);
+		u->rq = rql->udiag_rqueue;
+		u->wq = rql->udiag_wqueue;
+	}
+	if (tb[UNIX_DIAG_NAME]) {
+		int i, len = RTA_PAYLOAD(tb[UNIX_DIAG_NAME]);
+
+		if ((u->name = malloc(len+1)) == NULL) {
+			free(u);
+			return -1;
+		}
+		memcpy(u->name, RTA_DATA(tb[UNIX_DIAG_NAME]), len);
+		u->name[len] = 0;
+		/* Abstract names are shown the way /proc/net/unix does */
+		if (u->name[0] == 0) {
+			for (i = 0; i < len; i++)
+				if (u->name[i] == 0)
+					u->name[i] = '@';
+		}
+	}
+
+	if (u->type == SOCK_DGRAM && u->state == SS_CLOSE && u->peer)
+		u->state = SS_ESTABLISHED;
+
+	u->next = *list;
+	*list = u;
+	return 0;
+}
+
+static int unix_cmp(const void *a, const void *b)
+{
+	const struct unixstat *x = *(struct unixstat **)a;
+	const struct unixstat *y = *(struct unixstat **)b;
+
+	if (x->type != y->type)
+		return x->type < y->type ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/* Order the list the way unix_show() builds it from /proc */
+static struct unixstat *unix_list_sort(struct unixstat *list)
+{
+	struct unixstat *u, **tab;
+	int i, cnt = 0;
+
+	for (u = list; u; u = u->next)
+		cnt++;
+	if (cnt < 2 || (tab = malloc(cnt * sizeof(*tab))) == NULL)
+		return list;
+
+	for (i = 0, u = list; u; u = u->next)
+		tab[i++] = u;
+	qsort(tab, cnt, sizeof(*tab), unix_cmp);
+	for (i = 0; i < cnt - 1; i++)
+		tab[i]->next = tab[i+1];
+	tab[cnt-1]->next = NULL;
+	list = tab[0];
+	free(tab);
+	return list;
+}
+
+static void unix_diag_req_fill(struct unix_diag_req *req, struct filter *f)
+{
+	memset(req, 0, sizeof(*req));
+	req->sdiag_family = AF_UNIX;
+	req->udiag_states = f->states;
+	/* Connected datagram sockets are TCP_CLOSE to the kernel */
+	if (f->states & (1<<SS_ESTABLISHED))
+		req->udiag_states |= (1<<SS_CLOSE);
+	req->udiag_show = UDIAG_SHOW_NAME | UDIAG_SHOW_PEER | UDIAG_SHOW_RQLEN;
+}
+
+static int unix_show_netlink(struct filter *f)
+{
+	struct unix_diag_req req;
+	struct unixstat *list = NULL;
+
+	unix_diag_req_fill(&req, f);
+	if (sockdiag_dump(&req, sizeof(req), f, unix_show_sock, &list) < 0) {
+		unix_list_free(list);
+		return -1;
+	}
+
+	list = unix_list_sort(list);
+	unix_list_print(list, f);
+	unix_list_free(list);
+	return 0;
 }
 
 int unix_show(struct filter *f)
@@ -1994,6 +3148,10 @@ int unix_show(struct filter *f)
 	int  cnt;
 	struct unixstat *list = NULL;
 
+	if (!getenv("PROC_NET_UNIX") && !getenv("PROC_ROOT")
+	    && unix_show_netlink(f) == 0)
+		return 0;
+
 	if ((fp = net_unix_open()) == NULL)
 		return -1;
 	fgets(buf, sizeof(buf)-1, fp);
@@ -2066,6 +3224,93 @@ int unix_show(struct filter *f)
 }
 
 
+static void packet_print(struct filter *f, int type, int prot, int iface,
+			 int rq, unsigned uid, unsigned ino,
+			 unsigned long long sk)
+{
+	if (type == SOCK_RAW && !(f->dbs&(1<<PACKET_R_DB)))
+		return;
+	if (type == SOCK_DGRAM && !(f->dbs&(1<<PACKET_DG_DB)))
+		return;
+	if (f->f) {
+		struct tcpstat tst;
+		tst.local.family = AF_PACKET;
+		tst.remote.family = AF_PACKET;
+		tst.rport = 0;
+		tst.lport = iface;
+		tst.local.data[0] = prot;
+		tst.remote.data[0] = 0;
+		if (run_ssfilter(f, &tst) == 0)
+			return;
+	}
+
+	if (netid_width)
+		printf("%-*s ", netid_width,
+		       type == SOCK_RAW ? "p_raw" : "p_dgr");
+	if (state_width)
+		printf("%-*s ", state_width, "UNCONN");
+	printf("%-6d %-6d ", rq, 0);
+	if (prot == 3) {
+		printf("%*s:", addr_width, "*");
+	} else {
+		char tb[16];
+		printf("%*s:", addr_width,
+		       ll_proto_n2a(htons(prot), tb, sizeof(tb)));
+	}
+	if (iface == 0) {
+		printf("%-*s ", serv_width, "*");
+	} else {
+		printf("%-*s ", serv_width, xll_index_to_name(iface));
+	}
+	printf("%*s*%-*s",
+	       addr_width, "", serv_width, "");
+
+	if (show_users) {
+		char ubuf[4096];
+		if (find_users(ino, ubuf, sizeof(ubuf)) > 0)
+			printf(" users:(%s)", ubuf);
+	}
+	if (show_details) {
+		printf(" ino=%u uid=%u sk=%llx", ino, uid, sk);
+	}
+	printf("\n");
+}
+
+static int packet_show_sock(struct nlmsghdr *nlh, struct filter *f, void *arg)
+{
+	struct packet_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[PACKET_DIAG_MAX+1];
+	int iface = 0, rq = 0;
+	unsigned uid = 0;
+
+	parse_rtattr(tb, PACKET_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+
+	if (tb[PACKET_DIAG_INFO]) {
+		struct packet_diag_info *pinfo = RTA_DATA(tb[PACKET_DIAG_INFO]);
+		iface = pinfo->pdi_index;
+	}
+	if (tb[PACKET_DIAG_MEMINFO]) {
+		__u32 *skmeminfo = RTA_DATA(tb[PACKET_DIAG_MEMINFO]);
+		rq = skmeminfo[SK_MEMINFO_RMEM_ALLOC];
+	}
+	if (tb[PACKET_DIAG_UID])
+		uid = *(__u32*)RTA_DATA(tb[PACKET_DIAG_UID]);
+
+	packet_print(f, r->pdiag_type, r->pdiag_num, iface, rq, uid,
+		     r->pdiag_ino,
+		     ((unsigned long long)r->pdiag_cookie[1] << 32) |
+		     r->pdiag_cookie[0]);
+	return 0;
+}
+
+static void packet_diag_req_fill(struct packet_diag_req *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->sdiag_family = AF_PACKET;
+	req->pdiag_show = PACKET_SHOW_INFO | PACKET_SHOW_MEMINFO;
+}
+
 int packet_show(struct filter *f)
 {
 	FILE *fp;
@@ -2082,6 +3327,14 @@ int packet_show(struct filter *f)
 	if (!(f->states & (1<<SS_CLOSE)))
 		return 0;
 
+	if (!getenv("PROC_NET_PACKET") && !getenv("PROC_ROOT")) {
+		struct packet_diag_req req;
+
+		packet_diag_req_fill(&req);
+		if (sockdiag_dump(&req, sizeof(req), f, packet_show_sock, NULL) == 0)
+			return 0;
+	}
+
 	if ((fp = net_packet_open()) == NULL)
 		return -1;
 	fgets(buf, sizeof(buf)-1, fp);
@@ -2092,57 +3345,113 @@ int packet_show(struct filter *f)
 		       &type, &prot, &iface, &state,
 		       &rq, &uid, &ino);
 
-		if (type == SOCK_RAW && !(f->dbs&(1<<PACKET_R_DB)))
-			continue;
-		if (type == SOCK_DGRAM && !(f->dbs&(1<<PACKET_DG_DB)))
-			continue;
-		if (f->f) {
-			struct tcpstat tst;
-			tst.local.family = AF_PACKET;
-			tst.remote.family = AF_PACKET;
-			tst.rport = 0;
-			tst.lport = iface;
-			tst.local.data[0] = prot;
-			tst.remote.data[0] = 0;
-			if (run_ssfilter(f->f, &tst) == 0)
-				continue;
-		}
+		packet_print(f, type, prot, iface, rq, uid, ino, sk);
+	}
 
-		if (netid_width)
-			printf("%-*s ", netid_width,
-			       type == SOCK_RAW ? "p_raw" : "p_dgr");
-		if (state_width)
-			printf("%-*s ", state_width, "UNCONN");
-		printf("%-6d %-6d ", rq, 0);
-		if (prot == 3) {
-			printf("%*s:", addr_width, "*");
-		} else {
-			char tb[16];
-			printf("%*s:", addr_width,
-			       ll_proto_n2a(htons(prot), tb, sizeof(tb)));
-		}
-		if (iface == 0) {
-			printf("%-*s ", serv_width, "*");
-		} else {
-			printf("%-*s ", serv_width, xll_index_to_name(iface));
-		}
-		printf("%*s*%-*s",
-		       addr_width, "", serv_width, "");
+	return 0;
+}
 
-		if (show_users) {
-			char ubuf[4096];
-			if (find_users(ino, ubuf, sizeof(ubuf)) > 0)
-				printf(" users:(%s)", ubuf);
-		}
-		if (show_details) {
-			printf(" ino=%u uid=%u sk=%llx", ino, uid, sk);
+static void netlink_print(struct filter *f, int prot, int pid,
+			  unsigned groups, int rq, int wq,
+			  unsigned long long sk, unsigned long long cb)
+{
+	if (f->f) {
+		struct tcpstat tst;
+		tst.local.family = AF_NETLINK;
+		tst.remote.family = AF_NETLINK;
+		tst.rport = -1;
+		tst.lport = pid;
+		tst.local.data[0] = prot;
+		tst.remote.data[0] = 0;
+		if (run_ssfilter(f, &tst) == 0)
+			return;
+	}
+
+	if (netid_width)
+		printf("%-*s ", netid_width, "nl");
+	if (state_width)
+		printf("%-*s ", state_width, "UNCONN");
+	printf("%-6d %-6d ", rq, wq);
+	if (resolve_services && prot == 0)
+		printf("%*s:", addr_width, "rtnl");
+	else if (resolve_services && prot == 3)
+		printf("%*s:", addr_width, "fw");
+	else if (resolve_services && prot == 4)
+		printf("%*s:", addr_width, "tcpdiag");
+	else
+		printf("%*d:", addr_width, prot);
+	if (pid == -1) {
+		printf("%-*s ", serv_width, "*");
+	} else if (resolve_services) {
+		int done = 0;
+		if (!pid) {
+			done = 1;
+			printf("%-*s ", serv_width, "kernel");
+		} else if (pid > 0) {
+			char procname[64];
+			FILE *fp;
+			sprintf(procname, "%s/%d/stat",
+				getenv("PROC_ROOT") ? : "/proc", pid);
+			if ((fp = fopen(procname, "r")) != NULL) {
+				if (fscanf(fp, "%*d (%[^)])", procname) == 1) {
+					sprintf(procname+strlen(procname), "/%d", pid);
+					printf("%-*s ", serv_width, procname);
+					done = 1;
+				}
+				fclose(fp);
+			}
 		}
-		printf("\n");
+		if (!done)
+			printf("%-*d ", serv_width, pid);
+	} else {
+		printf("%-*d ", serv_width, pid);
+	}
+	printf("%*s*%-*s",
+	       addr_width, "", serv_width, "");
+
+	if (show_details) {
+		printf(" sk=%llx cb=%llx groups=0x%08x", sk, cb, groups);
 	}
+	printf("\n");
+}
+
+static int netlink_show_sock(struct nlmsghdr *nlh, struct filter *f, void *arg)
+{
+	struct netlink_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[NETLINK_DIAG_MAX+1];
+	unsigned groups = 0;
+	int rq = 0, wq = 0, cb = 0;
+
+	parse_rtattr(tb, NETLINK_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
 
+	if (tb[NETLINK_DIAG_GROUPS] && RTA_PAYLOAD(tb[NETLINK_DIAG_GROUPS]))
+		groups = *(__u32*)RTA_DATA(tb[NETLINK_DIAG_GROUPS]);
+	if (tb[NETLINK_DIAG_MEMINFO]) {
+		__u32 *skmeminfo = RTA_DATA(tb[NETLINK_DIAG_MEMINFO]);
+		rq = skmeminfo[SK_MEMINFO_RMEM_ALLOC];
+		wq = skmeminfo[SK_MEMINFO_WMEM_ALLOC];
+	}
+	if (tb[NETLINK_DIAG_FLAGS])
+		cb = !!(*(__u32*)RTA_DATA(tb[NETLINK_DIAG_FLAGS]) &
+			NDIAG_FLAG_CB_RUNNING);
+
+	netlink_print(f, r->ndiag_protocol, (int)r->ndiag_portid, groups,
+		      rq, wq,
+		      ((unsigned long long)r->ndiag_cookie[1] << 32) |
+		      r->ndiag_cookie[0], cb);
 	return 0;
 }
 
+static void netlink_diag_req_fill(struct netlink_diag_req *req)
+{
+	memset(req, 0, sizeof(*req));
+	req->sdiag_family = AF_NETLINK;
+	req->sdiag_protocol = NDIAG_PROTO_ALL;
+	req->ndiag_show = NDIAG_SHOW_GROUPS | NDIAG_SHOW_MEMINFO |
+			  NDIAG_SHOW_FLAGS;
+}
+
 int netlink_show(struct filter *f)
 {
 	FILE *fp;
@@ -2155,6 +3464,14 @@ int netlink_show(struct filter *f)
 	if (!(f->states & (1<<SS_CLOSE)))
 		return 0;
 
+	if (!getenv("PROC_NET_NETLINK") && !getenv("PROC_ROOT")) {
+		struct netlink_diag_req req;
+
+		netlink_diag_req_fill(&req);
+		if (sockdiag_dump(&req, sizeof(req), f, netlink_show_sock, NULL) == 0)
+			return 0;
+	}
+
 	if ((fp = net_netlink_open()) == NULL)
 		return -1;
 	fgets(buf, sizeof(buf)-1, fp);
@@ -2164,67 +3481,80 @@ int netlink_show(struct filter *f)
 		       &sk,
 		       &prot, &pid, &groups, &rq, &wq, &cb, &rc);
 
-		if (f->f) {
-			struct tcpstat tst;
-			tst.local.family = AF_NETLINK;
-			tst.remote.family = AF_NETLINK;
-			tst.rport = -1;
-			tst.lport = pid;
-			tst.local.data[0] = prot;
-			tst.remote.data[0] = 0;
-			if (run_ssfilter(f->f, &tst) == 0)
-				continue;
-		}
+		netlink_print(f, prot, pid, groups, rq, wq, sk, cb);
+	}
 
-		if (netid_width)
-			printf("%-*s ", netid_width, "nl");
-		if (state_width)
-			printf("%-*s ", state_width, "UNCONN");
-		printf("%-6d %-6d ", rq, wq);
-		if (resolve_services && prot == 0)
-			printf("%*s:", addr_width, "rtnl");
-		else if (resolve_services && prot == 3)
-			printf("%*s:", addr_width, "fw");
-		else if (resolve_services && prot == 4)
-			printf("%*s:", addr_width, "tcpdiag");
-		else
-			printf("%*d:", addr_width, prot);
-		if (pid == -1) {
-			printf("%-*s ", serv_width, "*");
-		} else if (resolve_services) {
-			int done = 0;
-			if (!pid) {
-				done = 1;
-				printf("%-*s ", serv_width, "kernel");
-			} else if (pid > 0) {
-				char procname[64];
-				FILE *fp;
-				sprintf(procname, "%s/%d/stat",
-					getenv("PROC_ROOT") ? : "/proc", pid);
-				if ((fp = fopen(procname, "r")) != NULL) {
-					if (fscanf(fp, "%*d (%[^)])", procname) == 1) {
-						sprintf(procname+strlen(procname), "/%d", pid);
-						printf("%-*s ", serv_width, procname);
-						done = 1;
-					}
-					fclose(fp);
-				}
-			}
-			if (!done)
-				printf("%-*d ", serv_width, pid);
-		} else {
-			printf("%-*d ", serv_width, pid);
+	return 0;
+}
+
+static int diag_proc_forced(const char *env)
+{
+	return getenv(env) || getenv("PROC_ROOT");
+}
+
+/* Start every sock_diag dump that the *_show() calls in main() are
+ * going to make, each on its own socket and thread.
+ */
+static void diag_prefetch(struct filter *f)
+{
+	static const struct {
+		int db;
+		int protocol;
+		const char *env;
+	} inet[] = {
+		{ RAW_DB,  IPPROTO_RAW,  "PROC_NET_RAW" },
+		{ UDP_DB,  IPPROTO_UDP,  "PROC_NET_UDP" },
+		{ TCP_DB,  IPPROTO_TCP,  "PROC_NET_TCP" },
+		{ DCCP_DB, IPPROTO_DCCP, "PROC_NET_TCP" },
+	};
+	struct {
+		union {
+			struct inet_diag_req_v2 inet;
+			struct unix_diag_req un;
+			struct packet_diag_req pkt;
+			struct netlink_diag_req nl;
+		} r;
+		int len;
+	} req[16];
+	int i, fam, n = 0;
+
+	if (f->states & (1<<SS_CLOSE)) {
+		if ((f->dbs & (1<<NETLINK_DB)) && !diag_proc_forced("PROC_NET_NETLINK")) {
+			netlink_diag_req_fill(&req[n].r.nl);
+			req[n++].len = sizeof(struct netlink_diag_req);
+		}
+		if ((f->dbs & PACKET_DBM) && !diag_proc_forced("PROC_NET_PACKET")) {
+			packet_diag_req_fill(&req[n].r.pkt);
+			req[n++].len = sizeof(struct packet_diag_req);
 		}
-		printf("%*s*%-*s",
-		       addr_width, "", serv_width, "");
+	}
+	if ((f->dbs & UNIX_DBM) && !diag_proc_forced("PROC_NET_UNIX")) {
+		unix_diag_req_fill(&req[n].r.un, f);
+		req[n++].len = sizeof(struct unix_diag_req);
+	}
+	for (i = 0; i < sizeof(inet)/sizeof(inet[0]); i++) {
+		if (!(f->dbs & (1<<inet[i].db)) || diag_proc_forced(inet[i].env))
+			continue;
+		if ((inet[i].db == TCP_DB || inet[i].db == DCCP_DB) &&
+		    getenv("TCPDIAG_FILE"))
+			continue;
+		for (fam = 0; fam < 2; fam++) {
+			int family = fam ? AF_INET6 : AF_INET;
 
-		if (show_details) {
-			printf(" sk=%llx cb=%llx groups=0x%08x", sk, cb, groups);
+			if (!(f->families & (1<<family)))
+				continue;
+			inet_diag_req_fill(&req[n].r.inet, f, family,
+					   inet[i].protocol);
+			req[n++].len = sizeof(struct inet_diag_req_v2);
 		}
-		printf("\n");
 	}
 
-	return 0;
+	/* A single dump gains nothing from a thread */
+	if (n < 2)
+		return;
+
+	for (i = 0; i < n; i++)
+		diag_job_start(f, &req[i].r, req[i].len);
 }
 
 struct snmpstat
@@ -2404,6 +3734,7 @@ static void _usage(FILE *dest)
 "   -e, --extended      show detailed socket information\n"
 "   -m, --memory        show socket memory usage\n"
 "   -p, --processes	show process using socket\n"
+"   -P, --lazy-processes like -p, scanning /proc only as far as needed\n"
 "   -i, --info		show internal TCP information\n"
 "   -s, --summary	show socket usage summary\n"
 "\n"
@@ -2476,6 +3807,7 @@ static const struct option long_opts[] = {
 	{ "memory", 0, 0, 'm' },
 	{ "info", 0, 0, 'i' },
 	{ "processes", 0, 0, 'p' },
+	{ "lazy-processes", 0, 0, 'P' },
 	{ "dccp", 0, 0, 'd' },
 	{ "tcp", 0, 0, 't' },
 	{ "udp", 0, 0, 'u' },
@@ -2512,7 +3844,7 @@ int main(int argc, char *argv[])
 
 	current_filter.states = default_filter.states;
 
-	while ((ch = getopt_long(argc, argv, "dhaletuwxnro460spf:miA:D:F:vV",
+	while ((ch = getopt_long(argc, argv, "dhaletuwxnro460spPf:miA:D:F:vV",
 				 long_opts, NULL)) != EOF) {
 		switch(ch) {
 		case 'n':
@@ -2536,7 +3868,10 @@ int main(int argc, char *argv[])
 			break;
 		case 'p':
 			show_users++;
-			user_ent_hash_build();
+			break;
+		case 'P':
+			show_users++;
+			lazy_users = 1;
 			break;
 		case 'd':
 			current_filter.dbs |= (1<<DCCP_DB);
@@ -2768,6 +4103,9 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	if (current_filter.f)
+		current_filter.prog = ssfilter_compile(current_filter.f);
+
 	if (dump_tcpdiag) {
 		FILE *dump_fp = stdout;
 		if (!(current_filter.dbs & (1<<TCP_DB))) {
@@ -2838,6 +4176,8 @@ int main(int argc, char *argv[])
 
 	fflush(stdout);
 
+	diag_prefetch(&current_filter);
+
 	if (current_filter.dbs & (1<<NETLINK_DB))
 		netlink_show(&current_filter);
 	if (current_filter.dbs & PACKET_DBM)
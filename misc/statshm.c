@@ -0,0 +1,175 @@
+/*
+ * statshm.c	Shared memory snapshots of ifstat, nstat and rtacct daemons.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "statshm.h"
+
+#define STATSHM_MAGIC	0x53544d42
+#define STATSHM_TRIES	1000
+
+struct statshm_hdr
+{
+	__u32	magic;
+	__u32	seq;		/* odd while the snapshot is rewritten */
+	__u32	len;
+	__u32	pad;
+};
+
+struct statshm
+{
+	int			fd;
+	size_t			size;
+	struct statshm_hdr	*hdr;
+};
+
+static size_t statshm_size(size_t len)
+{
+	size_t page = getpagesize();
+
+	return (sizeof(struct statshm_hdr) + 2 * len + page - 1) & ~(page - 1);
+}
+
+struct statshm *statshm_create(const char *name)
+{
+	struct statshm *s = calloc(1, sizeof(*s));
+
+	if (s == NULL)
+		return NULL;
+
+	/* Never reuse a segment someone else may have put there */
+	shm_unlink(name);
+	s->fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (s->fd < 0) {
+		free(s);
+		return NULL;
+	}
+	/* Held while the daemon lives, clients check it is gone */
+	if (flock(s->fd, LOCK_EX) < 0)
+		goto err;
+	s->size = statshm_size(0);
+	if (ftruncate(s->fd, s->size) < 0)
+		goto err;
+	s->hdr = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (s->hdr == MAP_FAILED)
+		goto err;
+	s->hdr->magic = STATSHM_MAGIC;
+	return s;
+
+err:
+	close(s->fd);
+	shm_unlink(name);
+	free(s);
+	return NULL;
+}
+
+int statshm_publish(struct statshm *s, const void *data, size_t len)
+{
+	struct statshm_hdr *hdr = s->hdr;
+
+	/* The segment only grows, readers may still map its old size */
+	if (sizeof(*hdr) + len > s->size) {
+		size_t size = statshm_size(len);
+		void *p;
+
+		if (ftruncate(s->fd, size) < 0)
+			return -1;
+		p = mremap(hdr, s->size, size, MREMAP_MAYMOVE);
+		if (p == MAP_FAILED)
+			return -1;
+		hdr = s->hdr = p;
+		s->size = size;
+	}
+
+	hdr->seq++;
+	__sync_synchronize();
+	memcpy(hdr + 1, data, len);
+	hdr->len = len;
+	__sync_synchronize();
+	hdr->seq++;
+	return 0;
+}
+
+/*
+ * Copy the snapshot of a running daemon into a malloced buffer.
+ * Returns -1 when there is none, or it does not belong to us or root.
+ */
+int statshm_read(const char *name, char **data, size_t *len)
+{
+	struct statshm_hdr *hdr = MAP_FAILED;
+	size_t size = 0;
+	char *buf = NULL;
+	struct stat st;
+	int fd, tries;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || (st.st_uid != getuid() && st.st_uid != 0))
+		goto err;
+	if (flock(fd, LOCK_SH|LOCK_NB) == 0)
+		goto err;
+
+	for (tries = 0; tries < STATSHM_TRIES; tries++) {
+		__u32 seq, n;
+
+		if (hdr == MAP_FAILED || hdr->len + sizeof(*hdr) > size) {
+			if (hdr != MAP_FAILED)
+				munmap(hdr, size);
+			if (fstat(fd, &st) || st.st_size < sizeof(*hdr))
+				goto err;
+			size = st.st_size;
+			hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (hdr == MAP_FAILED)
+				goto err;
+			if (hdr->magic != STATSHM_MAGIC)
+				goto err;
+		}
+
+		seq = hdr->seq;
+		__sync_synchronize();
+		n = hdr->len;
+		if (seq == 0)
+			goto err;
+		if ((seq & 1) || n + sizeof(*hdr) > size) {
+			sched_yield();
+			continue;
+		}
+		buf = realloc(buf, n + 1);
+		if (buf == NULL)
+			goto err;
+		memcpy(buf, hdr + 1, n);
+		__sync_synchronize();
+		if (hdr->seq != seq)
+			continue;
+
+		buf[n] = 0;
+		munmap(hdr, size);
+		close(fd);
+		*data = buf;
+		*len = n;
+		return 0;
+	}
+
+err:
+	free(buf);
+	if (hdr != MAP_FAILED)
+		munmap(hdr, size);
+	close(fd);
+	return -1;
+}
@@ -0,0 +1,29 @@
+#ifndef _STATSHM_H
+#define _STATSHM_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+ * Snapshot of a statistics daemon published in shared memory.  The
+ * daemon rewrites it after every scan under a sequence counter; clients
+ * copy it out without locking and retry if it changed meanwhile.
+ */
+struct statshm;
+
+/*
+ * The snapshot is a table of fixed size records, counters as numbers
+ * rather than text, which clients format themselves.
+ */
+struct statshm_table
+{
+	char	source[128];
+	__u32	count;
+	__u32	size;		/* of a record */
+};
+
+extern struct statshm *statshm_create(const char *name);
+extern int statshm_publish(struct statshm *s, const void *data, size_t len);
+extern int statshm_read(const char *name, char **data, size_t *len);
+
+#endif /* _STATSHM_H */
@@ -0,0 +1,814 @@
+/*
+ * tcstat.c	Traffic control qdisc and class statistics with rates.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Works as ifstat does: with -d it becomes a daemon which dumps every
+ * qdisc and class periodically, accumulates their counters in a table
+ * hashed by (dev, handle) and keeps EWMA byte, packet and drop rates.
+ * The table is published in shared memory; a client copies it out in one
+ * go and does the sorting and summing itself.  Without a daemon the
+ * kernel is asked directly and no rates are shown.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <libnetlink.h>
+#include <ll_map.h>
+#include <linux/pkt_sched.h>
+#include <linux/gen_stats.h>
+
+#include <SNAPSHOT.h>
+
+#include "statshm.h"
+
+int dump_zeros = 0;
+int scan_interval = 0;
+int time_constant = 0;
+int top_n = 0;
+int by_drops = 0;
+int subtree = 0;
+__u32 subtree_id;
+char **patterns;
+int npatterns;
+
+char info_source[128];
+static struct statshm *shm;
+static struct rtnl_handle rth;
+
+#define TCSTAT_HASH	65536
+#define TCSTAT_MAXDEV	4096
+
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+
+enum {
+	TCSTAT_QDISC,
+	TCSTAT_CLASS,
+};
+
+enum {
+	T_BYTES,
+	T_PACKETS,
+	T_DROPS,
+	T_OVERLIMITS,
+	T_REQUEUES,
+	T_MAX
+};
+#define T_RATES	(T_DROPS + 1)	/* counters with a rate */
+
+/* What the daemon publishes, one per qdisc or class */
+struct tcstat_rec
+{
+	__u32		ifindex;
+	__u32		type;
+	__u32		handle;
+	__u32		parent;
+	char		kind[16];
+	__u64		val[T_MAX];
+	double		rate[T_RATES];
+	__u32		qlen;
+	__u32		backlog;
+};
+
+struct tcstat_hdr
+{
+	char		info[128];
+	__u32		count;
+	__u32		pad;
+};
+
+struct tcstat_ent
+{
+	struct tcstat_ent	*next;
+	struct tcstat_ent	*hnext;
+	struct tcstat_ent	*up;		/* parent qdisc or class */
+	int			has_child;	/* a class below it */
+	__u64			ival[T_MAX];	/* as the kernel reported */
+	struct tcstat_rec	r;
+};
+
+struct tcstat_ent *kern_db;
+static struct tcstat_ent **kern_tail = &kern_db;
+static int devs[TCSTAT_MAXDEV];
+static int ndevs;
+
+/* Default qdiscs all have handle 0, their parent tells them apart */
+static unsigned hash_key(int ifindex, int type, __u32 handle, __u32 parent)
+{
+	unsigned h = ifindex * 0x9e3779b1U ^ handle ^ type;
+
+	if (handle == 0)
+		h ^= parent * 0x85ebca6bU;
+	h ^= h >> 16;
+	return h & (TCSTAT_HASH - 1);
+}
+
+static struct tcstat_ent **hash_db(struct tcstat_ent *db)
+{
+	struct tcstat_ent **tbl = calloc(TCSTAT_HASH, sizeof(*tbl));
+
+	if (!tbl)
+		abort();
+	for (; db; db = db->next) {
+		unsigned h = hash_key(db->r.ifindex, db->r.type,
+				      db->r.handle, db->r.parent);
+
+		db->hnext = tbl[h];
+		tbl[h] = db;
+	}
+	return tbl;
+}
+
+static struct tcstat_ent *lookup_db(struct tcstat_ent **tbl, int ifindex,
+				    int type, __u32 handle, __u32 parent)
+{
+	struct tcstat_ent *n;
+
+	for (n = tbl[hash_key(ifindex, type, handle, parent)]; n; n = n->hnext)
+		if (n->r.ifindex == ifindex && n->r.type == type &&
+		    n->r.handle == handle &&
+		    (handle || n->r.parent == parent))
+			return n;
+	return NULL;
+}
+
+static void free_db(struct tcstat_ent *db)
+{
+	while (db) {
+		struct tcstat_ent *n = db;
+
+		db = db->next;
+		free(n);
+	}
+}
+
+static void add_db(struct tcstat_ent *n)
+{
+	n->next = NULL;
+	*kern_tail = n;
+	kern_tail = &n->next;
+}
+
+static int match(int ifindex)
+{
+	const char *id;
+	int i;
+
+	if (npatterns == 0)
+		return 1;
+
+	id = ll_index_to_name(ifindex);
+	for (i=0; i<npatterns; i++) {
+		if (!fnmatch(patterns[i], id, 0))
+			return 1;
+	}
+	return 0;
+}
+
+static int get_nlmsg(const struct sockaddr_nl *who,
+		     struct nlmsghdr *m, void *arg)
+{
+	struct tcmsg *t = NLMSG_DATA(m);
+	struct rtattr *tb[TCA_MAX+1];
+	int len = m->nlmsg_len;
+	struct tcstat_ent *n;
+
+	if (m->nlmsg_type != RTM_NEWQDISC && m->nlmsg_type != RTM_NEWTCLASS)
+		return 0;
+
+	len -= NLMSG_LENGTH(sizeof(*t));
+	if (len < 0)
+		return -1;
+
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t), len);
+	if (tb[TCA_KIND] == NULL)
+		return 0;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		abort();
+	n->r.ifindex = t->tcm_ifindex;
+	n->r.type = m->nlmsg_type == RTM_NEWQDISC ? TCSTAT_QDISC : TCSTAT_CLASS;
+	n->r.handle = t->tcm_handle;
+	n->r.parent = t->tcm_parent;
+	strncpy(n->r.kind, RTA_DATA(tb[TCA_KIND]), sizeof(n->r.kind) - 1);
+
+	if (tb[TCA_STATS2]) {
+		struct rtattr *xstats[TCA_STATS_MAX+1];
+
+		parse_rtattr_nested(xstats, TCA_STATS_MAX, tb[TCA_STATS2]);
+		if (xstats[TCA_STATS_BASIC]) {
+			struct gnet_stats_basic bs = { 0 };
+
+			memcpy(&bs, RTA_DATA(xstats[TCA_STATS_BASIC]),
+			       MIN(RTA_PAYLOAD(xstats[TCA_STATS_BASIC]), sizeof(bs)));
+			n->ival[T_BYTES] = bs.bytes;
+			n->ival[T_PACKETS] = bs.packets;
+		}
+		if (xstats[TCA_STATS_QUEUE]) {
+			struct gnet_stats_queue q = { 0 };
+
+			memcpy(&q, RTA_DATA(xstats[TCA_STATS_QUEUE]),
+			       MIN(RTA_PAYLOAD(xstats[TCA_STATS_QUEUE]), sizeof(q)));
+			n->ival[T_DROPS] = q.drops;
+			n->ival[T_OVERLIMITS] = q.overlimits;
+			n->ival[T_REQUEUES] = q.requeues;
+			n->r.qlen = q.qlen;
+			n->r.backlog = q.backlog;
+		}
+	} else if (tb[TCA_STATS]) {
+		struct tc_stats st = { 0 };
+
+		memcpy(&st, RTA_DATA(tb[TCA_STATS]),
+		       MIN(RTA_PAYLOAD(tb[TCA_STATS]), sizeof(st)));
+		n->ival[T_BYTES] = st.bytes;
+		n->ival[T_PACKETS] = st.packets;
+		n->ival[T_DROPS] = st.drops;
+		n->ival[T_OVERLIMITS] = st.overlimits;
+		n->r.qlen = st.qlen;
+		n->r.backlog = st.backlog;
+	}
+	memcpy(n->r.val, n->ival, sizeof(n->r.val));
+
+	/* Only devices with a qdisc of their own can have classes */
+	if (n->r.type == TCSTAT_QDISC && n->r.handle &&
+	    (ndevs == 0 || devs[ndevs-1] != n->r.ifindex) &&
+	    ndevs < TCSTAT_MAXDEV)
+		devs[ndevs++] = n->r.ifindex;
+
+	add_db(n);
+	return 0;
+}
+
+static void dump_tc(int type, int ifindex)
+{
+	struct tcmsg t = { .tcm_family = AF_UNSPEC, .tcm_ifindex = ifindex };
+
+	if (rtnl_dump_request(&rth, type, &t, sizeof(t)) < 0) {
+		perror("Cannot send dump request");
+		exit(1);
+	}
+	if (rtnl_dump_filter(&rth, get_nlmsg, NULL, NULL, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		exit(1);
+	}
+}
+
+void load_info(void)
+{
+	int i;
+
+	ndevs = 0;
+	dump_tc(RTM_GETQDISC, 0);
+	for (i = 0; i < ndevs; i++)
+		dump_tc(RTM_GETTCLASS, devs[i]);
+}
+
+static void load_raw_table(const char *buf, size_t len)
+{
+	const struct tcstat_hdr *hdr = (const void *)buf;
+	const struct tcstat_rec *rec = (const void *)(hdr + 1);
+	__u32 i;
+
+	if (len < sizeof(*hdr) ||
+	    hdr->count > (len - sizeof(*hdr)) / sizeof(*rec))
+		return;
+	snprintf(info_source, sizeof(info_source), "%.*s",
+		 (int)sizeof(hdr->info) - 1, hdr->info);
+	for (i = 0; i < hdr->count; i++) {
+		struct tcstat_ent *n = calloc(1, sizeof(*n));
+
+		if (!n)
+			abort();
+		n->r = rec[i];
+		add_db(n);
+	}
+}
+
+/* Clients read the table from shared memory */
+static void publish_db(void)
+{
+	static char *buf;
+	static size_t size;
+	struct tcstat_hdr *hdr;
+	struct tcstat_rec *rec;
+	struct tcstat_ent *n;
+	size_t len;
+	__u32 cnt = 0;
+
+	if (shm == NULL)
+		return;
+	for (n = kern_db; n; n = n->next)
+		cnt++;
+	len = sizeof(*hdr) + cnt * sizeof(*rec);
+	if (len > size) {
+		char *p = realloc(buf, len);
+
+		if (p == NULL)
+			return;
+		buf = p;
+		size = len;
+	}
+	hdr = (void *)buf;
+	memset(hdr, 0, sizeof(*hdr));
+	snprintf(hdr->info, sizeof(hdr->info), "%s", info_source);
+	hdr->count = cnt;
+	rec = (void *)(hdr + 1);
+	for (n = kern_db; n; n = n->next)
+		*rec++ = n->r;
+	statshm_publish(shm, buf, len);
+}
+
+static int load_shm_db(void)
+{
+	char name[32];
+	char *buf;
+	size_t len;
+
+	sprintf(name, "/tcstat%d", getuid());
+	if (statshm_read(name, &buf, &len) &&
+	    statshm_read("/tcstat0", &buf, &len))
+		return -1;
+	load_raw_table(buf, len);
+	free(buf);
+	return 0;
+}
+
+/*
+ * Take a new sample, interval is in microseconds.  Qdiscs and classes are
+ * created and deleted all the time, so the list is replaced with the new
+ * dump and old entries are found through the hash.
+ */
+void update_db(long long interval)
+{
+	struct tcstat_ent *n, *h, **tbl;
+	double w = 0;
+
+	h = kern_db;
+	kern_db = NULL;
+	kern_tail = &kern_db;
+
+	load_info();
+
+	if (interval > 0)
+		w = 1 - exp(-log(10) * interval / (time_constant * 1000.0));
+
+	tbl = hash_db(h);
+	for (n = kern_db; n; n = n->next) {
+		struct tcstat_ent *h1;
+		int i;
+
+		h1 = lookup_db(tbl, n->r.ifindex, n->r.type,
+			       n->r.handle, n->r.parent);
+		if (h1 == NULL || strcmp(h1->r.kind, n->r.kind))
+			continue;
+
+		memcpy(n->r.val, h1->r.val, sizeof(n->r.val));
+		memcpy(n->r.rate, h1->r.rate, sizeof(n->r.rate));
+
+		/* Byte counters are 64 bit, going back means it was recreated */
+		if (n->ival[T_BYTES] < h1->ival[T_BYTES])
+			memset(h1->ival, 0, sizeof(h1->ival));
+		for (i = 0; i < T_MAX; i++) {
+			__u64 incr = n->ival[i] - h1->ival[i];
+
+			if (i != T_BYTES)
+				incr = (__u32)incr;
+			n->r.val[i] += incr;
+			if (i < T_RATES && interval > 0) {
+				double sample = incr * 1000000.0 / interval;
+
+				n->r.rate[i] += w * (sample - n->r.rate[i]);
+			}
+		}
+	}
+	free(tbl);
+	free_db(h);
+}
+
+#define T_DIFF(a,b) (((long long)(a).tv_sec-(b).tv_sec)*1000000 + ((a).tv_usec-(b).tv_usec))
+
+void server_loop(void)
+{
+	struct timeval snaptime = { 0 };
+
+	sprintf(info_source, "%d.%lu sampling_interval=%g time_const=%d",
+		getpid(), (unsigned long)random(), scan_interval/1000.0, time_constant/1000);
+
+	load_info();
+	publish_db();
+	gettimeofday(&snaptime, NULL);
+
+	for (;;) {
+		long long tdiff;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		tdiff = T_DIFF(now, snaptime);
+		if (tdiff >= scan_interval * 1000LL) {
+			update_db(tdiff);
+			publish_db();
+			snaptime = now;
+			tdiff = 0;
+		}
+		poll(NULL, 0, scan_interval - tdiff/1000);
+	}
+}
+
+/*
+ * Link every entry to the qdisc or class above it and mark the classes
+ * which have others below, directly or through a child qdisc.
+ */
+static void link_db(void)
+{
+	struct tcstat_ent *n, **tbl = hash_db(kern_db);
+
+	for (n = kern_db; n; n = n->next) {
+		__u32 p = n->r.parent;
+
+		/* top level classes are reported with root as parent */
+		if (n->r.type == TCSTAT_CLASS && p == TC_H_ROOT)
+			p = TC_H_MAJ(n->r.handle);
+		if (p == TC_H_ROOT || p == TC_H_UNSPEC || TC_H_MAJ(p) == TC_H_MAJ(TC_H_INGRESS))
+			continue;
+		if (TC_H_MIN(p) == 0)
+			n->up = lookup_db(tbl, n->r.ifindex, TCSTAT_QDISC, p, 0);
+		else
+			n->up = lookup_db(tbl, n->r.ifindex, TCSTAT_CLASS, p, 0);
+	}
+	for (n = kern_db; n; n = n->next) {
+		struct tcstat_ent *a;
+		int depth = 0;
+
+		if (n->r.type != TCSTAT_CLASS)
+			continue;
+		for (a = n->up; a && a->r.type == TCSTAT_QDISC && depth < 64; depth++)
+			a = a->up;
+		if (a && a->r.type == TCSTAT_CLASS)
+			a->has_child = 1;
+	}
+	free(tbl);
+}
+
+static int is_leaf(const struct tcstat_ent *n)
+{
+	return n->r.type == TCSTAT_CLASS && !n->has_child;
+}
+
+static int is_zero(const struct tcstat_ent *n)
+{
+	int i;
+
+	for (i = 0; i < T_MAX; i++)
+		if (n->r.val[i])
+			return 0;
+	return n->r.qlen == 0;
+}
+
+/* use communication definitions of meg/kilo etc */
+static const unsigned long long giga = 1000000000ull;
+static const unsigned long long mega = 1000000;
+static const unsigned long long kilo = 1000;
+
+void format_rate(FILE *fp, const __u64 *vals, const double *rates, int i)
+{
+	char temp[64];
+	if (vals[i] > giga)
+		fprintf(fp, "%7lluM ", (unsigned long long)vals[i]/mega);
+	else if (vals[i] > mega)
+		fprintf(fp, "%7lluK ", (unsigned long long)vals[i]/kilo);
+	else
+		fprintf(fp, "%8llu ", (unsigned long long)vals[i]);
+
+	if (rates[i] > mega) {
+		sprintf(temp, "%uM", (unsigned)(rates[i]/mega));
+		fprintf(fp, "%-6s ", temp);
+	} else if (rates[i] > kilo) {
+		sprintf(temp, "%uK", (unsigned)(rates[i]/kilo));
+		fprintf(fp, "%-6s ", temp);
+	} else
+		fprintf(fp, "%-6u ", (unsigned)rates[i]);
+}
+
+static char *sprint_handle(__u32 h, char *buf)
+{
+	if (h == TC_H_ROOT)
+		sprintf(buf, "root");
+	else if (h == TC_H_UNSPEC)
+		sprintf(buf, "none");
+	else if (TC_H_MAJ(h) == 0)
+		sprintf(buf, ":%x", TC_H_MIN(h));
+	else if (TC_H_MIN(h) == 0)
+		sprintf(buf, "%x:", TC_H_MAJ(h)>>16);
+	else
+		sprintf(buf, "%x:%x", TC_H_MAJ(h)>>16, TC_H_MIN(h));
+	return buf;
+}
+
+static int get_handle(__u32 *h, const char *str)
+{
+	unsigned maj, min = 0;
+	char *p;
+
+	maj = strtoul(str, &p, 16);
+	if (*p != ':' || p == str || maj >= 0x10000)
+		return -1;
+	str = p + 1;
+	if (*str) {
+		min = strtoul(str, &p, 16);
+		if (*p || min >= 0x10000)
+			return -1;
+	}
+	*h = TC_H_MAKE(maj << 16, min);
+	return 0;
+}
+
+void print_head(FILE *fp, const char *what, const char *kind)
+{
+	fprintf(fp, "#%s\n", info_source);
+	fprintf(fp, "%-10s %-5s %-9s %-9s %-8s ", "Dev", "", what, "Parent", kind);
+	fprintf(fp, "%8s/%-6s ", "Bytes", "Rate");
+	fprintf(fp, "%8s/%-6s ", "Pkts", "Rate");
+	fprintf(fp, "%8s/%-6s ", "Drops", "Rate");
+	fprintf(fp, "%8s %6s\n", "Overlim", "Qlen");
+}
+
+void print_one(FILE *fp, const struct tcstat_rec *r)
+{
+	char b1[16], b2[16];
+
+	fprintf(fp, "%-10s %-5s %-9s %-9s %-8s ", ll_index_to_name(r->ifindex),
+		r->type == TCSTAT_QDISC ? "qdisc" : "class",
+		sprint_handle(r->handle, b1), sprint_handle(r->parent, b2),
+		r->kind);
+	format_rate(fp, r->val, r->rate, T_BYTES);
+	format_rate(fp, r->val, r->rate, T_PACKETS);
+	format_rate(fp, r->val, r->rate, T_DROPS);
+	fprintf(fp, "%8llu %6u\n", (unsigned long long)r->val[T_OVERLIMITS],
+		r->qlen);
+}
+
+void dump_kern_db(FILE *fp)
+{
+	struct tcstat_ent *n;
+
+	print_head(fp, "Id", "Kind");
+	for (n = kern_db; n; n = n->next) {
+		if (!match(n->r.ifindex) || (!dump_zeros && is_zero(n)))
+			continue;
+		print_one(fp, &n->r);
+	}
+}
+
+static int cmp_rate(const void *a, const void *b)
+{
+	const struct tcstat_ent *x = *(struct tcstat_ent * const *)a;
+	const struct tcstat_ent *y = *(struct tcstat_ent * const *)b;
+	int i = by_drops ? T_DROPS : T_BYTES;
+
+	if (x->r.rate[i] != y->r.rate[i])
+		return x->r.rate[i] < y->r.rate[i] ? 1 : -1;
+	return x->r.val[i] < y->r.val[i] ? 1 : x->r.val[i] > y->r.val[i] ? -1 : 0;
+}
+
+/* The leaf classes moving most bytes (or dropping most packets) */
+void dump_top_db(FILE *fp)
+{
+	struct tcstat_ent *n, **v;
+	int cnt = 0, i;
+
+	for (n = kern_db; n; n = n->next)
+		cnt++;
+	v = malloc((cnt + 1) * sizeof(*v));
+	if (!v)
+		abort();
+	cnt = 0;
+	for (n = kern_db; n; n = n->next)
+		if (is_leaf(n) && match(n->r.ifindex))
+			v[cnt++] = n;
+	qsort(v, cnt, sizeof(*v), cmp_rate);
+
+	print_head(fp, "Class", "Kind");
+	for (i = 0; i < cnt && i < top_n; i++)
+		print_one(fp, &v[i]->r);
+	free(v);
+}
+
+/*
+ * Totals below a qdisc or class, per device.  Only leaf classes are summed,
+ * inner ones count the same traffic again.  A classless qdisc or a leaf
+ * class stands for itself.
+ */
+void dump_subtree_db(FILE *fp)
+{
+	int type = TC_H_MIN(subtree_id) ? TCSTAT_CLASS : TCSTAT_QDISC;
+	struct tcstat_ent *n, *a;
+	struct tcstat_rec tot;
+	int i, d, leaves;
+
+	print_head(fp, "Subtree", "Leaves");
+	for (d = 0; d < ndevs; d++) {
+		struct tcstat_ent *top = NULL;
+
+		memset(&tot, 0, sizeof(tot));
+		leaves = 0;
+		for (n = kern_db; n; n = n->next) {
+			int depth = 0;
+
+			if (n->r.ifindex != devs[d])
+				continue;
+			if (n->r.type == type && n->r.handle == subtree_id)
+				top = n;
+			if (!is_leaf(n))
+				continue;
+			for (a = n; a && depth < 64; a = a->up, depth++)
+				if (a->r.type == type && a->r.handle == subtree_id)
+					break;
+			if (a == NULL || depth == 64)
+				continue;
+			for (i = 0; i < T_MAX; i++)
+				tot.val[i] += n->r.val[i];
+			for (i = 0; i < T_RATES; i++)
+				tot.rate[i] += n->r.rate[i];
+			tot.qlen += n->r.qlen;
+			leaves++;
+		}
+		if (top == NULL)
+			continue;
+		if (leaves == 0)
+			tot = top->r;
+		tot.ifindex = top->r.ifindex;
+		tot.type = top->r.type;
+		tot.handle = top->r.handle;
+		tot.parent = top->r.parent;
+		snprintf(tot.kind, sizeof(tot.kind), "%d", leaves ? leaves : 1);
+		print_one(fp, &tot);
+	}
+}
+
+static void usage(void) __attribute__((noreturn));
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: tcstat [OPTION] [ PATTERN [ PATTERN ] ]\n"
+"   -h, --help		this message\n"
+"   -d, --scan=SECS	sample every statistics every SECS\n"
+"   -D, --drops		order by drop rate\n"
+"   -k, --kernel	read the kernel, not the daemon\n"
+"   -n, --top=N		show the N busiest leaf classes\n"
+"   -S, --subtree=ID	show totals below qdisc or class ID\n"
+"   -t, --interval=SECS	report average over the last SECS\n"
+"   -V, --version	output version information\n"
+"   -z, --zeros		show entries with zero activity\n");
+
+	exit(-1);
+}
+
+static const struct option longopts[] = {
+	{ "help", 0, 0, 'h' },
+	{ "scan", 1, 0, 'd'},
+	{ "drops", 0, 0, 'D' },
+	{ "kernel", 0, 0, 'k' },
+	{ "top", 1, 0, 'n' },
+	{ "subtree", 1, 0, 'S' },
+	{ "interval", 1, 0, 't' },
+	{ "version", 0, 0, 'V' },
+	{ "zeros", 0, 0, 'z' },
+	{ 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	int from_kernel = 0;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "hvVzkDd:t:n:S:",
+			longopts, NULL)) != EOF) {
+		switch(ch) {
+		case 'z':
+			dump_zeros = 1;
+			break;
+		case 'k':
+			from_kernel = 1;
+			break;
+		case 'D':
+			by_drops = 1;
+			break;
+		case 'n':
+			top_n = atoi(optarg);
+			if (top_n <= 0) {
+				fprintf(stderr, "tcstat: invalid number of classes\n");
+				exit(-1);
+			}
+			break;
+		case 'S':
+			if (get_handle(&subtree_id, optarg)) {
+				fprintf(stderr, "tcstat: invalid qdisc or class id \"%s\"\n", optarg);
+				exit(-1);
+			}
+			subtree = 1;
+			break;
+		case 'd':
+			scan_interval = atof(optarg) * 1000;
+			if (scan_interval <= 0) {
+				fprintf(stderr, "tcstat: invalid scan interval\n");
+				exit(-1);
+			}
+			break;
+		case 't':
+			time_constant = atoi(optarg);
+			if (time_constant <= 0) {
+				fprintf(stderr, "tcstat: invalid time constant divisor\n");
+				exit(-1);
+			}
+			break;
+		case 'v':
+		case 'V':
+			printf("tcstat utility, iproute2-ss%s\n", SNAPSHOT);
+			exit(0);
+		case 'h':
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (rtnl_open(&rth, 0) < 0)
+		exit(1);
+
+	if (scan_interval > 0) {
+		char shm_name[32];
+
+		if (time_constant == 0)
+			time_constant = 60;
+		time_constant *= 1000;
+		sprintf(shm_name, "/tcstat%d", getuid());
+		shm = statshm_create(shm_name);
+		if (shm == NULL) {
+			perror("tcstat: shm_open");
+			exit(-1);
+		}
+		if (daemon(0, 0)) {
+			perror("tcstat: daemon");
+			exit(-1);
+		}
+		signal(SIGPIPE, SIG_IGN);
+		server_loop();
+		exit(0);
+	}
+
+	patterns = argv;
+	npatterns = argc;
+
+	if (from_kernel || load_shm_db()) {
+		load_info();
+		strcpy(info_source, "kernel");
+	}
+	ll_init_map(&rth);
+
+	if (subtree) {
+		struct tcstat_ent *n;
+
+		/* devices in the order they come, once each */
+		ndevs = 0;
+		for (n = kern_db; n; n = n->next) {
+			int i;
+
+			if (!match(n->r.ifindex))
+				continue;
+			for (i = 0; i < ndevs; i++)
+				if (devs[i] == n->r.ifindex)
+					break;
+			if (i == ndevs && ndevs < TCSTAT_MAXDEV)
+				devs[ndevs++] = n->r.ifindex;
+		}
+		link_db();
+		dump_subtree_db(stdout);
+	} else if (top_n) {
+		link_db();
+		dump_top_db(stdout);
+	} else
+		dump_kern_db(stdout);
+
+	rtnl_close(&rth);
+	exit(0);
+}
@@ -25,6 +25,7 @@
 
 #include "utils.h"
 #include "tc_util.h"
+#include "tc_common.h"
 
 extern int show_pretty;
 
@@ -1287,8 +1288,588 @@ static int u32_print_opt(struct filter_util *qu, FILE *f, struct rtattr *opt,
 	return 0;
 }
 
+/*
+ * "tc filter compile ... u32": a list of rules, one "match ... classid X"
+ * per line, is turned into hash tables.  A set of rules is split on the
+ * fully masked byte taking most distinct values, with the smallest divisor
+ * keeping those apart, and every bucket is split again until at most
+ * "leaf" rules are left to be searched linearly.  Rules lacking the byte
+ * stay behind the link node, and so does every rule which a packet could
+ * match together with one of those before it, which keeps the first
+ * match what it is in the list.
+ */
+#define U32C_LEAF	8
+#define U32C_DEPTH	8
+#define U32C_MAXCAND	64
+#define U32C_WINDOW	256
+
+struct u32c_rule
+{
+	int			lineno;
+	__u32			classid;
+	int			nkeys;
+	struct tc_u32_key	*keys;
+};
+
+struct u32c_cand
+{
+	int	off;
+	int	byte;		/* within the word at off, 0 comes first */
+};
+
+struct u32c
+{
+	struct tcmsg	t;
+	const char	*file;
+	unsigned	next_ht;
+	int		leaf;
+	int		tables;
+	int		links;
+	int		longest;
+	int		depth;
+	int		failed;
+};
+
+/* u32_hash_fold() of the kernel, the bucket a word lands in */
+static unsigned u32c_hash(__u32 key, const struct tc_u32_sel *sel,
+			  unsigned divisor)
+{
+	__u32 h = ntohl(key & sel->hmask);
+
+	if (sel->hmask)
+		h >>= ffs(ntohl(sel->hmask)) - 1;
+	return h & (divisor - 1);
+}
+
+static const struct tc_u32_key *u32c_key(const struct u32c_rule *r, int off)
+{
+	int i;
+
+	for (i = 0; i < r->nkeys; i++)
+		if (r->keys[i].off == off && r->keys[i].offmask == 0)
+			return &r->keys[i];
+	return NULL;
+}
+
+static int u32c_byte(const struct u32c_rule *r, const struct u32c_cand *c)
+{
+	const struct tc_u32_key *k = u32c_key(r, c->off);
+
+	if (k == NULL || ((const __u8 *)&k->mask)[c->byte] != 0xFF)
+		return -1;
+	return ((const __u8 *)&k->val)[c->byte];
+}
+
+/* Can a packet match both rules?  Only keys on the same word tell */
+static int u32c_overlap(const struct u32c_rule *a, const struct u32c_rule *b)
+{
+	int i, j;
+
+	for (i = 0; i < a->nkeys; i++) {
+		const struct tc_u32_key *x = &a->keys[i];
+
+		if (x->offmask)
+			continue;
+		for (j = 0; j < b->nkeys; j++) {
+			const struct tc_u32_key *y = &b->keys[j];
+
+			if (y->offmask == 0 && y->off == x->off &&
+			    ((x->val ^ y->val) & x->mask & y->mask))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int u32c_has(const struct u32c_cand *c, int n, int off, int byte)
+{
+	while (n-- > 0)
+		if (c[n].off == off && c[n].byte == byte)
+			return 1;
+	return 0;
+}
+
+/* Pick the byte to hash on; returns the number of distinct values */
+static int u32c_choose(struct u32c_rule **r, int n,
+		       const struct u32c_cand *used, int nused,
+		       struct u32c_cand *best)
+{
+	struct u32c_cand cand[U32C_MAXCAND];
+	int ncand = 0, best_distinct = 1, best_cover = 0;
+	int i, k, b;
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < r[i]->nkeys; k++) {
+			const struct tc_u32_key *key = &r[i]->keys[k];
+
+			if (key->offmask)
+				continue;
+			for (b = 0; b < 4; b++) {
+				if (((const __u8 *)&key->mask)[b] != 0xFF ||
+				    u32c_has(cand, ncand, key->off, b) ||
+				    u32c_has(used, nused, key->off, b) ||
+				    ncand == U32C_MAXCAND)
+					continue;
+				cand[ncand].off = key->off;
+				cand[ncand].byte = b;
+				ncand++;
+			}
+		}
+	}
+
+	for (k = 0; k < ncand; k++) {
+		__u32 seen[256/32];
+		int distinct = 0, cover = 0;
+
+		memset(seen, 0, sizeof(seen));
+		for (i = 0; i < n; i++) {
+			int v = u32c_byte(r[i], &cand[k]);
+
+			if (v < 0)
+				continue;
+			cover++;
+			if (!(seen[v/32] & (1U << (v%32)))) {
+				seen[v/32] |= 1U << (v%32);
+				distinct++;
+			}
+		}
+		if (distinct > best_distinct ||
+		    (distinct == best_distinct && cover > best_cover)) {
+			best_distinct = distinct;
+			best_cover = cover;
+			*best = cand[k];
+		}
+	}
+	return best_distinct;
+}
+
+/* Smallest divisor that keeps the distinct values in distinct buckets */
+static unsigned u32c_divisor(struct u32c_rule **r, int n,
+			     const struct u32c_cand *c, int distinct)
+{
+	unsigned divisor;
+
+	for (divisor = 1; divisor < distinct; divisor <<= 1)
+		;
+	for (; divisor < 0x100; divisor <<= 1) {
+		__u32 seen[256/32];
+		int i, buckets = 0;
+
+		memset(seen, 0, sizeof(seen));
+		for (i = 0; i < n; i++) {
+			int v = u32c_byte(r[i], c);
+
+			if (v < 0)
+				continue;
+			v &= divisor - 1;
+			if (!(seen[v/32] & (1U << (v%32)))) {
+				seen[v/32] |= 1U << (v%32);
+				buckets++;
+			}
+		}
+		if (buckets == distinct)
+			break;
+	}
+	return divisor;
+}
+
+static int u32c_send(struct u32c *c, int tag, __u32 handle, __u32 htid,
+		     const struct tc_u32_sel *sel, __u32 classid,
+		     __u32 link, unsigned divisor)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct tcmsg	t;
+		char		buf[MAX_MSG];
+	} req;
+	struct rtattr *tail;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST|NLM_F_EXCL|NLM_F_CREATE;
+	req.n.nlmsg_type = RTM_NEWTFILTER;
+	req.t = c->t;
+	req.t.tcm_handle = handle;
+
+	addattr_l(&req.n, sizeof(req), TCA_KIND, "u32", 4);
+	tail = NLMSG_TAIL(&req.n);
+	addattr_l(&req.n, sizeof(req), TCA_OPTIONS, NULL, 0);
+	if (divisor)
+		addattr32(&req.n, sizeof(req), TCA_U32_DIVISOR, divisor);
+	if (htid)
+		addattr32(&req.n, sizeof(req), TCA_U32_HASH, htid);
+	if (link)
+		addattr32(&req.n, sizeof(req), TCA_U32_LINK, link);
+	if (classid)
+		addattr32(&req.n, sizeof(req), TCA_U32_CLASSID, classid);
+	if (sel)
+		addattr_l(&req.n, sizeof(req), TCA_U32_SEL, sel,
+			  sizeof(*sel) + sel->nkeys * sizeof(sel->keys[0]));
+	tail->rta_len = (void *)NLMSG_TAIL(&req.n) - (void *)tail;
+
+	rtnl_batch_tag(&rth, tag);
+	return rtnl_talk(&rth, &req.n, 0, 0, NULL, NULL, NULL);
+}
+
+static int u32c_leaf(struct u32c *c, const struct u32c_rule *r,
+		     __u32 htid, unsigned node)
+{
+	struct {
+		struct tc_u32_sel sel;
+		struct tc_u32_key keys[128];
+	} sel;
+
+	memset(&sel, 0, sizeof(sel));
+	sel.sel.flags = TC_U32_TERMINAL;
+	sel.sel.nkeys = r->nkeys;
+	memcpy(sel.sel.keys, r->keys, r->nkeys * sizeof(r->keys[0]));
+	return u32c_send(c, r->lineno, node, htid, &sel.sel, r->classid, 0, 0);
+}
+
+static int u32c_linear(struct u32c *c, struct u32c_rule **r, int n,
+		       __u32 htid, unsigned *node)
+{
+	int i, err = 0;
+
+	if (*node + n > 0x1000) {
+		fprintf(stderr, "%s:%d: too many rules collide in one bucket\n",
+			c->file, r[0]->lineno);
+		return -1;
+	}
+	for (i = 0; i < n && err == 0; i++)
+		err = u32c_leaf(c, r[i], htid, (*node)++);
+	if (n > c->longest)
+		c->longest = n;
+	return err;
+}
+
+/*
+ * Place rules into bucket htid from node number *node on.  Tables are
+ * created and filled before the link node pointing to them, so that
+ * classification never sees them half built.
+ */
+static int u32c_place(struct u32c *c, struct u32c_rule **r, int n,
+		      __u32 htid, unsigned *node,
+		      struct u32c_cand *used, int nused)
+{
+	struct u32c_rule **left = NULL;
+	int err = 0;
+
+	while (n > 0 && err == 0) {
+		struct u32c_rule **hashed, **sorted, **rest;
+		struct tc_u32_sel sel;
+		struct u32c_cand cand;
+		unsigned divisor, ht, b, link_node;
+		int count[0x100], start[0x100];
+		__u32 seen[256/32];
+		int i, j, distinct = 0, nhashed = 0, nrest = 0;
+
+		if (n <= c->leaf || nused == U32C_DEPTH ||
+		    u32c_choose(r, n, used, nused, &cand) < 2) {
+			err = u32c_linear(c, r, n, htid, node);
+			break;
+		}
+
+		hashed = malloc(n * sizeof(*hashed));
+		sorted = malloc(n * sizeof(*sorted));
+		rest = malloc(n * sizeof(*rest));
+		if (hashed == NULL || sorted == NULL || rest == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			free(hashed);
+			free(sorted);
+			free(rest);
+			err = -1;
+			break;
+		}
+
+		/* Hashed rules are tried first, so none may overlap a rule left before it */
+		memset(seen, 0, sizeof(seen));
+		for (i = 0; i < n; i++) {
+			int v = u32c_byte(r[i], &cand);
+
+			for (j = 0; v >= 0 && j < nrest; j++)
+				if (u32c_overlap(rest[j], r[i]))
+					v = -1;
+			if (v < 0) {
+				rest[nrest++] = r[i];
+				continue;
+			}
+			hashed[nhashed++] = r[i];
+			if (!(seen[v/32] & (1U << (v%32)))) {
+				seen[v/32] |= 1U << (v%32);
+				distinct++;
+			}
+		}
+		if (distinct < 2) {
+			free(hashed);
+			free(sorted);
+			free(rest);
+			err = u32c_linear(c, r, n, htid, node);
+			break;
+		}
+
+		if (c->next_ht == 0x800)
+			c->next_ht++;
+		if (c->next_ht > 0xFFF || *node >= 0x1000) {
+			fprintf(stderr, "Out of u32 hash table or node ids\n");
+			free(hashed);
+			free(sorted);
+			free(rest);
+			err = -1;
+			break;
+		}
+		ht = c->next_ht++ << 20;
+		link_node = (*node)++;
+		divisor = u32c_divisor(hashed, nhashed, &cand, distinct);
+
+		memset(&sel, 0, sizeof(sel));
+		sel.hoff = cand.off;
+		((__u8 *)&sel.hmask)[cand.byte] = 0xFF;
+
+		/* Stable sort into buckets, keeping the rest in order */
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < nhashed; i++)
+			count[u32c_hash(u32c_key(hashed[i], cand.off)->val,
+					&sel, divisor)]++;
+		for (b = 0, i = 0; b < divisor; b++) {
+			start[b] = i;
+			i += count[b];
+		}
+		for (i = 0; i < nhashed; i++)
+			sorted[start[u32c_hash(u32c_key(hashed[i], cand.off)->val,
+					       &sel, divisor)]++] = hashed[i];
+		free(hashed);
+
+		err = u32c_send(c, 0, ht, 0, NULL, 0, 0, divisor);
+		c->tables++;
+		if (nused + 1 > c->depth)
+			c->depth = nused + 1;
+		used[nused] = cand;
+		for (b = 0, i = 0; b < divisor && err == 0; b++) {
+			unsigned bnode = 1;
+
+			if (count[b])
+				err = u32c_place(c, sorted + i, count[b],
+						 ht | (b << 12), &bnode,
+						 used, nused + 1);
+			i += count[b];
+		}
+		if (err == 0)
+			err = u32c_send(c, 0, link_node, htid, &sel, 0, ht, 0);
+		c->links++;
+
+		free(sorted);
+		free(left);
+		left = r = rest;
+		n = nrest;
+	}
+	free(left);
+	return err;
+}
+
+static int u32c_error(int tag, int error, void *arg)
+{
+	struct u32c *c = arg;
+
+	if (tag)
+		fprintf(stderr, "%s:%d: ", c->file, tag);
+	else
+		fprintf(stderr, "Hash table: ");
+	fprintf(stderr, "%s\n", error ? strerror(error) : "request lost");
+	c->failed++;
+	return 1;
+}
+
+static int u32c_read(struct u32c *c, FILE *fp, struct u32c_rule **rules)
+{
+	struct u32c_rule *r = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = 0, n = 0, max = 0;
+
+	while (getline(&line, &len, fp) > 0) {
+		struct {
+			struct nlmsghdr	n;
+			char		buf[MAX_MSG];
+		} mark;
+		struct {
+			struct tc_u32_sel sel;
+			struct tc_u32_key keys[128];
+		} sel;
+		char *args[100], **argv = args;
+		__u32 classid = 0;
+		char *cp;
+		int argc;
+
+		lineno++;
+		cp = strchr(line, '#');
+		if (cp)
+			*cp = 0;
+		argc = makeargs(line, args, 100);
+		if (argc == 0)
+			continue;
+
+		memset(&sel, 0, sizeof(sel));
+		mark.n.nlmsg_len = NLMSG_LENGTH(0);
+		while (argc > 0) {
+			if (matches(*argv, "match") == 0) {
+				NEXT_ARG();
+				if (parse_selector(&argc, &argv, &sel.sel, &mark.n) ||
+				    mark.n.nlmsg_len != NLMSG_LENGTH(0)) {
+					fprintf(stderr, "%s:%d: Illegal \"match\"\n",
+						c->file, lineno);
+					return -1;
+				}
+				continue;
+			} else if (matches(*argv, "classid") == 0 ||
+				   strcmp(*argv, "flowid") == 0) {
+				NEXT_ARG();
+				if (get_tc_classid(&classid, *argv)) {
+					fprintf(stderr, "%s:%d: Illegal \"classid\"\n",
+						c->file, lineno);
+					return -1;
+				}
+			} else {
+				fprintf(stderr, "%s:%d: What is \"%s\"?\n",
+					c->file, lineno, *argv);
+				return -1;
+			}
+			argc--; argv++;
+		}
+		if (classid == 0) {
+			fprintf(stderr, "%s:%d: \"classid\" is required\n",
+				c->file, lineno);
+			return -1;
+		}
+
+		if (n == max) {
+			max = max ? 2 * max : 1024;
+			r = realloc(r, max * sizeof(*r));
+			if (r == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				return -1;
+			}
+		}
+		r[n].lineno = lineno;
+		r[n].classid = classid;
+		r[n].nkeys = sel.sel.nkeys;
+		r[n].keys = malloc(sel.sel.nkeys * sizeof(sel.keys[0]) + 1);
+		if (r[n].keys == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		memcpy(r[n].keys, sel.keys, sel.sel.nkeys * sizeof(sel.keys[0]));
+		n++;
+	}
+	free(line);
+	*rules = r;
+	return n;
+}
+
+static void u32c_explain(void)
+{
+	fprintf(stderr, "Usage: tc filter compile dev STRING [ root | parent CLASSID ] pref PRIO\n");
+	fprintf(stderr, "                 [ protocol PROTO ] u32 [ file FILE ] [ ht ID ] [ leaf N ]\n");
+	fprintf(stderr, "Every line of FILE (default: stdin) is a rule:\n");
+	fprintf(stderr, "       match SELECTOR [ match SELECTOR ... ] { classid | flowid } CLASSID\n");
+	fprintf(stderr, "ID is the first hash table to use, N the longest chain wanted.\n");
+}
+
+static int u32_compile_opt(struct filter_util *qu, struct tcmsg *t,
+			   int argc, char **argv)
+{
+	struct rtnl_batch *outer = rth.batch;
+	struct u32c_cand used[U32C_DEPTH];
+	struct u32c_rule *rules, **r;
+	struct u32c c;
+	unsigned node = 1;
+	FILE *fp = stdin;
+	int i, n, err;
+
+	memset(&c, 0, sizeof(c));
+	c.t = *t;
+	c.file = "-";
+	c.next_ht = 1;
+	c.leaf = U32C_LEAF;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "file") == 0) {
+			NEXT_ARG();
+			c.file = *argv;
+		} else if (strcmp(*argv, "ht") == 0) {
+			__u32 handle;
+
+			NEXT_ARG();
+			if (get_u32_handle(&handle, *argv) ||
+			    TC_U32_KEY(handle) || TC_U32_USERHTID(handle) == 0) {
+				fprintf(stderr, "Illegal \"ht\"\n");
+				return -1;
+			}
+			c.next_ht = TC_U32_USERHTID(handle);
+		} else if (strcmp(*argv, "leaf") == 0) {
+			NEXT_ARG();
+			if (get_integer(&c.leaf, *argv, 0) || c.leaf < 1) {
+				fprintf(stderr, "Illegal \"leaf\"\n");
+				return -1;
+			}
+		} else {
+			if (strcmp(*argv, "help"))
+				fprintf(stderr, "What is \"%s\"?\n", *argv);
+			u32c_explain();
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	if (strcmp(c.file, "-") && (fp = fopen(c.file, "r")) == NULL) {
+		perror(c.file);
+		return 1;
+	}
+	n = u32c_read(&c, fp, &rules);
+	if (fp != stdin)
+		fclose(fp);
+	if (n <= 0)
+		return n < 0 ? 1 : 0;
+
+	r = malloc(n * sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		r[i] = &rules[i];
+
+	/* All of it goes in one batch, with errors reported per rule */
+	if (outer && rtnl_batch_flush(&rth) < 0)
+		return 2;
+	rth.batch = NULL;
+	if (rtnl_batch_start(&rth, U32C_WINDOW, u32c_error, &c) < 0)
+		return 1;
+	err = u32c_place(&c, r, n, TC_U32_ROOT, &node, used, 0);
+	if (rtnl_batch_stop(&rth) < 0)
+		err = -1;
+	rth.batch = outer;
+
+	if (show_stats)
+		printf("%d rules: %d hash tables, %d links, %d levels, longest chain %d\n",
+		       n, c.tables, c.links, c.depth, c.longest);
+
+	for (i = 0; i < n; i++)
+		free(rules[i].keys);
+	free(rules);
+	free(r);
+
+	if (err || c.failed) {
+		if (c.failed)
+			fprintf(stderr, "%d requests failed\n", c.failed);
+		return 2;
+	}
+	return 0;
+}
+
 struct filter_util u32_filter_util = {
 	.id = "u32",
 	.parse_fopt = u32_parse_opt,
 	.print_fopt = u32_print_opt,
+	.compile_fopt = u32_compile_opt,
 };
@@ -38,6 +38,7 @@ int show_pretty = 0;
 int resolve_hosts = 0;
 int use_iec = 0;
 int force = 0;
+static int pipeline;
 struct rtnl_handle rth;
 
 static void *BODY = NULL;	/* cached handle dlopen(NULL) */
@@ -182,9 +183,11 @@ noexist:
 static void usage(void)
 {
 	fprintf(stderr, "Usage: tc [ OPTIONS ] OBJECT { COMMAND | help }\n"
-			"       tc [-force] -batch filename\n"
+			"       tc [-force] [-pipeline window] -batch filename\n"
+			"       tc apply filename\n"
 	                "where  OBJECT := { qdisc | class | filter | action | monitor }\n"
-	                "       OPTIONS := { -s[tatistics] | -d[etails] | -r[aw] | -p[retty] | -b[atch] [filename] }\n");
+	                "       OPTIONS := { -s[tatistics] | -d[etails] | -r[aw] | -p[retty] | -b[atch] [filename] |\n"
+	                "                    -pi[peline] [window] }\n");
 }
 
 static int do_cmd(int argc, char **argv)
@@ -204,6 +207,9 @@ static int do_cmd(int argc, char **argv)
 	if (matches(*argv, "monitor") == 0)
 		return do_tcmonitor(argc-1, argv+1);
 
+	if (matches(*argv, "apply") == 0)
+		return do_apply(argc-1, argv+1);
+
 	if (matches(*argv, "help") == 0) {
 		usage();
 		return 0;
@@ -214,6 +220,24 @@ static int do_cmd(int argc, char **argv)
 	return -1;
 }
 
+static int batch_errors;
+
+static int batch_error(int lineno, int error, void *arg)
+{
+	if (error) {
+		errno = error;
+		perror("RTNETLINK answers");
+	}
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)arg, lineno);
+	batch_errors++;
+	return 1;
+}
+
+static void batch_exit(void)
+{
+	rtnl_batch_stop(&rth);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -235,6 +259,12 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (pipeline) {
+		if (rtnl_batch_start(&rth, pipeline, batch_error, (void *)name) < 0)
+			return -1;
+		atexit(batch_exit);
+	}
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -244,16 +274,23 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		rtnl_batch_tag(&rth, cmdlineno);
 		if (do_cmd(largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
 			ret = 1;
 			if (!force)
 				break;
 		}
+		if (batch_errors && !force)
+			break;
 	}
 	if (line)
 		free(line);
 
+	rtnl_batch_stop(&rth);
+	if (batch_errors)
+		ret = 1;
+
 	rtnl_close(&rth);
 	return ret;
 }
@@ -287,6 +324,16 @@ int main(int argc, char **argv)
 			return 0;
 		} else if (matches(argv[1], "-force") == 0) {
 			++force;
+		} else if (matches(argv[1], "-pipeline") == 0) {
+			unsigned int window;
+
+			if (argc <= 2 || get_unsigned(&window, argv[2], 0) ||
+			    window == 0) {
+				fprintf(stderr, "Invalid pipeline window\n");
+				return -1;
+			}
+			pipeline = window;
+			argc--;	argv++;
 		} else 	if (matches(argv[1], "-batch") == 0) {
 			do_batching = 1;
 			if (argc > 2)
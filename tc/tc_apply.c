@@ -0,0 +1,1417 @@
+/*
+ * tc_apply.c		"tc apply".
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Brings the traffic control setup of some devices to the state described
+ * by a file of tc commands, touching only what differs.  The commands are
+ * parsed into netlink requests without being sent, the current state is
+ * dumped, and both are matched in a hash keyed by (dev, parent, handle,
+ * prio).  What is left over is removed bottom up, then the requests that
+ * are new or differ are sent in file order, all through one batch.
+ *
+ * Qdiscs are identified by their parent, classes by their id, filters by
+ * their chain (parent, prio, protocol) and actions by kind and index.
+ * A chain is replaced as a whole when any of its filters differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <linux/if_ether.h>
+
+#include "utils.h"
+#include "tc_util.h"
+#include "tc_common.h"
+
+#define TA_HASH		4096
+#define TA_WINDOW	256
+#define TA_MAXDEV	64
+
+enum {
+	TA_QDISC,
+	TA_CLASS,
+	TA_CHAIN,
+	TA_ACTION,
+	TA_MAJOR,	/* qdisc by handle */
+};
+
+static const char *ta_names[] = { "qdisc", "class", "filter", "action" };
+
+struct ta_msgs
+{
+	struct nlmsghdr	**n;
+	int		*line;
+	int		cnt;
+	int		max;
+};
+
+struct ta_obj
+{
+	struct ta_obj	*hnext;
+	struct ta_obj	*next;
+	int		type;
+	int		ifindex;
+	__u32		parent;
+	__u32		handle;
+	__u32		info;
+	char		kind[16];
+	char		cur_kind[16];
+	__u32		cur_handle;	/* of a qdisc */
+	__u32		cur_parent;	/* of a class */
+	struct ta_msgs	cur;
+	struct ta_msgs	want;
+	struct ta_obj	*owner;	/* qdisc taking this with it */
+	struct ta_obj	*up;	/* class this hangs off */
+	struct ta_obj	*alias;
+	int		differs;
+	int		gone;
+	int		implied;
+	int		sent;
+};
+
+struct ta_req
+{
+	struct nlmsghdr	*n;
+	int		line;
+	int		type;
+	struct ta_obj	*o;
+};
+
+struct ta_op
+{
+	int		line;
+	int		type;
+	struct ta_obj	*o;
+	__u32		handle;	/* of a single filter */
+};
+
+struct ta_ctx
+{
+	const char	*file;
+	struct ta_obj	*hash[TA_HASH];
+	struct ta_obj	*list;
+	struct ta_obj	**tail;
+	struct ta_req	*reqs;		/* in file order */
+	int		nreqs;
+	int		maxreqs;
+	int		dev[TA_MAXDEV];
+	int		ndev;
+	struct ta_op	*ops;
+	int		nops;
+	int		maxops;
+	int		failed;
+	int		added;
+	int		changed;
+	int		deleted;
+	int		unchanged;
+};
+
+/*
+ * Fields the kernel fills in or counts, compared only when the request
+ * sets them, or never if they are the kernel's own business.  Type 0 is
+ * for options which are a plain structure rather than attributes.
+ */
+#define TA_RATESPEC(kind, type, base)					\
+	{ kind, type, base + offsetof(struct tc_ratespec, cell_log), 1, 1 },	\
+	{ kind, type, base + offsetof(struct tc_ratespec, __reserved), 1, 1 },	\
+	{ kind, type, base + offsetof(struct tc_ratespec, cell_align), 2, 1 }
+
+static const struct {
+	const char	*kind;
+	int		type;
+	int		off;
+	int		len;
+	int		always;
+} ta_volatile[] = {
+	{ "htb", TCA_HTB_INIT, offsetof(struct tc_htb_glob, version), 4, 1 },
+	{ "htb", TCA_HTB_INIT, offsetof(struct tc_htb_glob, direct_pkts), 4, 1 },
+	{ "htb", TCA_HTB_PARMS, offsetof(struct tc_htb_opt, quantum), 4, 0 },
+	{ "htb", TCA_HTB_PARMS, offsetof(struct tc_htb_opt, level), 4, 1 },
+	TA_RATESPEC("htb", TCA_HTB_PARMS, offsetof(struct tc_htb_opt, rate)),
+	TA_RATESPEC("htb", TCA_HTB_PARMS, offsetof(struct tc_htb_opt, ceil)),
+	TA_RATESPEC("tbf", TCA_TBF_PARMS, offsetof(struct tc_tbf_qopt, rate)),
+	TA_RATESPEC("tbf", TCA_TBF_PARMS, offsetof(struct tc_tbf_qopt, peakrate)),
+	TA_RATESPEC("cbq", TCA_CBQ_RATE, 0),
+	{ "sfq", 0, offsetof(struct tc_sfq_qopt, quantum), 4, 0 },
+	{ "sfq", 0, offsetof(struct tc_sfq_qopt, limit), 4, 0 },
+	{ "sfq", 0, offsetof(struct tc_sfq_qopt, divisor), 4, 0 },
+	{ "sfq", 0, offsetof(struct tc_sfq_qopt, flows), 4, 0 },
+	{ "multiq", 0, offsetof(struct tc_multiq_qopt, bands), 2, 0 },
+	{ "multiq", 0, offsetof(struct tc_multiq_qopt, max_bands), 2, 1 },
+	{ NULL, 0, 0, 0, 0 },
+};
+
+/* Actions we know the parameters of, all starting with tc_gen */
+static const struct {
+	const char	*kind;
+	int		parms;
+} ta_actions[] = {
+	{ "gact", 2 },
+	{ "mirred", 2 },
+	{ "nat", 2 },
+	{ "pedit", 2 },
+	{ "skbedit", 2 },
+	{ "csum", 1 },
+	{ NULL, 0 },
+};
+
+static int ta_add_msg(struct ta_msgs *m, struct nlmsghdr *n, int line)
+{
+	struct nlmsghdr *c;
+
+	if (m->cnt == m->max) {
+		int max = m->max ? 2 * m->max : 4;
+		struct nlmsghdr **nn = realloc(m->n, max * sizeof(*nn));
+		int *nl = realloc(m->line, max * sizeof(*nl));
+
+		if (nn)
+			m->n = nn;
+		if (nl)
+			m->line = nl;
+		if (nn == NULL || nl == NULL)
+			goto oom;
+		m->max = max;
+	}
+	c = malloc(n->nlmsg_len);
+	if (c == NULL)
+		goto oom;
+	memcpy(c, n, n->nlmsg_len);
+	m->n[m->cnt] = c;
+	m->line[m->cnt++] = line;
+	return 0;
+oom:
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+}
+
+static unsigned ta_hashfn(int type, int ifindex, __u32 parent, __u32 handle,
+			  __u32 info, const char *kind)
+{
+	unsigned h = type;
+
+	h = h * 31 + ifindex;
+	h = h * 31 + parent;
+	h = h * 31 + handle;
+	h = h * 31 + info;
+	while (*kind)
+		h = h * 31 + *kind++;
+	return (h ^ (h >> 12)) & (TA_HASH - 1);
+}
+
+static struct ta_obj *ta_find(struct ta_ctx *c, int type, int ifindex,
+			      __u32 parent, __u32 handle, __u32 info,
+			      const char *kind, int create)
+{
+	unsigned h = ta_hashfn(type, ifindex, parent, handle, info, kind);
+	struct ta_obj *o;
+
+	for (o = c->hash[h]; o; o = o->hnext)
+		if (o->type == type && o->ifindex == ifindex &&
+		    o->parent == parent && o->handle == handle &&
+		    o->info == info && strcmp(o->kind, kind) == 0)
+			return o;
+	if (!create)
+		return NULL;
+
+	o = calloc(1, sizeof(*o));
+	if (o == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+	o->type = type;
+	o->ifindex = ifindex;
+	o->parent = parent;
+	o->handle = handle;
+	o->info = info;
+	strncpy(o->kind, kind, sizeof(o->kind) - 1);
+	o->hnext = c->hash[h];
+	c->hash[h] = o;
+	if (type != TA_MAJOR) {
+		*c->tail = o;
+		c->tail = &o->next;
+	}
+	return o;
+}
+
+static const char *ta_kind(struct nlmsghdr *n, struct rtattr **tb)
+{
+	struct tcmsg *t = NLMSG_DATA(n);
+
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t),
+		     n->nlmsg_len - NLMSG_LENGTH(sizeof(*t)));
+	return tb[TCA_KIND] ? RTA_DATA(tb[TCA_KIND]) : "";
+}
+
+static int ta_has_dev(struct ta_ctx *c, int ifindex)
+{
+	int i;
+
+	for (i = 0; i < c->ndev; i++)
+		if (c->dev[i] == ifindex)
+			return 1;
+	return 0;
+}
+
+/* Payloads which are a clean stream of attributes */
+static int ta_nested(const void *data, int len)
+{
+	const struct rtattr *rta = data;
+
+	while (RTA_OK(rta, len))
+		rta = RTA_NEXT(rta, len);
+	return len == 0;
+}
+
+static int ta_volatile_byte(const char *kind, int type, int off,
+			    const __u8 *want)
+{
+	int i, k;
+
+	for (i = 0; ta_volatile[i].kind; i++) {
+		if (strcmp(ta_volatile[i].kind, kind) ||
+		    ta_volatile[i].type != type ||
+		    off < ta_volatile[i].off ||
+		    off >= ta_volatile[i].off + ta_volatile[i].len)
+			continue;
+		if (ta_volatile[i].always)
+			return 1;
+		for (k = 0; k < ta_volatile[i].len; k++)
+			if (want[ta_volatile[i].off + k])
+				return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Compare the first len bytes, the whole of both when len is negative */
+static int ta_attr_equal(const char *kind, int type, const struct rtattr *w,
+			 const struct rtattr *cur, int len)
+{
+	const __u8 *wd = RTA_DATA(w), *cd = RTA_DATA(cur);
+	int i;
+
+	if (len < 0) {
+		len = RTA_PAYLOAD(w);
+		if (RTA_PAYLOAD(cur) != len)
+			return 0;
+	}
+	for (i = 0; i < len; i++)
+		if (wd[i] != cd[i] && !ta_volatile_byte(kind, type, i, wd))
+			return 0;
+	return 1;
+}
+
+/*
+ * Do the current options satisfy the requested ones?  The kernel reports
+ * fewer attributes than it accepts (e.g. rate tables), so only what it
+ * reports is compared.  Options that are a plain structure may come back
+ * larger, only the part the request sent is compared.
+ */
+static int ta_opts_equal(const char *kind, struct rtattr *want,
+			 struct rtattr *cur)
+{
+	const __u8 *wd, *cd;
+	int wlen, clen;
+
+	if (want == NULL)
+		return 1;
+	if (cur == NULL)
+		return 0;
+
+	wd = RTA_DATA(want);
+	cd = RTA_DATA(cur);
+	wlen = RTA_PAYLOAD(want);
+	clen = RTA_PAYLOAD(cur);
+	if (wlen == clen && memcmp(wd, cd, wlen) == 0)
+		return 1;
+
+	if (wlen && ta_nested(wd, wlen) && ta_nested(cd, clen)) {
+		const struct rtattr *w = (const void *)wd;
+
+		for (; RTA_OK(w, wlen); w = RTA_NEXT(w, wlen)) {
+			const struct rtattr *c = (const void *)cd;
+			int len = clen;
+
+			for (; RTA_OK(c, len); c = RTA_NEXT(c, len))
+				if (c->rta_type == w->rta_type)
+					break;
+			if (RTA_OK(c, len) &&
+			    !ta_attr_equal(kind, w->rta_type, w, c, -1))
+				return 0;
+		}
+		return 1;
+	}
+
+	if (clen < wlen)
+		return 0;
+	return ta_attr_equal(kind, 0, want, cur, wlen);
+}
+
+static int ta_tc_equal(struct nlmsghdr *want, struct nlmsghdr *cur)
+{
+	struct rtattr *wtb[TCA_MAX+1], *ctb[TCA_MAX+1];
+	const char *kind = ta_kind(want, wtb);
+
+	if (strcmp(kind, ta_kind(cur, ctb)))
+		return 0;
+	return ta_opts_equal(kind, wtb[TCA_OPTIONS], ctb[TCA_OPTIONS]);
+}
+
+/* Filters that come with their chain rather than from a request */
+static int ta_implicit_filter(struct nlmsghdr *n)
+{
+	struct rtattr *tb[TCA_MAX+1];
+	struct tcmsg *t = NLMSG_DATA(n);
+	const char *kind = ta_kind(n, tb);
+
+	if (t->tcm_handle == 0)
+		return 1;
+	/* the root hash table u32 makes for itself */
+	if (strcmp(kind, "u32") == 0 && TC_U32_KEY(t->tcm_handle) == 0 &&
+	    tb[TCA_OPTIONS]) {
+		struct rtattr *utb[TCA_U32_MAX+1];
+
+		parse_rtattr_nested(utb, TCA_U32_MAX, tb[TCA_OPTIONS]);
+		return utb[TCA_U32_DIVISOR] &&
+		       *(__u32 *)RTA_DATA(utb[TCA_U32_DIVISOR]) == 1;
+	}
+	return 0;
+}
+
+/*
+ * Filters given without a handle are numbered by the kernel, and u32 lists
+ * them by handle, which stops following insertion order once its node ids
+ * wrap.  Such a chain is taken as equal when every filter has a match, a
+ * rebuild would come out in the same order.  The search resumes after the
+ * previous match so a rotated chain costs no more than an ordered one.
+ */
+static int ta_chain_unordered(struct ta_obj *o)
+{
+	char *used;
+	int i, j, k, n = 0, ok = 0;
+
+	for (i = 0; i < o->want.cnt; i++)
+		if (((struct tcmsg *)NLMSG_DATA(o->want.n[i]))->tcm_handle)
+			return 0;
+	for (j = 0; j < o->cur.cnt; j++)
+		if (!ta_implicit_filter(o->cur.n[j]))
+			n++;
+	if (n != o->want.cnt || (used = calloc(o->cur.cnt, 1)) == NULL)
+		return 0;
+
+	for (i = 0, j = 0; i < o->want.cnt; i++) {
+		for (k = 0; k < o->cur.cnt; k++, j = (j + 1) % o->cur.cnt)
+			if (!used[j] && !ta_implicit_filter(o->cur.n[j]) &&
+			    ta_tc_equal(o->want.n[i], o->cur.n[j]))
+				break;
+		if (k == o->cur.cnt)
+			goto out;
+		used[j] = 1;
+	}
+	ok = 1;
+out:
+	free(used);
+	return ok;
+}
+
+static int ta_chain_ordered(struct ta_obj *o)
+{
+	int i, j = 0;
+
+	for (i = 0; i < o->want.cnt; i++, j++) {
+		struct tcmsg *w = NLMSG_DATA(o->want.n[i]);
+
+		while (j < o->cur.cnt && ta_implicit_filter(o->cur.n[j]) &&
+		       (w->tcm_handle == 0 ||
+			((struct tcmsg *)NLMSG_DATA(o->cur.n[j]))->tcm_handle !=
+			w->tcm_handle))
+			j++;
+		if (j == o->cur.cnt)
+			return 0;
+		if (w->tcm_handle &&
+		    w->tcm_handle != ((struct tcmsg *)NLMSG_DATA(o->cur.n[j]))->tcm_handle)
+			return 0;
+		if (!ta_tc_equal(o->want.n[i], o->cur.n[j]))
+			return 0;
+	}
+	for (; j < o->cur.cnt; j++)
+		if (!ta_implicit_filter(o->cur.n[j]))
+			return 0;
+	return 1;
+}
+
+static int ta_chain_equal(struct ta_obj *o)
+{
+	return ta_chain_ordered(o) || ta_chain_unordered(o);
+}
+
+static int ta_chain_find(struct ta_msgs *m, __u32 handle)
+{
+	int i;
+
+	for (i = 0; i < m->cnt; i++)
+		if (((struct tcmsg *)NLMSG_DATA(m->n[i]))->tcm_handle == handle)
+			return i;
+	return -1;
+}
+
+/*
+ * Can a chain be changed filter by filter?  Only when every filter has
+ * a handle of its own to match on and the chain keeps its kind, filters
+ * numbered by the kernel leave nothing to pair them up by.
+ */
+static int ta_chain_by_handle(struct ta_obj *o)
+{
+	struct rtattr *tb[TCA_MAX+1];
+	const char *kind;
+	int i;
+
+	kind = ta_kind(o->cur.n[0], tb);
+	for (i = 0; i < o->want.cnt; i++) {
+		struct rtattr *wtb[TCA_MAX+1];
+
+		if (((struct tcmsg *)NLMSG_DATA(o->want.n[i]))->tcm_handle == 0 ||
+		    strcmp(ta_kind(o->want.n[i], wtb), kind))
+			return 0;
+	}
+	return 1;
+}
+
+/* u32 keeps the selector of a node it changes, so those are re-added */
+static int ta_filter_in_place(struct nlmsghdr *n)
+{
+	struct rtattr *tb[TCA_MAX+1];
+
+	return strcmp(ta_kind(n, tb), "u32") != 0;
+}
+
+static int ta_action_parms(const char *kind)
+{
+	int i;
+
+	for (i = 0; ta_actions[i].kind; i++)
+		if (strcmp(ta_actions[i].kind, kind) == 0)
+			return ta_actions[i].parms;
+	return 0;
+}
+
+/* Kind and tc_gen of one action of a TCA_ACT_TAB */
+static const char *ta_action_gen(struct rtattr *act, struct rtattr **opt,
+				 __u32 *index, int *bindcnt)
+{
+	struct rtattr *tb[TCA_ACT_MAX+1], *otb[16];
+	const char *kind;
+	int parms;
+
+	parse_rtattr_nested(tb, TCA_ACT_MAX, act);
+	if (tb[TCA_ACT_KIND] == NULL)
+		return NULL;
+	kind = RTA_DATA(tb[TCA_ACT_KIND]);
+	*opt = tb[TCA_ACT_OPTIONS];
+	*index = 0;
+	*bindcnt = 0;
+	parms = ta_action_parms(kind);
+	if (parms == 0 || *opt == NULL)
+		return kind;
+
+	parse_rtattr_nested(otb, 15, *opt);
+	if (otb[parms] && RTA_PAYLOAD(otb[parms]) >= 5 * sizeof(__u32)) {
+		__u32 *gen = RTA_DATA(otb[parms]);
+
+		*index = gen[0];
+		*bindcnt = gen[4];
+	}
+	return kind;
+}
+
+static int ta_action_equal(const char *kind, struct rtattr *want,
+			   struct rtattr *cur)
+{
+	int parms = ta_action_parms(kind);
+	struct rtattr *wtb[16], *ctb[16];
+	int i;
+
+	if (want == NULL)
+		return 1;
+	if (cur == NULL)
+		return 0;
+	parse_rtattr_nested(wtb, 15, want);
+	parse_rtattr_nested(ctb, 15, cur);
+	for (i = 1; i < 16; i++) {
+		__u8 *wd, *cd;
+		int len;
+
+		if (wtb[i] == NULL || ctb[i] == NULL)
+			continue;
+		wd = RTA_DATA(wtb[i]);
+		cd = RTA_DATA(ctb[i]);
+		len = RTA_PAYLOAD(wtb[i]);
+		if (len != RTA_PAYLOAD(ctb[i]))
+			return 0;
+		if (i == parms) {
+			/* capab, refcnt and bindcnt are the kernel's */
+			if (memcmp(wd, cd, 4) || memcmp(wd + 8, cd + 8, 4) ||
+			    memcmp(wd + 20, cd + 20, len - 20))
+				return 0;
+		} else if (memcmp(wd, cd, len))
+			return 0;
+	}
+	return 1;
+}
+
+/* Commands of the file only get as far as here */
+static int ta_capture(struct nlmsghdr *n, void *arg)
+{
+	struct ta_ctx *c = arg;
+
+	switch (n->nlmsg_type) {
+	case RTM_NEWQDISC:
+	case RTM_NEWTCLASS:
+	case RTM_NEWTFILTER:
+	case RTM_NEWACTION:
+		break;
+	default:
+		fprintf(stderr, "%s:%d: only additions can be applied\n",
+			c->file, cmdlineno);
+		return -1;
+	}
+	if (n->nlmsg_type != RTM_NEWACTION) {
+		struct tcmsg *t = NLMSG_DATA(n);
+
+		if (!ta_has_dev(c, t->tcm_ifindex)) {
+			if (c->ndev == TA_MAXDEV) {
+				fprintf(stderr, "%s:%d: too many devices\n",
+					c->file, cmdlineno);
+				return -1;
+			}
+			c->dev[c->ndev++] = t->tcm_ifindex;
+		}
+	}
+	if (c->nreqs == c->maxreqs) {
+		int max = c->maxreqs ? 2 * c->maxreqs : 256;
+		struct ta_req *reqs = realloc(c->reqs, max * sizeof(*reqs));
+
+		if (reqs == NULL)
+			goto oom;
+		c->reqs = reqs;
+		c->maxreqs = max;
+	}
+	c->reqs[c->nreqs].n = malloc(n->nlmsg_len);
+	if (c->reqs[c->nreqs].n == NULL)
+		goto oom;
+	memcpy(c->reqs[c->nreqs].n, n, n->nlmsg_len);
+	c->reqs[c->nreqs].line = cmdlineno;
+	c->reqs[c->nreqs].type = TA_ACTION;
+	c->reqs[c->nreqs++].o = NULL;
+	return 0;
+oom:
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+}
+
+/* Lines are numbered within the file, the outer batch keeps its count */
+static int ta_read(struct ta_ctx *c, FILE *fp)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int lineno = cmdlineno;
+	int ret = 0;
+
+	rtnl_capture(&rth, ta_capture, c);
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, fp) != -1) {
+		char *largv[100];
+		int largc;
+
+		largc = makeargs(line, largv, 100);
+		if (largc == 0)
+			continue;
+
+		if (matches(largv[0], "qdisc") == 0)
+			ret = do_qdisc(largc-1, largv+1);
+		else if (matches(largv[0], "class") == 0)
+			ret = do_class(largc-1, largv+1);
+		else if (matches(largv[0], "filter") == 0)
+			ret = do_filter(largc-1, largv+1);
+		else if (matches(largv[0], "actions") == 0)
+			ret = do_action(largc-1, largv+1);
+		else {
+			fprintf(stderr, "%s:%d: \"%s\" can not be applied\n",
+				c->file, cmdlineno, largv[0]);
+			ret = -1;
+		}
+		if (ret) {
+			fprintf(stderr, "Command failed %s:%d\n", c->file, cmdlineno);
+			break;
+		}
+	}
+	free(line);
+	rtnl_capture(&rth, NULL, NULL);
+	cmdlineno = lineno;
+	return ret;
+}
+
+static int ta_collect(const struct sockaddr_nl *who, struct nlmsghdr *n,
+		      void *arg)
+{
+	struct ta_msgs *m = arg;
+
+	/* action dumps come back as RTM_GETACTION */
+	if (n->nlmsg_type != RTM_NEWQDISC && n->nlmsg_type != RTM_NEWTCLASS &&
+	    n->nlmsg_type != RTM_NEWTFILTER && n->nlmsg_type != RTM_GETACTION)
+		return 0;
+	return ta_add_msg(m, n, 0);
+}
+
+static int ta_dump(int type, void *req, int len, struct ta_msgs *m)
+{
+	if (rtnl_dump_request(&rth, type, req, len) < 0) {
+		perror("Cannot send dump request");
+		return -1;
+	}
+	if (rtnl_dump_filter(&rth, ta_collect, m, NULL, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void ta_free_msgs(struct ta_msgs *m)
+{
+	int i;
+
+	for (i = 0; i < m->cnt; i++)
+		free(m->n[i]);
+	free(m->n);
+	free(m->line);
+	memset(m, 0, sizeof(*m));
+}
+
+static __u32 ta_class_parent(__u32 parent)
+{
+	if (parent != TC_H_ROOT && TC_H_MIN(parent) == 0)
+		return TC_H_ROOT;
+	return parent;
+}
+
+static int ta_load_cur(struct ta_ctx *c, struct ta_msgs *m)
+{
+	int i;
+
+	for (i = 0; i < m->cnt; i++) {
+		struct nlmsghdr *n = m->n[i];
+		struct tcmsg *t = NLMSG_DATA(n);
+		struct rtattr *tb[TCA_MAX+1];
+		const char *kind = ta_kind(n, tb);
+		struct ta_obj *o;
+
+		if (!ta_has_dev(c, t->tcm_ifindex))
+			continue;
+
+		switch (n->nlmsg_type) {
+		case RTM_NEWQDISC:
+			/* Defaults come and go by themselves */
+			if (t->tcm_handle == 0)
+				continue;
+			o = ta_find(c, TA_QDISC, t->tcm_ifindex, t->tcm_parent,
+				    0, 0, "", 1);
+			if (o) {
+				o->cur_handle = t->tcm_handle;
+				strncpy(o->cur_kind, kind, sizeof(o->cur_kind) - 1);
+			}
+			break;
+		case RTM_NEWTCLASS:
+			o = ta_find(c, TA_CLASS, t->tcm_ifindex, 0,
+				    t->tcm_handle, 0, "", 1);
+			if (o) {
+				o->cur_parent = ta_class_parent(t->tcm_parent);
+				strncpy(o->cur_kind, kind, sizeof(o->cur_kind) - 1);
+			}
+			break;
+		default:
+			o = ta_find(c, TA_CHAIN, t->tcm_ifindex, t->tcm_parent,
+				    0, t->tcm_info, "", 1);
+			break;
+		}
+		if (o == NULL || ta_add_msg(&o->cur, n, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int ta_load_want(struct ta_ctx *c)
+{
+	int i;
+
+	for (i = 0; i < c->nreqs; i++) {
+		struct ta_req *r = &c->reqs[i];
+		struct tcmsg *t = NLMSG_DATA(r->n);
+		__u32 parent = t->tcm_parent;
+		struct ta_obj *o, *q;
+
+		switch (r->n->nlmsg_type) {
+		case RTM_NEWQDISC:
+			r->type = TA_QDISC;
+			o = ta_find(c, TA_QDISC, t->tcm_ifindex, parent,
+				    0, 0, "", 1);
+			break;
+		case RTM_NEWTCLASS:
+			if (t->tcm_handle == 0) {
+				fprintf(stderr, "%s:%d: class needs a classid\n",
+					c->file, r->line);
+				return -1;
+			}
+			r->type = TA_CLASS;
+			o = ta_find(c, TA_CLASS, t->tcm_ifindex, 0,
+				    t->tcm_handle, 0, "", 1);
+			break;
+		case RTM_NEWTFILTER:
+			if (TC_H_MAJ(t->tcm_info) == 0) {
+				fprintf(stderr, "%s:%d: filter needs a pref\n",
+					c->file, r->line);
+				return -1;
+			}
+			/*
+			 * The kernel reports root filters under the qdisc,
+			 * a wanted one without a handle keeps the current.
+			 */
+			if (parent == 0 || parent == TC_H_ROOT) {
+				q = ta_find(c, TA_QDISC, t->tcm_ifindex,
+					    TC_H_ROOT, 0, 0, "", 0);
+				if (q)
+					parent = q->cur_handle;
+				if (q && q->want.cnt &&
+				    ((struct tcmsg *)NLMSG_DATA(q->want.n[0]))->tcm_handle)
+					parent = ((struct tcmsg *)NLMSG_DATA(q->want.n[0]))->tcm_handle;
+			}
+			r->type = TA_CHAIN;
+			o = ta_find(c, TA_CHAIN, t->tcm_ifindex, parent,
+				    0, t->tcm_info, "", 1);
+			break;
+		default:
+			continue;
+		}
+		if (o == NULL)
+			return -1;
+		if (o->want.cnt && o->type != TA_CHAIN) {
+			fprintf(stderr, "%s:%d: %s is also set on line %d\n",
+				c->file, r->line, ta_names[o->type],
+				o->want.line[0]);
+			return -1;
+		}
+		if (ta_add_msg(&o->want, r->n, r->line) < 0)
+			return -1;
+		r->o = o;
+	}
+	return 0;
+}
+
+static int ta_load_current(struct ta_ctx *c)
+{
+	struct ta_msgs cur;
+	struct ta_obj *o;
+	struct tcmsg t;
+	int i;
+
+	memset(&cur, 0, sizeof(cur));
+	for (i = 0; i < c->ndev; i++) {
+		memset(&t, 0, sizeof(t));
+		t.tcm_family = AF_UNSPEC;
+		t.tcm_ifindex = c->dev[i];
+		if (ta_dump(RTM_GETQDISC, &t, sizeof(t), &cur) < 0 ||
+		    ta_dump(RTM_GETTCLASS, &t, sizeof(t), &cur) < 0)
+			return -1;
+	}
+	if (ta_load_cur(c, &cur) < 0)
+		return -1;
+	ta_free_msgs(&cur);
+
+	/* Filters hang off qdiscs and classes, one dump for each */
+	for (o = c->list; o; o = o->next) {
+		if ((o->type != TA_QDISC && o->type != TA_CLASS) ||
+		    o->cur.cnt == 0)
+			continue;
+		memset(&t, 0, sizeof(t));
+		t.tcm_family = AF_UNSPEC;
+		t.tcm_ifindex = o->ifindex;
+		t.tcm_parent = o->type == TA_QDISC ? o->cur_handle : o->handle;
+		if (ta_dump(RTM_GETTFILTER, &t, sizeof(t), &cur) < 0)
+			return -1;
+	}
+	if (ta_load_cur(c, &cur) < 0)
+		return -1;
+	ta_free_msgs(&cur);
+	return 0;
+}
+
+static int ta_load_actions(struct ta_ctx *c)
+{
+	struct ta_msgs cur;
+	char kinds[16][16];
+	int nkinds = 0, i, k;
+
+	memset(&cur, 0, sizeof(cur));
+	memset(kinds, 0, sizeof(kinds));
+
+	/* Desired actions first, noting the kinds to dump */
+	for (i = 0; i < c->nreqs; i++) {
+		struct nlmsghdr *n = c->reqs[i].n;
+		struct rtattr *tb[TCAA_MAX+1], *act;
+		int len;
+
+		if (c->reqs[i].type != TA_ACTION)
+			continue;
+		parse_rtattr(tb, TCAA_MAX, TA_RTA(NLMSG_DATA(n)),
+			     n->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcamsg)));
+		if (tb[TCA_ACT_TAB] == NULL)
+			continue;
+		len = RTA_PAYLOAD(tb[TCA_ACT_TAB]);
+		for (act = RTA_DATA(tb[TCA_ACT_TAB]); RTA_OK(act, len);
+		     act = RTA_NEXT(act, len)) {
+			struct rtattr *opt;
+			const char *kind;
+			__u32 index;
+			int bindcnt;
+			struct ta_obj *o;
+
+			kind = ta_action_gen(act, &opt, &index, &bindcnt);
+			if (kind == NULL)
+				continue;
+			if (index == 0) {
+				fprintf(stderr, "%s:%d: action needs an index\n",
+					c->file, c->reqs[i].line);
+				return -1;
+			}
+			o = ta_find(c, TA_ACTION, 0, 0, index, 0, kind, 1);
+			if (o == NULL || ta_add_msg(&o->want, n, c->reqs[i].line) < 0)
+				return -1;
+			for (k = 0; k < nkinds; k++)
+				if (strcmp(kinds[k], kind) == 0)
+					break;
+			if (k == nkinds && nkinds < 16 && ta_action_parms(kind))
+				strncpy(kinds[nkinds++], kind, 15);
+		}
+	}
+
+	for (k = 0; k < nkinds; k++) {
+		struct {
+			struct nlmsghdr	n;
+			struct tcamsg	t;
+			char		buf[256];
+		} req;
+		struct rtattr *tail, *tail2;
+
+		memset(&req, 0, sizeof(req));
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcamsg));
+		req.t.tca_family = AF_UNSPEC;
+		tail = NLMSG_TAIL(&req.n);
+		addattr_l(&req.n, sizeof(req), TCA_ACT_TAB, NULL, 0);
+		tail2 = NLMSG_TAIL(&req.n);
+		addattr_l(&req.n, sizeof(req), 1, NULL, 0);
+		addattr_l(&req.n, sizeof(req), TCA_ACT_KIND, kinds[k],
+			  strlen(kinds[k]) + 1);
+		tail2->rta_len = (void *)NLMSG_TAIL(&req.n) - (void *)tail2;
+		tail->rta_len = (void *)NLMSG_TAIL(&req.n) - (void *)tail;
+		if (ta_dump(RTM_GETACTION, &req.t,
+			    NLMSG_ALIGN(req.n.nlmsg_len) - NLMSG_ALIGN(sizeof(struct nlmsghdr)),
+			    &cur) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < cur.cnt; i++) {
+		struct nlmsghdr *n = cur.n[i];
+		struct rtattr *tb[TCAA_MAX+1], *act;
+		int len;
+
+		parse_rtattr(tb, TCAA_MAX, TA_RTA(NLMSG_DATA(n)),
+			     n->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcamsg)));
+		if (tb[TCA_ACT_TAB] == NULL)
+			continue;
+		len = RTA_PAYLOAD(tb[TCA_ACT_TAB]);
+		for (act = RTA_DATA(tb[TCA_ACT_TAB]); RTA_OK(act, len);
+		     act = RTA_NEXT(act, len)) {
+			struct rtattr *opt;
+			const char *kind;
+			__u32 index;
+			int bindcnt;
+			struct ta_obj *o;
+
+			kind = ta_action_gen(act, &opt, &index, &bindcnt);
+			/* Actions bound to filters belong to them */
+			if (kind == NULL || index == 0 || bindcnt > 0)
+				continue;
+			o = ta_find(c, TA_ACTION, 0, 0, index, 0, kind, 1);
+			if (o == NULL || ta_add_msg(&o->cur, n, 0) < 0)
+				return -1;
+		}
+	}
+	ta_free_msgs(&cur);
+	return 0;
+}
+
+static struct rtattr *ta_action_opt(struct nlmsghdr *n, const char *kind,
+				    __u32 index)
+{
+	struct rtattr *tb[TCAA_MAX+1], *act;
+	int len;
+
+	parse_rtattr(tb, TCAA_MAX, TA_RTA(NLMSG_DATA(n)),
+		     n->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcamsg)));
+	if (tb[TCA_ACT_TAB] == NULL)
+		return NULL;
+	len = RTA_PAYLOAD(tb[TCA_ACT_TAB]);
+	for (act = RTA_DATA(tb[TCA_ACT_TAB]); RTA_OK(act, len);
+	     act = RTA_NEXT(act, len)) {
+		struct rtattr *opt;
+		const char *k;
+		__u32 i;
+		int bindcnt;
+
+		k = ta_action_gen(act, &opt, &i, &bindcnt);
+		if (k && i == index && strcmp(k, kind) == 0)
+			return opt;
+	}
+	return NULL;
+}
+
+/* Work out what differs and what goes away with it */
+static void ta_plan(struct ta_ctx *c)
+{
+	struct ta_obj *o;
+	int changed;
+
+	for (o = c->list; o; o = o->next) {
+		if (o->type == TA_QDISC && o->cur.cnt)
+			ta_find(c, TA_MAJOR, o->ifindex, 0, o->cur_handle, 0,
+				"", 1)->alias = o;
+	}
+	for (o = c->list; o; o = o->next) {
+		struct ta_obj *m = NULL;
+
+		if (o->cur.cnt == 0)
+			continue;
+		switch (o->type) {
+		case TA_QDISC:
+			if (o->parent != TC_H_ROOT && o->parent != TC_H_INGRESS)
+				o->up = ta_find(c, TA_CLASS, o->ifindex, 0,
+						o->parent, 0, "", 0);
+			break;
+		case TA_CLASS:
+			m = ta_find(c, TA_MAJOR, o->ifindex, 0,
+				    TC_H_MAJ(o->handle), 0, "", 0);
+			if (o->cur_parent != TC_H_ROOT)
+				o->up = ta_find(c, TA_CLASS, o->ifindex, 0,
+						o->cur_parent, 0, "", 0);
+			break;
+		case TA_CHAIN:
+			m = ta_find(c, TA_MAJOR, o->ifindex, 0,
+				    TC_H_MAJ(o->parent), 0, "", 0);
+			if (TC_H_MIN(o->parent))
+				o->up = ta_find(c, TA_CLASS, o->ifindex, 0,
+						o->parent, 0, "", 0);
+			break;
+		}
+		if (m)
+			o->owner = m->alias;
+	}
+
+	for (o = c->list; o; o = o->next) {
+		struct tcmsg *w;
+
+		if (o->cur.cnt == 0)
+			continue;
+		if (o->want.cnt == 0) {
+			o->differs = 1;
+			continue;
+		}
+		w = NLMSG_DATA(o->want.n[0]);
+		switch (o->type) {
+		case TA_QDISC:
+			if ((w->tcm_handle && w->tcm_handle != o->cur_handle) ||
+			    !ta_tc_equal(o->want.n[0], o->cur.n[0])) {
+				struct rtattr *tb[TCA_MAX+1];
+
+				/* Options alone can be changed in place */
+				if (strcmp(ta_kind(o->want.n[0], tb), o->cur_kind) ||
+				    (w->tcm_handle && w->tcm_handle != o->cur_handle))
+					o->gone = 1;
+				o->differs = 1;
+			}
+			break;
+		case TA_CLASS:
+			if (ta_class_parent(w->tcm_parent) != o->cur_parent)
+				o->gone = 1;
+			if (!ta_tc_equal(o->want.n[0], o->cur.n[0]))
+				o->differs = 1;
+			break;
+		case TA_CHAIN:
+			if (ta_chain_equal(o))
+				break;
+			o->differs = 1;
+			if (!ta_chain_by_handle(o))
+				o->gone = 1;
+			break;
+		case TA_ACTION:
+			if (!ta_action_equal(o->kind,
+					     ta_action_opt(o->want.n[0], o->kind, o->handle),
+					     ta_action_opt(o->cur.n[0], o->kind, o->handle)))
+				o->differs = 1;
+			break;
+		}
+	}
+
+	/* Classes of qdiscs which do not create them are left alone */
+	for (o = c->list; o; o = o->next) {
+		if (o->type == TA_CLASS && o->cur.cnt && o->want.cnt == 0) {
+			struct qdisc_util *q = get_qdisc_kind(o->cur_kind);
+
+			if (q && q->parse_copt)
+				o->gone = 1;
+			else
+				o->differs = 0;
+		} else if (o->want.cnt == 0 && o->cur.cnt)
+			o->gone = 1;
+	}
+
+	do {
+		changed = 0;
+		for (o = c->list; o; o = o->next) {
+			if (o->cur.cnt == 0 || o->implied)
+				continue;
+			if ((o->owner && o->owner != o && o->owner->gone) ||
+			    (o->type == TA_QDISC && o->up && o->up->gone)) {
+				o->gone = o->implied = 1;
+				changed = 1;
+			} else if (!o->gone && o->up && o->up->gone &&
+				   (o->type == TA_CLASS || o->type == TA_CHAIN)) {
+				o->gone = 1;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+static int ta_op(struct ta_ctx *c, int line, int type, struct ta_obj *o)
+{
+	if (c->nops == c->maxops) {
+		int max = c->maxops ? 2 * c->maxops : 256;
+		struct ta_op *ops = realloc(c->ops, max * sizeof(*ops));
+
+		if (ops == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		c->ops = ops;
+		c->maxops = max;
+	}
+	c->ops[c->nops].line = line;
+	c->ops[c->nops].type = type;
+	c->ops[c->nops].o = o;
+	c->ops[c->nops].handle = 0;
+	rtnl_batch_tag(&rth, c->nops++);
+	return 0;
+}
+
+static int ta_error(int tag, int error, void *arg)
+{
+	struct ta_ctx *c = arg;
+	struct ta_op *op = &c->ops[tag];
+
+	if (op->line)
+		fprintf(stderr, "%s:%d: ", c->file, op->line);
+	else if (op->type == TA_ACTION)
+		fprintf(stderr, "Deleting action %s index %u: ",
+			op->o->kind, op->o->handle);
+	else {
+		struct ta_obj *o = op->o;
+		SPRINT_BUF(b1);
+
+		fprintf(stderr, "Deleting %s %s", ta_names[op->type],
+			sprint_tc_classid(o->type == TA_QDISC ? o->cur_handle :
+					  o->type == TA_CLASS ? o->handle :
+					  o->parent, b1));
+		if (o->type == TA_CHAIN)
+			fprintf(stderr, " pref %u", TC_H_MAJ(o->info) >> 16);
+		if (op->handle)
+			fprintf(stderr, " handle %x", op->handle);
+		fprintf(stderr, " on %s: ", ll_index_to_name(o->ifindex));
+	}
+	fprintf(stderr, "%s\n", error ? strerror(error) : "request lost");
+	c->failed++;
+	return 1;
+}
+
+/* A handle picks one filter of a chain, 0 deletes it whole */
+static int ta_delete(struct ta_ctx *c, struct ta_obj *o, __u32 handle)
+{
+	struct {
+		struct nlmsghdr	n;
+		char		buf[256];
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	if (o->type == TA_ACTION) {
+		struct rtattr *tail, *tail2;
+
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcamsg));
+		req.n.nlmsg_type = RTM_DELACTION;
+		tail = NLMSG_TAIL(&req.n);
+		addattr_l(&req.n, sizeof(req), TCA_ACT_TAB, NULL, 0);
+		tail2 = NLMSG_TAIL(&req.n);
+		addattr_l(&req.n, sizeof(req), 1, NULL, 0);
+		addattr_l(&req.n, sizeof(req), TCA_ACT_KIND, o->kind,
+			  strlen(o->kind) + 1);
+		addattr32(&req.n, sizeof(req), TCA_ACT_INDEX, o->handle);
+		tail2->rta_len = (void *)NLMSG_TAIL(&req.n) - (void *)tail2;
+		tail->rta_len = (void *)NLMSG_TAIL(&req.n) - (void *)tail;
+	} else {
+		static const int cmd[] = { RTM_DELQDISC, RTM_DELTCLASS,
+					   RTM_DELTFILTER };
+		struct tcmsg *t = NLMSG_DATA(&req.n);
+
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+		req.n.nlmsg_type = cmd[o->type];
+		t->tcm_family = AF_UNSPEC;
+		t->tcm_ifindex = o->ifindex;
+		t->tcm_parent = o->type == TA_CLASS ? 0 : o->parent;
+		t->tcm_handle = o->type == TA_QDISC ? o->cur_handle :
+				o->type == TA_CHAIN ? handle : o->handle;
+		t->tcm_info = o->info;
+	}
+	c->deleted++;
+	if (ta_op(c, 0, o->type, o) < 0)
+		return -1;
+	c->ops[c->nops - 1].handle = handle;
+	return rtnl_talk(&rth, &req.n, 0, 0, NULL, NULL, NULL);
+}
+
+/* Filters of a chain changed by handle which must go first */
+static int ta_delete_filters(struct ta_ctx *c, struct ta_obj *o)
+{
+	int j, k;
+
+	for (j = 0; j < o->cur.cnt; j++) {
+		__u32 handle = ((struct tcmsg *)NLMSG_DATA(o->cur.n[j]))->tcm_handle;
+
+		if (ta_implicit_filter(o->cur.n[j]))
+			continue;
+		k = ta_chain_find(&o->want, handle);
+		if (k >= 0 && (ta_filter_in_place(o->want.n[k]) ||
+			       ta_tc_equal(o->want.n[k], o->cur.n[j])))
+			continue;
+		if (ta_delete(c, o, handle) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int ta_depth(struct ta_obj *o)
+{
+	int d = 0;
+
+	while ((o = o->up) != NULL && d < 64)
+		d++;
+	return d;
+}
+
+static int ta_send(struct ta_ctx *c)
+{
+	struct ta_obj *o;
+	int i, d, max_depth = 0;
+
+	/* Filters first so that classes can go, then bottom up */
+	for (o = c->list; o; o = o->next) {
+		if (o->type != TA_CHAIN || o->implied)
+			continue;
+		if (o->gone && ta_delete(c, o, 0) < 0)
+			return -1;
+		if (!o->gone && o->differs && o->want.cnt &&
+		    ta_delete_filters(c, o) < 0)
+			return -1;
+	}
+	for (o = c->list; o; o = o->next)
+		if (o->type == TA_ACTION && o->gone && ta_delete(c, o, 0) < 0)
+			return -1;
+	for (o = c->list; o; o = o->next)
+		if (o->type == TA_QDISC && o->gone && !o->implied &&
+		    ta_delete(c, o, 0) < 0)
+			return -1;
+	for (o = c->list; o; o = o->next)
+		if (o->type == TA_CLASS && o->gone && !o->implied &&
+		    ta_depth(o) > max_depth)
+			max_depth = ta_depth(o);
+	for (d = max_depth; d >= 0; d--)
+		for (o = c->list; o; o = o->next)
+			if (o->type == TA_CLASS && o->gone && !o->implied &&
+			    ta_depth(o) == d && ta_delete(c, o, 0) < 0)
+				return -1;
+
+	for (i = 0; i < c->nreqs; i++) {
+		struct nlmsghdr *n = c->reqs[i].n;
+		int line = c->reqs[i].line;
+		int type = c->reqs[i].type;
+		int change = 0;
+
+		if (type == TA_ACTION) {
+			struct rtattr *tb[TCAA_MAX+1], *act;
+			int len, send = 0;
+
+			parse_rtattr(tb, TCAA_MAX, TA_RTA(NLMSG_DATA(n)),
+				     n->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcamsg)));
+			len = tb[TCA_ACT_TAB] ? RTA_PAYLOAD(tb[TCA_ACT_TAB]) : 0;
+			for (act = tb[TCA_ACT_TAB] ? RTA_DATA(tb[TCA_ACT_TAB]) : NULL;
+			     act && RTA_OK(act, len); act = RTA_NEXT(act, len)) {
+				struct rtattr *opt;
+				const char *kind;
+				__u32 index;
+				int bindcnt;
+
+				kind = ta_action_gen(act, &opt, &index, &bindcnt);
+				o = kind ? ta_find(c, TA_ACTION, 0, 0, index, 0,
+						   kind, 0) : NULL;
+				if (o == NULL || o->cur.cnt == 0 ||
+				    o->differs || !ta_action_parms(kind))
+					send = 1;
+			}
+			if (!send) {
+				c->unchanged++;
+				continue;
+			}
+			n->nlmsg_flags = NLM_F_REQUEST|NLM_F_CREATE|NLM_F_REPLACE;
+			c->changed++;
+		} else {
+			o = c->reqs[i].o;
+			if (o->cur.cnt && !o->gone && !o->differs) {
+				c->unchanged++;
+				continue;
+			}
+			change = o->cur.cnt && !o->gone;
+			if (type == TA_CHAIN) {
+				/*
+				 * One request per filter of the chain, only for
+				 * those which differ if it is changed by handle.
+				 */
+				int j, k;
+
+				if (o->sent)
+					continue;
+				o->sent = 1;
+				for (k = 0; k < o->want.cnt; k++) {
+					struct nlmsghdr *f = o->want.n[k];
+
+					j = change ? ta_chain_find(&o->cur,
+						((struct tcmsg *)NLMSG_DATA(f))->tcm_handle) : -1;
+					if (j >= 0 && ta_tc_equal(f, o->cur.n[j])) {
+						c->unchanged++;
+						continue;
+					}
+					if (j >= 0 && ta_filter_in_place(f)) {
+						f->nlmsg_flags = NLM_F_REQUEST|NLM_F_CREATE;
+						c->changed++;
+					} else
+						c->added++;
+					if (ta_op(c, o->want.line[k], type, o) < 0)
+						return -1;
+					rtnl_talk(&rth, f, 0, 0, NULL, NULL, NULL);
+				}
+				continue;
+			}
+			n = o->want.n[0];
+			if (change) {
+				struct tcmsg *t = NLMSG_DATA(n);
+
+				n->nlmsg_flags = NLM_F_REQUEST;
+				if (type == TA_QDISC)
+					t->tcm_handle = o->cur_handle;
+				c->changed++;
+			} else
+				c->added++;
+		}
+		if (ta_op(c, line, type, o) < 0)
+			return -1;
+		rtnl_talk(&rth, n, 0, 0, NULL, NULL, NULL);
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tc apply FILE\n");
+	fprintf(stderr, "FILE holds \"qdisc\", \"class\", \"filter\" and \"action\" commands\n");
+	fprintf(stderr, "as for \"tc -batch\"; the devices they name are brought to that state.\n");
+}
+
+int do_apply(int argc, char **argv)
+{
+	struct rtnl_batch *outer = rth.batch;
+	struct ta_ctx *c;
+	FILE *fp = stdin;
+	int ret = 0;
+
+	if (argc != 1 || matches(*argv, "help") == 0) {
+		usage();
+		return -1;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	c->file = *argv;
+	c->tail = &c->list;
+
+	if (strcmp(c->file, "-") && (fp = fopen(c->file, "r")) == NULL) {
+		fprintf(stderr, "Cannot open file \"%s\" for reading: %s\n",
+			c->file, strerror(errno));
+		return 1;
+	}
+
+	if (outer && rtnl_batch_flush(&rth) < 0) {
+		if (fp != stdin)
+			fclose(fp);
+		return 2;
+	}
+	rth.batch = NULL;
+
+	ll_init_map(&rth);
+	ret = ta_read(c, fp);
+	if (fp != stdin)
+		fclose(fp);
+	if (ret || ta_load_current(c) ||
+	    ta_load_want(c) || ta_load_actions(c)) {
+		rth.batch = outer;
+		return 1;
+	}
+	ta_plan(c);
+
+	if (rtnl_batch_start(&rth, TA_WINDOW, ta_error, c) < 0) {
+		rth.batch = outer;
+		return 1;
+	}
+	if (ta_send(c) < 0)
+		ret = 1;
+	if (rtnl_batch_stop(&rth) < 0)
+		ret = 2;
+	rth.batch = outer;
+
+	if (show_stats)
+		printf("%d unchanged, %d added, %d changed, %d deleted\n",
+		       c->unchanged, c->added, c->changed, c->deleted);
+	if (c->failed) {
+		fprintf(stderr, "%d requests failed\n", c->failed);
+		ret = 2;
+	}
+	return ret;
+}
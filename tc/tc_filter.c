@@ -37,6 +37,8 @@ static void usage(void)
 	fprintf(stderr, "       [ [ FILTER_TYPE ] [ help | OPTIONS ] ]\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "       tc filter show [ dev STRING ] [ root | parent CLASSID ]\n");
+	fprintf(stderr, "       tc filter compile dev STRING [ root | parent CLASSID ] pref PRIO\n");
+	fprintf(stderr, "       [ protocol PROTO ] FILTER_TYPE [ help | OPTIONS ]\n");
 	fprintf(stderr, "Where:\n");
 	fprintf(stderr, "FILTER_TYPE := { rsvp | u32 | fw | route | etc. }\n");
 	fprintf(stderr, "FILTERID := ... format depends on classifier, see there\n");
@@ -349,6 +351,90 @@ int tc_filter_list(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Build a whole filter set from a rule list.  Only the classifier knows
+ * how to lay its rules out, so everything after the kind goes to it.
+ */
+static int tc_filter_compile(int argc, char **argv)
+{
+	struct filter_util *q;
+	struct tcmsg t;
+	__u32 prio = 0;
+	__u32 protocol = htons(ETH_P_ALL);
+	char d[16];
+
+	memset(&t, 0, sizeof(t));
+	memset(d, 0, sizeof(d));
+	t.tcm_family = AF_UNSPEC;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			if (d[0])
+				duparg("dev", *argv);
+			strncpy(d, *argv, sizeof(d)-1);
+		} else if (strcmp(*argv, "root") == 0) {
+			if (t.tcm_parent) {
+				fprintf(stderr, "Error: \"root\" is duplicate parent ID\n");
+				return -1;
+			}
+			t.tcm_parent = TC_H_ROOT;
+		} else if (strcmp(*argv, "parent") == 0) {
+			__u32 handle;
+			NEXT_ARG();
+			if (t.tcm_parent)
+				duparg("parent", *argv);
+			if (get_tc_classid(&handle, *argv))
+				invarg(*argv, "Invalid parent ID");
+			t.tcm_parent = handle;
+		} else if (matches(*argv, "preference") == 0 ||
+			   matches(*argv, "priority") == 0) {
+			NEXT_ARG();
+			if (prio)
+				duparg("priority", *argv);
+			if (get_u32(&prio, *argv, 0))
+				invarg(*argv, "invalid priority value");
+		} else if (matches(*argv, "protocol") == 0) {
+			__u16 id;
+			NEXT_ARG();
+			if (ll_proto_a2n(&id, *argv))
+				invarg(*argv, "invalid protocol");
+			protocol = id;
+		} else if (matches(*argv, "help") == 0) {
+			usage();
+			return 0;
+		} else
+			break;
+		argc--; argv++;
+	}
+
+	if (argc == 0) {
+		fprintf(stderr, "Filter type is required\n");
+		return -1;
+	}
+	if (d[0] == 0 || prio == 0) {
+		fprintf(stderr, "\"dev\" and \"pref\" are required to compile a filter\n");
+		return -1;
+	}
+	q = get_filter_kind(*argv);
+	if (q == NULL || q->compile_fopt == NULL) {
+		fprintf(stderr, "Filter \"%s\" can not be compiled\n", *argv);
+		return -1;
+	}
+	argc--; argv++;
+
+	t.tcm_info = TC_H_MAKE(prio<<16, protocol);
+
+	ll_init_map(&rth);
+
+	if ((t.tcm_ifindex = ll_name_to_index(d)) == 0) {
+		fprintf(stderr, "Cannot find device \"%s\"\n", d);
+		return 1;
+	}
+
+	return q->compile_fopt(q, &t, argc, argv);
+}
+
 int do_filter(int argc, char **argv)
 {
 	if (argc < 1)
@@ -361,6 +447,8 @@ int do_filter(int argc, char **argv)
 		return tc_filter_modify(RTM_NEWTFILTER, NLM_F_CREATE, argc-1, argv+1);
 	if (matches(*argv, "delete") == 0)
 		return tc_filter_modify(RTM_DELTFILTER, 0,  argc-1, argv+1);
+	if (matches(*argv, "compile") == 0)
+		return tc_filter_compile(argc-1, argv+1);
 #if 0
 	if (matches(*argv, "get") == 0)
 		return tc_filter_get(RTM_GETTFILTER, 0,  argc-1, argv+1);
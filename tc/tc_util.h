@@ -39,6 +39,8 @@ struct filter_util
 	int	(*parse_fopt)(struct filter_util *qu, char *fhandle, int argc,
 			      char **argv, struct nlmsghdr *n);
 	int	(*print_fopt)(struct filter_util *qu, FILE *f, struct rtattr *opt, __u32 fhandle);
+	int	(*compile_fopt)(struct filter_util *qu, struct tcmsg *t,
+				int argc, char **argv);
 };
 
 struct action_util
@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <errno.h>
 
@@ -36,6 +37,8 @@
 #include <linux/genetlink.h>
 #include <libmnl/libmnl.h>
 
+#include "msg.h"
+
 int parse_attrs(const struct nlattr *attr, void *data)
 {
 	const struct nlattr **tb = data;
@@ -61,30 +64,48 @@ static int family_id_cb(const struct nlmsghdr *nlh, void *data)
 	return MNL_CB_OK;
 }
 
+/* One socket serves every query of the invocation. It is dropped after
+ * a failed query, so that the next one does not read what is left of it.
+ */
+static struct mnl_socket *msg_nl;
+static unsigned int msg_seq;
+static int msg_family;
+
+void msg_close(void)
+{
+	if (msg_nl) {
+		mnl_socket_close(msg_nl);
+		msg_nl = NULL;
+	}
+}
+
 static struct mnl_socket *msg_send(struct nlmsghdr *nlh)
 {
 	int ret;
-	struct mnl_socket *nl;
 
-	nl = mnl_socket_open(NETLINK_GENERIC);
-	if (nl == NULL) {
-		perror("mnl_socket_open");
-		return NULL;
-	}
-
-	ret = mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID);
-	if (ret < 0) {
-		perror("mnl_socket_bind");
-		return NULL;
+	if (!msg_nl) {
+		msg_nl = mnl_socket_open(NETLINK_GENERIC);
+		if (msg_nl == NULL) {
+			perror("mnl_socket_open");
+			return NULL;
+		}
+
+		ret = mnl_socket_bind(msg_nl, 0, MNL_SOCKET_AUTOPID);
+		if (ret < 0) {
+			perror("mnl_socket_bind");
+			msg_close();
+			return NULL;
+		}
 	}
 
-	ret = mnl_socket_sendto(nl, nlh, nlh->nlmsg_len);
+	ret = mnl_socket_sendto(msg_nl, nlh, nlh->nlmsg_len);
 	if (ret < 0) {
 		perror("mnl_socket_send");
+		msg_close();
 		return NULL;
 	}
 
-	return nl;
+	return msg_nl;
 }
 
 static int msg_recv(struct mnl_socket *nl, mnl_cb_t callback, void *data, int seq)
@@ -102,20 +123,175 @@ static int msg_recv(struct mnl_socket *nl, mnl_cb_t callback, void *data, int se
 			break;
 		ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
 	}
-	if (ret == -1)
+	if (ret == -1) {
+		perror("error");
+		msg_close();
+	}
+
+	return ret;
+}
+
+/*
+ * In batch mode requests which only expect an ACK are sent without
+ * waiting for it, up to a window of them.  The ACKs are collected when
+ * the window is full, before any other query and at the end, and each
+ * failure is handed to the caller with the tag of its request.
+ */
+struct msg_pending {
+	unsigned int seq;
+	int tag;
+};
+
+static struct msg_pending *msg_pend;
+static int msg_window, msg_head, msg_inflight, msg_tag;
+static msg_batch_err_t msg_errfn;
+static void *msg_errarg;
+
+static void msg_batch_fail(int tag, int error)
+{
+	if (msg_errfn && msg_errfn(tag, error, msg_errarg))
+		return;
+	if (error) {
+		errno = error;
 		perror("error");
+	} else {
+		fprintf(stderr, "error, no answer to request\n");
+	}
+}
+
+static void msg_batch_ack(unsigned int seq, int error)
+{
+	while (msg_inflight) {
+		struct msg_pending *p = &msg_pend[msg_head];
+
+		msg_head = (msg_head + 1) % msg_window;
+		msg_inflight--;
+		if (p->seq == seq) {
+			if (error)
+				msg_batch_fail(p->tag, error);
+			return;
+		}
+		/* Answers come in order, an earlier one is not coming */
+		msg_batch_fail(p->tag, 0);
+	}
+}
+
+/* The socket is going away, nothing more will be heard of the rest */
+static void msg_batch_abort(int error)
+{
+	while (msg_inflight) {
+		msg_batch_fail(msg_pend[msg_head].tag, error);
+		msg_head = (msg_head + 1) % msg_window;
+		msg_inflight--;
+	}
+}
+
+/* Collect ACKs until at most left requests are outstanding */
+static int msg_batch_recv(int left)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int ret;
+
+	while (msg_inflight > left) {
+		struct nlmsghdr *nlh;
+
+		if (!msg_nl) {
+			msg_batch_abort(0);
+			return -ENOTCONN;
+		}
+		ret = mnl_socket_recvfrom(msg_nl, buf, sizeof(buf));
+		if (ret <= 0) {
+			int error = ret < 0 ? errno : EPIPE;
+
+			msg_batch_abort(error);
+			msg_close();
+			return -error;
+		}
+		for (nlh = (struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, ret);
+		     nlh = mnl_nlmsg_next(nlh, &ret)) {
+			struct nlmsgerr *err = mnl_nlmsg_get_payload(nlh);
+
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			msg_batch_ack(nlh->nlmsg_seq, -err->error);
+		}
+	}
+	return 0;
+}
+
+int msg_batch_start(int window, msg_batch_err_t errfn, void *arg)
+{
+	if (window <= 0)
+		return 0;
+	msg_pend = calloc(window, sizeof(*msg_pend));
+	if (!msg_pend) {
+		fprintf(stderr, "error, out of memory\n");
+		return -1;
+	}
+	msg_window = window;
+	msg_head = msg_inflight = 0;
+	msg_errfn = errfn;
+	msg_errarg = arg;
+	return 0;
+}
+
+void msg_batch_tag(int tag)
+{
+	msg_tag = tag;
+}
+
+int msg_batch_flush(void)
+{
+	return msg_inflight ? msg_batch_recv(0) : 0;
+}
 
-	mnl_socket_close(nl);
+int msg_batch_stop(void)
+{
+	int ret = msg_batch_flush();
 
+	free(msg_pend);
+	msg_pend = NULL;
+	msg_window = 0;
 	return ret;
 }
 
+static int msg_queue(struct nlmsghdr *nlh)
+{
+	struct msg_pending *p;
+	int err;
+
+	if (!msg_seq)
+		msg_seq = time(NULL);
+	nlh->nlmsg_seq = ++msg_seq;
+
+	if (msg_inflight >= msg_window &&
+	    (err = msg_batch_recv(msg_window - 1)) < 0)
+		return err;
+	if (!msg_send(nlh)) {
+		/* msg_send() closed the socket, so the ACKs are lost too */
+		err = errno;
+		msg_batch_abort(0);
+		return -err;
+	}
+
+	p = &msg_pend[(msg_head + msg_inflight) % msg_window];
+	p->seq = nlh->nlmsg_seq;
+	p->tag = msg_tag;
+	msg_inflight++;
+	return 0;
+}
+
 static int msg_query(struct nlmsghdr *nlh, mnl_cb_t callback, void *data)
 {
 	unsigned int seq;
 	struct mnl_socket *nl;
 
-	seq = time(NULL);
+	/* Answers to this one must not be mixed with pending ACKs */
+	msg_batch_flush();
+
+	if (!msg_seq)
+		msg_seq = time(NULL);
+	seq = ++msg_seq;
 	nlh->nlmsg_seq = seq;
 
 	nl = msg_send(nlh);
@@ -125,7 +301,7 @@ static int msg_query(struct nlmsghdr *nlh, mnl_cb_t callback, void *data)
 	return msg_recv(nl, callback, data, seq);
 }
 
-static int get_family(void)
+int get_family(void)
 {
 	int err;
 	int nl_family;
@@ -133,6 +309,9 @@ static int get_family(void)
 	struct genlmsghdr *genl;
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 
+	if (msg_family > 0)
+		return msg_family;
+
 	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type	= GENL_ID_CTRL;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
@@ -147,12 +326,15 @@ static int get_family(void)
 	if ((err = msg_query(nlh, family_id_cb, &nl_family)))
 		return err;
 
+	msg_family = nl_family;
 	return nl_family;
 }
 
 int msg_doit(struct nlmsghdr *nlh, mnl_cb_t callback, void *data)
 {
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (msg_window && !callback)
+		return msg_queue(nlh);
 	return msg_query(nlh, callback, data);
 }
 
@@ -162,7 +344,7 @@ int msg_dumpit(struct nlmsghdr *nlh, mnl_cb_t callback, void *data)
 	return msg_query(nlh, callback, data);
 }
 
-struct nlmsghdr *msg_init(char *buf, int cmd, int flags)
+struct nlmsghdr *msg_init(char *buf, int cmd)
 {
 	int family;
 	struct nlmsghdr *nlh;
@@ -35,5 +35,18 @@ int msg_doit(struct nlmsghdr *nlh, mnl_cb_t callback, void *data);
 int msg_dumpit(struct nlmsghdr *nlh, mnl_cb_t callback, void *data);
 int parse_attrs(const struct nlattr *attr, void *data);
 int get_family(void);
+void msg_close(void);
+
+/*
+ * Called for each failed request of a batch with its tag and the positive
+ * errno, or 0 when no answer arrived.  Returns nonzero if it reported the
+ * failure itself.
+ */
+typedef int (*msg_batch_err_t)(int tag, int error, void *arg);
+
+int msg_batch_start(int window, msg_batch_err_t errfn, void *arg);
+void msg_batch_tag(int tag);
+int msg_batch_flush(void);
+int msg_batch_stop(void);
 
 #endif
@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #include <linux/tipc.h>
@@ -41,63 +42,129 @@
 
 #define PORTID_STR_LEN 45 /* Four u32 and five delimiter chars */
 
-static int publ_list_cb(const struct nlmsghdr *nlh, void *data)
+/* Publications of this node's sockets, from one name table dump,
+ * looked up by socket reference while the socket dump is printed.
+ */
+#define PUBL_HASH 65536
+
+struct publ {
+	struct publ *next;
+	uint32_t node;
+	uint32_t ref;
+	uint32_t type;
+	uint32_t lower;
+	uint32_t upper;
+};
+
+struct publ_table {
+	struct publ *hash[PUBL_HASH];
+	struct publ **tail[PUBL_HASH];
+};
+
+static int publ_table_cb(const struct nlmsghdr *nlh, void *data)
 {
+	struct publ_table *pt = data;
 	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
-	struct nlattr *info[TIPC_NLA_MAX + 1];
-	struct nlattr *attrs[TIPC_NLA_SOCK_MAX + 1];
+	struct nlattr *info[TIPC_NLA_MAX + 1] = {};
+	struct nlattr *attrs[TIPC_NLA_NAME_TABLE_MAX + 1] = {};
+	struct nlattr *publ[TIPC_NLA_PUBL_MAX + 1] = {};
+	struct publ *p;
+	unsigned int h;
 
 	mnl_attr_parse(nlh, sizeof(*genl), parse_attrs, info);
-	if (!info[TIPC_NLA_PUBL])
+	if (!info[TIPC_NLA_NAME_TABLE])
 		return MNL_CB_ERROR;
 
-	mnl_attr_parse_nested(info[TIPC_NLA_PUBL], parse_attrs, attrs);
+	mnl_attr_parse_nested(info[TIPC_NLA_NAME_TABLE], parse_attrs, attrs);
+	if (!attrs[TIPC_NLA_NAME_TABLE_PUBL])
+		return MNL_CB_ERROR;
 
-	printf("  bound to {%u,%u,%u}\n",
-	       mnl_attr_get_u32(attrs[TIPC_NLA_PUBL_TYPE]),
-	       mnl_attr_get_u32(attrs[TIPC_NLA_PUBL_LOWER]),
-	       mnl_attr_get_u32(attrs[TIPC_NLA_PUBL_UPPER]));
+	mnl_attr_parse_nested(attrs[TIPC_NLA_NAME_TABLE_PUBL], parse_attrs, publ);
+	if (!publ[TIPC_NLA_PUBL_REF] || !publ[TIPC_NLA_PUBL_NODE] ||
+	    !publ[TIPC_NLA_PUBL_TYPE] || !publ[TIPC_NLA_PUBL_LOWER] ||
+	    !publ[TIPC_NLA_PUBL_UPPER])
+		return MNL_CB_ERROR;
+
+	if (!(p = malloc(sizeof(*p)))) {
+		fprintf(stderr, "error, out of memory\n");
+		return MNL_CB_ERROR;
+	}
+	p->next = NULL;
+	p->node = mnl_attr_get_u32(publ[TIPC_NLA_PUBL_NODE]);
+	p->ref = mnl_attr_get_u32(publ[TIPC_NLA_PUBL_REF]);
+	p->type = mnl_attr_get_u32(publ[TIPC_NLA_PUBL_TYPE]);
+	p->lower = mnl_attr_get_u32(publ[TIPC_NLA_PUBL_LOWER]);
+	p->upper = mnl_attr_get_u32(publ[TIPC_NLA_PUBL_UPPER]);
+
+	/* Appended, so a socket's names keep the order of the dump */
+	h = p->ref % PUBL_HASH;
+	if (!pt->tail[h])
+		pt->tail[h] = &pt->hash[h];
+	*pt->tail[h] = p;
+	pt->tail[h] = &p->next;
 
 	return MNL_CB_OK;
 }
 
-static int publ_list(uint32_t sock)
+static int publ_table_load(struct publ_table *pt)
 {
 	struct nlmsghdr *nlh;
 	char buf[MNL_SOCKET_BUFFER_SIZE];
-	struct nlattr *nest;
 
-	if (!(nlh = msg_init(buf, TIPC_NL_PUBL_GET))) {
+	if (!(nlh = msg_init(buf, TIPC_NL_NAME_TABLE_GET))) {
 		fprintf(stderr, "error, message initialisation failed\n");
 		return -1;
 	}
 
-	nest = mnl_attr_nest_start(nlh, TIPC_NLA_SOCK);
-	mnl_attr_put_u32(nlh, TIPC_NLA_SOCK_REF, sock);
-	mnl_attr_nest_end(nlh, nest);
+	return msg_dumpit(nlh, publ_table_cb, pt);
+}
+
+static void publ_table_free(struct publ_table *pt)
+{
+	int i;
+
+	for (i = 0; i < PUBL_HASH; i++) {
+		struct publ *p, *next;
 
-	return msg_dumpit(nlh, publ_list_cb, NULL);
+		for (p = pt->hash[i]; p; p = next) {
+			next = p->next;
+			free(p);
+		}
+	}
+	free(pt);
+}
+
+static void publ_list(struct publ_table *pt, uint32_t node, uint32_t sock)
+{
+	struct publ *p;
+
+	for (p = pt->hash[sock % PUBL_HASH]; p; p = p->next) {
+		if (p->ref != sock || p->node != node)
+			continue;
+		printf("  bound to {%u,%u,%u}\n", p->type, p->lower, p->upper);
+	}
 }
 
 static int sock_list_cb(const struct nlmsghdr *nlh, void *data)
 {
+	struct publ_table *pt = data;
 	struct genlmsghdr *genl = mnl_nlmsg_get_payload(nlh);
-	struct nlattr *info[TIPC_NLA_MAX + 1];
-	struct nlattr *attrs[TIPC_NLA_SOCK_MAX + 1];
+	struct nlattr *info[TIPC_NLA_MAX + 1] = {};
+	struct nlattr *attrs[TIPC_NLA_SOCK_MAX + 1] = {};
 
 	mnl_attr_parse(nlh, sizeof(*genl), parse_attrs, info);
 	if (!info[TIPC_NLA_SOCK])
 		return MNL_CB_ERROR;
 
 	mnl_attr_parse_nested(info[TIPC_NLA_SOCK], parse_attrs, attrs);
-	if (!attrs[TIPC_NLA_SOCK_REF])
+	if (!attrs[TIPC_NLA_SOCK_REF] || !attrs[TIPC_NLA_SOCK_ADDR])
 		return MNL_CB_ERROR;
 
 	printf("socket %u\n", mnl_attr_get_u32(attrs[TIPC_NLA_SOCK_REF]));
 
 	if (attrs[TIPC_NLA_SOCK_CON]) {
 		uint32_t node;
-		struct nlattr *con[TIPC_NLA_CON_MAX + 1];
+		struct nlattr *con[TIPC_NLA_CON_MAX + 1] = {};
 
 		mnl_attr_parse_nested(attrs[TIPC_NLA_SOCK_CON], parse_attrs, con);
 		node = mnl_attr_get_u32(con[TIPC_NLA_CON_NODE]);
@@ -113,7 +180,8 @@ static int sock_list_cb(const struct nlmsghdr *nlh, void *data)
 		else
 			printf("\n");
 	} else if (attrs[TIPC_NLA_SOCK_HAS_PUBL]) {
-		publ_list(mnl_attr_get_u32(attrs[TIPC_NLA_SOCK_REF]));
+		publ_list(pt, mnl_attr_get_u32(attrs[TIPC_NLA_SOCK_ADDR]),
+			  mnl_attr_get_u32(attrs[TIPC_NLA_SOCK_REF]));
 	}
 
 	return MNL_CB_OK;
@@ -123,18 +191,31 @@ static int cmd_socket_list(struct nlmsghdr *nlh, const struct cmd *cmd,
 			   struct cmdl *cmdl, void *data)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct publ_table *pt;
+	int err;
 
 	if (help_flag) {
 		fprintf(stderr, "Usage: %s socket list\n", cmdl->argv[0]);
 		return -EINVAL;
 	}
 
+	if (!(pt = calloc(1, sizeof(*pt)))) {
+		fprintf(stderr, "error, out of memory\n");
+		return -ENOMEM;
+	}
+	if ((err = publ_table_load(pt)))
+		goto out;
+
 	if (!(nlh = msg_init(buf, TIPC_NL_SOCK_GET))) {
 		fprintf(stderr, "error, message initialisation failed\n");
-		return -1;
+		err = -1;
+		goto out;
 	}
 
-	return msg_dumpit(nlh, sock_list_cb, NULL);
+	err = msg_dumpit(nlh, sock_list_cb, pt);
+out:
+	publ_table_free(pt);
+	return err;
 }
 
 void cmd_socket_help(struct cmdl *cmdl)
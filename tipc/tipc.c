@@ -29,9 +29,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include <unistd.h>
 
+#include <libmnl/libmnl.h>
+
+#include "utils.h"
+#include "msg.h"
 #include "bearer.h"
 #include "link.h"
 #include "nametable.h"
@@ -41,6 +47,9 @@
 #include "cmdl.h"
 
 int help_flag;
+int resolve_hosts;
+static int force;
+static int pipeline = 32;
 
 static void about(struct cmdl *cmdl)
 {
@@ -48,8 +57,14 @@ static void about(struct cmdl *cmdl)
 		"Transparent Inter-Process Communication Protocol\n"
 		"Usage: %s [OPTIONS] COMMAND [ARGS] ...\n"
 		"\n"
+		"       %s [OPTIONS] -batch FILE\n"
+		"\n"
 		"Options:\n"
 		" -h, --help \t\tPrint help for last given command\n"
+		" -batch FILE\t\tRun the commands in FILE, - for stdin\n"
+		" -force\t\t\tDo not stop at the first failing command\n"
+		" -pipeline N\t\tIn batch mode, have up to N requests\n"
+		"\t\t\tin flight, 0 to wait for each (default 32)\n"
 		"\n"
 		"Commands:\n"
 		" bearer                - Show or modify bearers\n"
@@ -58,7 +73,78 @@ static void about(struct cmdl *cmdl)
 		" nametable             - Show nametable\n"
 		" node                  - Show or modify node related parameters\n"
 		" socket                - Show sockets\n",
-		cmdl->argv[0]);
+		cmdl->argv[0], cmdl->argv[0]);
+}
+
+static int batch_errors;
+
+static int batch_error(int lineno, int error, void *arg)
+{
+	if (error) {
+		errno = error;
+		perror("error");
+	} else {
+		fprintf(stderr, "error, no answer to request\n");
+	}
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)arg, lineno);
+	batch_errors++;
+	return 1;
+}
+
+/* Every line runs as a command line of its own, sharing the netlink
+ * socket and the family id with all the others.
+ */
+static int batch(const char *name, char *argv0, const struct cmd *cmd,
+		 const struct cmd *cmds)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0;
+
+	if (name && strcmp(name, "-") != 0) {
+		if (freopen(name, "r", stdin) == NULL) {
+			fprintf(stderr, "Cannot open file \"%s\" for reading: %s\n",
+				name, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (msg_batch_start(pipeline, batch_error, (void *)name) < 0)
+		return -1;
+
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, stdin) != -1) {
+		char *largv[100];
+		struct cmdl cmdl;
+		int largc;
+
+		largv[0] = argv0;
+		largc = makeargs(line, largv + 1, 99);
+		if (largc == 0)
+			continue;	/* blank line */
+
+		cmdl.optind = 1;
+		cmdl.argc = largc + 1;
+		cmdl.argv = largv;
+
+		msg_batch_tag(cmdlineno);
+		if (run_cmd(NULL, cmd, cmds, &cmdl, NULL)) {
+			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
+			ret = 1;
+			if (!force)
+				break;
+		}
+		if (batch_errors && !force)
+			break;
+	}
+	free(line);
+
+	msg_batch_stop();
+	msg_close();
+	if (batch_errors)
+		ret = 1;
+
+	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -67,8 +153,12 @@ int main(int argc, char *argv[])
 	int res;
 	struct cmdl cmdl;
 	const struct cmd cmd = {"tipc", NULL, about};
+	char *batch_file = NULL;
 	struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
+		{"batch", required_argument, 0, 'b'},
+		{"force", no_argument, 0, 'f'},
+		{"pipeline", required_argument, 0, 'p'},
 		{0, 0, 0, 0}
 	};
 	const struct cmd cmds[] = {
@@ -84,7 +174,9 @@ int main(int argc, char *argv[])
 	do {
 		int option_index = 0;
 
-		i = getopt_long(argc, argv, "h", long_options, &option_index);
+		/* Single dash long options, as in "ip -batch" */
+		i = getopt_long_only(argc, argv, "h", long_options,
+				     &option_index);
 
 		switch (i) {
 		case 'h':
@@ -94,6 +186,19 @@ int main(int argc, char *argv[])
 			 */
 			help_flag = 1;
 			break;
+		case 'b':
+			batch_file = optarg;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'p':
+			if (get_integer(&pipeline, optarg, 0) || pipeline < 0) {
+				fprintf(stderr, "error, invalid pipeline \"%s\"\n",
+					optarg);
+				return 1;
+			}
+			break;
 		case -1:
 			/* End of options */
 			break;
@@ -103,6 +208,9 @@ int main(int argc, char *argv[])
 		}
 	} while (i != -1);
 
+	if (batch_file)
+		return batch(batch_file, argv[0], &cmd, cmds) ? 1 : 0;
+
 	cmdl.optind = optind;
 	cmdl.argc = argc;
 	cmdl.argv = argv;